@@ -0,0 +1,445 @@
+#include <string.h>
+#include <math.h>
+#include "battery-estimator.h"
+
+/*
+ * Battery state of charge estimator. The PMU reports neither the battery
+ * current nor the load, only the battery voltage, and the load class is
+ * derived from the modem type. So the estimate is a one dimensional
+ * Kalman filter over the voltage based SoC:
+ *
+ * - predict: SoC moves at the learned charge or discharge rate of the
+ *   current load class. This is not coulomb counting, the rates are the
+ *   average slope of the voltage based SoC itself, in percent per hour,
+ *   and say nothing about the battery capacity;
+ * - update: the voltage based SoC from the lookup tables is the
+ *   measurement, corrected by the learned offset of the load class for
+ *   the voltage sag under that load (on battery only). Its noise is
+ *   tracked from the recent innovations, so the remaining jitter of a 5G
+ *   modem gets filtered out instead of moving the reported value.
+ *
+ * The rates are learned from completed charge and discharge segments, a
+ * segment covering most of the range counts as a full cycle and gets a
+ * larger learning weight. The offset of a load class follows the mean
+ * innovation while the filter has settled under that load. Both are saved
+ * as calibration data.
+ */
+
+#define PCAT_BATTERY_ESTIMATOR_DISCHARGE_RATE_NORMAL 15.0
+#define PCAT_BATTERY_ESTIMATOR_DISCHARGE_RATE_HIGH 30.0
+#define PCAT_BATTERY_ESTIMATOR_CHARGE_RATE 40.0
+#define PCAT_BATTERY_ESTIMATOR_RATE_MIN 1.0
+#define PCAT_BATTERY_ESTIMATOR_RATE_MAX 200.0
+
+#define PCAT_BATTERY_ESTIMATOR_INITIAL_VARIANCE 100.0
+#define PCAT_BATTERY_ESTIMATOR_TRANSITION_VARIANCE 25.0
+#define PCAT_BATTERY_ESTIMATOR_PROCESS_NOISE 0.001
+#define PCAT_BATTERY_ESTIMATOR_MEASUREMENT_NOISE_MIN 4.0
+#define PCAT_BATTERY_ESTIMATOR_INNOVATION_WEIGHT 0.05
+#define PCAT_BATTERY_ESTIMATOR_MEASUREMENT_TIME_CONSTANT 300.0
+#define PCAT_BATTERY_ESTIMATOR_DT_MAX 600.0
+
+#define PCAT_BATTERY_ESTIMATOR_SEGMENT_DURATION_MIN 1800.0
+#define PCAT_BATTERY_ESTIMATOR_SEGMENT_DELTA_MIN 10.0
+#define PCAT_BATTERY_ESTIMATOR_CYCLE_DELTA 70.0
+#define PCAT_BATTERY_ESTIMATOR_LEARN_WEIGHT_PARTIAL 0.2
+#define PCAT_BATTERY_ESTIMATOR_LEARN_WEIGHT_CYCLE 0.5
+
+#define PCAT_BATTERY_ESTIMATOR_OFFSET_MAX 30.0
+#define PCAT_BATTERY_ESTIMATOR_OFFSET_TIME_CONSTANT 1800.0
+#define PCAT_BATTERY_ESTIMATOR_OFFSET_LEARN_VARIANCE 4.0
+#define PCAT_BATTERY_ESTIMATOR_OFFSET_SAVE_DELTA 0.5
+
+#define PCAT_BATTERY_ESTIMATOR_CALIBRATION_GROUP "Calibration"
+
+struct _PCatBatteryEstimator
+{
+    gboolean initialized;
+    gint64 timestamp;
+    gdouble soc;
+    gdouble variance;
+    gdouble measurement_noise;
+    gdouble measured_smooth;
+    gboolean on_battery;
+    PCatBatteryEstimatorLoad load;
+
+    gint64 segment_start_timestamp;
+    gdouble segment_start_soc;
+    gboolean segment_valid;
+
+    PCatBatteryEstimatorCalibration calibration;
+    gdouble measurement_offset_saved[PCAT_BATTERY_ESTIMATOR_LOAD_LAST];
+    gboolean calibration_dirty;
+};
+
+PCatBatteryEstimator *pcat_battery_estimator_new()
+{
+    PCatBatteryEstimator *estimator;
+
+    estimator = g_new0(PCatBatteryEstimator, 1);
+    estimator->calibration.discharge_rate[
+        PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL] =
+        PCAT_BATTERY_ESTIMATOR_DISCHARGE_RATE_NORMAL;
+    estimator->calibration.discharge_rate[
+        PCAT_BATTERY_ESTIMATOR_LOAD_HIGH] =
+        PCAT_BATTERY_ESTIMATOR_DISCHARGE_RATE_HIGH;
+    estimator->calibration.charge_rate = PCAT_BATTERY_ESTIMATOR_CHARGE_RATE;
+
+    return estimator;
+}
+
+void pcat_battery_estimator_free(PCatBatteryEstimator *estimator)
+{
+    g_free(estimator);
+}
+
+static void pcat_battery_estimator_segment_start(
+    PCatBatteryEstimator *estimator)
+{
+    estimator->segment_start_timestamp = estimator->timestamp;
+    estimator->segment_start_soc = estimator->measured_smooth;
+    estimator->segment_valid = TRUE;
+}
+
+static void pcat_battery_estimator_rate_learn(gdouble *rate,
+    gdouble observed, gdouble weight)
+{
+    *rate += (observed - *rate) * weight;
+    *rate = CLAMP(*rate, PCAT_BATTERY_ESTIMATOR_RATE_MIN,
+        PCAT_BATTERY_ESTIMATOR_RATE_MAX);
+}
+
+/*
+ * Learn the average rate of a finished segment, segments which are too
+ * short or changed the load class on the way are dropped.
+ */
+static void pcat_battery_estimator_segment_finish(
+    PCatBatteryEstimator *estimator)
+{
+    gdouble duration, delta, weight;
+
+    if(!estimator->segment_valid)
+    {
+        return;
+    }
+    estimator->segment_valid = FALSE;
+
+    duration = (estimator->timestamp - estimator->segment_start_timestamp) /
+        1e6;
+    delta = estimator->measured_smooth - estimator->segment_start_soc;
+    if(estimator->on_battery)
+    {
+        delta = -delta;
+    }
+
+    if(duration < PCAT_BATTERY_ESTIMATOR_SEGMENT_DURATION_MIN ||
+       delta < PCAT_BATTERY_ESTIMATOR_SEGMENT_DELTA_MIN)
+    {
+        return;
+    }
+
+    if(delta >= PCAT_BATTERY_ESTIMATOR_CYCLE_DELTA)
+    {
+        weight = PCAT_BATTERY_ESTIMATOR_LEARN_WEIGHT_CYCLE;
+        if(estimator->on_battery)
+        {
+            estimator->calibration.cycles++;
+        }
+    }
+    else
+    {
+        weight = PCAT_BATTERY_ESTIMATOR_LEARN_WEIGHT_PARTIAL;
+    }
+
+    if(estimator->on_battery)
+    {
+        pcat_battery_estimator_rate_learn(
+            &estimator->calibration.discharge_rate[estimator->load],
+            delta * 3600.0 / duration, weight);
+    }
+    else
+    {
+        pcat_battery_estimator_rate_learn(&estimator->calibration.charge_rate,
+            delta * 3600.0 / duration, weight);
+    }
+
+    estimator->calibration_dirty = TRUE;
+}
+
+/*
+ * Follow the mean innovation of a load class other than the reference
+ * one, only once the filter has settled so the prediction can be trusted
+ * more than the sagging measurement.
+ */
+static void pcat_battery_estimator_offset_learn(
+    PCatBatteryEstimator *estimator, PCatBatteryEstimatorLoad load,
+    gdouble innovation, gdouble dt)
+{
+    gdouble *offset = &estimator->calibration.measurement_offset[load];
+
+    if(load==PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL ||
+       estimator->variance > PCAT_BATTERY_ESTIMATOR_OFFSET_LEARN_VARIANCE)
+    {
+        return;
+    }
+
+    *offset -= innovation * dt / (PCAT_BATTERY_ESTIMATOR_OFFSET_TIME_CONSTANT +
+        dt);
+    *offset = CLAMP(*offset, 0.0, PCAT_BATTERY_ESTIMATOR_OFFSET_MAX);
+
+    if(fabs(*offset - estimator->measurement_offset_saved[load]) >=
+        PCAT_BATTERY_ESTIMATOR_OFFSET_SAVE_DELTA)
+    {
+        estimator->calibration_dirty = TRUE;
+    }
+}
+
+void pcat_battery_estimator_update(PCatBatteryEstimator *estimator,
+    gint64 timestamp, gdouble measured_soc, gboolean on_battery,
+    PCatBatteryEstimatorLoad load)
+{
+    gdouble dt, rate, innovation, gain, alpha;
+
+    if(load >= PCAT_BATTERY_ESTIMATOR_LOAD_LAST)
+    {
+        load = PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL;
+    }
+
+    if(on_battery)
+    {
+        measured_soc = MIN(measured_soc +
+            estimator->calibration.measurement_offset[load], 100.0);
+    }
+
+    if(!estimator->initialized)
+    {
+        estimator->initialized = TRUE;
+        estimator->timestamp = timestamp;
+        estimator->soc = measured_soc;
+        estimator->variance = PCAT_BATTERY_ESTIMATOR_INITIAL_VARIANCE;
+        estimator->measurement_noise =
+            PCAT_BATTERY_ESTIMATOR_MEASUREMENT_NOISE_MIN;
+        estimator->measured_smooth = measured_soc;
+        estimator->on_battery = on_battery;
+        estimator->load = load;
+        pcat_battery_estimator_segment_start(estimator);
+
+        return;
+    }
+
+    dt = (timestamp - estimator->timestamp) / 1e6;
+    if(dt < 0.0)
+    {
+        dt = 0.0;
+    }
+    else if(dt > PCAT_BATTERY_ESTIMATOR_DT_MAX)
+    {
+        dt = PCAT_BATTERY_ESTIMATOR_DT_MAX;
+    }
+    estimator->timestamp = timestamp;
+
+    alpha = dt / (PCAT_BATTERY_ESTIMATOR_MEASUREMENT_TIME_CONSTANT + dt);
+    estimator->measured_smooth += (measured_soc -
+        estimator->measured_smooth) * alpha;
+
+    if(on_battery!=estimator->on_battery)
+    {
+        /*
+         * Plugging or unplugging the charger shifts the voltage curve, let
+         * the measurements take over again for a while.
+         */
+        pcat_battery_estimator_segment_finish(estimator);
+        estimator->on_battery = on_battery;
+        estimator->load = load;
+        estimator->variance += PCAT_BATTERY_ESTIMATOR_TRANSITION_VARIANCE;
+        estimator->measured_smooth = measured_soc;
+        pcat_battery_estimator_segment_start(estimator);
+    }
+    else if(load!=estimator->load)
+    {
+        estimator->segment_valid = FALSE;
+        estimator->load = load;
+    }
+
+    /* Predict. */
+    if(on_battery)
+    {
+        rate = -estimator->calibration.discharge_rate[load];
+    }
+    else
+    {
+        rate = estimator->calibration.charge_rate;
+    }
+    estimator->soc += rate * dt / 3600.0;
+    estimator->soc = CLAMP(estimator->soc, 0.0, 100.0);
+    estimator->variance += PCAT_BATTERY_ESTIMATOR_PROCESS_NOISE * dt;
+
+    /* Update, with the measurement noise following the innovations. */
+    innovation = measured_soc - estimator->soc;
+    estimator->measurement_noise += (innovation * innovation -
+        estimator->measurement_noise) *
+        PCAT_BATTERY_ESTIMATOR_INNOVATION_WEIGHT;
+    if(estimator->measurement_noise <
+        PCAT_BATTERY_ESTIMATOR_MEASUREMENT_NOISE_MIN)
+    {
+        estimator->measurement_noise =
+            PCAT_BATTERY_ESTIMATOR_MEASUREMENT_NOISE_MIN;
+    }
+
+    if(on_battery)
+    {
+        pcat_battery_estimator_offset_learn(estimator, load, innovation, dt);
+    }
+
+    gain = estimator->variance / (estimator->variance +
+        estimator->measurement_noise);
+    estimator->soc += gain * innovation;
+    estimator->soc = CLAMP(estimator->soc, 0.0, 100.0);
+    estimator->variance *= (1.0 - gain);
+
+    /* A full battery on the charger is a known point. */
+    if(!on_battery && measured_soc >= 100.0)
+    {
+        pcat_battery_estimator_segment_finish(estimator);
+        estimator->soc = 100.0;
+    }
+}
+
+gdouble pcat_battery_estimator_soc_get(
+    const PCatBatteryEstimator *estimator)
+{
+    return estimator->soc;
+}
+
+/*
+ * Confidence in percent, 100 is a standard deviation of 0% and 0 is a
+ * standard deviation of 10% (the initial value) or more.
+ */
+guint pcat_battery_estimator_confidence_get(
+    const PCatBatteryEstimator *estimator)
+{
+    gdouble confidence;
+
+    if(!estimator->initialized)
+    {
+        return 0;
+    }
+
+    confidence = 100.0 - sqrt(estimator->variance) * 10.0;
+
+    return (guint)CLAMP(confidence, 0.0, 100.0);
+}
+
+const PCatBatteryEstimatorCalibration *
+    pcat_battery_estimator_calibration_get(
+    const PCatBatteryEstimator *estimator)
+{
+    return &estimator->calibration;
+}
+
+gboolean pcat_battery_estimator_calibration_load(
+    PCatBatteryEstimator *estimator, const gchar *file)
+{
+    GKeyFile *keyfile;
+    GError *error = NULL;
+    gdouble value;
+
+    keyfile = g_key_file_new();
+
+    if(!g_key_file_load_from_file(keyfile, file, G_KEY_FILE_NONE, &error))
+    {
+        g_clear_error(&error);
+        g_key_file_unref(keyfile);
+
+        return FALSE;
+    }
+
+    value = g_key_file_get_double(keyfile,
+        PCAT_BATTERY_ESTIMATOR_CALIBRATION_GROUP, "DischargeRateNormal",
+        NULL);
+    if(value >= PCAT_BATTERY_ESTIMATOR_RATE_MIN &&
+       value <= PCAT_BATTERY_ESTIMATOR_RATE_MAX)
+    {
+        estimator->calibration.discharge_rate[
+            PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL] = value;
+    }
+
+    value = g_key_file_get_double(keyfile,
+        PCAT_BATTERY_ESTIMATOR_CALIBRATION_GROUP, "DischargeRateHigh",
+        NULL);
+    if(value >= PCAT_BATTERY_ESTIMATOR_RATE_MIN &&
+       value <= PCAT_BATTERY_ESTIMATOR_RATE_MAX)
+    {
+        estimator->calibration.discharge_rate[
+            PCAT_BATTERY_ESTIMATOR_LOAD_HIGH] = value;
+    }
+
+    value = g_key_file_get_double(keyfile,
+        PCAT_BATTERY_ESTIMATOR_CALIBRATION_GROUP, "ChargeRate", NULL);
+    if(value >= PCAT_BATTERY_ESTIMATOR_RATE_MIN &&
+       value <= PCAT_BATTERY_ESTIMATOR_RATE_MAX)
+    {
+        estimator->calibration.charge_rate = value;
+    }
+
+    value = g_key_file_get_double(keyfile,
+        PCAT_BATTERY_ESTIMATOR_CALIBRATION_GROUP, "MeasurementOffsetHigh",
+        NULL);
+    if(value >= 0.0 && value <= PCAT_BATTERY_ESTIMATOR_OFFSET_MAX)
+    {
+        estimator->calibration.measurement_offset[
+            PCAT_BATTERY_ESTIMATOR_LOAD_HIGH] = value;
+        estimator->measurement_offset_saved[
+            PCAT_BATTERY_ESTIMATOR_LOAD_HIGH] = value;
+    }
+
+    estimator->calibration.cycles = g_key_file_get_integer(keyfile,
+        PCAT_BATTERY_ESTIMATOR_CALIBRATION_GROUP, "Cycles", NULL);
+
+    g_key_file_unref(keyfile);
+
+    return TRUE;
+}
+
+/*
+ * Serialize the calibration and clear the dirty flag, the caller writes
+ * the data out (away from the PMU I/O path).
+ */
+gchar *pcat_battery_estimator_calibration_to_data(
+    PCatBatteryEstimator *estimator, gsize *length)
+{
+    GKeyFile *keyfile;
+    gchar *data;
+
+    keyfile = g_key_file_new();
+
+    g_key_file_set_double(keyfile, PCAT_BATTERY_ESTIMATOR_CALIBRATION_GROUP,
+        "DischargeRateNormal", estimator->calibration.discharge_rate[
+        PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL]);
+    g_key_file_set_double(keyfile, PCAT_BATTERY_ESTIMATOR_CALIBRATION_GROUP,
+        "DischargeRateHigh", estimator->calibration.discharge_rate[
+        PCAT_BATTERY_ESTIMATOR_LOAD_HIGH]);
+    g_key_file_set_double(keyfile, PCAT_BATTERY_ESTIMATOR_CALIBRATION_GROUP,
+        "ChargeRate", estimator->calibration.charge_rate);
+    g_key_file_set_double(keyfile, PCAT_BATTERY_ESTIMATOR_CALIBRATION_GROUP,
+        "MeasurementOffsetHigh", estimator->calibration.measurement_offset[
+        PCAT_BATTERY_ESTIMATOR_LOAD_HIGH]);
+    g_key_file_set_integer(keyfile, PCAT_BATTERY_ESTIMATOR_CALIBRATION_GROUP,
+        "Cycles", estimator->calibration.cycles);
+
+    data = g_key_file_to_data(keyfile, length, NULL);
+    g_key_file_unref(keyfile);
+
+    memcpy(estimator->measurement_offset_saved,
+        estimator->calibration.measurement_offset,
+        sizeof(estimator->measurement_offset_saved));
+    estimator->calibration_dirty = FALSE;
+
+    return data;
+}
+
+gboolean pcat_battery_estimator_calibration_dirty(
+    const PCatBatteryEstimator *estimator)
+{
+    return estimator->calibration_dirty;
+}
@@ -0,0 +1,52 @@
+#ifndef HAVE_PCAT_BATTERY_ESTIMATOR_H
+#define HAVE_PCAT_BATTERY_ESTIMATOR_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+    PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL = 0,
+    PCAT_BATTERY_ESTIMATOR_LOAD_HIGH,
+    PCAT_BATTERY_ESTIMATOR_LOAD_LAST
+}PCatBatteryEstimatorLoad;
+
+/*
+ * Rates are in percent of the voltage based SoC per hour, the measurement
+ * offsets in percent SoC by which the voltage based SoC on battery reads
+ * low under a load class (the normal load is the reference, its offset
+ * stays 0).
+ */
+typedef struct _PCatBatteryEstimatorCalibration
+{
+    gdouble discharge_rate[PCAT_BATTERY_ESTIMATOR_LOAD_LAST];
+    gdouble charge_rate;
+    gdouble measurement_offset[PCAT_BATTERY_ESTIMATOR_LOAD_LAST];
+    guint cycles;
+}PCatBatteryEstimatorCalibration;
+
+typedef struct _PCatBatteryEstimator PCatBatteryEstimator;
+
+PCatBatteryEstimator *pcat_battery_estimator_new();
+void pcat_battery_estimator_free(PCatBatteryEstimator *estimator);
+void pcat_battery_estimator_update(PCatBatteryEstimator *estimator,
+    gint64 timestamp, gdouble measured_soc, gboolean on_battery,
+    PCatBatteryEstimatorLoad load);
+gdouble pcat_battery_estimator_soc_get(
+    const PCatBatteryEstimator *estimator);
+guint pcat_battery_estimator_confidence_get(
+    const PCatBatteryEstimator *estimator);
+const PCatBatteryEstimatorCalibration *
+    pcat_battery_estimator_calibration_get(
+    const PCatBatteryEstimator *estimator);
+gboolean pcat_battery_estimator_calibration_load(
+    PCatBatteryEstimator *estimator, const gchar *file);
+gchar *pcat_battery_estimator_calibration_to_data(
+    PCatBatteryEstimator *estimator, gsize *length);
+gboolean pcat_battery_estimator_calibration_dirty(
+    const PCatBatteryEstimator *estimator);
+
+G_END_DECLS
+
+#endif
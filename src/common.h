@@ -2,6 +2,7 @@
 #define HAVE_PCAT_COMMON_H
 
 #include <glib.h>
+#include "log-file.h"
 
 G_BEGIN_DECLS
 
@@ -20,7 +21,9 @@ typedef enum
     PCAT_MANAGER_ROUTE_MODE_NONE,
     PCAT_MANAGER_ROUTE_MODE_UNKNOWN,
     PCAT_MANAGER_ROUTE_MODE_WIRED,
-    PCAT_MANAGER_ROUTE_MODE_MOBILE
+    PCAT_MANAGER_ROUTE_MODE_MOBILE,
+    PCAT_MANAGER_ROUTE_MODE_WIFI,
+    PCAT_MANAGER_ROUTE_MODE_SATELLITE
 }PCatManagerRouteMode;
 
 typedef enum
@@ -29,6 +32,14 @@ typedef enum
     PCAT_MANAGER_MWAN_MODE_DEFAULT
 }PCatManagerMWANMode;
 
+/* An uplink known to the route engine, weight 0 means the default. */
+typedef struct _PCatManagerNetworkInterfaceData
+{
+    gchar *name;
+    PCatManagerRouteMode route_mode;
+    guint weight;
+}PCatManagerNetworkInterfaceData;
+
 typedef struct _PCatManagerMainConfigData
 {
     gboolean valid;
@@ -45,6 +56,11 @@ typedef struct _PCatManagerMainConfigData
 
     gchar *pm_serial_device;
     guint pm_serial_baud;
+    guint pm_serial_baud_max;
+    gchar **pm_serial_baud_firmware;
+    gboolean pm_serial_low_latency;
+    guint pm_serial_read_min;
+    guint pm_serial_read_timeout;
     guint pm_auto_shutdown_voltage_general;
     guint pm_auto_shutdown_voltage_lte;
     guint pm_auto_shutdown_voltage_5g;
@@ -61,9 +77,25 @@ typedef struct _PCatManagerMainConfigData
     guint pm_charger_limit_voltage;
     guint pm_charger_fast_voltage;
     guint pm_battery_full_threshold;
+    guint pm_command_window;
+    guint pm_io_thread_priority;
+    guint pm_io_thread_cpu_mask;
+    gboolean pm_battery_estimator_enabled;
+
+    gchar *journal_file;
+    guint journal_records;
+    guint journal_sync_interval;
+    guint journal_status_interval;
+
+    gchar **net_check_targets;
+    guint net_check_timeout;
+    guint net_check_rounds;
+    GPtrArray *net_interfaces;
 
     gboolean debug_modem_external_exec_stdout_log;
     gboolean debug_output_log;
+    gboolean debug_pmu_link_stats;
+    PCatLogFileLimits debug_log_limits;
 }PCatManagerMainConfigData;
 
 typedef struct _PCatManagerPowerScheduleData
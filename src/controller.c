@@ -19,6 +19,7 @@ typedef struct _PCatControllerConnectionData
     GSource *output_stream_source;
     GByteArray *input_buffer;
     GByteArray *output_buffer;
+    gboolean route_mode_subscribed;
 }PCatControllerConnectionData;
 
 typedef struct _PCatControllerData
@@ -421,15 +422,11 @@ static void pcat_controller_command_pmu_status_func(
     const gchar *command, struct json_object *root)
 {
     struct json_object *rroot, *child;
-    guint battery_voltage = 0, charger_voltage = 0, battery_percentage = 0;
-    gint board_temp;
-    gboolean on_battery = FALSE;
+    PCatPMUManagerStatus status = {0};
 
     rroot = json_object_new_object();
 
-    pcat_pmu_manager_pmu_status_get(&battery_voltage, &charger_voltage,
-        &on_battery, &battery_percentage);
-    board_temp = pcat_pmu_manager_board_temp_get();
+    pcat_pmu_manager_status_snapshot_get(&status);
 
     child = json_object_new_string(command);
     json_object_object_add(rroot, "command", child);
@@ -437,19 +434,22 @@ static void pcat_controller_command_pmu_status_func(
     child = json_object_new_int(0);
     json_object_object_add(rroot, "code", child);
 
-    child = json_object_new_int(battery_voltage);
+    child = json_object_new_int(status.battery_voltage);
     json_object_object_add(rroot, "battery-voltage", child);
 
-    child = json_object_new_int(charger_voltage);
+    child = json_object_new_int(status.charger_voltage);
     json_object_object_add(rroot, "charger-voltage", child);
 
-    child = json_object_new_int(on_battery ? 1 : 0);
+    child = json_object_new_int(status.on_battery ? 1 : 0);
     json_object_object_add(rroot, "on-battery", child);
 
-    child = json_object_new_int(battery_percentage);
+    child = json_object_new_int(status.battery_percentage);
     json_object_object_add(rroot, "charge-percentage", child);
 
-    child = json_object_new_int(board_temp);
+    child = json_object_new_int(status.battery_percentage_confidence);
+    json_object_object_add(rroot, "charge-percentage-confidence", child);
+
+    child = json_object_new_int(status.board_temp);
     json_object_object_add(rroot, "board-temperature", child);
 
     pcat_controller_unix_socket_output_json_push(ctrl_data, connection_data,
@@ -720,21 +720,15 @@ static void pcat_controller_command_modem_status_get_func(
     const gchar *command, struct json_object *root)
 {
     struct json_object *rroot, *child;
-    PCatModemManagerMode mode = PCAT_MODEM_MANAGER_MODE_NONE;
-    PCatModemManagerSIMState sim_state = PCAT_MODEM_MANAGER_SIM_STATE_ABSENT;
-    gint signal_strength = 0;
-    gchar *isp_name = NULL;
-    gchar *isp_plmn = NULL;
+    PCatModemManagerStatus status = {0};
     gint code = 0;
     const gchar *mode_str = "none", *sim_state_str = "absent";
-    gboolean rfkill_state = FALSE;
 
     rroot = json_object_new_object();
     child = json_object_new_string(command);
     json_object_object_add(rroot, "command", child);
 
-    if(!pcat_modem_manager_status_get(&mode, &sim_state, &rfkill_state,
-        &signal_strength, &isp_name, &isp_plmn))
+    if(!pcat_modem_manager_status_snapshot_get(&status))
     {
         code = 1;
     }
@@ -742,7 +736,7 @@ static void pcat_controller_command_modem_status_get_func(
     child = json_object_new_int(code);
     json_object_object_add(rroot, "code", child);
 
-    switch(mode)
+    switch(status.mode)
     {
         case PCAT_MODEM_MANAGER_MODE_2G:
         {
@@ -770,7 +764,7 @@ static void pcat_controller_command_modem_status_get_func(
         }
     }
 
-    switch(sim_state)
+    switch(status.sim_state)
     {
         case PCAT_MODEM_MANAGER_SIM_STATE_ABSENT:
         {
@@ -816,42 +810,31 @@ static void pcat_controller_command_modem_status_get_func(
     child = json_object_new_string(mode_str);
     json_object_object_add(rroot, "mode", child);
 
-    child = json_object_new_int(rfkill_state ? 1 : 0);
+    child = json_object_new_int(status.rfkill_state ? 1 : 0);
     json_object_object_add(rroot, "rfkill-state", child);
 
     child = json_object_new_string(sim_state_str);
     json_object_object_add(rroot, "sim-state", child);
 
-    child = json_object_new_string(isp_name!=NULL ? isp_name : "");
+    child = json_object_new_string(status.isp_name);
     json_object_object_add(rroot, "isp-name", child);
 
-    child = json_object_new_string(isp_plmn!=NULL ? isp_plmn : "");
+    child = json_object_new_string(status.isp_plmn);
     json_object_object_add(rroot, "isp-lpmn", child);
     
-    child = json_object_new_int(signal_strength);
+    child = json_object_new_int(status.signal_strength);
     json_object_object_add(rroot, "signal-strength", child);
 
-    g_free(isp_name);
-    g_free(isp_plmn);
-
     pcat_controller_unix_socket_output_json_push(ctrl_data, connection_data,
         rroot);
     json_object_put(rroot);
 }
 
-static void pcat_controller_command_network_route_mode_get_func(
-    PCatControllerData *ctrl_data,
-    PCatControllerConnectionData *connection_data,
-    const gchar *command, struct json_object *root)
+static const gchar *pcat_controller_network_route_mode_string_get(
+    PCatManagerRouteMode mode)
 {
-    struct json_object *rroot, *child;
-    PCatManagerRouteMode mode;
     const gchar *mode_str = "none";
 
-    rroot = json_object_new_object();
-
-    mode = pcat_main_network_route_mode_get();
-
     switch(mode)
     {
         case PCAT_MANAGER_ROUTE_MODE_WIRED:
@@ -864,6 +847,16 @@ static void pcat_controller_command_network_route_mode_get_func(
             mode_str = "mobile";
             break;
         }
+        case PCAT_MANAGER_ROUTE_MODE_WIFI:
+        {
+            mode_str = "wifi";
+            break;
+        }
+        case PCAT_MANAGER_ROUTE_MODE_SATELLITE:
+        {
+            mode_str = "satellite";
+            break;
+        }
         case PCAT_MANAGER_ROUTE_MODE_UNKNOWN:
         {
             mode_str = "unknown";
@@ -875,13 +868,67 @@ static void pcat_controller_command_network_route_mode_get_func(
         }
     }
 
+    return mode_str;
+}
+
+static void pcat_controller_command_network_route_mode_get_func(
+    PCatControllerData *ctrl_data,
+    PCatControllerConnectionData *connection_data,
+    const gchar *command, struct json_object *root)
+{
+    struct json_object *rroot, *child;
+
+    rroot = json_object_new_object();
+
+    child = json_object_new_string(command);
+    json_object_object_add(rroot, "command", child);
+
+    child = json_object_new_int(0);
+    json_object_object_add(rroot, "code", child);
+
+    child = json_object_new_string(
+        pcat_controller_network_route_mode_string_get(
+        pcat_main_network_route_mode_get()));
+    json_object_object_add(rroot, "mode", child);
+
+    pcat_controller_unix_socket_output_json_push(ctrl_data, connection_data,
+        rroot);
+    json_object_put(rroot);
+}
+
+/*
+ * Subscribed connections get a "network-route-mode-changed" message on
+ * every route mode transition. The reply carries the current mode.
+ */
+static void pcat_controller_command_network_route_mode_subscribe_func(
+    PCatControllerData *ctrl_data,
+    PCatControllerConnectionData *connection_data,
+    const gchar *command, struct json_object *root)
+{
+    struct json_object *rroot, *child;
+
+    connection_data->route_mode_subscribed = TRUE;
+    if(json_object_object_get_ex(root, "state", &child))
+    {
+        connection_data->route_mode_subscribed =
+            (json_object_get_int(child)!=0);
+    }
+
+    rroot = json_object_new_object();
+
     child = json_object_new_string(command);
     json_object_object_add(rroot, "command", child);
 
     child = json_object_new_int(0);
     json_object_object_add(rroot, "code", child);
 
-    child = json_object_new_string(mode_str);
+    child = json_object_new_int(connection_data->route_mode_subscribed ?
+        1 : 0);
+    json_object_object_add(rroot, "state", child);
+
+    child = json_object_new_string(
+        pcat_controller_network_route_mode_string_get(
+        pcat_main_network_route_mode_get()));
     json_object_object_add(rroot, "mode", child);
 
     pcat_controller_unix_socket_output_json_push(ctrl_data, connection_data,
@@ -993,6 +1040,256 @@ static void pcat_controller_command_pmu_fw_version_get_func(
     json_object_put(rroot);
 }
 
+static void pcat_controller_command_pmu_command_queue_stats_get_func(
+    PCatControllerData *ctrl_data,
+    PCatControllerConnectionData *connection_data,
+    const gchar *command, struct json_object *root)
+{
+    struct json_object *rroot, *child, *array, *node;
+    static const gchar * const lane_names[
+        PCAT_PMU_MANAGER_COMMAND_PRIORITY_LAST] =
+    {
+        "safety", "ack", "config", "cosmetic"
+    };
+    guint depth;
+    guint64 dropped, coalesced;
+    guint i;
+
+    rroot = json_object_new_object();
+
+    child = json_object_new_string(command);
+    json_object_object_add(rroot, "command", child);
+
+    child = json_object_new_int(0);
+    json_object_object_add(rroot, "code", child);
+
+    array = json_object_new_array();
+    for(i=0;i<PCAT_PMU_MANAGER_COMMAND_PRIORITY_LAST;i++)
+    {
+        if(!pcat_pmu_manager_command_queue_stats_get(i, &depth, &dropped,
+            &coalesced))
+        {
+            continue;
+        }
+
+        node = json_object_new_object();
+
+        child = json_object_new_string(lane_names[i]);
+        json_object_object_add(node, "lane", child);
+
+        child = json_object_new_int(depth);
+        json_object_object_add(node, "depth", child);
+
+        child = json_object_new_int64(dropped);
+        json_object_object_add(node, "dropped", child);
+
+        child = json_object_new_int64(coalesced);
+        json_object_object_add(node, "coalesced", child);
+
+        json_object_array_add(array, node);
+    }
+    json_object_object_add(rroot, "lanes", array);
+
+    pcat_controller_unix_socket_output_json_push(ctrl_data, connection_data,
+        rroot);
+    json_object_put(rroot);
+}
+
+static void pcat_controller_command_pmu_link_stats_get_func(
+    PCatControllerData *ctrl_data,
+    PCatControllerConnectionData *connection_data,
+    const gchar *command, struct json_object *root)
+{
+    struct json_object *rroot, *child;
+    PCatPMUManagerLinkStats stats;
+
+    pcat_pmu_manager_link_stats_get(&stats);
+
+    rroot = json_object_new_object();
+
+    child = json_object_new_string(command);
+    json_object_object_add(rroot, "command", child);
+
+    child = json_object_new_int(0);
+    json_object_object_add(rroot, "code", child);
+
+    child = json_object_new_int64(stats.rx_bytes);
+    json_object_object_add(rroot, "rx-bytes", child);
+
+    child = json_object_new_int64(stats.rx_frames);
+    json_object_object_add(rroot, "rx-frames", child);
+
+    child = json_object_new_int64(stats.rx_errors);
+    json_object_object_add(rroot, "rx-errors", child);
+
+    child = json_object_new_int64(stats.tx_bytes);
+    json_object_object_add(rroot, "tx-bytes", child);
+
+    child = json_object_new_int64(stats.tx_frames);
+    json_object_object_add(rroot, "tx-frames", child);
+
+    child = json_object_new_int64(stats.tx_syscalls);
+    json_object_object_add(rroot, "tx-syscalls", child);
+
+    child = json_object_new_int64(stats.retransmits);
+    json_object_object_add(rroot, "retransmits", child);
+
+    child = json_object_new_int64(stats.allocations);
+    json_object_object_add(rroot, "allocations", child);
+
+    child = json_object_new_int64(stats.cpu_time);
+    json_object_object_add(rroot, "cpu-time", child);
+
+    pcat_controller_unix_socket_output_json_push(ctrl_data, connection_data,
+        rroot);
+    json_object_put(rroot);
+}
+
+/*
+ * Return a time range of the PMU telemetry history. Parameters are
+ * "tier" ("second", "minute" or "hour"), "start" and "end" in unix
+ * seconds, both optional. With "packed" set, every column is returned as
+ * base64 encoded little endian integers (64-bit timestamps, 32-bit
+ * values) instead of a JSON array.
+ */
+static void pcat_controller_command_pmu_telemetry_get_func(
+    PCatControllerData *ctrl_data,
+    PCatControllerConnectionData *connection_data,
+    const gchar *command, struct json_object *root)
+{
+    struct json_object *rroot, *child, *array;
+    static const gchar * const tier_names[PCAT_TELEMETRY_TIER_LAST] =
+    {
+        "second", "minute", "hour"
+    };
+    PCatTelemetryTier tier = PCAT_TELEMETRY_TIER_SECOND;
+    PCatTelemetrySeries *series = NULL;
+    gint64 start = 0, end = G_MAXINT64;
+    gboolean packed = FALSE;
+    const gchar *tier_name;
+    gchar *encoded;
+    gint code = 0;
+    guint i, j;
+
+    if(json_object_object_get_ex(root, "tier", &child))
+    {
+        tier_name = json_object_get_string(child);
+        for(i=0;i<PCAT_TELEMETRY_TIER_LAST;i++)
+        {
+            if(g_strcmp0(tier_name, tier_names[i])==0)
+            {
+                break;
+            }
+        }
+        if(i < PCAT_TELEMETRY_TIER_LAST)
+        {
+            tier = i;
+        }
+        else
+        {
+            code = 1;
+        }
+    }
+    if(json_object_object_get_ex(root, "start", &child))
+    {
+        start = json_object_get_int64(child);
+    }
+    if(json_object_object_get_ex(root, "end", &child))
+    {
+        end = json_object_get_int64(child);
+    }
+    if(json_object_object_get_ex(root, "packed", &child))
+    {
+        packed = (json_object_get_int(child)!=0);
+    }
+
+    if(code==0)
+    {
+        series = pcat_pmu_manager_telemetry_query(tier, start, end);
+        if(series==NULL)
+        {
+            code = 1;
+        }
+    }
+
+    rroot = json_object_new_object();
+
+    child = json_object_new_string(command);
+    json_object_object_add(rroot, "command", child);
+
+    child = json_object_new_int(code);
+    json_object_object_add(rroot, "code", child);
+
+    if(series!=NULL)
+    {
+        child = json_object_new_string(tier_names[tier]);
+        json_object_object_add(rroot, "tier", child);
+
+        child = json_object_new_int(series->interval);
+        json_object_object_add(rroot, "interval", child);
+
+        child = json_object_new_int(series->count);
+        json_object_object_add(rroot, "count", child);
+
+        if(packed)
+        {
+            for(i=0;i<series->count;i++)
+            {
+                series->timestamps[i] = GINT64_TO_LE(series->timestamps[i]);
+            }
+            encoded = g_base64_encode((const guchar *)series->timestamps,
+                series->count * sizeof(gint64));
+            child = json_object_new_string(encoded);
+            json_object_object_add(rroot, "timestamp", child);
+            g_free(encoded);
+
+            for(j=0;j<PCAT_TELEMETRY_COLUMN_LAST;j++)
+            {
+                for(i=0;i<series->count;i++)
+                {
+                    series->columns[j][i] = GINT32_TO_LE(
+                        series->columns[j][i]);
+                }
+                encoded = g_base64_encode(
+                    (const guchar *)series->columns[j],
+                    series->count * sizeof(gint32));
+                child = json_object_new_string(encoded);
+                json_object_object_add(rroot,
+                    pcat_telemetry_column_name_get(j), child);
+                g_free(encoded);
+            }
+        }
+        else
+        {
+            array = json_object_new_array();
+            for(i=0;i<series->count;i++)
+            {
+                json_object_array_add(array,
+                    json_object_new_int64(series->timestamps[i]));
+            }
+            json_object_object_add(rroot, "timestamp", array);
+
+            for(j=0;j<PCAT_TELEMETRY_COLUMN_LAST;j++)
+            {
+                array = json_object_new_array();
+                for(i=0;i<series->count;i++)
+                {
+                    json_object_array_add(array,
+                        json_object_new_int(series->columns[j][i]));
+                }
+                json_object_object_add(rroot,
+                    pcat_telemetry_column_name_get(j), array);
+            }
+        }
+
+        pcat_telemetry_series_free(series);
+    }
+
+    pcat_controller_unix_socket_output_json_push(ctrl_data, connection_data,
+        rroot);
+    json_object_put(rroot);
+}
+
 static void pcat_controller_command_modem_rfkill_mode_set_func(
     PCatControllerData *ctrl_data,
     PCatControllerConnectionData *connection_data,
@@ -1167,6 +1464,11 @@ static PCatControllerCommandData g_pcat_controller_command_list[] =
         .command = "network-route-mode-get",
         .callback = pcat_controller_command_network_route_mode_get_func,
     },
+    {
+        .command = "network-route-mode-subscribe",
+        .callback =
+            pcat_controller_command_network_route_mode_subscribe_func,
+    },
     {
         .command = "charger-on-auto-start-set",
         .callback = pcat_controller_command_charger_on_auto_start_set_func,
@@ -1179,6 +1481,18 @@ static PCatControllerCommandData g_pcat_controller_command_list[] =
         .command = "pmu-fw-version-get",
         .callback = pcat_controller_command_pmu_fw_version_get_func,
     },
+    {
+        .command = "pmu-command-queue-stats-get",
+        .callback = pcat_controller_command_pmu_command_queue_stats_get_func,
+    },
+    {
+        .command = "pmu-link-stats-get",
+        .callback = pcat_controller_command_pmu_link_stats_get_func,
+    },
+    {
+        .command = "pmu-telemetry-get",
+        .callback = pcat_controller_command_pmu_telemetry_get_func,
+    },
     {
         .command = "modem-rfkill-mode-set",
         .callback = pcat_controller_command_modem_rfkill_mode_set_func,
@@ -1331,3 +1645,39 @@ void pcat_controller_uninit()
     g_pcat_controller_data.initialized = FALSE;
 }
 
+void pcat_controller_network_route_mode_notify(PCatManagerRouteMode mode)
+{
+    PCatControllerData *ctrl_data = &g_pcat_controller_data;
+    PCatControllerConnectionData *connection_data;
+    GHashTableIter iter;
+    struct json_object *rroot, *child;
+
+    if(!ctrl_data->initialized)
+    {
+        return;
+    }
+
+    rroot = json_object_new_object();
+
+    child = json_object_new_string("network-route-mode-changed");
+    json_object_object_add(rroot, "command", child);
+
+    child = json_object_new_int(0);
+    json_object_object_add(rroot, "code", child);
+
+    child = json_object_new_string(
+        pcat_controller_network_route_mode_string_get(mode));
+    json_object_object_add(rroot, "mode", child);
+
+    g_hash_table_iter_init(&iter, ctrl_data->control_connection_table);
+    while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&connection_data))
+    {
+        if(connection_data->route_mode_subscribed)
+        {
+            pcat_controller_unix_socket_output_json_push(ctrl_data,
+                connection_data, rroot);
+        }
+    }
+
+    json_object_put(rroot);
+}
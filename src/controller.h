@@ -2,11 +2,13 @@
 #define HAVE_PCAT_CONTROLLER_MANAGER_H
 
 #include <glib.h>
+#include "common.h"
 
 G_BEGIN_DECLS
 
 gboolean pcat_controller_init();
 void pcat_controller_uninit();
+void pcat_controller_network_route_mode_notify(PCatManagerRouteMode mode);
 
 G_END_DECLS
 
@@ -0,0 +1,12 @@
+#ifndef HAVE_PCAT_CRC16_H
+#define HAVE_PCAT_CRC16_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PCAT_CRC16_INIT 0xFFFF
+
+uint16_t pcat_crc16_update(uint16_t crc, const uint8_t *data, size_t len);
+uint16_t pcat_crc16_compute(const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,461 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "icmp-prober.h"
+
+/*
+ * In-process ICMP echo prober. One echo request is sent to every target
+ * at once and a run returns as soon as the first reply arrived, so a
+ * working uplink is confirmed within one round trip and only a dead one
+ * waits for the whole timeout. Replies which arrive after their run
+ * returned are still picked up by the next one, but only go into the
+ * statistics. Unprivileged ICMP datagram sockets are used when the kernel
+ * allows them (net.ipv4.ping_group_range), raw sockets otherwise.
+ */
+
+#define PCAT_ICMP_PROBER_PACKET_SIZE 64
+#define PCAT_ICMP_PROBER_HEADER_SIZE 8
+#define PCAT_ICMP_PROBER_RECEIVE_SIZE 1500
+
+#define PCAT_ICMP_PROBER_ICMP_ECHO_REPLY 0
+#define PCAT_ICMP_PROBER_ICMP_ECHO_REQUEST 8
+#define PCAT_ICMP_PROBER_ICMP6_ECHO_REQUEST 128
+#define PCAT_ICMP_PROBER_ICMP6_ECHO_REPLY 129
+
+typedef struct _PCatIcmpProberTarget
+{
+    gint family;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    gint64 send_timestamp;
+    gboolean pending;
+    gint64 late_timestamp;
+    guint16 late_seq;
+    gboolean late;
+}PCatIcmpProberTarget;
+
+struct _PCatIcmpProber
+{
+    PCatIcmpProberTarget *targets;
+    PCatIcmpProberTargetStats *stats;
+    guint target_count;
+    gint fd[2];
+    gboolean raw[2];
+    guint16 ident;
+    guint16 seq;
+};
+
+static inline guint pcat_icmp_prober_family_index(gint family)
+{
+    return (family==AF_INET6) ? 1 : 0;
+}
+
+static guint16 pcat_icmp_prober_checksum(const guint8 *data, gsize len)
+{
+    guint32 sum = 0;
+    gsize i;
+
+    for(i=0;i+1<len;i+=2)
+    {
+        sum += (data[i] << 8) | data[i + 1];
+    }
+    if(len & 1)
+    {
+        sum += data[len - 1] << 8;
+    }
+    while(sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return ~sum & 0xffff;
+}
+
+static gint pcat_icmp_prober_socket_open(gint family, gboolean *raw)
+{
+    gint protocol = (family==AF_INET6) ? IPPROTO_ICMPV6 : IPPROTO_ICMP;
+    gint fd;
+
+    *raw = FALSE;
+    fd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+        protocol);
+    if(fd < 0)
+    {
+        *raw = TRUE;
+        fd = socket(family, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+            protocol);
+    }
+    if(fd < 0)
+    {
+        g_warning("Failed to open ICMP%s socket: %s",
+            (family==AF_INET6) ? "v6" : "", strerror(errno));
+    }
+
+    return fd;
+}
+
+static gboolean pcat_icmp_prober_address_equal(
+    const PCatIcmpProberTarget *target, const struct sockaddr_storage *addr)
+{
+    const struct sockaddr_in6 *target6, *addr6;
+    const struct sockaddr_in *target4, *addr4;
+
+    if(target->family!=addr->ss_family)
+    {
+        return FALSE;
+    }
+
+    if(target->family==AF_INET6)
+    {
+        target6 = (const struct sockaddr_in6 *)&target->addr;
+        addr6 = (const struct sockaddr_in6 *)addr;
+
+        return memcmp(&target6->sin6_addr, &addr6->sin6_addr,
+            sizeof(struct in6_addr))==0;
+    }
+
+    target4 = (const struct sockaddr_in *)&target->addr;
+    addr4 = (const struct sockaddr_in *)addr;
+
+    return target4->sin_addr.s_addr==addr4->sin_addr.s_addr;
+}
+
+/*
+ * Targets are numeric IPv4 or IPv6 addresses, invalid ones are skipped.
+ */
+PCatIcmpProber *pcat_icmp_prober_new(const gchar * const *targets)
+{
+    PCatIcmpProber *prober;
+    PCatIcmpProberTarget *target;
+    struct sockaddr_in *addr4;
+    struct sockaddr_in6 *addr6;
+    guint i, count = 0, family_index;
+
+    for(i=0;targets!=NULL && targets[i]!=NULL;i++)
+    {
+        count++;
+    }
+
+    prober = g_new0(PCatIcmpProber, 1);
+    prober->targets = g_new0(PCatIcmpProberTarget, MAX(count, 1));
+    prober->stats = g_new0(PCatIcmpProberTargetStats, MAX(count, 1));
+    prober->fd[0] = -1;
+    prober->fd[1] = -1;
+    prober->ident = getpid() & 0xffff;
+
+    for(i=0;i<count;i++)
+    {
+        target = &prober->targets[prober->target_count];
+        addr4 = (struct sockaddr_in *)&target->addr;
+        addr6 = (struct sockaddr_in6 *)&target->addr;
+
+        if(inet_pton(AF_INET, targets[i], &addr4->sin_addr)==1)
+        {
+            addr4->sin_family = AF_INET;
+            target->family = AF_INET;
+            target->addr_len = sizeof(struct sockaddr_in);
+        }
+        else if(inet_pton(AF_INET6, targets[i], &addr6->sin6_addr)==1)
+        {
+            addr6->sin6_family = AF_INET6;
+            target->family = AF_INET6;
+            target->addr_len = sizeof(struct sockaddr_in6);
+        }
+        else
+        {
+            g_warning("Invalid connection check target %s!", targets[i]);
+            continue;
+        }
+
+        family_index = pcat_icmp_prober_family_index(target->family);
+        if(prober->fd[family_index] < 0)
+        {
+            prober->fd[family_index] = pcat_icmp_prober_socket_open(
+                target->family, &prober->raw[family_index]);
+        }
+
+        prober->stats[prober->target_count].address = g_strdup(targets[i]);
+        prober->target_count++;
+    }
+
+    return prober;
+}
+
+void pcat_icmp_prober_free(PCatIcmpProber *prober)
+{
+    guint i;
+
+    if(prober==NULL)
+    {
+        return;
+    }
+
+    for(i=0;i<2;i++)
+    {
+        if(prober->fd[i] >= 0)
+        {
+            close(prober->fd[i]);
+        }
+    }
+    for(i=0;i<prober->target_count;i++)
+    {
+        g_free((gchar *)prober->stats[i].address);
+    }
+    g_free(prober->stats);
+    g_free(prober->targets);
+    g_free(prober);
+}
+
+static gboolean pcat_icmp_prober_send(PCatIcmpProber *prober, guint index)
+{
+    PCatIcmpProberTarget *target = &prober->targets[index];
+    guint8 packet[PCAT_ICMP_PROBER_PACKET_SIZE] = {0};
+    guint family_index;
+    guint16 v16;
+    guint32 v32;
+
+    family_index = pcat_icmp_prober_family_index(target->family);
+    if(prober->fd[family_index] < 0)
+    {
+        return FALSE;
+    }
+
+    packet[0] = (target->family==AF_INET6) ?
+        PCAT_ICMP_PROBER_ICMP6_ECHO_REQUEST :
+        PCAT_ICMP_PROBER_ICMP_ECHO_REQUEST;
+    v16 = GUINT16_TO_BE(prober->ident);
+    memcpy(packet + 4, &v16, 2);
+    v16 = GUINT16_TO_BE(prober->seq);
+    memcpy(packet + 6, &v16, 2);
+    v32 = GUINT32_TO_BE(index);
+    memcpy(packet + PCAT_ICMP_PROBER_HEADER_SIZE, &v32, 4);
+
+    /* The kernel fills the ICMPv6 checksum itself. */
+    if(target->family==AF_INET)
+    {
+        v16 = GUINT16_TO_BE(pcat_icmp_prober_checksum(packet,
+            sizeof(packet)));
+        memcpy(packet + 2, &v16, 2);
+    }
+
+    target->send_timestamp = g_get_monotonic_time();
+    if(sendto(prober->fd[family_index], packet, sizeof(packet), 0,
+        (const struct sockaddr *)&target->addr, target->addr_len) < 0)
+    {
+        g_debug("Failed to send ICMP echo to %s: %s",
+            prober->stats[index].address, strerror(errno));
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void pcat_icmp_prober_stats_update(PCatIcmpProberTargetStats *stats,
+    gdouble rtt)
+{
+    stats->received++;
+    stats->rtt_last = rtt;
+    if(stats->received==1 || rtt < stats->rtt_min)
+    {
+        stats->rtt_min = rtt;
+    }
+    if(rtt > stats->rtt_max)
+    {
+        stats->rtt_max = rtt;
+    }
+    stats->rtt_avg += (rtt - stats->rtt_avg) / stats->received;
+}
+
+/*
+ * Read all queued replies on a socket, returns the number of pending
+ * targets which got their answer. Late replies to the previous run are
+ * accounted but not counted.
+ */
+static guint pcat_icmp_prober_receive(PCatIcmpProber *prober,
+    guint family_index)
+{
+    guint8 buffer[PCAT_ICMP_PROBER_RECEIVE_SIZE];
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    const guint8 *icmp;
+    PCatIcmpProberTarget *target;
+    PCatIcmpProberTargetStats *stats;
+    gssize rsize;
+    gsize offset;
+    guint16 v16;
+    guint32 index;
+    guint16 seq;
+    guint replies = 0;
+
+    while(TRUE)
+    {
+        addr_len = sizeof(addr);
+        rsize = recvfrom(prober->fd[family_index], buffer, sizeof(buffer), 0,
+            (struct sockaddr *)&addr, &addr_len);
+        if(rsize < 0)
+        {
+            if(errno==EINTR)
+            {
+                continue;
+            }
+
+            break;
+        }
+
+        /* Raw IPv4 sockets also return the IP header. */
+        offset = 0;
+        if(family_index==0 && prober->raw[0])
+        {
+            if(rsize < 20)
+            {
+                continue;
+            }
+            offset = (buffer[0] & 0x0f) * 4;
+        }
+        if((gsize)rsize < offset + PCAT_ICMP_PROBER_HEADER_SIZE + 4)
+        {
+            continue;
+        }
+        icmp = buffer + offset;
+
+        if(icmp[0]!=(family_index ? PCAT_ICMP_PROBER_ICMP6_ECHO_REPLY :
+            PCAT_ICMP_PROBER_ICMP_ECHO_REPLY))
+        {
+            continue;
+        }
+
+        /* Datagram sockets get their identifier assigned by the kernel. */
+        memcpy(&v16, icmp + 4, 2);
+        if(prober->raw[family_index] && GUINT16_FROM_BE(v16)!=prober->ident)
+        {
+            continue;
+        }
+        memcpy(&v16, icmp + 6, 2);
+        seq = GUINT16_FROM_BE(v16);
+
+        memcpy(&index, icmp + PCAT_ICMP_PROBER_HEADER_SIZE, 4);
+        index = GUINT32_FROM_BE(index);
+        if(index >= prober->target_count)
+        {
+            continue;
+        }
+        target = &prober->targets[index];
+        if(!pcat_icmp_prober_address_equal(target, &addr))
+        {
+            continue;
+        }
+        stats = &prober->stats[index];
+
+        if(target->late && seq==target->late_seq)
+        {
+            target->late = FALSE;
+            pcat_icmp_prober_stats_update(stats,
+                (g_get_monotonic_time() - target->late_timestamp) / 1000.0);
+
+            continue;
+        }
+        if(!target->pending || seq!=prober->seq)
+        {
+            continue;
+        }
+
+        target->pending = FALSE;
+        stats->last_reply = TRUE;
+        pcat_icmp_prober_stats_update(stats,
+            (g_get_monotonic_time() - target->send_timestamp) / 1000.0);
+
+        replies++;
+    }
+
+    return replies;
+}
+
+/*
+ * Probe all targets in parallel and wait up to timeout (in ms) for the
+ * first reply, returns the number of targets which answered by then.
+ */
+guint pcat_icmp_prober_run(PCatIcmpProber *prober, guint timeout)
+{
+    struct pollfd pfds[2];
+    guint family_index[2];
+    guint i, nfds, pending = 0, replies = 0, received;
+    gint64 deadline, remaining;
+
+    prober->seq++;
+
+    for(i=0;i<prober->target_count;i++)
+    {
+        /* Only the last unanswered echo of a target is still waited for. */
+        if(prober->targets[i].pending)
+        {
+            prober->targets[i].late = TRUE;
+            prober->targets[i].late_seq = prober->seq - 1;
+            prober->targets[i].late_timestamp =
+                prober->targets[i].send_timestamp;
+        }
+        prober->targets[i].pending = FALSE;
+        prober->stats[i].last_reply = FALSE;
+        prober->stats[i].sent++;
+
+        if(pcat_icmp_prober_send(prober, i))
+        {
+            prober->targets[i].pending = TRUE;
+            pending++;
+        }
+    }
+
+    nfds = 0;
+    for(i=0;i<2;i++)
+    {
+        if(prober->fd[i] >= 0)
+        {
+            pfds[nfds].fd = prober->fd[i];
+            pfds[nfds].events = POLLIN;
+            family_index[nfds] = i;
+            nfds++;
+        }
+    }
+
+    deadline = g_get_monotonic_time() + (gint64)timeout * 1000;
+    while(pending > 0 && replies==0)
+    {
+        remaining = (deadline - g_get_monotonic_time()) / 1000;
+        if(remaining <= 0)
+        {
+            break;
+        }
+        if(poll(pfds, nfds, remaining) <= 0)
+        {
+            continue;
+        }
+
+        for(i=0;i<nfds;i++)
+        {
+            if(pfds[i].revents & POLLIN)
+            {
+                received = pcat_icmp_prober_receive(prober,
+                    family_index[i]);
+                replies += received;
+                pending -= MIN(pending, received);
+            }
+        }
+    }
+
+    return replies;
+}
+
+const PCatIcmpProberTargetStats *pcat_icmp_prober_stats_get(
+    PCatIcmpProber *prober, guint *count)
+{
+    if(count!=NULL)
+    {
+        *count = prober->target_count;
+    }
+
+    return prober->stats;
+}
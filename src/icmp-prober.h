@@ -0,0 +1,30 @@
+#ifndef HAVE_PCAT_ICMP_PROBER_H
+#define HAVE_PCAT_ICMP_PROBER_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _PCatIcmpProberTargetStats
+{
+    const gchar *address;
+    guint sent;
+    guint received;
+    gboolean last_reply;
+    gdouble rtt_last;
+    gdouble rtt_min;
+    gdouble rtt_avg;
+    gdouble rtt_max;
+}PCatIcmpProberTargetStats;
+
+typedef struct _PCatIcmpProber PCatIcmpProber;
+
+PCatIcmpProber *pcat_icmp_prober_new(const gchar * const *targets);
+void pcat_icmp_prober_free(PCatIcmpProber *prober);
+guint pcat_icmp_prober_run(PCatIcmpProber *prober, guint timeout);
+const PCatIcmpProberTargetStats *pcat_icmp_prober_stats_get(
+    PCatIcmpProber *prober, guint *count);
+
+G_END_DECLS
+
+#endif
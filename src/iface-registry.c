@@ -0,0 +1,183 @@
+#include "iface-registry.h"
+
+/*
+ * The uplinks the route engine cares about, indexed by OpenWrt interface
+ * name. The built-in wired and mobile interfaces are always there, the
+ * configured ones are added, or replace the class and weight of the
+ * built-in entry with the same name. Indices stay fixed for the lifetime
+ * of the registry so callers can keep per-interface arrays.
+ */
+
+#define PCAT_IFACE_REGISTRY_WEIGHT_DEFAULT 1
+
+/*
+ * Connectivity probe timeout per class in ms. A LTE/5G modem may first
+ * have to leave idle mode, a geostationary satellite round trip alone
+ * takes more than 500 ms.
+ */
+static const guint g_pcat_iface_registry_class_probe_timeouts[] =
+{
+    [PCAT_MANAGER_ROUTE_MODE_WIRED] = 450,
+    [PCAT_MANAGER_ROUTE_MODE_MOBILE] = 1500,
+    [PCAT_MANAGER_ROUTE_MODE_WIFI] = 450,
+    [PCAT_MANAGER_ROUTE_MODE_SATELLITE] = 3000
+};
+
+static const PCatManagerNetworkInterfaceData
+    g_pcat_iface_registry_builtin_interfaces[] =
+{
+    { "wan", PCAT_MANAGER_ROUTE_MODE_WIRED, 0 },
+    { "wan6", PCAT_MANAGER_ROUTE_MODE_WIRED, 0 },
+    { "wwan_5g", PCAT_MANAGER_ROUTE_MODE_MOBILE, 0 },
+    { "wwan_5g_v6", PCAT_MANAGER_ROUTE_MODE_MOBILE, 0 },
+    { "wwan_lte", PCAT_MANAGER_ROUTE_MODE_MOBILE, 0 },
+    { "wwan_lte_v6", PCAT_MANAGER_ROUTE_MODE_MOBILE, 0 }
+};
+
+struct _PCatIfaceRegistry
+{
+    GArray *interfaces;
+    GHashTable *index_table;
+    guint *weights;
+};
+
+static void pcat_iface_registry_add(PCatIfaceRegistry *registry,
+    const PCatManagerNetworkInterfaceData *data)
+{
+    PCatManagerNetworkInterfaceData *iface_data;
+    gpointer value;
+    guint index;
+
+    if(g_hash_table_lookup_extended(registry->index_table, data->name,
+        NULL, &value))
+    {
+        index = GPOINTER_TO_UINT(value);
+        iface_data = &g_array_index(registry->interfaces,
+            PCatManagerNetworkInterfaceData, index);
+    }
+    else
+    {
+        index = registry->interfaces->len;
+        g_array_set_size(registry->interfaces, index + 1);
+        iface_data = &g_array_index(registry->interfaces,
+            PCatManagerNetworkInterfaceData, index);
+        iface_data->name = g_strdup(data->name);
+
+        g_hash_table_insert(registry->index_table, iface_data->name,
+            GUINT_TO_POINTER(index));
+    }
+
+    iface_data->route_mode = data->route_mode;
+    iface_data->weight = data->weight > 0 ? data->weight :
+        PCAT_IFACE_REGISTRY_WEIGHT_DEFAULT;
+}
+
+PCatIfaceRegistry *pcat_iface_registry_new(const GPtrArray *interfaces)
+{
+    PCatIfaceRegistry *registry;
+    const PCatManagerNetworkInterfaceData *data;
+    guint i;
+
+    registry = g_new0(PCatIfaceRegistry, 1);
+    registry->interfaces = g_array_new(FALSE, TRUE,
+        sizeof(PCatManagerNetworkInterfaceData));
+    registry->index_table = g_hash_table_new(g_str_hash, g_str_equal);
+
+    for(i=0;i<G_N_ELEMENTS(g_pcat_iface_registry_builtin_interfaces);i++)
+    {
+        pcat_iface_registry_add(registry,
+            &g_pcat_iface_registry_builtin_interfaces[i]);
+    }
+    for(i=0;interfaces!=NULL && i<interfaces->len;i++)
+    {
+        data = g_ptr_array_index(interfaces, i);
+        pcat_iface_registry_add(registry, data);
+    }
+
+    registry->weights = g_new0(guint, registry->interfaces->len);
+    for(i=0;i<registry->interfaces->len;i++)
+    {
+        data = &g_array_index(registry->interfaces,
+            PCatManagerNetworkInterfaceData, i);
+        registry->weights[i] = data->weight;
+
+        g_debug("Route interface %s, class %d, weight %u.", data->name,
+            data->route_mode, data->weight);
+    }
+
+    return registry;
+}
+
+void pcat_iface_registry_free(PCatIfaceRegistry *registry)
+{
+    guint i;
+
+    if(registry==NULL)
+    {
+        return;
+    }
+
+    g_hash_table_unref(registry->index_table);
+    for(i=0;i<registry->interfaces->len;i++)
+    {
+        g_free(g_array_index(registry->interfaces,
+            PCatManagerNetworkInterfaceData, i).name);
+    }
+    g_array_unref(registry->interfaces);
+    g_free(registry->weights);
+    g_free(registry);
+}
+
+guint pcat_iface_registry_count_get(PCatIfaceRegistry *registry)
+{
+    return registry->interfaces->len;
+}
+
+/* Returns the index of the interface, or -1 if it is not an uplink. */
+gint pcat_iface_registry_lookup(PCatIfaceRegistry *registry,
+    const gchar *name)
+{
+    gpointer value;
+
+    if(name==NULL || !g_hash_table_lookup_extended(registry->index_table,
+        name, NULL, &value))
+    {
+        return -1;
+    }
+
+    return GPOINTER_TO_UINT(value);
+}
+
+const PCatManagerNetworkInterfaceData *pcat_iface_registry_get(
+    PCatIfaceRegistry *registry, guint index)
+{
+    if(index >= registry->interfaces->len)
+    {
+        return NULL;
+    }
+
+    return &g_array_index(registry->interfaces,
+        PCatManagerNetworkInterfaceData, index);
+}
+
+/* Weights of all interfaces by index, for pcat_mwan_status_parse(). */
+const guint *pcat_iface_registry_weights_get(PCatIfaceRegistry *registry)
+{
+    return registry->weights;
+}
+
+/* Default connectivity probe timeout in ms for the class of interface. */
+guint pcat_iface_registry_probe_timeout_get(PCatIfaceRegistry *registry,
+    guint index)
+{
+    const PCatManagerNetworkInterfaceData *data;
+
+    data = pcat_iface_registry_get(registry, index);
+    if(data==NULL || data->route_mode >=
+        G_N_ELEMENTS(g_pcat_iface_registry_class_probe_timeouts))
+    {
+        return 0;
+    }
+
+    return g_pcat_iface_registry_class_probe_timeouts[data->route_mode];
+}
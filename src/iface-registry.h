@@ -0,0 +1,24 @@
+#ifndef HAVE_PCAT_IFACE_REGISTRY_H
+#define HAVE_PCAT_IFACE_REGISTRY_H
+
+#include <glib.h>
+#include "common.h"
+
+G_BEGIN_DECLS
+
+typedef struct _PCatIfaceRegistry PCatIfaceRegistry;
+
+PCatIfaceRegistry *pcat_iface_registry_new(const GPtrArray *interfaces);
+void pcat_iface_registry_free(PCatIfaceRegistry *registry);
+guint pcat_iface_registry_count_get(PCatIfaceRegistry *registry);
+gint pcat_iface_registry_lookup(PCatIfaceRegistry *registry,
+    const gchar *name);
+const PCatManagerNetworkInterfaceData *pcat_iface_registry_get(
+    PCatIfaceRegistry *registry, guint index);
+const guint *pcat_iface_registry_weights_get(PCatIfaceRegistry *registry);
+guint pcat_iface_registry_probe_timeout_get(PCatIfaceRegistry *registry,
+    guint index);
+
+G_END_DECLS
+
+#endif
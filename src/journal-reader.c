@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "journal.h"
+
+/*
+ * Dump the persistent journal written by pcat-manager, oldest record
+ * first. Works on a copy of the file, so it can run while the manager is
+ * writing to it.
+ */
+
+static gchar *g_pcat_journal_reader_cmd_file = NULL;
+static gint g_pcat_journal_reader_cmd_tail = 0;
+static gboolean g_pcat_journal_reader_cmd_json = FALSE;
+
+static GOptionEntry g_pcat_journal_reader_cmd_entries[] =
+{
+    { "file", 'f', 0, G_OPTION_ARG_FILENAME,
+        &g_pcat_journal_reader_cmd_file,
+        "Journal file (default " PCAT_JOURNAL_FILE_DEFAULT ")", NULL },
+    { "tail", 'n', 0, G_OPTION_ARG_INT,
+        &g_pcat_journal_reader_cmd_tail,
+        "Only show the last N records", NULL },
+    { "json", 'j', 0, G_OPTION_ARG_NONE,
+        &g_pcat_journal_reader_cmd_json,
+        "Print one JSON object per record", NULL },
+    { NULL }
+};
+
+typedef struct _PCatJournalReaderTypeInfo
+{
+    const gchar *name;
+    const gchar *value_names[PCAT_JOURNAL_RECORD_VALUES];
+}PCatJournalReaderTypeInfo;
+
+static const PCatJournalReaderTypeInfo g_pcat_journal_reader_type_info[
+    PCAT_JOURNAL_RECORD_LAST] =
+{
+    [PCAT_JOURNAL_RECORD_NONE] = { "none", { NULL } },
+    [PCAT_JOURNAL_RECORD_START] = { "start", { NULL } },
+    [PCAT_JOURNAL_RECORD_PMU_STATUS] = { "pmu-status",
+        { "battery-voltage", "charger-voltage", "on-battery",
+        "charge-percentage", "board-temperature" } },
+    [PCAT_JOURNAL_RECORD_POWER_ON_EVENT] = { "power-on-event",
+        { "event" } },
+    [PCAT_JOURNAL_RECORD_SHUTDOWN] = { "shutdown",
+        { "cause", "battery-voltage", "charger-voltage" } },
+    [PCAT_JOURNAL_RECORD_REBOOT] = { "reboot",
+        { "cause", "battery-voltage", "charger-voltage" } },
+    [PCAT_JOURNAL_RECORD_MODEM_MODE] = { "modem-mode",
+        { "mode", "previous-mode" } }
+};
+
+static const gchar * const g_pcat_journal_reader_cause_names[
+    PCAT_JOURNAL_CAUSE_LAST] =
+{
+    "unknown", "pmu-request", "schedule", "charger-on-auto-start", "system"
+};
+
+static void pcat_journal_reader_record_print(const PCatJournalRecord *record)
+{
+    const PCatJournalReaderTypeInfo *info = NULL;
+    const gchar *type_name = "unknown";
+    GDateTime *dt;
+    gchar *time_str;
+    GString *str;
+    guint i;
+
+    if(record->type < PCAT_JOURNAL_RECORD_LAST)
+    {
+        info = &g_pcat_journal_reader_type_info[record->type];
+        type_name = info->name;
+    }
+
+    dt = g_date_time_new_from_unix_utc(record->timestamp);
+    time_str = (dt!=NULL) ? g_date_time_format(dt, "%Y-%m-%dT%H:%M:%SZ") :
+        g_strdup("-");
+    if(dt!=NULL)
+    {
+        g_date_time_unref(dt);
+    }
+
+    str = g_string_new(NULL);
+    if(g_pcat_journal_reader_cmd_json)
+    {
+        g_string_append_printf(str, "{\"sequence\":%u,\"time\":\"%s\","
+            "\"timestamp\":%u,\"type\":\"%s\"", record->sequence, time_str,
+            record->timestamp, type_name);
+    }
+    else
+    {
+        g_string_append_printf(str, "%10u %s %-15s", record->sequence,
+            time_str, type_name);
+    }
+
+    for(i=0;info!=NULL && i<PCAT_JOURNAL_RECORD_VALUES;i++)
+    {
+        if(info->value_names[i]==NULL)
+        {
+            break;
+        }
+
+        if(i==0 && (record->type==PCAT_JOURNAL_RECORD_SHUTDOWN ||
+            record->type==PCAT_JOURNAL_RECORD_REBOOT) &&
+            record->values[0] >= 0 &&
+            record->values[0] < PCAT_JOURNAL_CAUSE_LAST)
+        {
+            g_string_append_printf(str, g_pcat_journal_reader_cmd_json ?
+                ",\"%s\":\"%s\"" : " %s=%s", info->value_names[i],
+                g_pcat_journal_reader_cause_names[record->values[0]]);
+            continue;
+        }
+
+        g_string_append_printf(str, g_pcat_journal_reader_cmd_json ?
+            ",\"%s\":%d" : " %s=%d", info->value_names[i],
+            record->values[i]);
+    }
+
+    if(g_pcat_journal_reader_cmd_json)
+    {
+        g_string_append_c(str, '}');
+    }
+
+    puts(str->str);
+
+    g_string_free(str, TRUE);
+    g_free(time_str);
+}
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    GArray *records;
+    guint i, first = 0;
+    guint bad = 0;
+
+    context = g_option_context_new("- PCat Manager journal reader");
+    g_option_context_add_main_entries(context,
+        g_pcat_journal_reader_cmd_entries, NULL);
+    if(!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_warning("Option parsing failed: %s", error->message);
+        g_clear_error(&error);
+        g_option_context_free(context);
+
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if(g_pcat_journal_reader_cmd_file==NULL)
+    {
+        g_pcat_journal_reader_cmd_file = g_strdup(PCAT_JOURNAL_FILE_DEFAULT);
+    }
+
+    records = pcat_journal_file_load(g_pcat_journal_reader_cmd_file, &bad);
+    if(records==NULL)
+    {
+        g_free(g_pcat_journal_reader_cmd_file);
+
+        return 1;
+    }
+
+    if(g_pcat_journal_reader_cmd_tail > 0 &&
+       records->len > (guint)g_pcat_journal_reader_cmd_tail)
+    {
+        first = records->len - g_pcat_journal_reader_cmd_tail;
+    }
+    for(i=first;i<records->len;i++)
+    {
+        pcat_journal_reader_record_print(
+            &g_array_index(records, PCatJournalRecord, i));
+    }
+
+    if(bad > 0)
+    {
+        g_message("Skipped %u corrupted records.", bad);
+    }
+
+    g_array_unref(records);
+    g_free(g_pcat_journal_reader_cmd_file);
+
+    return 0;
+}
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glib.h>
+#include "journal.h"
+
+/*
+ * Round trip test of the journal: append records through the writer, read
+ * the file back with the loader the reader uses and check sequence
+ * numbers, CRCs and values. Also checks that nothing reaches the file
+ * before a sync, that a corrupted slot is skipped, that a restarted
+ * writer continues the sequence, that a filling buffer is synced from the
+ * main loop instead of by the appending caller and that records beyond
+ * the buffer limit are dropped.
+ */
+
+#define PCAT_JOURNAL_TEST_CAPACITY 300
+#define PCAT_JOURNAL_TEST_RECORDS 1000
+#define PCAT_JOURNAL_TEST_SYNC_EVERY 250
+#define PCAT_JOURNAL_TEST_CORRUPT_SEQUENCE 800
+#define PCAT_JOURNAL_TEST_EARLY_SYNC_RECORDS 200
+
+static void pcat_journal_test_values(guint32 sequence, gint32 *values)
+{
+    guint i;
+
+    for(i=0;i<PCAT_JOURNAL_RECORD_VALUES;i++)
+    {
+        values[i] = (gint32)(sequence * 7 + i) * ((i % 2) ? -1 : 1);
+    }
+}
+
+static void pcat_journal_test_append(guint32 sequence)
+{
+    gint32 values[PCAT_JOURNAL_RECORD_VALUES];
+
+    pcat_journal_test_values(sequence, values);
+    pcat_journal_append(PCAT_JOURNAL_RECORD_PMU_STATUS, values,
+        PCAT_JOURNAL_RECORD_VALUES);
+}
+
+static int pcat_journal_test_check(const gchar *file, guint32 first,
+    guint32 last, guint expected_bad, guint32 skip_sequence)
+{
+    GArray *records;
+    const PCatJournalRecord *record;
+    gint32 values[PCAT_JOURNAL_RECORD_VALUES];
+    guint32 sequence = first;
+    guint i, bad = 0;
+    int failures = 0;
+
+    records = pcat_journal_file_load(file, &bad);
+    if(records==NULL)
+    {
+        fprintf(stderr, "Failed to load journal %s!\n", file);
+
+        return 1;
+    }
+
+    if(bad!=expected_bad)
+    {
+        fprintf(stderr, "%u bad records, expected %u!\n", bad,
+            expected_bad);
+        failures++;
+    }
+
+    for(i=0;i<records->len;i++,sequence++)
+    {
+        if(sequence==skip_sequence)
+        {
+            sequence++;
+        }
+
+        record = &g_array_index(records, PCatJournalRecord, i);
+        if(record->sequence!=sequence)
+        {
+            fprintf(stderr, "Record %u has sequence %u, expected %u!\n", i,
+                record->sequence, sequence);
+            failures++;
+            break;
+        }
+
+        if(record->type==PCAT_JOURNAL_RECORD_START)
+        {
+            continue;
+        }
+
+        pcat_journal_test_values(sequence, values);
+        if(record->type!=PCAT_JOURNAL_RECORD_PMU_STATUS ||
+           memcmp(record->values, values, sizeof(values))!=0)
+        {
+            fprintf(stderr, "Record %u has wrong contents!\n", sequence);
+            failures++;
+        }
+    }
+
+    if(first <= last && sequence!=last + 1)
+    {
+        fprintf(stderr, "Journal ends at %u, expected %u!\n", sequence - 1,
+            last);
+        failures++;
+    }
+    else if(first > last && records->len > 0)
+    {
+        fprintf(stderr, "Journal has %u records, expected none!\n",
+            records->len);
+        failures++;
+    }
+
+    g_array_unref(records);
+
+    return failures;
+}
+
+int main(int argc, char *argv[])
+{
+    gchar *file = NULL;
+    guint8 byte;
+    guint32 sequence;
+    off_t offset;
+    int failures = 0;
+    int fd;
+    guint i;
+
+    fd = g_file_open_tmp("pcat-journal-test-XXXXXX.bin", &file, NULL);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Failed to create temporary file!\n");
+
+        return 1;
+    }
+    close(fd);
+
+    if(!pcat_journal_init(file, PCAT_JOURNAL_TEST_CAPACITY, 3600))
+    {
+        fprintf(stderr, "Failed to initialize journal!\n");
+        unlink(file);
+        g_free(file);
+
+        return 1;
+    }
+
+    /* The start record is only buffered until the first sync. */
+    failures += pcat_journal_test_check(file, 1, 0, 0, 0);
+
+    /*
+     * Sequence 1 is the start record. Syncing every 250 records wraps the
+     * ring several times, the early syncs scheduled in between never run
+     * as there is no main loop here.
+     */
+    for(i=0;i<PCAT_JOURNAL_TEST_RECORDS;i++)
+    {
+        sequence = i + 2;
+        pcat_journal_test_append(sequence);
+
+        if((i + 1) % PCAT_JOURNAL_TEST_SYNC_EVERY==0)
+        {
+            pcat_journal_sync();
+        }
+    }
+    pcat_journal_sync();
+
+    sequence = PCAT_JOURNAL_TEST_RECORDS + 1;
+    failures += pcat_journal_test_check(file,
+        sequence - PCAT_JOURNAL_TEST_CAPACITY + 1, sequence, 0, 0);
+
+    pcat_journal_uninit();
+
+    /* A torn record is skipped by the reader and the writer. */
+    offset = sizeof(PCatJournalFileHeader) +
+        (PCAT_JOURNAL_TEST_CORRUPT_SEQUENCE % PCAT_JOURNAL_TEST_CAPACITY) *
+        sizeof(PCatJournalRecord) + 12;
+    fd = open(file, O_RDWR);
+    if(fd < 0 || pread(fd, &byte, 1, offset)!=1)
+    {
+        fprintf(stderr, "Failed to read journal file!\n");
+        failures++;
+    }
+    else
+    {
+        byte ^= 0x01;
+        if(pwrite(fd, &byte, 1, offset)!=1)
+        {
+            fprintf(stderr, "Failed to corrupt journal file!\n");
+            failures++;
+        }
+    }
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+
+    if(!pcat_journal_init(file, PCAT_JOURNAL_TEST_CAPACITY, 3600))
+    {
+        fprintf(stderr, "Failed to reopen journal!\n");
+        failures++;
+    }
+    else
+    {
+        /* The restarted writer continues after the newest record. */
+        sequence += 2;
+        pcat_journal_test_append(sequence);
+        pcat_journal_uninit();
+
+        failures += pcat_journal_test_check(file,
+            sequence - PCAT_JOURNAL_TEST_CAPACITY + 1, sequence, 1,
+            PCAT_JOURNAL_TEST_CORRUPT_SEQUENCE);
+    }
+
+    /* A different capacity starts a new journal, large enough for all. */
+    if(!pcat_journal_init(file, PCAT_JOURNAL_PENDING_MAX * 2, 3600))
+    {
+        fprintf(stderr, "Failed to recreate journal!\n");
+        failures++;
+    }
+    else
+    {
+        /* A filling buffer is synced by the main loop, not by append. */
+        sequence = PCAT_JOURNAL_TEST_EARLY_SYNC_RECORDS + 1;
+        for(i=2;i<=sequence;i++)
+        {
+            pcat_journal_test_append(i);
+        }
+        failures += pcat_journal_test_check(file, 1, 0, 0, 0);
+        while(g_main_context_iteration(NULL, FALSE));
+        failures += pcat_journal_test_check(file, 1, sequence, 0, 0);
+
+        /* Without a sync only PCAT_JOURNAL_PENDING_MAX more fit. */
+        for(i=0;i<PCAT_JOURNAL_PENDING_MAX + 100;i++)
+        {
+            pcat_journal_test_append(sequence + 1 + i);
+        }
+        pcat_journal_sync();
+        failures += pcat_journal_test_check(file, 1,
+            sequence + PCAT_JOURNAL_PENDING_MAX, 0, 0);
+
+        pcat_journal_uninit();
+        while(g_main_context_iteration(NULL, FALSE));
+    }
+
+    unlink(file);
+    g_free(file);
+
+    if(failures > 0)
+    {
+        fprintf(stderr, "%d journal check(s) failed!\n", failures);
+
+        return 1;
+    }
+
+    printf("Journal checks passed.\n");
+
+    return 0;
+}
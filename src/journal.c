@@ -0,0 +1,510 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "crc16.h"
+
+/*
+ * Persistent journal of power related events. Records are fixed size and
+ * written into a file used as a ring. New records are kept in memory and
+ * written out together every few minutes (or right away for shutdown and
+ * reboot records), so the flash sees a few page writes instead of a write
+ * per event. Records not yet written are lost if the manager dies.
+ */
+
+/* One page worth of records, this many buffered schedule an early sync. */
+#define PCAT_JOURNAL_PENDING_SYNC 128
+
+typedef struct _PCatJournalData
+{
+    gboolean initialized;
+    GMutex mutex;
+    GMutex sync_mutex;
+    int fd;
+    guint capacity;
+    guint32 sequence;
+    GArray *pending;
+    GArray *flushing;
+    gboolean sync_scheduled;
+    guint dropped;
+    guint sync_timeout_id;
+}PCatJournalData;
+
+static PCatJournalData g_pcat_journal_data = {0};
+
+static guint16 pcat_journal_record_crc(const PCatJournalRecord *record)
+{
+    PCatJournalRecord tmp;
+
+    tmp = *record;
+    tmp.crc = 0;
+
+    return pcat_crc16_compute((const guint8 *)&tmp, sizeof(tmp));
+}
+
+/*
+ * Convert a record from the file to host byte order, returns FALSE for
+ * empty slots and records with a bad CRC (e.g. torn by a power loss).
+ */
+gboolean pcat_journal_record_decode(const PCatJournalRecord *raw,
+    PCatJournalRecord *record)
+{
+    guint i;
+
+    if(raw->sequence==0)
+    {
+        return FALSE;
+    }
+    if(pcat_journal_record_crc(raw)!=GUINT16_FROM_LE(raw->crc))
+    {
+        return FALSE;
+    }
+
+    record->sequence = GUINT32_FROM_LE(raw->sequence);
+    record->timestamp = GUINT32_FROM_LE(raw->timestamp);
+    record->type = GUINT16_FROM_LE(raw->type);
+    record->crc = GUINT16_FROM_LE(raw->crc);
+    for(i=0;i<PCAT_JOURNAL_RECORD_VALUES;i++)
+    {
+        record->values[i] = GINT32_FROM_LE(raw->values[i]);
+    }
+
+    return TRUE;
+}
+
+static inline off_t pcat_journal_slot_offset(PCatJournalData *journal_data,
+    guint32 sequence)
+{
+    return sizeof(PCatJournalFileHeader) + (off_t)(sequence %
+        journal_data->capacity) * sizeof(PCatJournalRecord);
+}
+
+static gboolean pcat_journal_pwrite(int fd, const void *data, gsize len,
+    off_t offset)
+{
+    const guint8 *p = data;
+    ssize_t wsize;
+
+    while(len > 0)
+    {
+        wsize = pwrite(fd, p, len, offset);
+        if(wsize < 0)
+        {
+            if(errno==EINTR)
+            {
+                continue;
+            }
+
+            return FALSE;
+        }
+
+        p += wsize;
+        len -= wsize;
+        offset += wsize;
+    }
+
+    return TRUE;
+}
+
+static gboolean pcat_journal_header_check(
+    const PCatJournalFileHeader *header, guint capacity)
+{
+    if(memcmp(header->magic, PCAT_JOURNAL_MAGIC, sizeof(header->magic))!=0)
+    {
+        return FALSE;
+    }
+    if(GUINT32_FROM_LE(header->version)!=PCAT_JOURNAL_VERSION ||
+       GUINT32_FROM_LE(header->record_size)!=sizeof(PCatJournalRecord) ||
+       GUINT32_FROM_LE(header->capacity)!=capacity)
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean pcat_journal_sync_timeout_func(gpointer user_data)
+{
+    pcat_journal_sync();
+
+    return TRUE;
+}
+
+static gboolean pcat_journal_sync_idle_func(gpointer user_data)
+{
+    pcat_journal_sync();
+
+    return FALSE;
+}
+
+gboolean pcat_journal_init(const gchar *file, guint capacity,
+    guint sync_interval)
+{
+    PCatJournalData *journal_data = &g_pcat_journal_data;
+    PCatJournalFileHeader header;
+    PCatJournalRecord *slots;
+    PCatJournalRecord record;
+    struct stat file_stat;
+    gsize file_size;
+    gboolean reset = FALSE;
+    guint i, j, count;
+    int fd;
+
+    if(journal_data->initialized)
+    {
+        return TRUE;
+    }
+
+    if(file==NULL)
+    {
+        file = PCAT_JOURNAL_FILE_DEFAULT;
+    }
+    if(capacity==0)
+    {
+        capacity = PCAT_JOURNAL_CAPACITY_DEFAULT;
+    }
+    if(sync_interval==0)
+    {
+        sync_interval = PCAT_JOURNAL_SYNC_INTERVAL_DEFAULT;
+    }
+    file_size = sizeof(PCatJournalFileHeader) +
+        (gsize)capacity * sizeof(PCatJournalRecord);
+
+    fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        g_warning("Failed to open journal file %s: %s", file,
+            strerror(errno));
+
+        return FALSE;
+    }
+
+    if(fstat(fd, &file_stat)!=0 || (gsize)file_stat.st_size!=file_size)
+    {
+        reset = TRUE;
+    }
+    else if(pread(fd, &header, sizeof(header), 0)!=sizeof(header) ||
+        !pcat_journal_header_check(&header, capacity))
+    {
+        reset = TRUE;
+    }
+
+    journal_data->fd = fd;
+    journal_data->capacity = capacity;
+    journal_data->sequence = 0;
+
+    if(reset)
+    {
+        g_message("Creating new journal in %s with %u records.", file,
+            capacity);
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, PCAT_JOURNAL_MAGIC, sizeof(header.magic));
+        header.version = GUINT32_TO_LE(PCAT_JOURNAL_VERSION);
+        header.record_size = GUINT32_TO_LE(sizeof(PCatJournalRecord));
+        header.capacity = GUINT32_TO_LE(capacity);
+
+        if(ftruncate(fd, 0)!=0 || ftruncate(fd, file_size)!=0 ||
+           !pcat_journal_pwrite(fd, &header, sizeof(header), 0) ||
+           fdatasync(fd)!=0)
+        {
+            g_warning("Failed to create journal file %s: %s", file,
+                strerror(errno));
+            close(fd);
+            journal_data->fd = -1;
+
+            return FALSE;
+        }
+    }
+    else
+    {
+        /* Find the newest record, one page worth of slots at a time. */
+        slots = g_new(PCatJournalRecord, PCAT_JOURNAL_PENDING_SYNC);
+        for(i=0;i<capacity;i+=count)
+        {
+            count = MIN(PCAT_JOURNAL_PENDING_SYNC, capacity - i);
+            if(pread(fd, slots, count * sizeof(PCatJournalRecord),
+                pcat_journal_slot_offset(journal_data, i))!=
+                (ssize_t)(count * sizeof(PCatJournalRecord)))
+            {
+                g_warning("Failed to read journal file %s!", file);
+
+                break;
+            }
+
+            for(j=0;j<count;j++)
+            {
+                if(pcat_journal_record_decode(&slots[j], &record) &&
+                    record.sequence > journal_data->sequence)
+                {
+                    journal_data->sequence = record.sequence;
+                }
+            }
+        }
+        g_free(slots);
+    }
+
+    g_mutex_init(&journal_data->mutex);
+    g_mutex_init(&journal_data->sync_mutex);
+    journal_data->pending = g_array_sized_new(FALSE, FALSE,
+        sizeof(PCatJournalRecord), PCAT_JOURNAL_PENDING_SYNC);
+    journal_data->flushing = g_array_sized_new(FALSE, FALSE,
+        sizeof(PCatJournalRecord), PCAT_JOURNAL_PENDING_SYNC);
+    journal_data->sync_timeout_id = g_timeout_add_seconds(sync_interval,
+        pcat_journal_sync_timeout_func, NULL);
+    journal_data->sync_scheduled = FALSE;
+    journal_data->dropped = 0;
+    journal_data->initialized = TRUE;
+
+    pcat_journal_append(PCAT_JOURNAL_RECORD_START, NULL, 0);
+
+    return TRUE;
+}
+
+void pcat_journal_uninit()
+{
+    PCatJournalData *journal_data = &g_pcat_journal_data;
+
+    if(!journal_data->initialized)
+    {
+        return;
+    }
+
+    if(journal_data->sync_timeout_id > 0)
+    {
+        g_source_remove(journal_data->sync_timeout_id);
+        journal_data->sync_timeout_id = 0;
+    }
+
+    pcat_journal_sync();
+
+    journal_data->initialized = FALSE;
+
+    close(journal_data->fd);
+    journal_data->fd = -1;
+
+    g_array_unref(journal_data->pending);
+    journal_data->pending = NULL;
+    g_array_unref(journal_data->flushing);
+    journal_data->flushing = NULL;
+
+    g_mutex_clear(&journal_data->sync_mutex);
+    g_mutex_clear(&journal_data->mutex);
+}
+
+/*
+ * Append a record to the in-memory buffer, safe to call from any thread.
+ * This never does file I/O: a buffer holding PCAT_JOURNAL_PENDING_SYNC
+ * records schedules a sync on the default main context, and records
+ * beyond PCAT_JOURNAL_PENDING_MAX are dropped and counted until it runs.
+ */
+void pcat_journal_append(PCatJournalRecordType type, const gint32 *values,
+    guint count)
+{
+    PCatJournalData *journal_data = &g_pcat_journal_data;
+    PCatJournalRecord record;
+    gboolean schedule = FALSE;
+    guint i;
+
+    if(!journal_data->initialized)
+    {
+        return;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.timestamp = GUINT32_TO_LE(
+        (guint32)(g_get_real_time() / G_USEC_PER_SEC));
+    record.type = GUINT16_TO_LE(type);
+    for(i=0;i<count && i<PCAT_JOURNAL_RECORD_VALUES;i++)
+    {
+        record.values[i] = GINT32_TO_LE(values[i]);
+    }
+
+    g_mutex_lock(&journal_data->mutex);
+
+    if(journal_data->pending->len >= PCAT_JOURNAL_PENDING_MAX)
+    {
+        journal_data->dropped++;
+        g_mutex_unlock(&journal_data->mutex);
+
+        return;
+    }
+
+    journal_data->sequence++;
+    if(journal_data->sequence==0)
+    {
+        journal_data->sequence++;
+    }
+    record.sequence = GUINT32_TO_LE(journal_data->sequence);
+    record.crc = GUINT16_TO_LE(pcat_journal_record_crc(&record));
+
+    g_array_append_val(journal_data->pending, record);
+    if(journal_data->pending->len >= PCAT_JOURNAL_PENDING_SYNC &&
+       !journal_data->sync_scheduled)
+    {
+        journal_data->sync_scheduled = TRUE;
+        schedule = TRUE;
+    }
+
+    g_mutex_unlock(&journal_data->mutex);
+
+    if(schedule)
+    {
+        g_idle_add(pcat_journal_sync_idle_func, NULL);
+    }
+}
+
+/*
+ * Write the buffered records to their slots and flush them to the
+ * storage. Records with consecutive sequence numbers sit in consecutive
+ * slots, so this is one write, or two where the ring wraps around.
+ */
+void pcat_journal_sync()
+{
+    PCatJournalData *journal_data = &g_pcat_journal_data;
+    const PCatJournalRecord *records;
+    GArray *flushing;
+    guint32 slot, last_slot = 0;
+    guint i, start = 0, dropped;
+    gboolean ret = TRUE;
+
+    if(!journal_data->initialized)
+    {
+        return;
+    }
+
+    g_mutex_lock(&journal_data->sync_mutex);
+
+    g_mutex_lock(&journal_data->mutex);
+    flushing = journal_data->pending;
+    journal_data->pending = journal_data->flushing;
+    journal_data->flushing = flushing;
+    journal_data->sync_scheduled = FALSE;
+    dropped = journal_data->dropped;
+    journal_data->dropped = 0;
+    g_mutex_unlock(&journal_data->mutex);
+
+    if(dropped > 0)
+    {
+        g_warning("Journal buffer full, dropped %u records!", dropped);
+    }
+
+    records = (const PCatJournalRecord *)flushing->data;
+    for(i=0;i<=flushing->len && ret;i++)
+    {
+        slot = (i < flushing->len) ? GUINT32_FROM_LE(records[i].sequence) %
+            journal_data->capacity : 0;
+        if(i > start && (i==flushing->len || slot!=last_slot + 1))
+        {
+            ret = pcat_journal_pwrite(journal_data->fd, records + start,
+                (i - start) * sizeof(PCatJournalRecord),
+                pcat_journal_slot_offset(journal_data,
+                GUINT32_FROM_LE(records[start].sequence)));
+            start = i;
+        }
+        last_slot = slot;
+    }
+
+    if(flushing->len > 0 && ret && fdatasync(journal_data->fd)!=0)
+    {
+        ret = FALSE;
+    }
+    if(!ret)
+    {
+        g_warning("Failed to sync journal: %s", strerror(errno));
+    }
+
+    g_array_set_size(flushing, 0);
+
+    g_mutex_unlock(&journal_data->sync_mutex);
+}
+
+static gint pcat_journal_record_compare(gconstpointer a, gconstpointer b)
+{
+    const PCatJournalRecord *ra = a;
+    const PCatJournalRecord *rb = b;
+
+    if(ra->sequence < rb->sequence)
+    {
+        return -1;
+    }
+    else if(ra->sequence > rb->sequence)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Read all valid records of a journal file, oldest first. Empty slots are
+ * skipped, records with a bad CRC are skipped and counted in bad.
+ */
+GArray *pcat_journal_file_load(const gchar *file, guint *bad)
+{
+    GError *error = NULL;
+    gchar *contents = NULL;
+    gsize length = 0;
+    const PCatJournalFileHeader *header;
+    const PCatJournalRecord *slots;
+    PCatJournalRecord record;
+    GArray *records;
+    guint capacity, i;
+
+    if(bad!=NULL)
+    {
+        *bad = 0;
+    }
+
+    if(!g_file_get_contents(file, &contents, &length, &error))
+    {
+        g_warning("Failed to read journal: %s", error->message);
+        g_clear_error(&error);
+
+        return NULL;
+    }
+
+    header = (const PCatJournalFileHeader *)contents;
+    if(length < sizeof(PCatJournalFileHeader) ||
+       memcmp(header->magic, PCAT_JOURNAL_MAGIC, sizeof(header->magic))!=0 ||
+       GUINT32_FROM_LE(header->version)!=PCAT_JOURNAL_VERSION ||
+       GUINT32_FROM_LE(header->record_size)!=sizeof(PCatJournalRecord))
+    {
+        g_warning("%s is not a valid journal file!", file);
+        g_free(contents);
+
+        return NULL;
+    }
+
+    capacity = GUINT32_FROM_LE(header->capacity);
+    if((length - sizeof(PCatJournalFileHeader)) / sizeof(PCatJournalRecord) <
+        capacity)
+    {
+        g_warning("Journal file %s is truncated!", file);
+        capacity = (length - sizeof(PCatJournalFileHeader)) /
+            sizeof(PCatJournalRecord);
+    }
+
+    slots = (const PCatJournalRecord *)(contents +
+        sizeof(PCatJournalFileHeader));
+    records = g_array_sized_new(FALSE, FALSE, sizeof(PCatJournalRecord),
+        capacity);
+    for(i=0;i<capacity;i++)
+    {
+        if(pcat_journal_record_decode(&slots[i], &record))
+        {
+            g_array_append_val(records, record);
+        }
+        else if(slots[i].sequence!=0 && bad!=NULL)
+        {
+            (*bad)++;
+        }
+    }
+    g_free(contents);
+
+    g_array_sort(records, pcat_journal_record_compare);
+
+    return records;
+}
@@ -0,0 +1,79 @@
+#ifndef HAVE_PCAT_JOURNAL_H
+#define HAVE_PCAT_JOURNAL_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define PCAT_JOURNAL_FILE_DEFAULT "/etc/pcat-manager-journal.bin"
+#define PCAT_JOURNAL_MAGIC "PCATJRNL"
+#define PCAT_JOURNAL_VERSION 1
+#define PCAT_JOURNAL_RECORD_VALUES 5
+#define PCAT_JOURNAL_CAPACITY_DEFAULT 16384
+#define PCAT_JOURNAL_SYNC_INTERVAL_DEFAULT 300
+
+/* Records buffered between syncs, more are dropped until the next one. */
+#define PCAT_JOURNAL_PENDING_MAX 1024
+
+typedef enum
+{
+    PCAT_JOURNAL_RECORD_NONE = 0,
+    PCAT_JOURNAL_RECORD_START,
+    PCAT_JOURNAL_RECORD_PMU_STATUS,
+    PCAT_JOURNAL_RECORD_POWER_ON_EVENT,
+    PCAT_JOURNAL_RECORD_SHUTDOWN,
+    PCAT_JOURNAL_RECORD_REBOOT,
+    PCAT_JOURNAL_RECORD_MODEM_MODE,
+    PCAT_JOURNAL_RECORD_LAST
+}PCatJournalRecordType;
+
+typedef enum
+{
+    PCAT_JOURNAL_CAUSE_UNKNOWN = 0,
+    PCAT_JOURNAL_CAUSE_PMU_REQUEST,
+    PCAT_JOURNAL_CAUSE_SCHEDULE,
+    PCAT_JOURNAL_CAUSE_CHARGER_ON_AUTO_START,
+    PCAT_JOURNAL_CAUSE_SYSTEM,
+    PCAT_JOURNAL_CAUSE_LAST
+}PCatJournalCause;
+
+/*
+ * On-disk format, all fields are little endian. The file is a header
+ * followed by a fixed number of record slots, the record with sequence
+ * number N lives in slot N % capacity. Sequence 0 marks an empty slot.
+ * The CRC16 covers the whole record with the crc field set to 0.
+ */
+typedef struct _PCatJournalFileHeader
+{
+    guint8 magic[8];
+    guint32 version;
+    guint32 record_size;
+    guint32 capacity;
+    guint32 reserved[11];
+}PCatJournalFileHeader;
+
+typedef struct _PCatJournalRecord
+{
+    guint32 sequence;
+    guint32 timestamp;
+    guint16 type;
+    guint16 crc;
+    gint32 values[PCAT_JOURNAL_RECORD_VALUES];
+}PCatJournalRecord;
+
+G_STATIC_ASSERT(sizeof(PCatJournalFileHeader)==64);
+G_STATIC_ASSERT(sizeof(PCatJournalRecord)==32);
+
+gboolean pcat_journal_init(const gchar *file, guint capacity,
+    guint sync_interval);
+void pcat_journal_uninit();
+void pcat_journal_append(PCatJournalRecordType type, const gint32 *values,
+    guint count);
+void pcat_journal_sync();
+gboolean pcat_journal_record_decode(const PCatJournalRecord *raw,
+    PCatJournalRecord *record);
+GArray *pcat_journal_file_load(const gchar *file, guint *bad);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include "log-file.h"
+
+/*
+ * Size and age capped log file. When a limit is hit the file is renamed
+ * to <path>.1 (optionally gzip compressed to <path>.1.gz), older
+ * generations are shifted up and the oldest one is removed, so the logs
+ * on tmpfs never take more than about (generations + 1) * max_size.
+ *
+ * Writes come from the main loop, so the compression runs in a worker
+ * thread, which the next rotation waits for before shifting the files.
+ * If the new file cannot be created, every write retries it.
+ */
+
+struct _PCatLogFile
+{
+    gchar *path;
+    PCatLogFileLimits limits;
+    FILE *fp;
+    gsize size;
+    gint64 open_timestamp;
+    gboolean open_failed;
+    GThread *compress_thread;
+};
+
+typedef struct _PCatLogFileCompressData
+{
+    gchar *src_path;
+    gchar *dst_path;
+}PCatLogFileCompressData;
+
+static gchar *pcat_log_file_generation_path(const PCatLogFile *file,
+    guint generation, gboolean compressed)
+{
+    return g_strdup_printf("%s.%u%s", file->path, generation,
+        compressed ? ".gz" : "");
+}
+
+static gboolean pcat_log_file_compress(const gchar *src_path,
+    const gchar *dst_path)
+{
+    GFile *src, *dst;
+    GFileInputStream *input;
+    GFileOutputStream *output;
+    GZlibCompressor *compressor;
+    GOutputStream *converter;
+    GError *error = NULL;
+    gboolean ret = FALSE;
+
+    src = g_file_new_for_path(src_path);
+    dst = g_file_new_for_path(dst_path);
+
+    input = g_file_read(src, NULL, &error);
+    if(input==NULL)
+    {
+        g_clear_error(&error);
+        g_object_unref(dst);
+        g_object_unref(src);
+
+        return FALSE;
+    }
+
+    output = g_file_replace(dst, NULL, FALSE, G_FILE_CREATE_NONE, NULL,
+        &error);
+    if(output!=NULL)
+    {
+        compressor = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP,
+            -1);
+        converter = g_converter_output_stream_new(G_OUTPUT_STREAM(output),
+            G_CONVERTER(compressor));
+
+        if(g_output_stream_splice(converter, G_INPUT_STREAM(input),
+            G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+            G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET, NULL, &error) >= 0)
+        {
+            ret = TRUE;
+        }
+
+        g_object_unref(converter);
+        g_object_unref(compressor);
+        g_object_unref(output);
+    }
+    g_clear_error(&error);
+
+    g_object_unref(input);
+    g_object_unref(dst);
+    g_object_unref(src);
+
+    if(!ret)
+    {
+        g_remove(dst_path);
+    }
+
+    return ret;
+}
+
+static gpointer pcat_log_file_compress_thread_func(gpointer user_data)
+{
+    PCatLogFileCompressData *data = (PCatLogFileCompressData *)user_data;
+
+    if(pcat_log_file_compress(data->src_path, data->dst_path))
+    {
+        g_remove(data->src_path);
+    }
+
+    g_free(data->src_path);
+    g_free(data->dst_path);
+    g_free(data);
+
+    return NULL;
+}
+
+static void pcat_log_file_compress_wait(PCatLogFile *file)
+{
+    if(file->compress_thread!=NULL)
+    {
+        g_thread_join(file->compress_thread);
+        file->compress_thread = NULL;
+    }
+}
+
+static void pcat_log_file_rotate(PCatLogFile *file)
+{
+    gchar *src_path, *dst_path;
+    guint i, generations = file->limits.generations;
+    gint compressed;
+    PCatLogFileCompressData *data;
+
+    if(file->fp!=NULL)
+    {
+        fclose(file->fp);
+        file->fp = NULL;
+    }
+
+    pcat_log_file_compress_wait(file);
+
+    if(generations==0)
+    {
+        g_remove(file->path);
+        return;
+    }
+
+    for(compressed=0;compressed<=1;compressed++)
+    {
+        src_path = pcat_log_file_generation_path(file, generations,
+            compressed);
+        g_remove(src_path);
+        g_free(src_path);
+    }
+
+    for(i=generations-1;i>=1;i--)
+    {
+        for(compressed=0;compressed<=1;compressed++)
+        {
+            src_path = pcat_log_file_generation_path(file, i, compressed);
+            dst_path = pcat_log_file_generation_path(file, i + 1,
+                compressed);
+            g_rename(src_path, dst_path);
+            g_free(dst_path);
+            g_free(src_path);
+        }
+    }
+
+    dst_path = pcat_log_file_generation_path(file, 1, FALSE);
+    if(g_rename(file->path, dst_path)==0 && file->limits.compress)
+    {
+        data = g_new0(PCatLogFileCompressData, 1);
+        data->src_path = dst_path;
+        data->dst_path = pcat_log_file_generation_path(file, 1, TRUE);
+
+        file->compress_thread = g_thread_try_new(
+            "pcat-log-file-compress-thread",
+            pcat_log_file_compress_thread_func, data, NULL);
+        if(file->compress_thread==NULL)
+        {
+            pcat_log_file_compress_thread_func(data);
+        }
+    }
+    else
+    {
+        g_free(dst_path);
+    }
+}
+
+static gboolean pcat_log_file_reopen(PCatLogFile *file)
+{
+    file->fp = fopen(file->path, "w");
+    file->size = 0;
+    file->open_timestamp = g_get_monotonic_time();
+
+    if(file->fp==NULL)
+    {
+        if(!file->open_failed)
+        {
+            fprintf(stderr, "Failed to open log file %s: %s\n", file->path,
+                strerror(errno));
+        }
+        file->open_failed = TRUE;
+
+        return FALSE;
+    }
+    file->open_failed = FALSE;
+
+    return TRUE;
+}
+
+/*
+ * Open a log file, the log left by the previous run becomes the first
+ * generation instead of being truncated.
+ */
+PCatLogFile *pcat_log_file_open(const gchar *path,
+    const PCatLogFileLimits *limits)
+{
+    PCatLogFile *file;
+    GStatBuf file_stat;
+
+    file = g_new0(PCatLogFile, 1);
+    file->path = g_strdup(path);
+    if(limits!=NULL)
+    {
+        file->limits = *limits;
+    }
+    if(file->limits.max_size==0)
+    {
+        file->limits.max_size = PCAT_LOG_FILE_MAX_SIZE_DEFAULT;
+    }
+
+    if(g_stat(path, &file_stat)==0 && file_stat.st_size > 0)
+    {
+        pcat_log_file_rotate(file);
+    }
+
+    if(!pcat_log_file_reopen(file))
+    {
+        pcat_log_file_compress_wait(file);
+        g_free(file->path);
+        g_free(file);
+
+        return NULL;
+    }
+
+    return file;
+}
+
+void pcat_log_file_close(PCatLogFile *file)
+{
+    if(file==NULL)
+    {
+        return;
+    }
+
+    if(file->fp!=NULL)
+    {
+        fclose(file->fp);
+    }
+    pcat_log_file_compress_wait(file);
+    g_free(file->path);
+    g_free(file);
+}
+
+void pcat_log_file_write(PCatLogFile *file, const gchar *data, gsize len)
+{
+    if(file->size > 0 && (file->size + len > file->limits.max_size ||
+       (file->limits.max_age > 0 && g_get_monotonic_time() >
+       file->open_timestamp + (gint64)file->limits.max_age *
+       G_USEC_PER_SEC)))
+    {
+        pcat_log_file_rotate(file);
+    }
+
+    /* Also retries a reopen which failed at the last rotation. */
+    if(file->fp==NULL && !pcat_log_file_reopen(file))
+    {
+        return;
+    }
+
+    fwrite(data, 1, len, file->fp);
+    file->size += len;
+}
+
+void pcat_log_file_flush(PCatLogFile *file)
+{
+    if(file->fp!=NULL)
+    {
+        fflush(file->fp);
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef HAVE_PCAT_LOG_FILE_H
+#define HAVE_PCAT_LOG_FILE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define PCAT_LOG_FILE_MAX_SIZE_DEFAULT (1024 * 1024)
+#define PCAT_LOG_FILE_GENERATIONS_DEFAULT 2
+
+typedef struct _PCatLogFileLimits
+{
+    gsize max_size;
+    guint max_age;
+    guint generations;
+    gboolean compress;
+}PCatLogFileLimits;
+
+typedef struct _PCatLogFile PCatLogFile;
+
+PCatLogFile *pcat_log_file_open(const gchar *path,
+    const PCatLogFileLimits *limits);
+void pcat_log_file_close(PCatLogFile *file);
+void pcat_log_file_write(PCatLogFile *file, const gchar *data, gsize len);
+void pcat_log_file_flush(PCatLogFile *file);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,481 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "logger.h"
+
+/*
+ * Log backend used when the debug log is enabled. Callers only copy the
+ * message into a slot of a bounded lock-free queue (multiple producers,
+ * one consumer, per-slot sequence numbers), a writer thread formats the
+ * lines, with the timestamp string reused within the same second, and
+ * flushes once per batch. When the queue fills up the less important
+ * levels are dropped first, so logging never blocks or allocates on the
+ * calling thread.
+ */
+
+#define PCAT_LOGGER_QUEUE_SIZE 256
+#define PCAT_LOGGER_QUEUE_MASK (PCAT_LOGGER_QUEUE_SIZE - 1)
+#define PCAT_LOGGER_SLOT_SIZE 512
+#define PCAT_LOGGER_DOMAIN_SIZE 24
+#define PCAT_LOGGER_MESSAGE_SIZE (PCAT_LOGGER_SLOT_SIZE - \
+    PCAT_LOGGER_DOMAIN_SIZE - 16)
+#define PCAT_LOGGER_FATAL_DRAIN_WAIT 1000000
+
+typedef enum
+{
+    PCAT_LOGGER_CLASS_DEBUG = 0,
+    PCAT_LOGGER_CLASS_INFO,
+    PCAT_LOGGER_CLASS_WARNING,
+    PCAT_LOGGER_CLASS_CRITICAL,
+    PCAT_LOGGER_CLASS_LAST
+}PCatLoggerClass;
+
+typedef struct _PCatLoggerSlot
+{
+    guint sequence;
+    guint level;
+    gint64 timestamp;
+    gchar domain[PCAT_LOGGER_DOMAIN_SIZE];
+    gchar message[PCAT_LOGGER_MESSAGE_SIZE];
+}PCatLoggerSlot;
+
+typedef struct _PCatLoggerData
+{
+    gboolean initialized;
+    gboolean running;
+    PCatLogFile *file;
+    gchar line[PCAT_LOGGER_SLOT_SIZE + 64];
+    GThread *thread;
+    int event_fd;
+    gint wakeup_pending;
+    gint producers;
+
+    PCatLoggerSlot slots[PCAT_LOGGER_QUEUE_SIZE];
+    guint enqueue_pos;
+    guint dequeue_pos;
+    guint dropped[PCAT_LOGGER_CLASS_LAST];
+
+    gint64 timestamp_second;
+    gchar timestamp_str[32];
+}PCatLoggerData;
+
+G_STATIC_ASSERT(sizeof(PCatLoggerSlot)==PCAT_LOGGER_SLOT_SIZE);
+
+static PCatLoggerData g_pcat_logger_data = {0};
+
+/*
+ * Fill level (in quarters of the queue) above which a class is dropped,
+ * critical and error messages are only lost when the queue is full.
+ */
+static const guint g_pcat_logger_class_drop_level[
+    PCAT_LOGGER_CLASS_LAST] =
+{
+    2, 3, 4, 4
+};
+
+static const gchar * const g_pcat_logger_class_names[
+    PCAT_LOGGER_CLASS_LAST] =
+{
+    "debug", "info", "warning", "critical"
+};
+
+static const gchar *pcat_logger_level_name(guint log_level)
+{
+    switch(log_level & G_LOG_LEVEL_MASK)
+    {
+        case G_LOG_LEVEL_DEBUG:
+        {
+            return "DEBUG";
+        }
+        case G_LOG_LEVEL_INFO:
+        {
+            return "INFO";
+        }
+        case G_LOG_LEVEL_MESSAGE:
+        {
+            return "MESSAGE";
+        }
+        case G_LOG_LEVEL_WARNING:
+        {
+            return "WARNING";
+        }
+        case G_LOG_LEVEL_CRITICAL:
+        {
+            return "CRITICAL";
+        }
+        case G_LOG_LEVEL_ERROR:
+        {
+            return "ERROR";
+        }
+        default:
+        {
+            break;
+        }
+    }
+
+    return "UNKNOWN";
+}
+
+static PCatLoggerClass pcat_logger_level_class(guint log_level)
+{
+    switch(log_level & G_LOG_LEVEL_MASK)
+    {
+        case G_LOG_LEVEL_DEBUG:
+        {
+            return PCAT_LOGGER_CLASS_DEBUG;
+        }
+        case G_LOG_LEVEL_INFO:
+        case G_LOG_LEVEL_MESSAGE:
+        {
+            return PCAT_LOGGER_CLASS_INFO;
+        }
+        case G_LOG_LEVEL_WARNING:
+        {
+            return PCAT_LOGGER_CLASS_WARNING;
+        }
+        default:
+        {
+            break;
+        }
+    }
+
+    return PCAT_LOGGER_CLASS_CRITICAL;
+}
+
+static gboolean pcat_logger_enqueue(PCatLoggerData *logger_data,
+    guint log_level, const gchar *log_domain, const gchar *message)
+{
+    PCatLoggerSlot *slot;
+    PCatLoggerClass log_class;
+    guint pos, sequence, used;
+    gint diff;
+
+    log_class = pcat_logger_level_class(log_level);
+
+    pos = (guint)g_atomic_int_get(&logger_data->enqueue_pos);
+    for(;;)
+    {
+        used = pos - (guint)g_atomic_int_get(&logger_data->dequeue_pos);
+        if(used * 4 >= g_pcat_logger_class_drop_level[log_class] *
+            PCAT_LOGGER_QUEUE_SIZE)
+        {
+            g_atomic_int_inc(&logger_data->dropped[log_class]);
+
+            return FALSE;
+        }
+
+        slot = &logger_data->slots[pos & PCAT_LOGGER_QUEUE_MASK];
+        sequence = (guint)g_atomic_int_get(&slot->sequence);
+        diff = (gint)(sequence - pos);
+        if(diff==0)
+        {
+            if(g_atomic_int_compare_and_exchange(
+                (gint *)&logger_data->enqueue_pos, pos, pos + 1))
+            {
+                break;
+            }
+            pos = (guint)g_atomic_int_get(&logger_data->enqueue_pos);
+        }
+        else if(diff < 0)
+        {
+            g_atomic_int_inc(&logger_data->dropped[log_class]);
+
+            return FALSE;
+        }
+        else
+        {
+            pos = (guint)g_atomic_int_get(&logger_data->enqueue_pos);
+        }
+    }
+
+    slot->level = log_level;
+    slot->timestamp = g_get_real_time();
+    g_strlcpy(slot->domain, log_domain, PCAT_LOGGER_DOMAIN_SIZE);
+    g_strlcpy(slot->message, message, PCAT_LOGGER_MESSAGE_SIZE);
+    g_atomic_int_set(&slot->sequence, pos + 1);
+
+    return TRUE;
+}
+
+static void pcat_logger_wakeup(PCatLoggerData *logger_data)
+{
+    guint64 value = 1;
+
+    if(g_atomic_int_compare_and_exchange(&logger_data->wakeup_pending, 0, 1))
+    {
+        if(write(logger_data->event_fd, &value, sizeof(value)) < 0)
+        {
+            g_atomic_int_set(&logger_data->wakeup_pending, 0);
+        }
+    }
+}
+
+static const gchar *pcat_logger_timestamp_get(PCatLoggerData *logger_data,
+    gint64 timestamp)
+{
+    GDateTime *dt;
+    gchar *dtstr;
+    gint64 second = timestamp / G_USEC_PER_SEC;
+
+    if(second==logger_data->timestamp_second)
+    {
+        return logger_data->timestamp_str;
+    }
+
+    dt = g_date_time_new_from_unix_local(second);
+    if(dt!=NULL)
+    {
+        dtstr = g_date_time_format(dt, "%Y/%m/%d %H:%M:%S");
+        g_date_time_unref(dt);
+        g_strlcpy(logger_data->timestamp_str, dtstr!=NULL ? dtstr : "",
+            sizeof(logger_data->timestamp_str));
+        g_free(dtstr);
+    }
+    logger_data->timestamp_second = second;
+
+    return logger_data->timestamp_str;
+}
+
+static void pcat_logger_line_write(PCatLoggerData *logger_data,
+    guint log_level, gint64 timestamp, const gchar *log_domain,
+    const gchar *message)
+{
+    gint len;
+
+    len = g_snprintf(logger_data->line, sizeof(logger_data->line),
+        "[%s] %s-%s: %s\n", pcat_logger_timestamp_get(logger_data, timestamp),
+        log_domain, pcat_logger_level_name(log_level), message);
+    if(len <= 0)
+    {
+        return;
+    }
+    len = MIN(len, (gint)sizeof(logger_data->line) - 1);
+
+    if(logger_data->file!=NULL)
+    {
+        pcat_log_file_write(logger_data->file, logger_data->line, len);
+    }
+    if((log_level & G_LOG_LEVEL_MASK) <= G_LOG_LEVEL_INFO)
+    {
+        fwrite(logger_data->line, 1, len, stderr);
+    }
+}
+
+/* Consume everything queued so far, returns the number of lines. */
+static guint pcat_logger_drain(PCatLoggerData *logger_data)
+{
+    PCatLoggerSlot *slot;
+    guint pos, sequence, dropped;
+    guint count = 0;
+    guint i;
+
+    for(;;)
+    {
+        pos = logger_data->dequeue_pos;
+        slot = &logger_data->slots[pos & PCAT_LOGGER_QUEUE_MASK];
+        sequence = (guint)g_atomic_int_get(&slot->sequence);
+        if(sequence!=pos + 1)
+        {
+            break;
+        }
+
+        pcat_logger_line_write(logger_data, slot->level, slot->timestamp,
+            slot->domain, slot->message);
+
+        g_atomic_int_set(&slot->sequence, pos + PCAT_LOGGER_QUEUE_SIZE);
+        g_atomic_int_set(&logger_data->dequeue_pos, pos + 1);
+        count++;
+    }
+
+    for(i=0;i<PCAT_LOGGER_CLASS_LAST;i++)
+    {
+        do
+        {
+            dropped = (guint)g_atomic_int_get(&logger_data->dropped[i]);
+        }
+        while(dropped > 0 && !g_atomic_int_compare_and_exchange(
+            (gint *)&logger_data->dropped[i], dropped, 0));
+
+        if(dropped > 0 && logger_data->file!=NULL)
+        {
+            g_snprintf(logger_data->line, sizeof(logger_data->line),
+                "[%s] -WARNING: Log queue full, dropped %u %s messages.\n",
+                pcat_logger_timestamp_get(logger_data, g_get_real_time()),
+                dropped, g_pcat_logger_class_names[i]);
+            pcat_log_file_write(logger_data->file, logger_data->line,
+                strlen(logger_data->line));
+            count++;
+        }
+    }
+
+    if(count > 0)
+    {
+        if(logger_data->file!=NULL)
+        {
+            pcat_log_file_flush(logger_data->file);
+        }
+        fflush(stderr);
+    }
+
+    return count;
+}
+
+static gpointer pcat_logger_thread_func(gpointer user_data)
+{
+    PCatLoggerData *logger_data = (PCatLoggerData *)user_data;
+    struct pollfd pfd;
+    guint64 value;
+
+    pfd.fd = logger_data->event_fd;
+    pfd.events = POLLIN;
+
+    while(g_atomic_int_get(&logger_data->running))
+    {
+        if(poll(&pfd, 1, -1) > 0)
+        {
+            if(read(logger_data->event_fd, &value, sizeof(value)) < 0)
+            {
+                value = 0;
+            }
+        }
+
+        g_atomic_int_set(&logger_data->wakeup_pending, 0);
+        pcat_logger_drain(logger_data);
+    }
+
+    pcat_logger_drain(logger_data);
+
+    return NULL;
+}
+
+gboolean pcat_logger_init(const gchar *file,
+    const PCatLogFileLimits *limits)
+{
+    PCatLoggerData *logger_data = &g_pcat_logger_data;
+    guint i;
+
+    if(logger_data->initialized)
+    {
+        return TRUE;
+    }
+
+    logger_data->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(logger_data->event_fd < 0)
+    {
+        fprintf(stderr, "Failed to create log event fd: %s\n",
+            strerror(errno));
+
+        return FALSE;
+    }
+
+    logger_data->file = pcat_log_file_open(file, limits);
+
+    for(i=0;i<PCAT_LOGGER_QUEUE_SIZE;i++)
+    {
+        logger_data->slots[i].sequence = i;
+    }
+    logger_data->enqueue_pos = 0;
+    logger_data->dequeue_pos = 0;
+    logger_data->wakeup_pending = 0;
+    logger_data->timestamp_second = -1;
+    memset(logger_data->dropped, 0, sizeof(logger_data->dropped));
+
+    logger_data->running = TRUE;
+    logger_data->thread = g_thread_new("pcat-logger-thread",
+        pcat_logger_thread_func, logger_data);
+
+    g_atomic_int_set(&logger_data->initialized, TRUE);
+
+    return TRUE;
+}
+
+void pcat_logger_uninit()
+{
+    PCatLoggerData *logger_data = &g_pcat_logger_data;
+    guint64 value = 1;
+
+    if(!g_atomic_int_get(&logger_data->initialized))
+    {
+        return;
+    }
+
+    /* Wait for callers which may still write to the event fd. */
+    g_atomic_int_set(&logger_data->initialized, FALSE);
+    while(g_atomic_int_get(&logger_data->producers) > 0)
+    {
+        g_thread_yield();
+    }
+
+    /* A failed write means the counter is already set, which wakes too. */
+    g_atomic_int_set(&logger_data->running, FALSE);
+    if(write(logger_data->event_fd, &value, sizeof(value)) < 0)
+    {
+        value = 0;
+    }
+    g_thread_join(logger_data->thread);
+    logger_data->thread = NULL;
+
+    close(logger_data->event_fd);
+    logger_data->event_fd = -1;
+    pcat_log_file_close(logger_data->file);
+    logger_data->file = NULL;
+}
+
+/*
+ * GLib log handler, may be called from any thread. Fatal errors wait for
+ * the writer (bounded) so the last lines reach the log before abort().
+ */
+void pcat_logger_handle_func(const gchar *log_domain,
+    GLogLevelFlags log_level, const gchar *message, gpointer user_data)
+{
+    PCatLoggerData *logger_data = &g_pcat_logger_data;
+    gint64 deadline;
+    guint pos;
+
+    if(log_domain==NULL)
+    {
+        log_domain = "";
+    }
+    if(message==NULL)
+    {
+        message = "";
+    }
+
+    g_atomic_int_inc(&logger_data->producers);
+    if(!g_atomic_int_get(&logger_data->initialized))
+    {
+        g_atomic_int_add(&logger_data->producers, -1);
+        fprintf(stderr, "%s-%s: %s\n", log_domain,
+            pcat_logger_level_name(log_level), message);
+    }
+    else
+    {
+        if(pcat_logger_enqueue(logger_data, log_level, log_domain, message))
+        {
+            pcat_logger_wakeup(logger_data);
+        }
+        g_atomic_int_add(&logger_data->producers, -1);
+    }
+
+    if(log_level & (G_LOG_LEVEL_ERROR | G_LOG_FLAG_FATAL))
+    {
+        if(g_atomic_int_get(&logger_data->initialized))
+        {
+            pos = (guint)g_atomic_int_get(&logger_data->enqueue_pos);
+            deadline = g_get_monotonic_time() + PCAT_LOGGER_FATAL_DRAIN_WAIT;
+            while((gint)(pos - (guint)g_atomic_int_get(
+                &logger_data->dequeue_pos)) > 0 &&
+                g_get_monotonic_time() < deadline)
+            {
+                g_usleep(1000);
+            }
+        }
+        fprintf(stderr, "%s-%s: %s\n", log_domain,
+            pcat_logger_level_name(log_level), message);
+        abort();
+    }
+}
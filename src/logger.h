@@ -0,0 +1,17 @@
+#ifndef HAVE_PCAT_LOGGER_H
+#define HAVE_PCAT_LOGGER_H
+
+#include <glib.h>
+#include "log-file.h"
+
+G_BEGIN_DECLS
+
+gboolean pcat_logger_init(const gchar *file,
+    const PCatLogFileLimits *limits);
+void pcat_logger_uninit();
+void pcat_logger_handle_func(const gchar *log_domain,
+    GLogLevelFlags log_level, const gchar *message, gpointer user_data);
+
+G_END_DECLS
+
+#endif
@@ -4,16 +4,15 @@
 #include <signal.h>
 #include <glib.h>
 #include <glib-unix.h>
-#include <pthread.h>
 #include <errno.h>
 #include <json.h>
 #include "common.h"
 #include "modem-manager.h"
 #include "pmu-manager.h"
 #include "controller.h"
-
-#define PCAT_MAIN_MWAN_STATUS_CHECK_TIMEOUT 30
-#define PCAT_MAIN_MWAN_STATUS_CHECK_BOOT_WAIT 120
+#include "journal.h"
+#include "logger.h"
+#include "route-engine.h"
 
 #define PCAT_MAIN_CONFIG_FILE "/etc/pcat-manager.conf"
 #define PCAT_MAIN_USER_CONFIG_FILE "/etc/pcat-manager-userdata.conf"
@@ -21,43 +20,14 @@
 
 #define PCAT_MAIN_LOG_FILE "/tmp/pcat-manager.log"
 
-typedef enum
-{
-    PCAT_MAIN_IFACE_WIRED,
-    PCAT_MAIN_IFACE_WIRED_V6,
-    PCAT_MAIN_IFACE_MOBILE_5G,
-    PCAT_MAIN_IFACE_MOBILE_5G_V6,
-    PCAT_MAIN_IFACE_MOBILE_LTE,
-    PCAT_MAIN_IFACE_MOBILE_LTE_V6,
-    PCAT_MAIN_IFACE_LAST
-}PCatMainIfaceType;
-
-const gchar * const g_pcat_main_iface_names[
-    PCAT_MAIN_IFACE_LAST] =
-{
-    "wan",
-    "wan6",
-    "wwan_5g",
-    "wwan_5g_v6",
-    "wwan_lte",
-    "wwan_lte_v6"
-};
-
-const PCatManagerRouteMode g_pcat_main_iface_route_mode[
-    PCAT_MAIN_IFACE_LAST] =
-{
-    PCAT_MANAGER_ROUTE_MODE_WIRED,
-    PCAT_MANAGER_ROUTE_MODE_WIRED,
-    PCAT_MANAGER_ROUTE_MODE_MOBILE,
-    PCAT_MANAGER_ROUTE_MODE_MOBILE,
-    PCAT_MANAGER_ROUTE_MODE_MOBILE,
-    PCAT_MANAGER_ROUTE_MODE_MOBILE
-};
-
-static const guint g_pcat_main_shutdown_wait_max = 30;
+/* Poll the PMU handshake every 50 ms for up to 30 s. */
+static const guint g_pcat_main_shutdown_check_interval = 50;
+static const guint g_pcat_main_shutdown_wait_max = 600;
 
 static gboolean g_pcat_main_cmd_daemonsize = FALSE;
 static gboolean g_pcat_main_cmd_distro = FALSE;
+static gchar *g_pcat_main_cmd_config_file = NULL;
+static gchar *g_pcat_main_cmd_user_config_file = NULL;
 
 static GMainLoop *g_pcat_main_loop = NULL;
 static gboolean g_pcat_main_shutdown = FALSE;
@@ -68,20 +38,11 @@ static guint g_pcat_main_shutdown_wait_count = 0;
 static gboolean g_pcat_main_watchdog_disabled = FALSE;
 
 static gboolean g_pcat_main_net_status_led_work_mode = TRUE;
-static guint g_pcat_main_status_check_timeout_id = 0;
-static PCatManagerRouteMode g_pcat_main_net_status_led_applied_mode =
-    PCAT_MANAGER_ROUTE_MODE_NONE;
-
-static PCatManagerRouteMode g_pcat_main_network_route_mode =
-    PCAT_MANAGER_ROUTE_MODE_NONE;
-static gboolean g_pcat_main_mwan_route_check_flag = TRUE;
-static gboolean g_pcat_main_connection_check_flag = TRUE;
 
 static PCatManagerMainConfigData g_pcat_main_config_data = {0};
 static PCatManagerUserConfigData g_pcat_main_user_config_data =
     {0};
 
-static FILE *g_pcat_main_debug_log_file_fp = NULL;
 
 static GOptionEntry g_pcat_cmd_entries[] =
 {
@@ -89,13 +50,64 @@ static GOptionEntry g_pcat_cmd_entries[] =
         "Run as a daemon", NULL },
     { "distro", 0, 0, G_OPTION_ARG_NONE, &g_pcat_main_cmd_distro,
         "Run this program on normal Linux distros (not OpenWRT)", NULL },
+    { "config", 'c', 0, G_OPTION_ARG_FILENAME, &g_pcat_main_cmd_config_file,
+        "Config file (default " PCAT_MAIN_CONFIG_FILE ")", NULL },
+    { "user-config", 'u', 0, G_OPTION_ARG_FILENAME,
+        &g_pcat_main_cmd_user_config_file,
+        "User config file (default " PCAT_MAIN_USER_CONFIG_FILE ")", NULL },
     { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
 };
 
+static void pcat_main_network_interface_data_free(
+    PCatManagerNetworkInterfaceData *data)
+{
+    if(data==NULL)
+    {
+        return;
+    }
+
+    g_free(data->name);
+    g_free(data);
+}
+
+static PCatManagerRouteMode pcat_main_network_route_mode_parse(
+    const gchar *str)
+{
+    if(g_strcmp0(str, "wired")==0)
+    {
+        return PCAT_MANAGER_ROUTE_MODE_WIRED;
+    }
+    else if(g_strcmp0(str, "mobile")==0)
+    {
+        return PCAT_MANAGER_ROUTE_MODE_MOBILE;
+    }
+    else if(g_strcmp0(str, "wifi")==0)
+    {
+        return PCAT_MANAGER_ROUTE_MODE_WIFI;
+    }
+    else if(g_strcmp0(str, "satellite")==0)
+    {
+        return PCAT_MANAGER_ROUTE_MODE_SATELLITE;
+    }
+
+    return PCAT_MANAGER_ROUTE_MODE_NONE;
+}
+
 static void pcat_main_config_data_clear()
 {
     g_free(g_pcat_main_config_data.pm_serial_device);
     g_pcat_main_config_data.pm_serial_device = NULL;
+    g_strfreev(g_pcat_main_config_data.pm_serial_baud_firmware);
+    g_pcat_main_config_data.pm_serial_baud_firmware = NULL;
+    g_free(g_pcat_main_config_data.journal_file);
+    g_pcat_main_config_data.journal_file = NULL;
+    g_strfreev(g_pcat_main_config_data.net_check_targets);
+    g_pcat_main_config_data.net_check_targets = NULL;
+    if(g_pcat_main_config_data.net_interfaces!=NULL)
+    {
+        g_ptr_array_unref(g_pcat_main_config_data.net_interfaces);
+        g_pcat_main_config_data.net_interfaces = NULL;
+    }
 
     g_pcat_main_config_data.valid = FALSE;
 }
@@ -108,16 +120,20 @@ static gboolean pcat_main_config_data_load()
     gint *ivlist;
     gsize ivlist_size;
     guint i;
+    gchar item_name[32] = {0};
+    gchar *svalue, *class_name;
+    PCatManagerRouteMode route_mode;
+    PCatManagerNetworkInterfaceData *iface_data;
 
     g_pcat_main_config_data.valid = FALSE;
 
     keyfile = g_key_file_new();
 
-    if(!g_key_file_load_from_file(keyfile, PCAT_MAIN_CONFIG_FILE,
+    if(!g_key_file_load_from_file(keyfile, g_pcat_main_cmd_config_file,
         G_KEY_FILE_NONE, &error))
     {
         g_warning("Failed to load keyfile %s: %s!",
-            PCAT_MAIN_CONFIG_FILE,
+            g_pcat_main_cmd_config_file,
             error->message!=NULL ? error->message : "Unknown");
 
         g_clear_error(&error);
@@ -239,6 +255,51 @@ static gboolean pcat_main_config_data_load()
         "SerialBaud", NULL);
     g_pcat_main_config_data.pm_serial_baud = ivalue;
 
+    ivalue = g_key_file_get_integer(keyfile, "PowerManager",
+        "SerialBaudMax", NULL);
+    g_pcat_main_config_data.pm_serial_baud_max = ivalue;
+
+    /*
+     * Switching to SerialBaudMax needs the SERIAL_BAUD_SET command, which
+     * stock PMU firmware does not implement. It is only tried when the PMU
+     * firmware version starts with one of these prefixes, there are none
+     * by default.
+     */
+    if(g_pcat_main_config_data.pm_serial_baud_firmware!=NULL)
+    {
+        g_strfreev(g_pcat_main_config_data.pm_serial_baud_firmware);
+    }
+    g_pcat_main_config_data.pm_serial_baud_firmware =
+        g_key_file_get_string_list(keyfile, "PowerManager",
+        "SerialBaudFirmware", NULL, NULL);
+
+    ivalue = g_key_file_get_integer(keyfile, "PowerManager",
+        "SerialLowLatency", NULL);
+    g_pcat_main_config_data.pm_serial_low_latency = ivalue;
+
+    /* The smallest PMU frame is 13 bytes, a larger VMIN could stall it. */
+    ivalue = g_key_file_get_integer(keyfile, "PowerManager",
+        "SerialReadMinBytes", NULL);
+    if(ivalue >= 1 && ivalue <= 13)
+    {
+        g_pcat_main_config_data.pm_serial_read_min = ivalue;
+    }
+    else
+    {
+        g_pcat_main_config_data.pm_serial_read_min = 1;
+    }
+
+    ivalue = g_key_file_get_integer(keyfile, "PowerManager",
+        "SerialReadTimeout", NULL);
+    if(ivalue >= 0 && ivalue <= 255)
+    {
+        g_pcat_main_config_data.pm_serial_read_timeout = ivalue;
+    }
+    else
+    {
+        g_pcat_main_config_data.pm_serial_read_timeout = 0;
+    }
+
     ivalue = g_key_file_get_integer(keyfile, "PowerManager",
         "AutoShutdownVoltageGeneral", NULL);
     if(ivalue >= 3000 && ivalue < 3700)
@@ -360,6 +421,37 @@ static gboolean pcat_main_config_data_load()
         g_pcat_main_config_data.pm_battery_full_threshold = 0;
     }
 
+    ivalue = g_key_file_get_integer(keyfile, "PowerManager",
+        "CommandWindow", NULL);
+    if(ivalue > 0)
+    {
+        g_pcat_main_config_data.pm_command_window = ivalue;
+    }
+    else
+    {
+        g_pcat_main_config_data.pm_command_window = 0;
+    }
+
+    ivalue = g_key_file_get_integer(keyfile, "PowerManager",
+        "IOThreadPriority", NULL);
+    if(ivalue > 0 && ivalue < 100)
+    {
+        g_pcat_main_config_data.pm_io_thread_priority = ivalue;
+    }
+    else
+    {
+        g_pcat_main_config_data.pm_io_thread_priority = 0;
+    }
+
+    ivalue = g_key_file_get_integer(keyfile, "PowerManager",
+        "IOThreadCPUMask", NULL);
+    g_pcat_main_config_data.pm_io_thread_cpu_mask = ivalue;
+
+    /* Opt-in until the estimator has been checked on real devices. */
+    ivalue = g_key_file_get_integer(keyfile, "PowerManager",
+        "BatteryEstimatorEnabled", NULL);
+    g_pcat_main_config_data.pm_battery_estimator_enabled = (ivalue!=0);
+
     ivalue = g_key_file_get_integer(keyfile, "Debug",
         "ModemExternalExecStdoutLog", NULL);
     g_pcat_main_config_data.debug_modem_external_exec_stdout_log =
@@ -369,6 +461,131 @@ static gboolean pcat_main_config_data_load()
         "OutputLog", NULL);
     g_pcat_main_config_data.debug_output_log = ivalue;
 
+    ivalue = g_key_file_get_integer(keyfile, "Debug",
+        "PMULinkStats", NULL);
+    g_pcat_main_config_data.debug_pmu_link_stats = ivalue;
+
+    ivalue = g_key_file_get_integer(keyfile, "Debug",
+        "LogMaxSize", NULL);
+    if(ivalue > 0)
+    {
+        g_pcat_main_config_data.debug_log_limits.max_size =
+            (gsize)ivalue * 1024;
+    }
+    else
+    {
+        g_pcat_main_config_data.debug_log_limits.max_size =
+            PCAT_LOG_FILE_MAX_SIZE_DEFAULT;
+    }
+
+    ivalue = g_key_file_get_integer(keyfile, "Debug",
+        "LogMaxAge", NULL);
+    g_pcat_main_config_data.debug_log_limits.max_age = ivalue > 0 ?
+        ivalue * 3600 : 0;
+
+    ivalue = g_key_file_get_integer(keyfile, "Debug",
+        "LogGenerations", NULL);
+    if(ivalue > 0 && ivalue <= 16)
+    {
+        g_pcat_main_config_data.debug_log_limits.generations = ivalue;
+    }
+    else
+    {
+        g_pcat_main_config_data.debug_log_limits.generations =
+            PCAT_LOG_FILE_GENERATIONS_DEFAULT;
+    }
+
+    ivalue = g_key_file_get_integer(keyfile, "Debug",
+        "LogCompress", NULL);
+    g_pcat_main_config_data.debug_log_limits.compress = (ivalue!=0);
+
+    if(g_pcat_main_config_data.journal_file!=NULL)
+    {
+        g_free(g_pcat_main_config_data.journal_file);
+    }
+    g_pcat_main_config_data.journal_file = g_key_file_get_string(
+        keyfile, "Journal", "File", NULL);
+
+    ivalue = g_key_file_get_integer(keyfile, "Journal",
+        "Records", NULL);
+    if(ivalue >= 256 && ivalue <= 1048576)
+    {
+        g_pcat_main_config_data.journal_records = ivalue;
+    }
+    else
+    {
+        g_pcat_main_config_data.journal_records = 0;
+    }
+
+    ivalue = g_key_file_get_integer(keyfile, "Journal",
+        "SyncInterval", NULL);
+    g_pcat_main_config_data.journal_sync_interval = ivalue > 0 ? ivalue : 0;
+
+    ivalue = g_key_file_get_integer(keyfile, "Journal",
+        "StatusInterval", NULL);
+    g_pcat_main_config_data.journal_status_interval = ivalue > 0 ?
+        ivalue : 60;
+
+    if(g_pcat_main_config_data.net_check_targets!=NULL)
+    {
+        g_strfreev(g_pcat_main_config_data.net_check_targets);
+    }
+    g_pcat_main_config_data.net_check_targets = g_key_file_get_string_list(
+        keyfile, "Network", "ConnectionCheckTargets", NULL, NULL);
+
+    /* Overrides the probe timeout the route engine picks per uplink class. */
+    ivalue = g_key_file_get_integer(keyfile, "Network",
+        "ConnectionCheckTimeout", NULL);
+    g_pcat_main_config_data.net_check_timeout =
+        (ivalue >= 100 && ivalue <= 10000) ? ivalue : 0;
+
+    ivalue = g_key_file_get_integer(keyfile, "Network",
+        "ConnectionCheckRounds", NULL);
+    g_pcat_main_config_data.net_check_rounds =
+        (ivalue >= 1 && ivalue <= 10) ? ivalue : 0;
+
+    /* Interface<N> adds an uplink or overrides a built-in one. */
+    if(g_pcat_main_config_data.net_interfaces!=NULL)
+    {
+        g_ptr_array_unref(g_pcat_main_config_data.net_interfaces);
+    }
+    g_pcat_main_config_data.net_interfaces = g_ptr_array_new_with_free_func(
+        (GDestroyNotify)pcat_main_network_interface_data_free);
+    for(i=0;;i++)
+    {
+        g_snprintf(item_name, 31, "Interface%u", i);
+        svalue = g_key_file_get_string(keyfile, "Network", item_name, NULL);
+        if(svalue==NULL)
+        {
+            break;
+        }
+
+        g_snprintf(item_name, 31, "InterfaceClass%u", i);
+        class_name = g_key_file_get_string(keyfile, "Network", item_name,
+            NULL);
+        route_mode = pcat_main_network_route_mode_parse(class_name);
+        if(*svalue=='\0' || route_mode==PCAT_MANAGER_ROUTE_MODE_NONE)
+        {
+            g_warning("Invalid network interface %s with class %s, "
+                "ignored!", svalue, class_name!=NULL ? class_name : "(null)");
+            g_free(class_name);
+            g_free(svalue);
+
+            continue;
+        }
+        g_free(class_name);
+
+        iface_data = g_new0(PCatManagerNetworkInterfaceData, 1);
+        iface_data->name = svalue;
+        iface_data->route_mode = route_mode;
+
+        g_snprintf(item_name, 31, "InterfaceWeight%u", i);
+        ivalue = g_key_file_get_integer(keyfile, "Network", item_name, NULL);
+        iface_data->weight = (ivalue > 0 && ivalue <= 1000) ? ivalue : 0;
+
+        g_ptr_array_add(g_pcat_main_config_data.net_interfaces, iface_data);
+    }
+
     g_key_file_unref(keyfile);
 
     g_pcat_main_config_data.valid = TRUE;
@@ -392,11 +609,11 @@ static gboolean pcat_main_user_config_data_load()
 
     keyfile = g_key_file_new();
 
-    if(!g_key_file_load_from_file(keyfile, PCAT_MAIN_USER_CONFIG_FILE,
-        G_KEY_FILE_NONE, &error))
+    if(!g_key_file_load_from_file(keyfile,
+        g_pcat_main_cmd_user_config_file, G_KEY_FILE_NONE, &error))
     {
         g_warning("Failed to load keyfile %s: %s!",
-            PCAT_MAIN_USER_CONFIG_FILE,
+            g_pcat_main_cmd_user_config_file,
             error->message!=NULL ? error->message : "Unknown");
 
         g_clear_error(&error);
@@ -607,7 +824,7 @@ static gboolean pcat_main_user_config_data_save()
     g_key_file_set_integer(keyfile, "Modem", "Connection5GFailTimeout",
         uconfig_data->modem_5g_fail_timeout);
 
-    ret = g_key_file_save_to_file(keyfile, PCAT_MAIN_USER_CONFIG_FILE,
+    ret = g_key_file_save_to_file(keyfile, g_pcat_main_cmd_user_config_file,
         &error);
     if(ret)
     {
@@ -616,7 +833,7 @@ static gboolean pcat_main_user_config_data_save()
     else
     {
         g_warning("Failed to save user configuration data to file %s: %s",
-            PCAT_MAIN_USER_CONFIG_FILE, error->message!=NULL ?
+            g_pcat_main_cmd_user_config_file, error->message!=NULL ?
             error->message : "Unknown");
     }
 
@@ -685,15 +902,29 @@ static gboolean pcat_main_reboot_check_timeout_func(
 
 static void pcat_main_system_shutdown()
 {
+    PCatPMUManagerStatus status = {0};
+    gint32 values[3];
+
     if(g_pcat_main_shutdown)
     {
         return;
     }
 
+    /* Shutdowns requested by the PMU manager log their own cause. */
+    if(!g_pcat_main_request_shutdown)
+    {
+        pcat_pmu_manager_status_snapshot_get(&status);
+        values[0] = PCAT_JOURNAL_CAUSE_SYSTEM;
+        values[1] = status.battery_voltage;
+        values[2] = status.charger_voltage;
+        pcat_journal_append(PCAT_JOURNAL_RECORD_SHUTDOWN, values, 3);
+    }
+    pcat_journal_sync();
+
     if(g_pcat_main_request_shutdown_send_pmu_request)
     {
         pcat_pmu_manager_shutdown_request();
-        g_timeout_add_seconds(1,
+        g_timeout_add(g_pcat_main_shutdown_check_interval,
             pcat_main_shutdown_check_timeout_func, NULL);
     }
     else
@@ -706,13 +937,23 @@ static void pcat_main_system_shutdown()
 
 static void pcat_main_system_reboot()
 {
+    PCatPMUManagerStatus status = {0};
+    gint32 values[3];
+
     if(g_pcat_main_reboot)
     {
         return;
     }
 
+    pcat_pmu_manager_status_snapshot_get(&status);
+    values[0] = PCAT_JOURNAL_CAUSE_SYSTEM;
+    values[1] = status.battery_voltage;
+    values[2] = status.charger_voltage;
+    pcat_journal_append(PCAT_JOURNAL_RECORD_REBOOT, values, 3);
+    pcat_journal_sync();
+
     pcat_pmu_manager_reboot_request();
-    g_timeout_add_seconds(1,
+    g_timeout_add(g_pcat_main_shutdown_check_interval,
         pcat_main_reboot_check_timeout_func, NULL);
 
     g_pcat_main_reboot = TRUE;
@@ -751,571 +992,75 @@ static gboolean pcat_main_sigusr1_func(gpointer user_data)
     return TRUE;
 }
 
-static void *pcat_main_mwan_policy_check_thread_func(void *user_data)
+/* Route mode transitions from the route engine, on the main thread. */
+static void pcat_main_network_route_mode_changed_func(
+    PCatManagerRouteMode mode, gpointer user_data)
 {
-    guint i, j;
-    gchar *command;
-    gchar *interface_status_stdout = NULL;
-    gchar *mwan3_stdout = NULL;
-    struct json_tokener *tokener;
-    struct json_object *root, *child, *protocol, *policies, *rules, *rule;
-    struct json_object *interfaces, *interface;
-    guint rules_len;
-    const gchar *iface, *upercent;
-    guint percent;
-    gboolean ret;
-    PCatMainIfaceType route_iface;
-    gboolean iface_status[PCAT_MAIN_IFACE_LAST];
-    gboolean mwan3_interface_check_flag;
-    gint64 mwan3_interface_check_timestamp;
-
-    mwan3_interface_check_timestamp = g_get_monotonic_time();
-
-    i = 0;
-    while(g_pcat_main_mwan_route_check_flag)
+    switch(mode)
     {
-        if(i > PCAT_MAIN_MWAN_STATUS_CHECK_BOOT_WAIT * 10)
+        case PCAT_MANAGER_ROUTE_MODE_WIRED:
         {
-            break;
-        }
-
-        i++;
-        g_usleep(100000);
-    }
-
-    while(g_pcat_main_mwan_route_check_flag)
-    {
-        mwan3_interface_check_flag = TRUE;
-
-        for(i=0;i<PCAT_MAIN_IFACE_LAST;i++)
-        {
-            iface_status[i] = FALSE;
-
-            command = g_strdup_printf("ubus call network.interface.%s status",
-                g_pcat_main_iface_names[i]);
-            g_spawn_command_line_sync(command, &interface_status_stdout,
-                NULL, NULL, NULL);
-            g_free(command);
-
-            G_STMT_START
+            if(g_pcat_main_net_status_led_work_mode)
             {
-                if(interface_status_stdout==NULL)
-                {
-                    break;
-                }
-
-                tokener = json_tokener_new();
-                root = json_tokener_parse_ex(tokener, interface_status_stdout,
-                    strlen(interface_status_stdout));
-                json_tokener_free(tokener);
-
-                if(root==NULL)
-                {
-                    break;
-                }
-
-                if(json_object_object_get_ex(root, "up", &child))
-                {
-                    if(!json_object_get_boolean(child))
-                    {
-                        json_object_put(root);
-
-                        break;
-                    }
-                }
-                else
-                {
-                    json_object_put(root);
-
-                    break;
-                }
-
-                ret = FALSE;
-                if(json_object_object_get_ex(root, "ipv4-address", &child))
-                {
-                    if(json_object_get_type(child)==json_type_array &&
-                       json_object_array_length(child) > 0)
-                    {
-                        ret = TRUE;
-                    }
-                }
-
-                if(json_object_object_get_ex(root, "ipv6-address", &child))
-                {
-                    if(json_object_get_type(child)==json_type_array &&
-                       json_object_array_length(child) > 0)
-                    {
-                        ret = TRUE;
-                    }
-                }
-                if(ret)
-                {
-                    iface_status[i] = TRUE;
-                }
-
-                json_object_put(root);
+                pcat_pmu_manager_net_status_led_setup(50, 50, 0);
             }
-            G_STMT_END;
-
-            g_free(interface_status_stdout);
-        }
-
-        g_spawn_command_line_sync("ubus call mwan3 status", &mwan3_stdout,
-            NULL, NULL, NULL);
-
-        ret = FALSE;
-
-        G_STMT_START
-        {
-            if(mwan3_stdout==NULL)
-            {
-                break;
-            }
-
-            tokener = json_tokener_new();
-            root = json_tokener_parse_ex(tokener, mwan3_stdout,
-                strlen(mwan3_stdout));
-            json_tokener_free(tokener);
 
-            if(root==NULL)
-            {
-                break;
-            }
-
-            if(!json_object_object_get_ex(root, "interfaces", &interfaces))
-            {
-                json_object_put(root);
-
-                break;
-            }
-
-            for(i=0;i<PCAT_MAIN_IFACE_LAST;i++)
-            {
-                if(!iface_status[i])
-                {
-                    continue;
-                }
-
-                if(!json_object_object_get_ex(interfaces,
-                    g_pcat_main_iface_names[i], &interface))
-                {
-                    continue;
-                }
-
-                if(json_object_object_get_ex(interface, "status", &child))
-                {
-                    if(g_strcmp0(json_object_get_string(child), "online")!=0)
-                    {
-                        mwan3_interface_check_flag = FALSE;
-
-                        break;
-                    }
-                }
-                else
-                {
-                    mwan3_interface_check_flag = FALSE;
-
-                    break;
-                }
-            }
-
-            if(mwan3_interface_check_flag)
-            {
-                mwan3_interface_check_timestamp = g_get_monotonic_time();
-            }
-
-            if(!json_object_object_get_ex(root, "policies", &policies))
-            {
-                json_object_put(root);
-
-                break;
-            }
-
-            if(json_object_object_get_ex(policies, "ipv4", &protocol))
-            {
-                if(json_object_object_get_ex(protocol, "balanced", &rules))
-                {
-                    rules_len = json_object_array_length(rules);
-
-                    for(i=0;i<rules_len;i++)
-                    {
-                        rule = json_object_array_get_idx(rules, i);
-                        iface = NULL;
-                        percent = 0;
-
-                        if(json_object_object_get_ex(rule, "interface",
-                            &child))
-                        {
-                            iface = json_object_get_string(child);
-                        }
-                        if(json_object_object_get_ex(rule, "percent",
-                            &child))
-                        {
-                            upercent = json_object_get_string(child);
-
-                            if(upercent!=NULL)
-                            {
-                                sscanf(upercent, "%d", &percent);
-                            }
-                        }
-
-                        route_iface = PCAT_MAIN_IFACE_LAST;
-
-                        if(percent > 0)
-                        {
-                            for(j=0;j<PCAT_MAIN_IFACE_LAST;j++)
-                            {
-                                if(g_strcmp0(iface,
-                                    g_pcat_main_iface_names[j])==0)
-                                {
-                                    route_iface = j;
-
-                                    ret = TRUE;
-
-                                    break;
-                                }
-                            }
-                        }
-
-                        if(ret)
-                        {
-                            if(route_iface!=PCAT_MAIN_IFACE_LAST)
-                            {
-                                g_pcat_main_network_route_mode =
-                                    g_pcat_main_iface_route_mode[
-                                    route_iface];
-                            }
-
-                            break;
-                        }
-                    }
-                }
-            }
-
-            if(ret)
-            {
-                json_object_put(root);
-
-                break;
-            }
-
-            if(json_object_object_get_ex(policies, "ipv6", &protocol))
-            {
-                if(json_object_object_get_ex(protocol, "balanced", &rules))
-                {
-                    rules_len = json_object_array_length(rules);
-
-                    for(i=0;i<rules_len;i++)
-                    {
-                        rule = json_object_array_get_idx(rules, i);
-                        iface = NULL;
-                        percent = 0;
-
-                        if(json_object_object_get_ex(rule, "interface",
-                            &child))
-                        {
-                            iface = json_object_get_string(child);
-                        }
-                        if(json_object_object_get_ex(rule, "percent",
-                            &child))
-                        {
-                            upercent = json_object_get_string(child);
-
-                            if(upercent!=NULL)
-                            {
-                                sscanf(upercent, "%d", &percent);
-                            }
-                        }
-
-                        route_iface = PCAT_MAIN_IFACE_LAST;
-
-                        if(percent > 0)
-                        {
-                            for(j=0;j<PCAT_MAIN_IFACE_LAST;j++)
-                            {
-                                if(g_strcmp0(iface,
-                                    g_pcat_main_iface_names[j])==0)
-                                {
-                                    route_iface = j;
-
-                                    ret = TRUE;
-
-                                    break;
-                                }
-                            }
-                        }
-
-                        if(ret)
-                        {
-                            if(route_iface!=PCAT_MAIN_IFACE_LAST)
-                            {
-                                g_pcat_main_network_route_mode =
-                                    g_pcat_main_iface_route_mode[
-                                    route_iface];
-                            }
-
-                            break;
-                        }
-                    }
-                }
-            }
-
-            json_object_put(root);
+            break;
         }
-        G_STMT_END;
-
-        g_free(mwan3_stdout);
-
-        if(!ret)
+        case PCAT_MANAGER_ROUTE_MODE_MOBILE:
         {
-            if(g_pcat_main_network_route_mode >
-                PCAT_MANAGER_ROUTE_MODE_UNKNOWN)
+            if(g_pcat_main_net_status_led_work_mode)
             {
-                g_pcat_main_network_route_mode =
-                    PCAT_MANAGER_ROUTE_MODE_NONE;
+                pcat_pmu_manager_net_status_led_setup(20, 380, 0);
             }
-        }
-
-        if(g_get_monotonic_time() >
-            mwan3_interface_check_timestamp +
-            PCAT_MAIN_MWAN_STATUS_CHECK_TIMEOUT * 1000000L)
-        {
-            g_spawn_command_line_sync("mwan3 restart", NULL,
-                NULL, NULL, NULL);
-
-            mwan3_interface_check_timestamp = g_get_monotonic_time();
 
-            g_warning("MWAN3 status is not correct, try to restart!");
+            break;
         }
-        else
+        case PCAT_MANAGER_ROUTE_MODE_WIFI:
         {
-            if(mwan3_interface_check_flag)
-            {
-                g_debug("MWAN3 status check OK!");
-            }
-            else
+            if(g_pcat_main_net_status_led_work_mode)
             {
-                g_debug("MWAN3 status ERROR!");
+                pcat_pmu_manager_net_status_led_setup(20, 80, 0);
             }
-        }
 
-        for(i=0;i<50 && g_pcat_main_mwan_route_check_flag;i++)
-        {
-            g_usleep(100000);
+            break;
         }
-    }
-
-    return NULL;
-}
-
-static void *pcat_main_connection_check_thread_func(void *user_data)
-{
-    guint i;
-    static const gchar * const check_address_list[] = {"1.1.1.1", "8.8.8.8",
-        "114.114.114.114", "223.6.6.6", NULL};
-    gboolean connection_status;
-    gchar *command;
-    gint wstatus;
-    guint retry_count = 0;
-
-    while(g_pcat_main_connection_check_flag)
-    {
-        if(g_pcat_main_network_route_mode > PCAT_MANAGER_ROUTE_MODE_UNKNOWN)
+        case PCAT_MANAGER_ROUTE_MODE_SATELLITE:
         {
-            for(i=0;i<50 && g_pcat_main_connection_check_flag;i++)
+            if(g_pcat_main_net_status_led_work_mode)
             {
-                g_usleep(100000);
+                pcat_pmu_manager_net_status_led_setup(20, 180, 0);
             }
 
-            continue;
+            break;
         }
-
-        connection_status = FALSE;
-        for(retry_count=0;retry_count < 5 && !connection_status;retry_count++)
+        case PCAT_MANAGER_ROUTE_MODE_UNKNOWN:
         {
-            for(i=0;check_address_list[i]!=NULL &&
-                g_pcat_main_connection_check_flag;i++)
+            if(g_pcat_main_net_status_led_work_mode)
             {
-                command = g_strdup_printf("ping -W 3 -w 3 -c 1 -q %s",
-                    check_address_list[i]);
-                if(g_spawn_command_line_sync(command, NULL,
-                    NULL, &wstatus, NULL))
-                {
-                    if(WIFEXITED(wstatus))
-                    {
-                        g_debug("Ping check on %s status: %d",
-                            check_address_list[i], WEXITSTATUS(wstatus));
-
-                        if(WEXITSTATUS(wstatus)==0)
-                        {
-                            connection_status = TRUE;
-                            g_free(command);
-
-                            break;
-                        }
-                    }
-                }
-                g_free(command);
+                pcat_pmu_manager_net_status_led_setup(100, 0, 0);
             }
-        }
 
-        if(g_pcat_main_network_route_mode <= PCAT_MANAGER_ROUTE_MODE_UNKNOWN)
-        {
-            g_pcat_main_network_route_mode = connection_status ?
-                PCAT_MANAGER_ROUTE_MODE_UNKNOWN : PCAT_MANAGER_ROUTE_MODE_NONE;
-        }
-
-        for(i=0;i<50 && g_pcat_main_connection_check_flag;i++)
-        {
-            g_usleep(100000);
+            break;
         }
-    }
-
-    return NULL;
-}
-
-static gboolean pcat_main_status_check_timeout_func(gpointer user_data)
-{
-    if(g_pcat_main_net_status_led_applied_mode!=
-           g_pcat_main_network_route_mode)
-    {
-        switch(g_pcat_main_network_route_mode)
+        default:
         {
-            case PCAT_MANAGER_ROUTE_MODE_WIRED:
+            if(g_pcat_main_net_status_led_work_mode)
             {
-                if(g_pcat_main_net_status_led_work_mode)
-                {
-                    pcat_pmu_manager_net_status_led_setup(
-                        50, 50, 0);
-                }
-
-                break;
+                pcat_pmu_manager_net_status_led_setup(0, 100, 0);
             }
-            case PCAT_MANAGER_ROUTE_MODE_MOBILE:
-            {
-                if(g_pcat_main_net_status_led_work_mode)
-                {
-                    pcat_pmu_manager_net_status_led_setup(
-                        20, 380, 0);
-                }
 
-                break;
-            }
-            case PCAT_MANAGER_ROUTE_MODE_UNKNOWN:
-            {
-                if(g_pcat_main_net_status_led_work_mode)
-                {
-                    pcat_pmu_manager_net_status_led_setup(
-                        100, 0, 0);
-                }
-
-                break;
-            }
-            default:
-            {
-                if(g_pcat_main_net_status_led_work_mode)
-                {
-                    pcat_pmu_manager_net_status_led_setup(
-                        0, 100, 0);
-                }
-
-                break;
-            }
-        }
-
-        g_pcat_main_net_status_led_applied_mode =
-            g_pcat_main_network_route_mode;
-    }
-
-    return TRUE;
-}
-
-static void pcat_main_log_handle_func(const gchar *log_domain,
-    GLogLevelFlags log_level, const gchar *message, gpointer user_data)
-{
-    const char *level = "";
-	GLogLevelFlags minlevel = G_LOG_LEVEL_INFO;
-    gchar buffer[16384] = {0};
-    gint outsize;
-    GDateTime *dt;
-    gchar *dtstr;
-
-	switch(log_level)
-    {
-		case G_LOG_LEVEL_DEBUG:
-        {
-            level = "DEBUG";
-            break;
-        }
-		case G_LOG_LEVEL_INFO:
-        {
-            level = "INFO";
-            break;
-        }
-		case G_LOG_LEVEL_MESSAGE:
-        {
-            level = "MESSAGE";
-            break;
-        }
-		case G_LOG_LEVEL_WARNING:
-        {
-            level = "WARNING";
-            break;
-        }
-		case G_LOG_LEVEL_CRITICAL:
-        {
-            level = "CRITICAL";
-            break;
-        }
-		case G_LOG_LEVEL_ERROR:
-        {
-            level = "ERROR";
-            break;
-        }
-		default:
-        {
-            level = "UNKNOWN";
             break;
         }
-	}
-
-    if(log_domain==NULL)
-    {
-        log_domain = "";
     }
 
-    dt = g_date_time_new_now_local();
-    dtstr = g_date_time_format(dt, "%Y/%m/%d %H:%M:%S");
-    g_date_time_unref(dt);
-
-    outsize = g_snprintf(buffer, 16383, "[%s] %s-%s: %s\n", dtstr,
-        log_domain, level, message);
-    g_free(dtstr);
-
-    if(g_pcat_main_debug_log_file_fp !=NULL && outsize > 0)
-    {
-        fwrite(buffer, 1, outsize, g_pcat_main_debug_log_file_fp);
-        fflush(g_pcat_main_debug_log_file_fp);
-    }
-
-	if(log_level <= minlevel && outsize > 0)
-    {
-		fprintf(stderr, "%s", buffer);
-	}
-	if(log_level <= G_LOG_LEVEL_ERROR)
-    {
-        fprintf(stderr, "%s", buffer);
-		abort();
-    }
+    pcat_controller_network_route_mode_notify(mode);
 }
 
-
 int main(int argc, char *argv[])
 {
     GError *error = NULL;
     GOptionContext *context;
-    pthread_t mwan_policy_check_thread;
-    pthread_t connection_check_thread;
 
     context = g_option_context_new("- PCat System Manager");
     g_option_context_set_ignore_unknown_options(context, TRUE);
@@ -1326,6 +1071,16 @@ int main(int argc, char *argv[])
         g_clear_error(&error);
     }
 
+    if(g_pcat_main_cmd_config_file==NULL)
+    {
+        g_pcat_main_cmd_config_file = g_strdup(PCAT_MAIN_CONFIG_FILE);
+    }
+    if(g_pcat_main_cmd_user_config_file==NULL)
+    {
+        g_pcat_main_cmd_user_config_file = g_strdup(
+            PCAT_MAIN_USER_CONFIG_FILE);
+    }
+
     if(!pcat_main_config_data_load())
     {
         g_warning("Failed to load main config data!");
@@ -1333,23 +1088,25 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    if(g_pcat_main_config_data.debug_output_log)
+    /* Threads do not survive the fork, start them all after this. */
+    if(g_pcat_main_cmd_daemonsize)
     {
-        g_pcat_main_debug_log_file_fp = fopen(PCAT_MAIN_LOG_FILE, "w");
-
-        g_log_set_handler(NULL, G_LOG_LEVEL_MASK | G_LOG_FLAG_FATAL |
-            G_LOG_FLAG_RECURSION, pcat_main_log_handle_func, NULL);
-
+        daemon(0, 0);
     }
 
-    if(!pcat_main_user_config_data_load())
+    if(g_pcat_main_config_data.debug_output_log)
     {
-        g_warning("Failed to load user config data, use default one!");
+        if(pcat_logger_init(PCAT_MAIN_LOG_FILE,
+            &g_pcat_main_config_data.debug_log_limits))
+        {
+            g_log_set_handler(NULL, G_LOG_LEVEL_MASK | G_LOG_FLAG_FATAL |
+                G_LOG_FLAG_RECURSION, pcat_logger_handle_func, NULL);
+        }
     }
 
-    if(g_pcat_main_cmd_daemonsize)
+    if(!pcat_main_user_config_data_load())
     {
-        daemon(0, 0);
+        g_warning("Failed to load user config data, use default one!");
     }
 
     signal(SIGPIPE, SIG_IGN);
@@ -1358,6 +1115,14 @@ int main(int argc, char *argv[])
 
     g_pcat_main_loop = g_main_loop_new(NULL, FALSE);
 
+    if(!pcat_journal_init(g_pcat_main_config_data.journal_file,
+        g_pcat_main_config_data.journal_records,
+        g_pcat_main_config_data.journal_sync_interval))
+    {
+        g_warning("Failed to initialize journal, power events will not be "
+            "recorded!");
+    }
+
     if(!pcat_pmu_manager_init())
     {
         g_warning("Failed to initialize PMU manager, "
@@ -1377,57 +1142,30 @@ int main(int argc, char *argv[])
 
     if(!g_pcat_main_cmd_distro)
     {
-        if(pthread_create(&mwan_policy_check_thread, NULL,
-            pcat_main_mwan_policy_check_thread_func, NULL)!=0)
+        if(!pcat_route_engine_init(
+            pcat_main_network_route_mode_changed_func, NULL))
         {
-            g_warning("Failed to create MWAN policy check thread, routing "
+            g_warning("Failed to initialize route engine, routing "
                 "check will not work!");
         }
-        else
-        {
-            pthread_detach(mwan_policy_check_thread);
-        }
-
-        if(pthread_create(&connection_check_thread, NULL,
-            pcat_main_connection_check_thread_func, NULL)!=0)
-        {
-            g_warning("Failed to create connection check thread, routing "
-                "check may not work correctly!");
-        }
-        else
-        {
-            pthread_detach(connection_check_thread);
-        }
-
-        g_pcat_main_status_check_timeout_id =
-            g_timeout_add_seconds(2, pcat_main_status_check_timeout_func, NULL);
     }
 
     g_main_loop_run(g_pcat_main_loop);
 
-    if(g_pcat_main_status_check_timeout_id > 0)
-    {
-        g_source_remove(g_pcat_main_status_check_timeout_id);
-        g_pcat_main_status_check_timeout_id = 0;
-    }
-
-    g_pcat_main_mwan_route_check_flag = FALSE;
-    g_pcat_main_connection_check_flag = FALSE;
-
     g_main_loop_unref(g_pcat_main_loop);
     g_pcat_main_loop = NULL;
 
+    pcat_route_engine_uninit();
     pcat_controller_uninit();
     pcat_modem_manager_uninit();
     pcat_pmu_manager_uninit();
+    pcat_journal_uninit();
     g_option_context_free(context);
     pcat_main_config_data_clear();
+    g_free(g_pcat_main_cmd_config_file);
+    g_free(g_pcat_main_cmd_user_config_file);
 
-    if(g_pcat_main_debug_log_file_fp!=NULL)
-    {
-        fclose(g_pcat_main_debug_log_file_fp);
-        g_pcat_main_debug_log_file_fp = NULL;
-    }
+    pcat_logger_uninit();
 
     return 0;
 }
@@ -1456,7 +1194,7 @@ void pcat_main_user_config_data_sync()
 
 PCatManagerRouteMode pcat_main_network_route_mode_get()
 {
-    return g_pcat_main_network_route_mode;
+    return pcat_route_engine_mode_get();
 }
 
 gboolean pcat_main_is_running_on_distro()
@@ -6,11 +6,15 @@
 #include <gio/gio.h>
 #include "modem-manager.h"
 #include "common.h"
+#include "seqlock.h"
+#include "journal.h"
 
 #define PCAT_MODEM_MANAGER_POWER_WAIT_TIME 50
 #define PCAT_MODEM_MANAGER_POWER_READY_TIME 30
 #define PCAT_MODEM_MANAGER_RESET_ON_TIME 3
 #define PCAT_MODEM_MANAGER_RESET_WAIT_TIME 30
+#define PCAT_MODEM_MANAGER_EXTERNAL_EXEC_STDOUT_LOG_FILE \
+    "/tmp/pcat-modem-external-exec-stdout.log"
 
 typedef enum
 {
@@ -41,6 +45,8 @@ typedef struct _PCatModemManagerData
     PCatModemManagerSIMState sim_state;
     gchar *isp_name;
     gchar *isp_plmn;
+    guint status_sequence;
+    PCatModemManagerStatus status;
 
     libusb_context *usb_ctx;
 
@@ -56,7 +62,7 @@ typedef struct _PCatModemManagerData
     GSource *external_control_exec_stdout_read_source;
     GString *external_control_exec_stdout_buffer;
 
-    FILE *external_control_exec_stdout_log_file;
+    PCatLogFile *external_control_exec_stdout_log_file;
     PCatModemManagerDeviceType device_type;
     gboolean modem_have_5g_connected;
     gint64 modem_5g_connection_timestamp;
@@ -84,6 +90,71 @@ static PCatModemManagerUSBData g_pcat_modem_manager_supported_dev_list[] =
 
 static PCatModemManagerData g_pcat_modem_manager_data = {0};
 
+/*
+ * Copy a string into a fixed size status field, cutting it at the last
+ * complete UTF-8 character if it does not fit.
+ */
+static void pcat_modem_manager_status_string_copy(gchar *dest,
+    const gchar *src, gsize dest_size)
+{
+    const gchar *end = NULL;
+
+    if(g_strlcpy(dest, src, dest_size) < dest_size)
+    {
+        return;
+    }
+
+    if(!g_utf8_validate(dest, -1, &end))
+    {
+        dest[end - dest] = '\0';
+    }
+}
+
+/*
+ * Publish the modem status for lock-free readers, the sequence number only
+ * moves when something changed. Status is updated from both the main loop
+ * and the work thread, so writers (and ISP string updates) are serialized
+ * by the mutex.
+ */
+static void pcat_modem_manager_status_publish(PCatModemManagerData *mm_data)
+{
+    PCatModemManagerStatus status;
+    gint32 values[2];
+
+    g_mutex_lock(&mm_data->mutex);
+
+    memset(&status, 0, sizeof(status));
+    status.mode = mm_data->modem_mode;
+    status.sim_state = mm_data->sim_state;
+    status.rfkill_state = mm_data->modem_rfkill_state;
+    status.signal_strength = mm_data->modem_signal_strength;
+    if(mm_data->isp_name!=NULL)
+    {
+        pcat_modem_manager_status_string_copy(status.isp_name,
+            mm_data->isp_name, PCAT_MODEM_MANAGER_ISP_NAME_MAX);
+    }
+    if(mm_data->isp_plmn!=NULL)
+    {
+        pcat_modem_manager_status_string_copy(status.isp_plmn,
+            mm_data->isp_plmn, PCAT_MODEM_MANAGER_ISP_PLMN_MAX);
+    }
+
+    if(memcmp(&status, &mm_data->status, sizeof(status))!=0)
+    {
+        if(status.mode!=mm_data->status.mode)
+        {
+            values[0] = status.mode;
+            values[1] = mm_data->status.mode;
+            pcat_journal_append(PCAT_JOURNAL_RECORD_MODEM_MODE, values, 2);
+        }
+
+        pcat_seqlock_write(&mm_data->status_sequence, &mm_data->status,
+            &status, sizeof(status));
+    }
+
+    g_mutex_unlock(&mm_data->mutex);
+}
+
 static inline gboolean pcat_modem_manager_modem_power_init(
     PCatModemManagerData *mm_data, PCatManagerMainConfigData *main_config_data)
 {
@@ -93,6 +164,7 @@ static inline gboolean pcat_modem_manager_modem_power_init(
     g_message("Start Modem power initialization.");
 
     mm_data->modem_rfkill_state = FALSE;
+    pcat_modem_manager_status_publish(mm_data);
 
     if(main_config_data->hw_gpio_modem_power_chip==NULL)
     {
@@ -309,9 +381,9 @@ static inline void pcat_modem_manager_external_control_exec_line_parser(
 
     if(mm_data->external_control_exec_stdout_log_file!=NULL)
     {
-        fwrite(buffer, size, 1,
-            mm_data->external_control_exec_stdout_log_file);
-        fflush(mm_data->external_control_exec_stdout_log_file);
+        pcat_log_file_write(mm_data->external_control_exec_stdout_log_file,
+            (const gchar *)buffer, size);
+        pcat_log_file_flush(mm_data->external_control_exec_stdout_log_file);
     }
 
     g_string_append_len(str, (const gchar *)buffer, size);
@@ -462,6 +534,8 @@ static inline void pcat_modem_manager_external_control_exec_line_parser(
 
                     mm_data->modem_signal_strength = signal_value;
                     g_message("Modem signal strength: %d", signal_value);
+
+                    pcat_modem_manager_status_publish(mm_data);
                 }
                 else if(g_strcmp0(cmd, "SIMSTATUS")==0)
                 {
@@ -475,6 +549,8 @@ static inline void pcat_modem_manager_external_control_exec_line_parser(
 
                             g_message("SIM card state changed to %d.",
                                 sim_state);
+
+                            pcat_modem_manager_status_publish(mm_data);
                         }
                     }
                 }
@@ -486,6 +562,8 @@ static inline void pcat_modem_manager_external_control_exec_line_parser(
                         sscanf(value_raw_str, "%d", &isp_name_is_ucs2);
                     }
 
+                    g_mutex_lock(&mm_data->mutex);
+
                     value_raw_str = g_hash_table_lookup(table, "FNN");
                     if(value_raw_str!=NULL)
                     {
@@ -505,6 +583,10 @@ static inline void pcat_modem_manager_external_control_exec_line_parser(
                         }
                         mm_data->isp_plmn = g_strdup(value_raw_str);
                     }
+
+                    g_mutex_unlock(&mm_data->mutex);
+
+                    pcat_modem_manager_status_publish(mm_data);
                 }
 
                 g_hash_table_unref(table);
@@ -959,7 +1041,9 @@ gboolean pcat_modem_manager_init()
     if(main_config_data->debug_modem_external_exec_stdout_log)
     {
         g_pcat_modem_manager_data.external_control_exec_stdout_log_file =
-            fopen("/tmp/pcat-modem-external-exec-stdout.log", "w+");
+            pcat_log_file_open(
+            PCAT_MODEM_MANAGER_EXTERNAL_EXEC_STDOUT_LOG_FILE,
+            &main_config_data->debug_log_limits);
     }
 
     errcode = libusb_init(&g_pcat_modem_manager_data.usb_ctx);
@@ -1027,7 +1111,7 @@ void pcat_modem_manager_uninit()
 
     if(g_pcat_modem_manager_data.external_control_exec_stdout_log_file!=NULL)
     {
-        fclose(
+        pcat_log_file_close(
             g_pcat_modem_manager_data.external_control_exec_stdout_log_file);
         g_pcat_modem_manager_data.external_control_exec_stdout_log_file =
             NULL;
@@ -1036,43 +1120,27 @@ void pcat_modem_manager_uninit()
     g_pcat_modem_manager_data.initialized = FALSE;
 }
 
-gboolean pcat_modem_manager_status_get(PCatModemManagerMode *mode,
-    PCatModemManagerSIMState *sim_state, gboolean *rfkill_state,
-    gint *signal_strength, gchar **isp_name, gchar **isp_plmn)
+gboolean pcat_modem_manager_status_snapshot_get(
+    PCatModemManagerStatus *status)
 {
-    if(!g_pcat_modem_manager_data.initialized)
+    if(!g_pcat_modem_manager_data.initialized || status==NULL)
     {
         return FALSE;
     }
 
-    if(mode!=NULL)
-    {
-        *mode = g_pcat_modem_manager_data.modem_mode;
-    }
-    if(sim_state!=NULL)
-    {
-        *sim_state = g_pcat_modem_manager_data.sim_state;
-    }
-    if(rfkill_state!=NULL)
-    {
-        *rfkill_state = g_pcat_modem_manager_data.modem_rfkill_state;
-    }
-    if(signal_strength!=NULL)
-    {
-        *signal_strength = g_pcat_modem_manager_data.modem_signal_strength;
-    }
-    if(isp_name!=NULL)
-    {
-        *isp_name = g_strdup(g_pcat_modem_manager_data.isp_name);
-    }
-    if(isp_plmn!=NULL)
-    {
-        *isp_plmn = g_strdup(g_pcat_modem_manager_data.isp_plmn);
-    }
+    status->sequence = pcat_seqlock_read(
+        &g_pcat_modem_manager_data.status_sequence, status,
+        &g_pcat_modem_manager_data.status, sizeof(PCatModemManagerStatus));
 
     return TRUE;
 }
 
+guint pcat_modem_manager_status_sequence_get()
+{
+    return pcat_seqlock_sequence_get(
+        &g_pcat_modem_manager_data.status_sequence);
+}
+
 PCatModemManagerDeviceType pcat_modem_manager_device_type_get()
 {
     return g_pcat_modem_manager_data.device_type;
@@ -1090,6 +1158,7 @@ void pcat_modem_manager_device_rfkill_mode_set(gboolean state)
     }
 
     g_pcat_modem_manager_data.modem_rfkill_state = state;
+    pcat_modem_manager_status_publish(&g_pcat_modem_manager_data);
     main_config_data = pcat_main_config_data_get();
 
     if(state)
@@ -31,11 +31,25 @@ typedef enum {
     PCAT_MODEM_MANAGER_SIM_STATE_BAD = 6,
 }PCatModemManagerSIMState;
 
+#define PCAT_MODEM_MANAGER_ISP_NAME_MAX 64
+#define PCAT_MODEM_MANAGER_ISP_PLMN_MAX 16
+
+typedef struct _PCatModemManagerStatus
+{
+    guint sequence;
+    PCatModemManagerMode mode;
+    PCatModemManagerSIMState sim_state;
+    gboolean rfkill_state;
+    gint signal_strength;
+    gchar isp_name[PCAT_MODEM_MANAGER_ISP_NAME_MAX];
+    gchar isp_plmn[PCAT_MODEM_MANAGER_ISP_PLMN_MAX];
+}PCatModemManagerStatus;
+
 gboolean pcat_modem_manager_init();
 void pcat_modem_manager_uninit();
-gboolean pcat_modem_manager_status_get(PCatModemManagerMode *mode,
-    PCatModemManagerSIMState *sim_state, gboolean *rfkill_state,
-    gint *signal_strength, gchar **isp_name, gchar **isp_plmn);
+gboolean pcat_modem_manager_status_snapshot_get(
+    PCatModemManagerStatus *status);
+guint pcat_modem_manager_status_sequence_get();
 PCatModemManagerDeviceType pcat_modem_manager_device_type_get();
 void pcat_modem_manager_device_rfkill_mode_set(gboolean state);
 
@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <json.h>
+
+#include "ubus-client.h"
+#include "mwan-status.h"
+
+/*
+ * Benchmark of the mwan3 status extraction. Every document, captured on
+ * a router with "ubus call mwan3 status > file" or generated with
+ * --interfaces, is encoded to blobmsg once (the way ubusd delivers it)
+ * and then checked --iterations times, both through a json-c tree as the
+ * route check used to do and with the streaming extractor.
+ */
+
+#define PCAT_MWAN_STATUS_BENCH_TRACK_IPS 4
+#define PCAT_MWAN_STATUS_BENCH_NETWORKS 8
+
+static const gchar * const g_pcat_mwan_status_bench_iface_names[] =
+{
+    "wan",
+    "wan6",
+    "wwan_5g",
+    "wwan_5g_v6",
+    "wwan_lte",
+    "wwan_lte_v6",
+    NULL
+};
+
+static gint g_pcat_mwan_status_bench_cmd_iterations = 20000;
+static gint g_pcat_mwan_status_bench_cmd_interfaces = 0;
+
+static GOptionEntry g_pcat_mwan_status_bench_cmd_entries[] =
+{
+    { "iterations", 'n', 0, G_OPTION_ARG_INT,
+        &g_pcat_mwan_status_bench_cmd_iterations,
+        "Checks per document and method", NULL },
+    { "interfaces", 'i', 0, G_OPTION_ARG_INT,
+        &g_pcat_mwan_status_bench_cmd_interfaces,
+        "Generate a document with this many interfaces", NULL },
+    { NULL }
+};
+
+static gint pcat_mwan_status_bench_iface_lookup_func(const gchar *name,
+    gpointer user_data)
+{
+    guint i;
+
+    for(i=0;g_pcat_mwan_status_bench_iface_names[i]!=NULL;i++)
+    {
+        if(strcmp(name, g_pcat_mwan_status_bench_iface_names[i])==0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Same lookups as the json-c based route check, returns the route. */
+static gint pcat_mwan_status_bench_tree_check(const guint8 *data,
+    gsize len, guint *online)
+{
+    static const gchar * const protocols[] = {"ipv4", "ipv6", NULL};
+    struct json_object *root, *interfaces, *interface, *child;
+    struct json_object *policies, *protocol, *rules, *rule;
+    const gchar *iface, *upercent;
+    guint i, j, rules_len;
+    guint percent;
+    gint route_iface = -1;
+
+    *online = 0;
+
+    root = pcat_ubus_blobmsg_to_json(data, len);
+
+    if(json_object_object_get_ex(root, "interfaces", &interfaces))
+    {
+        for(i=0;g_pcat_mwan_status_bench_iface_names[i]!=NULL;i++)
+        {
+            if(json_object_object_get_ex(interfaces,
+                g_pcat_mwan_status_bench_iface_names[i], &interface) &&
+               json_object_object_get_ex(interface, "status", &child) &&
+               g_strcmp0(json_object_get_string(child), "online")==0)
+            {
+                (*online)++;
+            }
+        }
+    }
+
+    if(json_object_object_get_ex(root, "policies", &policies))
+    {
+        for(i=0;protocols[i]!=NULL && route_iface < 0;i++)
+        {
+            if(!json_object_object_get_ex(policies, protocols[i],
+                &protocol) ||
+               !json_object_object_get_ex(protocol, "balanced", &rules))
+            {
+                continue;
+            }
+
+            rules_len = json_object_array_length(rules);
+            for(j=0;j<rules_len && route_iface < 0;j++)
+            {
+                rule = json_object_array_get_idx(rules, j);
+                iface = NULL;
+                percent = 0;
+
+                if(json_object_object_get_ex(rule, "interface", &child))
+                {
+                    iface = json_object_get_string(child);
+                }
+                if(json_object_object_get_ex(rule, "percent", &child))
+                {
+                    upercent = json_object_get_string(child);
+                    if(upercent!=NULL)
+                    {
+                        sscanf(upercent, "%u", &percent);
+                    }
+                }
+
+                if(iface!=NULL && percent > 0)
+                {
+                    route_iface = pcat_mwan_status_bench_iface_lookup_func(
+                        iface, NULL);
+                }
+            }
+        }
+    }
+
+    json_object_put(root);
+
+    return route_iface;
+}
+
+static gint pcat_mwan_status_bench_stream_check(const guint8 *data,
+    gsize len, guint *online)
+{
+    PCatMwanStatusIfaceState iface_states[
+        G_N_ELEMENTS(g_pcat_mwan_status_bench_iface_names) - 1];
+    PCatMwanStatus status;
+    guint i;
+
+    status.iface_states = iface_states;
+    status.iface_weights = NULL;
+    status.iface_count = G_N_ELEMENTS(iface_states);
+    pcat_mwan_status_parse(data, len,
+        pcat_mwan_status_bench_iface_lookup_func, NULL, &status);
+
+    *online = 0;
+    for(i=0;i<status.iface_count;i++)
+    {
+        if(iface_states[i]==PCAT_MWAN_STATUS_IFACE_ONLINE)
+        {
+            (*online)++;
+        }
+    }
+
+    return status.route_iface;
+}
+
+/*
+ * Shaped like the mwan3 status of a large multi-WAN setup: tracking IPs
+ * and connected networks per interface, one "<iface>_only" policy per
+ * interface, and our interfaces listed last in the balanced policy.
+ */
+static struct json_object *pcat_mwan_status_bench_document_generate(
+    guint count)
+{
+    struct json_object *root, *interfaces, *interface, *track_ips, *entry;
+    struct json_object *connected, *networks[2], *policies, *policy;
+    struct json_object *protocol, *member;
+    gchar **names;
+    gchar *str;
+    guint i, j, p;
+
+    names = g_new0(gchar *, count + 1);
+    for(i=0;i<count;i++)
+    {
+        j = count - 1 - i;
+        names[i] = j < G_N_ELEMENTS(g_pcat_mwan_status_bench_iface_names)-1 ?
+            g_strdup(g_pcat_mwan_status_bench_iface_names[j]) :
+            g_strdup_printf("wan_extra%u", i);
+    }
+
+    root = json_object_new_object();
+
+    interfaces = json_object_new_object();
+    for(i=0;i<count;i++)
+    {
+        interface = json_object_new_object();
+        json_object_object_add(interface, "age", json_object_new_int(3));
+        json_object_object_add(interface, "online",
+            json_object_new_int(86400 + i));
+        json_object_object_add(interface, "offline", json_object_new_int(0));
+        json_object_object_add(interface, "uptime",
+            json_object_new_int(86400 + i));
+        json_object_object_add(interface, "score", json_object_new_int(10));
+        json_object_object_add(interface, "lost", json_object_new_int(0));
+        json_object_object_add(interface, "turn", json_object_new_int(0));
+        json_object_object_add(interface, "status",
+            json_object_new_string(i % 3 ? "online" : "offline"));
+        json_object_object_add(interface, "enabled",
+            json_object_new_boolean(TRUE));
+        json_object_object_add(interface, "running",
+            json_object_new_boolean(TRUE));
+        json_object_object_add(interface, "tracking",
+            json_object_new_string("active"));
+        json_object_object_add(interface, "up",
+            json_object_new_boolean(TRUE));
+
+        track_ips = json_object_new_array();
+        for(j=0;j<PCAT_MWAN_STATUS_BENCH_TRACK_IPS;j++)
+        {
+            entry = json_object_new_object();
+            str = g_strdup_printf("198.51.100.%u", j + 1);
+            json_object_object_add(entry, "ip", json_object_new_string(str));
+            g_free(str);
+            json_object_object_add(entry, "status",
+                json_object_new_string("up"));
+            json_object_object_add(entry, "latency",
+                json_object_new_int(10 + j));
+            json_object_object_add(entry, "packetloss",
+                json_object_new_int(0));
+            json_object_array_add(track_ips, entry);
+        }
+        json_object_object_add(interface, "track_ip", track_ips);
+
+        json_object_object_add(interfaces, names[i], interface);
+    }
+    json_object_object_add(root, "interfaces", interfaces);
+
+    connected = json_object_new_object();
+    networks[0] = json_object_new_array();
+    networks[1] = json_object_new_array();
+    for(i=0;i<count * PCAT_MWAN_STATUS_BENCH_NETWORKS;i++)
+    {
+        str = g_strdup_printf("10.%u.%u.0/24", i / 256, i % 256);
+        json_object_array_add(networks[0], json_object_new_string(str));
+        g_free(str);
+        str = g_strdup_printf("2001:db8:%x::/64", i);
+        json_object_array_add(networks[1], json_object_new_string(str));
+        g_free(str);
+    }
+    json_object_object_add(connected, "ipv4", networks[0]);
+    json_object_object_add(connected, "ipv6", networks[1]);
+    json_object_object_add(root, "connected", connected);
+
+    policies = json_object_new_object();
+    for(p=0;p<2;p++)
+    {
+        protocol = json_object_new_object();
+        for(i=0;i<count;i++)
+        {
+            policy = json_object_new_array();
+            member = json_object_new_object();
+            json_object_object_add(member, "interface",
+                json_object_new_string(names[i]));
+            json_object_object_add(member, "percent",
+                json_object_new_int(100));
+            json_object_array_add(policy, member);
+
+            str = g_strdup_printf("%s_only", names[i]);
+            json_object_object_add(protocol, str, policy);
+            g_free(str);
+        }
+
+        policy = json_object_new_array();
+        for(i=0;i<count;i++)
+        {
+            member = json_object_new_object();
+            json_object_object_add(member, "interface",
+                json_object_new_string(names[i]));
+            json_object_object_add(member, "percent",
+                json_object_new_int(MAX(100 / count, 1)));
+            json_object_array_add(policy, member);
+        }
+        json_object_object_add(protocol, "balanced", policy);
+
+        json_object_object_add(policies, p==0 ? "ipv4" : "ipv6", protocol);
+    }
+    json_object_object_add(root, "policies", policies);
+
+    g_strfreev(names);
+
+    return root;
+}
+
+static void pcat_mwan_status_bench_run(const gchar *name,
+    struct json_object *document)
+{
+    GByteArray *blobmsg;
+    gsize json_size;
+    gint64 start, tree_time, stream_time;
+    gint tree_route, stream_route;
+    guint tree_online, stream_online;
+    gint i, iterations;
+
+    iterations = MAX(g_pcat_mwan_status_bench_cmd_iterations, 1);
+
+    json_size = strlen(json_object_to_json_string(document));
+    blobmsg = g_byte_array_new();
+    pcat_ubus_blobmsg_from_json(blobmsg, document);
+
+    tree_route = pcat_mwan_status_bench_tree_check(blobmsg->data,
+        blobmsg->len, &tree_online);
+    stream_route = pcat_mwan_status_bench_stream_check(blobmsg->data,
+        blobmsg->len, &stream_online);
+    if(tree_route!=stream_route || tree_online!=stream_online)
+    {
+        g_warning("%s: results differ, tree route %d online %u, "
+            "streaming route %d online %u!", name, tree_route, tree_online,
+            stream_route, stream_online);
+    }
+
+    start = g_get_monotonic_time();
+    for(i=0;i<iterations;i++)
+    {
+        pcat_mwan_status_bench_tree_check(blobmsg->data, blobmsg->len,
+            &tree_online);
+    }
+    tree_time = g_get_monotonic_time() - start;
+
+    start = g_get_monotonic_time();
+    for(i=0;i<iterations;i++)
+    {
+        pcat_mwan_status_bench_stream_check(blobmsg->data, blobmsg->len,
+            &stream_online);
+    }
+    stream_time = g_get_monotonic_time() - start;
+
+    printf("%s: %zu bytes json, %u bytes blobmsg, route %d, "
+        "tree %.2f us, streaming %.2f us per check (%.1fx)\n", name,
+        json_size, blobmsg->len, stream_route,
+        (gdouble)tree_time / iterations, (gdouble)stream_time / iterations,
+        stream_time > 0 ? (gdouble)tree_time / stream_time : 0.0);
+
+    g_byte_array_unref(blobmsg);
+}
+
+int main(int argc, char *argv[])
+{
+    static const guint default_counts[] = {2, 8, 32};
+    GOptionContext *context;
+    GError *error = NULL;
+    struct json_object *document;
+    gchar *contents, *name;
+    guint i;
+    gint j;
+
+    context = g_option_context_new("[CAPTURE...] - PCat mwan3 status "
+        "extraction benchmark");
+    g_option_context_add_main_entries(context,
+        g_pcat_mwan_status_bench_cmd_entries, NULL);
+    if(!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_warning("Option parsing failed: %s", error->message);
+        g_clear_error(&error);
+        g_option_context_free(context);
+
+        return 1;
+    }
+    g_option_context_free(context);
+
+    for(j=1;j<argc;j++)
+    {
+        if(!g_file_get_contents(argv[j], &contents, NULL, &error))
+        {
+            g_warning("Failed to read %s: %s", argv[j], error->message);
+            g_clear_error(&error);
+
+            continue;
+        }
+
+        document = json_tokener_parse(contents);
+        g_free(contents);
+        if(document==NULL ||
+           json_object_get_type(document)!=json_type_object)
+        {
+            g_warning("%s is not a JSON object!", argv[j]);
+            json_object_put(document);
+
+            continue;
+        }
+
+        pcat_mwan_status_bench_run(argv[j], document);
+        json_object_put(document);
+    }
+
+    if(argc > 1 && g_pcat_mwan_status_bench_cmd_interfaces <= 0)
+    {
+        return 0;
+    }
+
+    for(i=0;i<G_N_ELEMENTS(default_counts);i++)
+    {
+        if(g_pcat_mwan_status_bench_cmd_interfaces > 0 && i > 0)
+        {
+            break;
+        }
+
+        document = pcat_mwan_status_bench_document_generate(
+            g_pcat_mwan_status_bench_cmd_interfaces > 0 ?
+            g_pcat_mwan_status_bench_cmd_interfaces : default_counts[i]);
+
+        name = g_strdup_printf("generated, %u interfaces",
+            g_pcat_mwan_status_bench_cmd_interfaces > 0 ?
+            g_pcat_mwan_status_bench_cmd_interfaces : default_counts[i]);
+        pcat_mwan_status_bench_run(name, document);
+        g_free(name);
+
+        json_object_put(document);
+    }
+
+    return 0;
+}
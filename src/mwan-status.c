@@ -0,0 +1,209 @@
+#include <string.h>
+#include "mwan-status.h"
+#include "ubus-client.h"
+
+/*
+ * Streaming extractor for the mwan3 status reply. The blobmsg table is
+ * walked in place and only interfaces.<name>.status and
+ * policies.<ipv4|ipv6>.balanced[].interface/percent are looked at, no
+ * json tree is built and nothing is allocated, however many interfaces,
+ * tracking IPs and connected networks the document carries.
+ */
+
+typedef enum
+{
+    PCAT_MWAN_STATUS_PROTOCOL_IPV4,
+    PCAT_MWAN_STATUS_PROTOCOL_IPV6,
+    PCAT_MWAN_STATUS_PROTOCOL_LAST
+}PCatMwanStatusProtocol;
+
+static void pcat_mwan_status_interfaces_parse(
+    const PCatUbusBlobmsgField *interfaces,
+    PCatMwanStatusIfaceLookupFunc lookup, gpointer user_data,
+    PCatMwanStatus *status)
+{
+    PCatUbusBlobmsgIter iter, iface_iter;
+    PCatUbusBlobmsgField iface, field;
+    const gchar *value;
+    gint index;
+
+    if(interfaces->type!=PCAT_UBUS_BLOBMSG_TYPE_TABLE)
+    {
+        return;
+    }
+    status->has_interfaces = TRUE;
+
+    pcat_ubus_blobmsg_field_iter_init(interfaces, &iter);
+    while(pcat_ubus_blobmsg_iter_next(&iter, &iface))
+    {
+        index = lookup(iface.name, user_data);
+        if(index < 0 || (guint)index >= status->iface_count ||
+           !pcat_ubus_blobmsg_field_iter_init(&iface, &iface_iter))
+        {
+            continue;
+        }
+
+        status->iface_states[index] = PCAT_MWAN_STATUS_IFACE_NO_STATUS;
+
+        while(pcat_ubus_blobmsg_iter_next(&iface_iter, &field))
+        {
+            if(strcmp(field.name, "status")!=0)
+            {
+                continue;
+            }
+
+            value = pcat_ubus_blobmsg_field_string_get(&field);
+            if(value!=NULL)
+            {
+                status->iface_states[index] = strcmp(value, "online")==0 ?
+                    PCAT_MWAN_STATUS_IFACE_ONLINE :
+                    PCAT_MWAN_STATUS_IFACE_OFFLINE;
+            }
+
+            break;
+        }
+    }
+}
+
+/* Returns the heaviest member of the balanced policy we know, or -1. */
+static gint pcat_mwan_status_balanced_parse(
+    const PCatUbusBlobmsgField *balanced,
+    PCatMwanStatusIfaceLookupFunc lookup, gpointer user_data,
+    const PCatMwanStatus *status)
+{
+    PCatUbusBlobmsgIter iter, rule_iter;
+    PCatUbusBlobmsgField rule, field;
+    const gchar *iface;
+    gint64 percent;
+    gint index, route_iface = -1;
+    guint weight, route_weight = 0;
+
+    if(!pcat_ubus_blobmsg_field_iter_init(balanced, &iter))
+    {
+        return -1;
+    }
+
+    while(pcat_ubus_blobmsg_iter_next(&iter, &rule))
+    {
+        if(!pcat_ubus_blobmsg_field_iter_init(&rule, &rule_iter))
+        {
+            continue;
+        }
+
+        iface = NULL;
+        percent = 0;
+        while(pcat_ubus_blobmsg_iter_next(&rule_iter, &field))
+        {
+            if(strcmp(field.name, "interface")==0)
+            {
+                iface = pcat_ubus_blobmsg_field_string_get(&field);
+            }
+            else if(strcmp(field.name, "percent")==0)
+            {
+                percent = pcat_ubus_blobmsg_field_int_get(&field);
+            }
+        }
+
+        if(iface==NULL || percent <= 0)
+        {
+            continue;
+        }
+
+        index = lookup(iface, user_data);
+        if(index < 0 || (guint)index >= status->iface_count)
+        {
+            continue;
+        }
+        if(status->iface_weights==NULL)
+        {
+            return index;
+        }
+
+        weight = status->iface_weights[index];
+        if(route_iface < 0 || weight > route_weight)
+        {
+            route_iface = index;
+            route_weight = weight;
+        }
+    }
+
+    return route_iface;
+}
+
+void pcat_mwan_status_parse(const guint8 *data, gsize len,
+    PCatMwanStatusIfaceLookupFunc lookup, gpointer user_data,
+    PCatMwanStatus *status)
+{
+    PCatUbusBlobmsgIter iter, policies_iter, protocol_iter;
+    PCatUbusBlobmsgField field, protocol, policy;
+    gint route_iface[PCAT_MWAN_STATUS_PROTOCOL_LAST] = {-1, -1};
+    guint i;
+
+    status->has_interfaces = FALSE;
+    status->route_iface = -1;
+    for(i=0;i<status->iface_count;i++)
+    {
+        status->iface_states[i] = PCAT_MWAN_STATUS_IFACE_MISSING;
+    }
+
+    pcat_ubus_blobmsg_iter_init(&iter, data, len);
+    while(pcat_ubus_blobmsg_iter_next(&iter, &field))
+    {
+        if(strcmp(field.name, "interfaces")==0)
+        {
+            pcat_mwan_status_interfaces_parse(&field, lookup, user_data,
+                status);
+
+            continue;
+        }
+
+        if(strcmp(field.name, "policies")!=0 ||
+           !pcat_ubus_blobmsg_field_iter_init(&field, &policies_iter))
+        {
+            continue;
+        }
+
+        while(pcat_ubus_blobmsg_iter_next(&policies_iter, &protocol))
+        {
+            if(strcmp(protocol.name, "ipv4")==0)
+            {
+                i = PCAT_MWAN_STATUS_PROTOCOL_IPV4;
+            }
+            else if(strcmp(protocol.name, "ipv6")==0)
+            {
+                i = PCAT_MWAN_STATUS_PROTOCOL_IPV6;
+            }
+            else
+            {
+                continue;
+            }
+
+            if(!pcat_ubus_blobmsg_field_iter_init(&protocol,
+                &protocol_iter))
+            {
+                continue;
+            }
+
+            while(pcat_ubus_blobmsg_iter_next(&protocol_iter, &policy))
+            {
+                if(strcmp(policy.name, "balanced")==0)
+                {
+                    route_iface[i] = pcat_mwan_status_balanced_parse(
+                        &policy, lookup, user_data, status);
+
+                    break;
+                }
+            }
+        }
+    }
+
+    for(i=0;i<PCAT_MWAN_STATUS_PROTOCOL_LAST;i++)
+    {
+        if(route_iface[i] >= 0)
+        {
+            status->route_iface = route_iface[i];
+
+            break;
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef HAVE_PCAT_MWAN_STATUS_H
+#define HAVE_PCAT_MWAN_STATUS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+    PCAT_MWAN_STATUS_IFACE_MISSING,
+    PCAT_MWAN_STATUS_IFACE_NO_STATUS,
+    PCAT_MWAN_STATUS_IFACE_ONLINE,
+    PCAT_MWAN_STATUS_IFACE_OFFLINE
+}PCatMwanStatusIfaceState;
+
+/* Maps an mwan3 interface name to the caller's index, -1 to skip it. */
+typedef gint (*PCatMwanStatusIfaceLookupFunc)(const gchar *name,
+    gpointer user_data);
+
+/*
+ * What the route check needs from "ubus call mwan3 status". iface_states
+ * and the optional iface_weights are provided by the caller and indexed
+ * like the lookup function does. route_iface is the balanced policy
+ * member with a non-zero share and the largest weight, the first listed
+ * one on a tie (IPv4 before IPv6), or -1.
+ */
+typedef struct _PCatMwanStatus
+{
+    gboolean has_interfaces;
+    PCatMwanStatusIfaceState *iface_states;
+    const guint *iface_weights;
+    guint iface_count;
+    gint route_iface;
+}PCatMwanStatus;
+
+void pcat_mwan_status_parse(const guint8 *data, gsize len,
+    PCatMwanStatusIfaceLookupFunc lookup, gpointer user_data,
+    PCatMwanStatus *status);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,532 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "netlink-monitor.h"
+
+/*
+ * Keep track of the links and their usable addresses through rtnetlink.
+ * The tables are filled by a dump at startup and kept up to date by the
+ * link, address and route multicast groups, so the caller can sleep on
+ * the socket and only look at the network state when it really changed.
+ * Of the routes only main table default route changes are reported.
+ */
+
+#define PCAT_NETLINK_MONITOR_BUFFER_SIZE 32768
+#define PCAT_NETLINK_MONITOR_SOCKET_BUFFER_SIZE (256 * 1024)
+#define PCAT_NETLINK_MONITOR_DUMP_TIMEOUT 1000
+
+#define PCAT_NETLINK_MONITOR_LINK_FLAGS_MASK (IFF_UP | IFF_RUNNING)
+
+typedef struct _PCatNetlinkMonitorLink
+{
+    gchar name[IF_NAMESIZE];
+    guint flags;
+    GHashTable *addresses;
+    guint address_count[2];
+}PCatNetlinkMonitorLink;
+
+struct _PCatNetlinkMonitor
+{
+    gint fd;
+    guint32 seq;
+    gboolean resync;
+    GHashTable *link_table;
+    guint8 *buffer;
+};
+
+static void pcat_netlink_monitor_link_free(PCatNetlinkMonitorLink *link)
+{
+    g_hash_table_unref(link->addresses);
+    g_free(link);
+}
+
+static PCatNetlinkMonitorLink *pcat_netlink_monitor_link_get(
+    PCatNetlinkMonitor *monitor, gint index, gboolean create)
+{
+    PCatNetlinkMonitorLink *link;
+
+    link = g_hash_table_lookup(monitor->link_table, GINT_TO_POINTER(index));
+    if(link==NULL && create)
+    {
+        link = g_new0(PCatNetlinkMonitorLink, 1);
+        link->addresses = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, NULL);
+        g_hash_table_insert(monitor->link_table, GINT_TO_POINTER(index),
+            link);
+    }
+
+    return link;
+}
+
+static gboolean pcat_netlink_monitor_link_process(
+    PCatNetlinkMonitor *monitor, const struct nlmsghdr *nlh)
+{
+    const struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+    const struct rtattr *rta;
+    PCatNetlinkMonitorLink *link;
+    const gchar *name = NULL;
+    gsize name_len = 0;
+    gboolean changed = FALSE;
+    gint len;
+
+    if(nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+    {
+        return FALSE;
+    }
+
+    if(nlh->nlmsg_type==RTM_DELLINK)
+    {
+        return g_hash_table_remove(monitor->link_table,
+            GINT_TO_POINTER(ifi->ifi_index));
+    }
+
+    len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+    for(rta=IFLA_RTA(ifi);RTA_OK(rta, len);rta=RTA_NEXT(rta, len))
+    {
+        if(rta->rta_type==IFLA_IFNAME && RTA_PAYLOAD(rta) > 0)
+        {
+            name = RTA_DATA(rta);
+            name_len = strnlen(name, RTA_PAYLOAD(rta));
+        }
+    }
+
+    link = pcat_netlink_monitor_link_get(monitor, ifi->ifi_index, TRUE);
+    if(name!=NULL && (strlen(link->name)!=name_len ||
+       strncmp(link->name, name, name_len)!=0))
+    {
+        g_strlcpy(link->name, name, MIN(sizeof(link->name), name_len + 1));
+        changed = TRUE;
+    }
+
+    /*
+     * Wireless drivers send link messages for all sorts of events, only
+     * the state flags are interesting.
+     */
+    if((link->flags & PCAT_NETLINK_MONITOR_LINK_FLAGS_MASK)!=
+        (ifi->ifi_flags & PCAT_NETLINK_MONITOR_LINK_FLAGS_MASK))
+    {
+        changed = TRUE;
+    }
+    link->flags = ifi->ifi_flags;
+
+    return changed;
+}
+
+static gboolean pcat_netlink_monitor_address_process(
+    PCatNetlinkMonitor *monitor, const struct nlmsghdr *nlh)
+{
+    const struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+    const struct rtattr *rta;
+    const void *address = NULL, *local = NULL;
+    PCatNetlinkMonitorLink *link;
+    gchar address_str[INET6_ADDRSTRLEN];
+    gchar *key;
+    guint32 flags;
+    gboolean usable, changed = FALSE;
+    guint family_index;
+    gint len;
+
+    if(nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)) ||
+       (ifa->ifa_family!=AF_INET && ifa->ifa_family!=AF_INET6))
+    {
+        return FALSE;
+    }
+
+    flags = ifa->ifa_flags;
+    len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifa));
+    for(rta=IFA_RTA(ifa);RTA_OK(rta, len);rta=RTA_NEXT(rta, len))
+    {
+        switch(rta->rta_type)
+        {
+            case IFA_ADDRESS:
+            {
+                address = RTA_DATA(rta);
+                break;
+            }
+            case IFA_LOCAL:
+            {
+                local = RTA_DATA(rta);
+                break;
+            }
+            case IFA_FLAGS:
+            {
+                if(RTA_PAYLOAD(rta) >= sizeof(guint32))
+                {
+                    memcpy(&flags, RTA_DATA(rta), sizeof(guint32));
+                }
+                break;
+            }
+            default:
+            {
+                break;
+            }
+        }
+    }
+
+    /* On point to point links IFA_ADDRESS is the peer. */
+    if(ifa->ifa_family==AF_INET && local!=NULL)
+    {
+        address = local;
+    }
+    if(address==NULL || inet_ntop(ifa->ifa_family, address, address_str,
+        sizeof(address_str))==NULL)
+    {
+        return FALSE;
+    }
+
+    /* Same rules as netifd uses for the address lists in ubus. */
+    if(ifa->ifa_family==AF_INET6)
+    {
+        usable = (ifa->ifa_scope==RT_SCOPE_UNIVERSE &&
+            !(flags & IFA_F_DADFAILED));
+        family_index = 1;
+    }
+    else
+    {
+        usable = (ifa->ifa_scope < RT_SCOPE_HOST);
+        family_index = 0;
+    }
+    if(nlh->nlmsg_type==RTM_DELADDR)
+    {
+        usable = FALSE;
+    }
+
+    link = pcat_netlink_monitor_link_get(monitor, ifa->ifa_index, usable);
+    if(link==NULL)
+    {
+        return FALSE;
+    }
+
+    key = g_strdup_printf("%s/%u", address_str, ifa->ifa_prefixlen);
+    if(usable)
+    {
+        if(!g_hash_table_contains(link->addresses, key))
+        {
+            g_hash_table_add(link->addresses, key);
+            link->address_count[family_index]++;
+            key = NULL;
+            changed = TRUE;
+        }
+    }
+    else if(g_hash_table_remove(link->addresses, key))
+    {
+        link->address_count[family_index]--;
+        changed = TRUE;
+    }
+    g_free(key);
+
+    return changed;
+}
+
+/*
+ * Only the default routes of the main table matter, mwan3 reacts to
+ * tracking changes by replacing them. Neighbour discovery, prefix routes
+ * and the per interface tables churn far more often.
+ */
+static gboolean pcat_netlink_monitor_route_process(
+    PCatNetlinkMonitor *monitor, const struct nlmsghdr *nlh)
+{
+    const struct rtmsg *rtm = NLMSG_DATA(nlh);
+    const struct rtattr *rta;
+    guint32 table;
+    gint len;
+
+    if(nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*rtm)) ||
+       (rtm->rtm_family!=AF_INET && rtm->rtm_family!=AF_INET6) ||
+       rtm->rtm_dst_len!=0 || (rtm->rtm_flags & RTM_F_CLONED))
+    {
+        return FALSE;
+    }
+
+    table = rtm->rtm_table;
+    len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*rtm));
+    for(rta=RTM_RTA(rtm);RTA_OK(rta, len);rta=RTA_NEXT(rta, len))
+    {
+        if(rta->rta_type==RTA_TABLE && RTA_PAYLOAD(rta) >= sizeof(guint32))
+        {
+            memcpy(&table, RTA_DATA(rta), sizeof(guint32));
+        }
+    }
+
+    return (table==RT_TABLE_MAIN);
+}
+
+static gboolean pcat_netlink_monitor_message_process(
+    PCatNetlinkMonitor *monitor, const struct nlmsghdr *nlh)
+{
+    switch(nlh->nlmsg_type)
+    {
+        case RTM_NEWLINK:
+        case RTM_DELLINK:
+        {
+            return pcat_netlink_monitor_link_process(monitor, nlh);
+        }
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+        {
+            return pcat_netlink_monitor_address_process(monitor, nlh);
+        }
+        case RTM_NEWROUTE:
+        case RTM_DELROUTE:
+        {
+            return pcat_netlink_monitor_route_process(monitor, nlh);
+        }
+        default:
+        {
+            break;
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * Read and process one datagram, returns 1 if one was processed, 0 if
+ * there was nothing to read and -1 on errors (resync is set if the kernel
+ * dropped messages).
+ */
+static gint pcat_netlink_monitor_read(PCatNetlinkMonitor *monitor,
+    guint32 dump_seq, gboolean *changed, gboolean *done)
+{
+    struct sockaddr_nl addr;
+    socklen_t addr_len = sizeof(addr);
+    const struct nlmsghdr *nlh;
+    gssize rsize;
+    gint len;
+
+    rsize = recvfrom(monitor->fd, monitor->buffer,
+        PCAT_NETLINK_MONITOR_BUFFER_SIZE, 0, (struct sockaddr *)&addr,
+        &addr_len);
+    if(rsize < 0)
+    {
+        if(errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR)
+        {
+            return 0;
+        }
+        if(errno==ENOBUFS)
+        {
+            monitor->resync = TRUE;
+        }
+
+        return -1;
+    }
+    if(addr.nl_pid!=0)
+    {
+        return 1;
+    }
+
+    len = rsize;
+    for(nlh=(const struct nlmsghdr *)monitor->buffer;NLMSG_OK(nlh, len);
+        nlh=NLMSG_NEXT(nlh, len))
+    {
+        if(nlh->nlmsg_type==NLMSG_DONE || nlh->nlmsg_type==NLMSG_ERROR)
+        {
+            if(dump_seq!=0 && nlh->nlmsg_seq==dump_seq)
+            {
+                *done = TRUE;
+            }
+
+            continue;
+        }
+
+        if(pcat_netlink_monitor_message_process(monitor, nlh))
+        {
+            *changed = TRUE;
+        }
+    }
+
+    return 1;
+}
+
+static gboolean pcat_netlink_monitor_dump(PCatNetlinkMonitor *monitor,
+    guint16 type)
+{
+    struct
+    {
+        struct nlmsghdr nlh;
+        struct ifinfomsg ifi;
+    }req;
+    struct sockaddr_nl addr;
+    struct pollfd pfd;
+    gboolean changed = FALSE, done = FALSE;
+    gint64 deadline, timeout;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = sizeof(req);
+    req.nlh.nlmsg_type = type;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nlh.nlmsg_seq = ++monitor->seq;
+    req.ifi.ifi_family = AF_UNSPEC;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    if(sendto(monitor->fd, &req, sizeof(req), 0, (struct sockaddr *)&addr,
+        sizeof(addr)) < 0)
+    {
+        return FALSE;
+    }
+
+    deadline = g_get_monotonic_time() +
+        PCAT_NETLINK_MONITOR_DUMP_TIMEOUT * 1000;
+    pfd.fd = monitor->fd;
+    pfd.events = POLLIN;
+    while(!done)
+    {
+        timeout = (deadline - g_get_monotonic_time()) / 1000;
+        if(timeout <= 0)
+        {
+            return FALSE;
+        }
+        if(poll(&pfd, 1, timeout) <= 0)
+        {
+            continue;
+        }
+
+        if(pcat_netlink_monitor_read(monitor, req.nlh.nlmsg_seq, &changed,
+            &done) < 0)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean pcat_netlink_monitor_resync(PCatNetlinkMonitor *monitor)
+{
+    guint i;
+
+    for(i=0;i<3;i++)
+    {
+        monitor->resync = FALSE;
+        g_hash_table_remove_all(monitor->link_table);
+
+        if(pcat_netlink_monitor_dump(monitor, RTM_GETLINK) &&
+           pcat_netlink_monitor_dump(monitor, RTM_GETADDR))
+        {
+            return TRUE;
+        }
+        if(!monitor->resync)
+        {
+            break;
+        }
+    }
+
+    g_warning("Failed to dump network links and addresses!");
+
+    return FALSE;
+}
+
+PCatNetlinkMonitor *pcat_netlink_monitor_new()
+{
+    PCatNetlinkMonitor *monitor;
+    struct sockaddr_nl addr;
+    gint fd, buffer_size = PCAT_NETLINK_MONITOR_SOCKET_BUFFER_SIZE;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+        NETLINK_ROUTE);
+    if(fd < 0)
+    {
+        g_warning("Failed to open rtnetlink socket: %s", strerror(errno));
+
+        return NULL;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size,
+        sizeof(buffer_size));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+        RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        g_warning("Failed to bind rtnetlink socket: %s", strerror(errno));
+        close(fd);
+
+        return NULL;
+    }
+
+    monitor = g_new0(PCatNetlinkMonitor, 1);
+    monitor->fd = fd;
+    monitor->link_table = g_hash_table_new_full(g_direct_hash,
+        g_direct_equal, NULL, (GDestroyNotify)pcat_netlink_monitor_link_free);
+    monitor->buffer = g_malloc(PCAT_NETLINK_MONITOR_BUFFER_SIZE);
+
+    pcat_netlink_monitor_resync(monitor);
+
+    return monitor;
+}
+
+void pcat_netlink_monitor_free(PCatNetlinkMonitor *monitor)
+{
+    if(monitor==NULL)
+    {
+        return;
+    }
+
+    close(monitor->fd);
+    g_hash_table_unref(monitor->link_table);
+    g_free(monitor->buffer);
+    g_free(monitor);
+}
+
+gint pcat_netlink_monitor_fd_get(PCatNetlinkMonitor *monitor)
+{
+    return monitor->fd;
+}
+
+/*
+ * Process all queued notifications without blocking, returns TRUE if a
+ * link, address or route changed.
+ */
+gboolean pcat_netlink_monitor_dispatch(PCatNetlinkMonitor *monitor)
+{
+    gboolean changed = FALSE, done = FALSE;
+    gint ret;
+
+    while((ret=pcat_netlink_monitor_read(monitor, 0, &changed, &done)) > 0);
+
+    if(ret < 0 && monitor->resync)
+    {
+        pcat_netlink_monitor_resync(monitor);
+        changed = TRUE;
+    }
+
+    return changed;
+}
+
+/*
+ * Check if the link is up and has a global address of the given family
+ * (AF_INET or AF_INET6).
+ */
+gboolean pcat_netlink_monitor_address_check(PCatNetlinkMonitor *monitor,
+    const gchar *ifname, gint family)
+{
+    GHashTableIter iter;
+    PCatNetlinkMonitorLink *link;
+
+    if(ifname==NULL)
+    {
+        return FALSE;
+    }
+
+    g_hash_table_iter_init(&iter, monitor->link_table);
+    while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&link))
+    {
+        if(g_strcmp0(link->name, ifname)!=0)
+        {
+            continue;
+        }
+
+        return ((link->flags & IFF_UP) &&
+            link->address_count[family==AF_INET6 ? 1 : 0] > 0);
+    }
+
+    return FALSE;
+}
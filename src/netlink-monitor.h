@@ -0,0 +1,19 @@
+#ifndef HAVE_PCAT_NETLINK_MONITOR_H
+#define HAVE_PCAT_NETLINK_MONITOR_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _PCatNetlinkMonitor PCatNetlinkMonitor;
+
+PCatNetlinkMonitor *pcat_netlink_monitor_new();
+void pcat_netlink_monitor_free(PCatNetlinkMonitor *monitor);
+gint pcat_netlink_monitor_fd_get(PCatNetlinkMonitor *monitor);
+gboolean pcat_netlink_monitor_dispatch(PCatNetlinkMonitor *monitor);
+gboolean pcat_netlink_monitor_address_check(PCatNetlinkMonitor *monitor,
+    const gchar *ifname, gint family);
+
+G_END_DECLS
+
+#endif
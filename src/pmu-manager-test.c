@@ -0,0 +1,1809 @@
+#include "pmu-manager.c"
+
+#include <stdlib.h>
+#include <math.h>
+#include <poll.h>
+
+/*
+ * White-box tests of the PMU serial link. The real serial port code is
+ * driven through a PTY, the test plays the PMU on the master side.
+ *
+ * parser <corpus-dir>: replays every *.hex file of the corpus at several
+ * ring buffer offsets and chunk sizes, then feeds a seeded random stream
+ * of valid frames, corrupted frames and line noise.
+ *
+ * command-pool: sends acknowledged and unacknowledged commands in rounds
+ * and in a burst which overflows the queue, checks that none of it falls
+ * back to the heap once the command pool is set up.
+ *
+ * serial-baud: the speed negotiation is only tried with listed firmware,
+ * and a request which is never answered does not stay pending.
+ *
+ * shutdown-request: the host shutdown request is only sent while the
+ * manager is initialized and the serial port is open.
+ *
+ * soc-lut: the millivolt SoC lookup tables give exactly the percentages
+ * of the interpolation they replaced, for every 16 bit voltage.
+ *
+ * estimator <trace-dir>: replays the charge and discharge traces through
+ * the battery estimator until the learned rates match the traces, saves
+ * and reloads the calibration, then checks that the 5G load trace does
+ * not make the estimate jump and teaches a measurement offset.
+ *
+ * telemetry: fills the telemetry tiers with a second counter until every
+ * ring wrapped, checks the minute and hour rollups, the inclusive bounds
+ * of the range query and that a clock step back clears the history.
+ */
+
+#define PCAT_PMU_MANAGER_TEST_POLL_TIMEOUT 2000
+#define PCAT_PMU_MANAGER_TEST_CHUNK_MAX 4096
+#define PCAT_PMU_MANAGER_TEST_FUZZ_SEED 1
+#define PCAT_PMU_MANAGER_TEST_FUZZ_SIZE (4 * 1024 * 1024)
+#define PCAT_PMU_MANAGER_TEST_FRAME_DST 0x2
+#define PCAT_PMU_MANAGER_TEST_POOL_ROUNDS 2000
+#define PCAT_PMU_MANAGER_TEST_POOL_BURST 200
+#define PCAT_PMU_MANAGER_TEST_IDLE_TIMEOUT 10000000L
+#define PCAT_PMU_MANAGER_TEST_TRACE_GAP 30000000L
+#define PCAT_PMU_MANAGER_TEST_TRACE_CYCLES 6
+#define PCAT_PMU_MANAGER_TEST_RATE_TOLERANCE 0.1
+#define PCAT_PMU_MANAGER_TEST_SOC_STEP_MAX 1.0
+#define PCAT_PMU_MANAGER_TEST_TELEMETRY_START 1599998400L
+#define PCAT_PMU_MANAGER_TEST_TELEMETRY_HOURS 730
+
+typedef struct _PCatPMUManagerTestTraceSample
+{
+    guint seconds;
+    guint battery_voltage;
+    guint charger_voltage;
+    guint modem_5g;
+}PCatPMUManagerTestTraceSample;
+
+static PCatManagerMainConfigData g_pcat_pmu_manager_test_config = {0};
+static PCatManagerUserConfigData g_pcat_pmu_manager_test_user_config = {0};
+static int g_pcat_pmu_manager_test_master_fd = -1;
+static guint64 g_pcat_pmu_manager_test_master_rx_bytes = 0;
+
+static const gsize g_pcat_pmu_manager_test_ring_offsets[] =
+{
+    0,
+    PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE - 1,
+    PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE - 5,
+    PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE - 13
+};
+
+static const gsize g_pcat_pmu_manager_test_chunk_sizes[] =
+{
+    1,
+    7,
+    PCAT_PMU_MANAGER_TEST_CHUNK_MAX
+};
+
+PCatManagerMainConfigData *pcat_main_config_data_get()
+{
+    return &g_pcat_pmu_manager_test_config;
+}
+
+PCatManagerUserConfigData *pcat_main_user_config_data_get()
+{
+    return &g_pcat_pmu_manager_test_user_config;
+}
+
+void pcat_main_request_shutdown(gboolean send_pmu_request)
+{
+    (void)send_pmu_request;
+}
+
+PCatModemManagerDeviceType pcat_modem_manager_device_type_get()
+{
+    return PCAT_MODEM_MANAGER_DEVICE_GENERAL;
+}
+
+static void pcat_pmu_manager_test_log_handler(const gchar *log_domain,
+    GLogLevelFlags log_level, const gchar *message, gpointer user_data)
+{
+    /* Checksum warnings are expected by the thousand. */
+    if(log_level & (G_LOG_LEVEL_WARNING | G_LOG_LEVEL_MESSAGE |
+        G_LOG_LEVEL_INFO | G_LOG_LEVEL_DEBUG))
+    {
+        return;
+    }
+
+    g_log_default_handler(log_domain, log_level, message, user_data);
+}
+
+static gboolean pcat_pmu_manager_test_open()
+{
+    int fd;
+    const gchar *slave_name;
+
+    fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Failed to open PTY master: %s\n", strerror(errno));
+
+        return FALSE;
+    }
+
+    if(grantpt(fd)!=0 || unlockpt(fd)!=0 || (slave_name=ptsname(fd))==NULL)
+    {
+        fprintf(stderr, "Failed to unlock PTY slave: %s\n",
+            strerror(errno));
+        close(fd);
+
+        return FALSE;
+    }
+
+    g_pcat_pmu_manager_test_master_fd = fd;
+    g_pcat_pmu_manager_test_config.pm_serial_device = g_strdup(slave_name);
+    g_pcat_pmu_manager_test_config.pm_serial_baud = PCAT_SERIAL_BAUD_DEFAULT;
+
+    if(!pcat_pmu_serial_open(&g_pcat_pmu_manager_data))
+    {
+        fprintf(stderr, "Failed to open PMU serial port %s!\n", slave_name);
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void pcat_pmu_manager_test_close()
+{
+    pcat_pmu_serial_close(&g_pcat_pmu_manager_data);
+
+    if(g_pcat_pmu_manager_test_master_fd >= 0)
+    {
+        close(g_pcat_pmu_manager_test_master_fd);
+        g_pcat_pmu_manager_test_master_fd = -1;
+    }
+
+    g_free(g_pcat_pmu_manager_test_config.pm_serial_device);
+    g_pcat_pmu_manager_test_config.pm_serial_device = NULL;
+}
+
+/*
+ * Run the serial read watch until everything written so far has been
+ * received, a PTY hands data to the slave side asynchronously.
+ */
+static gboolean pcat_pmu_manager_test_receive(guint64 rx_bytes)
+{
+    PCatPMUManagerData *pmu_data = &g_pcat_pmu_manager_data;
+    struct pollfd pfd;
+
+    pfd.fd = pmu_data->serial_fd;
+    pfd.events = POLLIN;
+
+    while(pmu_data->link_stats.rx_bytes < rx_bytes)
+    {
+        if(poll(&pfd, 1, PCAT_PMU_MANAGER_TEST_POLL_TIMEOUT) <= 0)
+        {
+            fprintf(stderr, "Timed out waiting for PTY data!\n");
+
+            return FALSE;
+        }
+
+        pcat_pmu_serial_read_watch_func(NULL, G_IO_IN, pmu_data);
+    }
+
+    return TRUE;
+}
+
+/*
+ * Write data to the PTY master in chunks of at most chunk_max bytes, or of
+ * random size up to chunk_max if rand is set, receiving after each one.
+ */
+static gboolean pcat_pmu_manager_test_feed(const guint8 *data, gsize len,
+    gsize chunk_max, GRand *rand)
+{
+    PCatPMUManagerData *pmu_data = &g_pcat_pmu_manager_data;
+    guint64 rx_bytes;
+    gssize wsize;
+    gsize size;
+
+    rx_bytes = pmu_data->link_stats.rx_bytes;
+
+    while(len > 0)
+    {
+        size = chunk_max;
+        if(rand!=NULL)
+        {
+            size = g_rand_int_range(rand, 1, chunk_max + 1);
+        }
+        if(size > len)
+        {
+            size = len;
+        }
+
+        wsize = write(g_pcat_pmu_manager_test_master_fd, data, size);
+        if(wsize < 0)
+        {
+            if(errno!=EAGAIN && errno!=EINTR)
+            {
+                fprintf(stderr, "Failed to write PTY master: %s\n",
+                    strerror(errno));
+
+                return FALSE;
+            }
+
+            wsize = 0;
+        }
+
+        data += wsize;
+        len -= wsize;
+        rx_bytes += wsize;
+
+        if(!pcat_pmu_manager_test_receive(rx_bytes))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void pcat_pmu_manager_test_parser_reset(gsize ring_offset)
+{
+    PCatPMUManagerData *pmu_data = &g_pcat_pmu_manager_data;
+
+    pmu_data->serial_read_head = ring_offset;
+    pmu_data->serial_read_tail = ring_offset;
+    pmu_data->serial_read_parse_state = PCAT_PMU_MANAGER_SERIAL_PARSE_SYNC;
+}
+
+static gsize pcat_pmu_manager_test_frame_build(guint8 *p, guint8 dst,
+    guint16 command, guint16 frame_num, const guint8 *extra_data,
+    guint16 extra_data_len, gboolean corrupt)
+{
+    guint16 len = extra_data_len + 3;
+    guint16 crc;
+
+    p[0] = 0xA5;
+    p[1] = 0x1;
+    p[2] = dst;
+    p[3] = frame_num & 0xFF;
+    p[4] = (frame_num >> 8) & 0xFF;
+    p[5] = len & 0xFF;
+    p[6] = (len >> 8) & 0xFF;
+    p[7] = command & 0xFF;
+    p[8] = (command >> 8) & 0xFF;
+    if(extra_data_len > 0)
+    {
+        memcpy(p + 9, extra_data, extra_data_len);
+    }
+    p[9 + extra_data_len] = 0;
+
+    crc = pcat_crc16_compute(p + 1, 6 + len);
+    if(corrupt)
+    {
+        crc ^= 0x1;
+    }
+    p[7 + len] = crc & 0xFF;
+    p[8 + len] = (crc >> 8) & 0xFF;
+    p[9 + len] = 0x5A;
+
+    return (gsize)len + 10;
+}
+
+/*
+ * A corpus file holds an "expect frames=N errors=M" line and the stream
+ * as hex bytes, lines starting with '#' are comments.
+ */
+static GByteArray *pcat_pmu_manager_test_corpus_load(const gchar *path,
+    guint *expect_frames, guint *expect_errors)
+{
+    gchar *contents = NULL;
+    gchar **lines, **tokens;
+    GByteArray *stream;
+    GError *error = NULL;
+    gboolean expect_found = FALSE;
+    gchar *endptr;
+    gulong value;
+    guint i, j;
+    guint8 byte;
+
+    if(!g_file_get_contents(path, &contents, NULL, &error))
+    {
+        fprintf(stderr, "Failed to read corpus file %s: %s\n", path,
+            error!=NULL ? error->message : "unknown error");
+        g_clear_error(&error);
+
+        return NULL;
+    }
+
+    stream = g_byte_array_new();
+    lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+
+    for(i=0;lines[i]!=NULL;i++)
+    {
+        g_strstrip(lines[i]);
+
+        if(lines[i][0]=='\0' || lines[i][0]=='#')
+        {
+            continue;
+        }
+
+        if(g_str_has_prefix(lines[i], "expect "))
+        {
+            if(sscanf(lines[i], "expect frames=%u errors=%u",
+                expect_frames, expect_errors)==2)
+            {
+                expect_found = TRUE;
+            }
+
+            continue;
+        }
+
+        tokens = g_strsplit_set(lines[i], " \t", -1);
+        for(j=0;tokens[j]!=NULL;j++)
+        {
+            if(tokens[j][0]=='\0')
+            {
+                continue;
+            }
+
+            value = strtoul(tokens[j], &endptr, 16);
+            if(*endptr!='\0' || value > 0xFF)
+            {
+                fprintf(stderr, "Invalid byte %s in corpus file %s!\n",
+                    tokens[j], path);
+                g_strfreev(tokens);
+                g_strfreev(lines);
+                g_byte_array_unref(stream);
+
+                return NULL;
+            }
+
+            byte = value;
+            g_byte_array_append(stream, &byte, 1);
+        }
+        g_strfreev(tokens);
+    }
+    g_strfreev(lines);
+
+    if(!expect_found)
+    {
+        fprintf(stderr, "Corpus file %s has no expect line!\n", path);
+        g_byte_array_unref(stream);
+
+        return NULL;
+    }
+
+    return stream;
+}
+
+static gint pcat_pmu_manager_test_name_compare(gconstpointer a,
+    gconstpointer b)
+{
+    return g_strcmp0(*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+static int pcat_pmu_manager_test_parser_corpus(const gchar *corpus_dir)
+{
+    PCatPMUManagerData *pmu_data = &g_pcat_pmu_manager_data;
+    GDir *dir;
+    GError *error = NULL;
+    const gchar *name;
+    GPtrArray *names;
+    GByteArray *stream;
+    gchar *path;
+    guint expect_frames = 0, expect_errors = 0;
+    guint64 rx_frames, rx_errors;
+    guint i, j, k;
+    int failures = 0;
+
+    dir = g_dir_open(corpus_dir, 0, &error);
+    if(dir==NULL)
+    {
+        fprintf(stderr, "Failed to open corpus directory %s: %s\n",
+            corpus_dir, error->message);
+        g_clear_error(&error);
+
+        return 1;
+    }
+
+    names = g_ptr_array_new_with_free_func(g_free);
+    while((name=g_dir_read_name(dir))!=NULL)
+    {
+        if(g_str_has_suffix(name, ".hex"))
+        {
+            g_ptr_array_add(names, g_strdup(name));
+        }
+    }
+    g_dir_close(dir);
+    g_ptr_array_sort(names, pcat_pmu_manager_test_name_compare);
+
+    if(names->len==0)
+    {
+        fprintf(stderr, "Corpus directory %s is empty!\n", corpus_dir);
+        failures++;
+    }
+
+    for(i=0;i<names->len;i++)
+    {
+        path = g_build_filename(corpus_dir, names->pdata[i], NULL);
+        stream = pcat_pmu_manager_test_corpus_load(path, &expect_frames,
+            &expect_errors);
+        g_free(path);
+
+        if(stream==NULL)
+        {
+            failures++;
+
+            continue;
+        }
+
+        for(j=0;j<G_N_ELEMENTS(g_pcat_pmu_manager_test_ring_offsets);j++)
+        {
+            for(k=0;k<G_N_ELEMENTS(g_pcat_pmu_manager_test_chunk_sizes);k++)
+            {
+                pcat_pmu_manager_test_parser_reset(
+                    g_pcat_pmu_manager_test_ring_offsets[j]);
+                rx_frames = pmu_data->link_stats.rx_frames;
+                rx_errors = pmu_data->link_stats.rx_errors;
+
+                if(!pcat_pmu_manager_test_feed(stream->data, stream->len,
+                    g_pcat_pmu_manager_test_chunk_sizes[k], NULL))
+                {
+                    g_byte_array_unref(stream);
+                    g_ptr_array_unref(names);
+
+                    return failures + 1;
+                }
+
+                rx_frames = pmu_data->link_stats.rx_frames - rx_frames;
+                rx_errors = pmu_data->link_stats.rx_errors - rx_errors;
+
+                if(rx_frames!=expect_frames || rx_errors!=expect_errors)
+                {
+                    fprintf(stderr, "%s at ring offset %zu in %zu byte "
+                        "chunks: got %" G_GUINT64_FORMAT " frame(s) and %"
+                        G_GUINT64_FORMAT " error(s), expected %u and %u!\n",
+                        (const gchar *)names->pdata[i],
+                        g_pcat_pmu_manager_test_ring_offsets[j],
+                        g_pcat_pmu_manager_test_chunk_sizes[k], rx_frames,
+                        rx_errors, expect_frames, expect_errors);
+                    failures++;
+                }
+            }
+        }
+
+        g_byte_array_unref(stream);
+    }
+
+    printf("Replayed %u corpus file(s).\n", names->len);
+    g_ptr_array_unref(names);
+
+    return failures;
+}
+
+static int pcat_pmu_manager_test_parser_fuzz()
+{
+    PCatPMUManagerData *pmu_data = &g_pcat_pmu_manager_data;
+    GRand *rand;
+    guint8 *stream, *extra_data;
+    gsize len = 0, i, size;
+    guint64 valid_frames = 0, corrupt_frames = 0;
+    guint64 rx_frames, rx_errors;
+    guint kind;
+    guint8 byte;
+    int failures = 0;
+
+    rand = g_rand_new_with_seed(PCAT_PMU_MANAGER_TEST_FUZZ_SEED);
+    stream = g_malloc(PCAT_PMU_MANAGER_TEST_FUZZ_SIZE +
+        PCAT_PMU_MANAGER_SERIAL_FRAME_MAX);
+    extra_data = g_malloc(PCAT_PMU_MANAGER_SERIAL_FRAME_MAX);
+    for(i=0;i<PCAT_PMU_MANAGER_SERIAL_FRAME_MAX;i++)
+    {
+        extra_data[i] = g_rand_int(rand);
+    }
+
+    while(len < PCAT_PMU_MANAGER_TEST_FUZZ_SIZE)
+    {
+        kind = g_rand_int_range(rand, 0, 100);
+        if(kind < 10)
+        {
+            /* Line noise, without sync bytes so it cannot resync. */
+            size = g_rand_int_range(rand, 1, 50);
+            for(i=0;i<size;i++)
+            {
+                byte = g_rand_int(rand);
+                stream[len++] = (byte==0xA5) ? 0 : byte;
+            }
+        }
+        else if(kind < 20)
+        {
+            len += pcat_pmu_manager_test_frame_build(stream + len,
+                PCAT_PMU_MANAGER_TEST_FRAME_DST, g_rand_int(rand),
+                g_rand_int(rand), extra_data + g_rand_int_range(rand, 0, 256),
+                g_rand_int_range(rand, 0, 3000), TRUE);
+            corrupt_frames++;
+        }
+        else if(kind < 21)
+        {
+            /* Up to the largest frame the length field allows. */
+            len += pcat_pmu_manager_test_frame_build(stream + len,
+                PCAT_PMU_MANAGER_TEST_FRAME_DST, g_rand_int(rand),
+                g_rand_int(rand), extra_data,
+                g_rand_int_range(rand, 0, 65529 + 1), FALSE);
+            valid_frames++;
+        }
+        else
+        {
+            len += pcat_pmu_manager_test_frame_build(stream + len,
+                PCAT_PMU_MANAGER_TEST_FRAME_DST, g_rand_int(rand),
+                g_rand_int(rand), extra_data + g_rand_int_range(rand, 0, 256),
+                g_rand_int_range(rand, 0, 40), FALSE);
+            valid_frames++;
+        }
+    }
+
+    pcat_pmu_manager_test_parser_reset(0);
+    rx_frames = pmu_data->link_stats.rx_frames;
+    rx_errors = pmu_data->link_stats.rx_errors;
+
+    if(!pcat_pmu_manager_test_feed(stream, len,
+        PCAT_PMU_MANAGER_TEST_CHUNK_MAX, rand))
+    {
+        failures++;
+    }
+    else
+    {
+        rx_frames = pmu_data->link_stats.rx_frames - rx_frames;
+        rx_errors = pmu_data->link_stats.rx_errors - rx_errors;
+
+        if(rx_frames!=valid_frames || rx_errors!=corrupt_frames)
+        {
+            fprintf(stderr, "Random stream: got %" G_GUINT64_FORMAT
+                " frame(s) and %" G_GUINT64_FORMAT " error(s), expected %"
+                G_GUINT64_FORMAT " and %" G_GUINT64_FORMAT "!\n", rx_frames,
+                rx_errors, valid_frames, corrupt_frames);
+            failures++;
+        }
+
+        if(pmu_data->serial_read_parse_state!=
+            PCAT_PMU_MANAGER_SERIAL_PARSE_SYNC ||
+            pmu_data->serial_read_tail!=pmu_data->serial_read_head)
+        {
+            fprintf(stderr, "Random stream: parser not idle at the end!\n");
+            failures++;
+        }
+
+        printf("Parsed %" G_GUINT64_FORMAT " frame(s) and %"
+            G_GUINT64_FORMAT " corrupted frame(s) in %zu bytes.\n",
+            valid_frames, corrupt_frames, len);
+    }
+
+    g_free(extra_data);
+    g_free(stream);
+    g_rand_free(rand);
+
+    return failures;
+}
+
+static gboolean pcat_pmu_manager_test_write_idle()
+{
+    PCatPMUManagerData *pmu_data = &g_pcat_pmu_manager_data;
+
+    return (pmu_data->serial_write_current_command_data==NULL &&
+        pcat_pmu_manager_command_queue_is_empty(pmu_data) &&
+        g_queue_is_empty(&pmu_data->serial_write_inflight_queue));
+}
+
+/*
+ * The test is not the I/O thread, so commands it submits are only queued
+ * until the flush scheduled on the (default) I/O context has run.
+ */
+static void pcat_pmu_manager_test_flush()
+{
+    while(g_pcat_pmu_manager_data.serial_write_flush_source!=0)
+    {
+        if(!g_main_context_iteration(NULL, FALSE))
+        {
+            break;
+        }
+    }
+}
+
+/*
+ * Read everything the manager has written so far from the PTY master and
+ * reply with an ACK to every frame which asks for one, except for frames
+ * of ignore_command which are only counted. Incomplete frames are kept in
+ * pending. Return the number of frames read, or -1 on error.
+ */
+static gint pcat_pmu_manager_test_acknowledge(GByteArray *pending,
+    guint16 ignore_command, guint *ignored)
+{
+    PCatPMUManagerData *pmu_data = &g_pcat_pmu_manager_data;
+    struct pollfd pfd;
+    guint8 buffer[4096];
+    guint8 ack[16];
+    GByteArray *acks;
+    gssize rsize;
+    gsize frame_len;
+    guint16 dp_size, command, frame_num;
+    gint count = 0;
+
+    pcat_pmu_manager_test_flush();
+
+    pfd.fd = g_pcat_pmu_manager_test_master_fd;
+    pfd.events = POLLIN;
+
+    while(g_pcat_pmu_manager_test_master_rx_bytes <
+        pmu_data->link_stats.tx_bytes)
+    {
+        if(poll(&pfd, 1, PCAT_PMU_MANAGER_TEST_POLL_TIMEOUT) <= 0)
+        {
+            fprintf(stderr, "Timed out waiting for manager frames!\n");
+
+            return -1;
+        }
+
+        rsize = read(g_pcat_pmu_manager_test_master_fd, buffer,
+            sizeof(buffer));
+        if(rsize > 0)
+        {
+            g_byte_array_append(pending, buffer, rsize);
+            g_pcat_pmu_manager_test_master_rx_bytes += rsize;
+        }
+    }
+
+    acks = g_byte_array_new();
+
+    while(pending->len >= 7)
+    {
+        if(pending->data[0]!=0xA5)
+        {
+            fprintf(stderr, "Manager wrote a frame without sync byte!\n");
+            g_byte_array_unref(acks);
+
+            return -1;
+        }
+
+        dp_size = pending->data[5] + ((guint16)pending->data[6] << 8);
+        frame_len = (gsize)dp_size + 10;
+        if(pending->len < frame_len)
+        {
+            break;
+        }
+
+        frame_num = pending->data[3] + ((guint16)pending->data[4] << 8);
+        command = pending->data[7] + ((guint16)pending->data[8] << 8);
+        if(ignore_command!=0 && command==ignore_command)
+        {
+            if(ignored!=NULL)
+            {
+                (*ignored)++;
+            }
+        }
+        else if(pending->data[6 + dp_size]!=0)
+        {
+            g_byte_array_append(acks, ack,
+                pcat_pmu_manager_test_frame_build(ack,
+                PCAT_PMU_MANAGER_TEST_FRAME_DST, command + 1, frame_num,
+                NULL, 0, FALSE));
+        }
+
+        g_byte_array_remove_range(pending, 0, frame_len);
+        count++;
+    }
+
+    if(acks->len > 0 && !pcat_pmu_manager_test_feed(acks->data, acks->len,
+        PCAT_PMU_MANAGER_TEST_CHUNK_MAX, NULL))
+    {
+        count = -1;
+    }
+    g_byte_array_unref(acks);
+
+    return count;
+}
+
+/*
+ * Acknowledge frames until nothing is queued or in flight any more, the
+ * default main context runs the write watch and retransmit timer.
+ */
+static gboolean pcat_pmu_manager_test_drain(GByteArray *pending)
+{
+    gint64 deadline;
+    gint count;
+
+    deadline = g_get_monotonic_time() + PCAT_PMU_MANAGER_TEST_IDLE_TIMEOUT;
+
+    while(1)
+    {
+        count = pcat_pmu_manager_test_acknowledge(pending, 0, NULL);
+        if(count < 0)
+        {
+            return FALSE;
+        }
+
+        if(pcat_pmu_manager_test_write_idle())
+        {
+            return TRUE;
+        }
+
+        if(g_get_monotonic_time() > deadline)
+        {
+            fprintf(stderr, "Timed out waiting for the command queue to "
+                "drain!\n");
+
+            return FALSE;
+        }
+
+        if(count==0 && !g_main_context_iteration(NULL, FALSE))
+        {
+            g_usleep(1000);
+        }
+    }
+}
+
+static int pcat_pmu_manager_test_command_pool()
+{
+    PCatPMUManagerData *pmu_data = &g_pcat_pmu_manager_data;
+    GByteArray *pending;
+    GRand *rand;
+    guint8 extra_data[PCAT_PMU_MANAGER_COMMAND_INLINE_BUFFER_SIZE];
+    guint64 allocations, dropped;
+    guint16 frame_num;
+    guint round, count, i;
+    int failures = 0;
+
+    rand = g_rand_new_with_seed(PCAT_PMU_MANAGER_TEST_FUZZ_SEED);
+    pending = g_byte_array_new();
+    for(i=0;i<sizeof(extra_data);i++)
+    {
+        extra_data[i] = g_rand_int(rand);
+    }
+
+    allocations = pmu_data->link_stats.allocations;
+
+    /* Steady state, up to a full window of commands plus a reply. */
+    for(round=0;round<PCAT_PMU_MANAGER_TEST_POOL_ROUNDS;round++)
+    {
+        count = g_rand_int_range(rand, 1, pmu_data->serial_write_window + 1);
+        for(i=0;i<count;i++)
+        {
+            pcat_pmu_serial_write_data_request(pmu_data,
+                PCAT_PMU_MANAGER_COMMAND_SCHEDULE_STARTUP_TIME_SET, FALSE, 0,
+                extra_data, g_rand_int_range(rand, 0,
+                PCAT_PMU_MANAGER_COMMAND_INLINE_BUFFER_SIZE - 13 + 1), TRUE);
+        }
+        pcat_pmu_serial_write_data_request(pmu_data,
+            PCAT_PMU_MANAGER_COMMAND_STATUS_REPORT_ACK, TRUE, round, NULL, 0,
+            FALSE);
+
+        if(!pcat_pmu_manager_test_drain(pending))
+        {
+            failures++;
+            break;
+        }
+    }
+
+    if(pmu_data->link_stats.allocations!=allocations)
+    {
+        fprintf(stderr, "Steady state: %" G_GUINT64_FORMAT " command "
+            "allocation(s) outside the pool!\n",
+            pmu_data->link_stats.allocations - allocations);
+        failures++;
+    }
+
+    /* A burst which overflows the queue drops commands, back to the pool. */
+    dropped = pmu_data->serial_write_command_dropped[
+        PCAT_PMU_MANAGER_COMMAND_PRIORITY_CONFIG];
+    frame_num = pmu_data->serial_write_frame_num;
+    for(i=0;i<PCAT_PMU_MANAGER_TEST_POOL_BURST;i++)
+    {
+        pcat_pmu_serial_write_data_request(pmu_data,
+            PCAT_PMU_MANAGER_COMMAND_SCHEDULE_STARTUP_TIME_SET, FALSE, 0,
+            extra_data, 4, TRUE);
+    }
+    dropped = pmu_data->serial_write_command_dropped[
+        PCAT_PMU_MANAGER_COMMAND_PRIORITY_CONFIG] - dropped;
+
+    /* A cosmetic command finds no room and must not use a frame number. */
+    pcat_pmu_manager_net_status_led_setup_internal(pmu_data, 100, 100, 0);
+    if((guint16)(pmu_data->serial_write_frame_num - frame_num)!=
+        PCAT_PMU_MANAGER_TEST_POOL_BURST)
+    {
+        fprintf(stderr, "Burst: %u frame number(s) used by %u accepted "
+            "command(s)!\n", (guint16)(pmu_data->serial_write_frame_num -
+            frame_num), PCAT_PMU_MANAGER_TEST_POOL_BURST);
+        failures++;
+    }
+
+    if(!pcat_pmu_manager_test_drain(pending))
+    {
+        failures++;
+    }
+
+    if(dropped!=PCAT_PMU_MANAGER_TEST_POOL_BURST -
+        PCAT_PMU_MANAGER_COMMAND_QUEUE_MAX - pmu_data->serial_write_window)
+    {
+        fprintf(stderr, "Burst: %" G_GUINT64_FORMAT " command(s) dropped, "
+            "expected %u!\n", dropped, PCAT_PMU_MANAGER_TEST_POOL_BURST -
+            PCAT_PMU_MANAGER_COMMAND_QUEUE_MAX -
+            pmu_data->serial_write_window);
+        failures++;
+    }
+
+    if(pmu_data->link_stats.allocations!=allocations)
+    {
+        fprintf(stderr, "Burst: %" G_GUINT64_FORMAT " command allocation(s) "
+            "outside the pool!\n",
+            pmu_data->link_stats.allocations - allocations);
+        failures++;
+    }
+
+    if(g_queue_get_length(&pmu_data->command_pool_free_queue)!=
+        PCAT_PMU_MANAGER_COMMAND_POOL_SIZE)
+    {
+        fprintf(stderr, "%u of %u pooled command(s) were not returned!\n",
+            PCAT_PMU_MANAGER_COMMAND_POOL_SIZE -
+            g_queue_get_length(&pmu_data->command_pool_free_queue),
+            PCAT_PMU_MANAGER_COMMAND_POOL_SIZE);
+        failures++;
+    }
+
+    /* Only frames larger than the inline buffer need the heap. */
+    pcat_pmu_serial_write_data_request(pmu_data,
+        PCAT_PMU_MANAGER_COMMAND_SCHEDULE_STARTUP_TIME_SET, FALSE, 0,
+        extra_data, sizeof(extra_data), TRUE);
+    if(!pcat_pmu_manager_test_drain(pending))
+    {
+        failures++;
+    }
+    if(pmu_data->link_stats.allocations!=allocations + 1)
+    {
+        fprintf(stderr, "Large frame: %" G_GUINT64_FORMAT " allocation(s), "
+            "expected 1!\n", pmu_data->link_stats.allocations - allocations);
+        failures++;
+    }
+
+    printf("Sent %" G_GUINT64_FORMAT " frame(s) with %" G_GUINT64_FORMAT
+        " retransmit(s) and %" G_GUINT64_FORMAT " allocation(s).\n",
+        pmu_data->link_stats.tx_frames, pmu_data->link_stats.retransmits,
+        pmu_data->link_stats.allocations - allocations);
+
+    g_byte_array_unref(pending);
+    g_rand_free(rand);
+
+    return failures;
+}
+
+/*
+ * Play a firmware version reply, which is what starts the serial speed
+ * negotiation.
+ */
+static gboolean pcat_pmu_manager_test_fw_version_reply()
+{
+    static const gchar fw_version[] = "PCAT-PMU-TEST-1.0";
+    guint8 frame[64];
+
+    return pcat_pmu_manager_test_feed(frame,
+        pcat_pmu_manager_test_frame_build(frame, 0x1,
+        PCAT_PMU_MANAGER_COMMAND_PMU_FW_VERSION_GET_ACK, 0,
+        (const guint8 *)fw_version, strlen(fw_version), FALSE),
+        PCAT_PMU_MANAGER_TEST_CHUNK_MAX, NULL);
+}
+
+static int pcat_pmu_manager_test_serial_baud()
+{
+    PCatPMUManagerData *pmu_data = &g_pcat_pmu_manager_data;
+    gchar *firmware[] = { "PCAT-PMU-TEST-", NULL };
+    GByteArray *pending;
+    guint8 frame[16], status = 0;
+    guint ignored = 0;
+    gint64 deadline;
+    int failures = 0;
+
+    pending = g_byte_array_new();
+    pmu_data->pmu_fw_version_retired = g_ptr_array_new_with_free_func(
+        g_free);
+    g_pcat_pmu_manager_test_config.pm_serial_baud_max = 230400;
+
+    /* Not listed in SerialBaudFirmware, nothing is negotiated. */
+    if(!pcat_pmu_manager_test_fw_version_reply() ||
+       pcat_pmu_manager_test_acknowledge(pending,
+       PCAT_PMU_MANAGER_COMMAND_SERIAL_BAUD_SET, &ignored) < 0)
+    {
+        failures++;
+    }
+    if(ignored!=0 || pmu_data->serial_baud_pending!=0)
+    {
+        fprintf(stderr, "Unlisted firmware: serial speed change sent!\n");
+        failures++;
+    }
+
+    /* Listed, but the PMU never answers: the request must be given up. */
+    g_pcat_pmu_manager_test_config.pm_serial_baud_firmware = firmware;
+    pmu_data->serial_write_rto = PCAT_PMU_MANAGER_COMMAND_RTO_MIN;
+    if(!pcat_pmu_manager_test_fw_version_reply())
+    {
+        failures++;
+    }
+    if(pmu_data->serial_baud_pending!=230400)
+    {
+        fprintf(stderr, "Listed firmware: serial speed change not sent!\n");
+        failures++;
+    }
+
+    deadline = g_get_monotonic_time() + PCAT_PMU_MANAGER_TEST_IDLE_TIMEOUT;
+    while(pmu_data->serial_baud_pending!=0 &&
+        g_get_monotonic_time() < deadline)
+    {
+        if(pcat_pmu_manager_test_acknowledge(pending,
+            PCAT_PMU_MANAGER_COMMAND_SERIAL_BAUD_SET, &ignored) < 0)
+        {
+            failures++;
+            break;
+        }
+        if(!g_main_context_iteration(NULL, FALSE))
+        {
+            g_usleep(1000);
+        }
+    }
+    if(pmu_data->serial_baud_pending!=0 || ignored < 2)
+    {
+        fprintf(stderr, "Lost serial speed change still pending after %u "
+            "frame(s)!\n", ignored);
+        failures++;
+    }
+
+    /* A later attempt which is accepted switches the speed. */
+    if(!pcat_pmu_manager_test_fw_version_reply() ||
+       pcat_pmu_manager_test_acknowledge(pending,
+       PCAT_PMU_MANAGER_COMMAND_SERIAL_BAUD_SET, &ignored) < 0 ||
+       !pcat_pmu_manager_test_feed(frame,
+       pcat_pmu_manager_test_frame_build(frame, 0x1,
+       PCAT_PMU_MANAGER_COMMAND_SERIAL_BAUD_SET_ACK,
+       pmu_data->serial_write_frame_num - 1, &status, 1, FALSE),
+       PCAT_PMU_MANAGER_TEST_CHUNK_MAX, NULL))
+    {
+        failures++;
+    }
+    if(pmu_data->serial_baud!=230400 || pmu_data->serial_baud_pending!=0)
+    {
+        fprintf(stderr, "Accepted serial speed change: speed %u, pending "
+            "%u!\n", pmu_data->serial_baud, pmu_data->serial_baud_pending);
+        failures++;
+    }
+
+    g_pcat_pmu_manager_test_config.pm_serial_baud_firmware = NULL;
+    g_ptr_array_unref(pmu_data->pmu_fw_version_retired);
+    pmu_data->pmu_fw_version_retired = NULL;
+    g_free(pmu_data->pmu_fw_version);
+    pmu_data->pmu_fw_version = NULL;
+    g_byte_array_unref(pending);
+
+    return failures;
+}
+
+static int pcat_pmu_manager_test_shutdown_request()
+{
+    PCatPMUManagerData *pmu_data = &g_pcat_pmu_manager_data;
+    GByteArray *pending;
+    guint ignored = 0;
+    int failures = 0;
+
+    pending = g_byte_array_new();
+
+    /* Before the manager is initialized nothing may be queued. */
+    pcat_pmu_manager_shutdown_request();
+    if(pmu_data->shutdown_request ||
+       !pcat_pmu_manager_test_write_idle())
+    {
+        fprintf(stderr, "Shutdown request accepted before init!\n");
+        failures++;
+    }
+
+    pmu_data->initialized = TRUE;
+
+    pcat_pmu_manager_shutdown_request();
+    if(pcat_pmu_manager_test_acknowledge(pending,
+        PCAT_PMU_MANAGER_COMMAND_HOST_REQUEST_SHUTDOWN, &ignored) < 0 ||
+        ignored!=1 || !pmu_data->shutdown_request)
+    {
+        fprintf(stderr, "Shutdown request not sent!\n");
+        failures++;
+    }
+
+    /* Nor once the serial port is gone. */
+    pcat_pmu_serial_close(pmu_data);
+    pmu_data->shutdown_request = FALSE;
+    pcat_pmu_manager_shutdown_request();
+    if(pmu_data->shutdown_request ||
+       pmu_data->serial_write_command_queue_length!=0)
+    {
+        fprintf(stderr, "Shutdown request accepted without serial "
+            "port!\n");
+        failures++;
+    }
+
+    pmu_data->initialized = FALSE;
+    g_byte_array_unref(pending);
+
+    return failures;
+}
+
+/*
+ * The per-report interpolation the lookup tables replaced, kept here as
+ * the reference they have to match exactly.
+ */
+static guint pcat_pmu_manager_test_soc_reference(const guint *table,
+    guint battery_voltage)
+{
+    gdouble battery_percentage = 100.0f;
+    guint i;
+
+    if(battery_voltage > table[0])
+    {
+        battery_percentage = 100.0f;
+    }
+    else if(battery_voltage > table[10])
+    {
+        battery_percentage = 0.0f;
+        for(i=0;i<10;i++)
+        {
+            if(battery_voltage >= table[i+1])
+            {
+                battery_percentage = (90.0f - 10 * i) +
+                    ((gdouble)battery_voltage - table[i+1]) * 10 /
+                    (table[i] - table[i+1]);
+
+                break;
+            }
+        }
+    }
+    else
+    {
+        battery_percentage = 0.0f;
+    }
+
+    return (guint)(battery_percentage * 100);
+}
+
+static int pcat_pmu_manager_test_soc_lut_compare(const gchar *name,
+    const PCatPMUManagerSoCLUT *lut, const guint *table)
+{
+    guint v, expected, value;
+    int failures = 0;
+
+    for(v=0;v<=G_MAXUINT16;v++)
+    {
+        expected = pcat_pmu_manager_test_soc_reference(table, v);
+        value = pcat_pmu_manager_soc_lut_lookup(lut, v);
+        if(value!=expected)
+        {
+            if(failures < 10)
+            {
+                fprintf(stderr, "%s table at %u mV: %u, expected %u!\n",
+                    name, v, value, expected);
+            }
+            failures++;
+        }
+    }
+
+    return failures;
+}
+
+static int pcat_pmu_manager_test_soc_lut()
+{
+    static const guint custom_tables[][3][11] =
+    {
+        {
+            {4350, 4100, 4000, 3950, 3900, 3850, 3800, 3760, 3720, 3650, 3300},
+            {4190, 4111, 4033, 3977, 3901, 3855, 3802, 3777, 3701, 3655, 3599},
+            {4400, 4399, 4300, 4001, 4000, 3999, 3950, 3851, 3800, 3001, 3000}
+        },
+        {
+            {4180, 4050, 3970, 3910, 3860, 3810, 3780, 3760, 3730, 3670, 3400},
+            {4180, 4050, 3970, 3910, 3860, 3810, 3780, 3760, 3730, 3670, 3550},
+            {4190, 4140, 4090, 4040, 3990, 3940, 3890, 3840, 3790, 3740, 3690}
+        }
+    };
+    PCatPMUManagerData *pmu_data = &g_pcat_pmu_manager_data;
+    guint i;
+    int failures = 0;
+
+    for(i=0;i<=G_N_ELEMENTS(custom_tables);i++)
+    {
+        if(i==0)
+        {
+            memcpy(pmu_data->battery_discharge_table_normal,
+                g_pat_pmu_manager_battery_discharge_table_normal,
+                sizeof(pmu_data->battery_discharge_table_normal));
+            memcpy(pmu_data->battery_discharge_table_5g,
+                g_pat_pmu_manager_battery_discharge_table_5g,
+                sizeof(pmu_data->battery_discharge_table_5g));
+            memcpy(pmu_data->battery_charge_table,
+                g_pat_pmu_manager_battery_charge_table,
+                sizeof(pmu_data->battery_charge_table));
+        }
+        else
+        {
+            memcpy(pmu_data->battery_discharge_table_normal,
+                custom_tables[i-1][0],
+                sizeof(pmu_data->battery_discharge_table_normal));
+            memcpy(pmu_data->battery_discharge_table_5g,
+                custom_tables[i-1][1],
+                sizeof(pmu_data->battery_discharge_table_5g));
+            memcpy(pmu_data->battery_charge_table, custom_tables[i-1][2],
+                sizeof(pmu_data->battery_charge_table));
+        }
+
+        pmu_data->modem_device_type = (i % 2==0) ?
+            PCAT_MODEM_MANAGER_DEVICE_GENERAL : PCAT_MODEM_MANAGER_DEVICE_5G;
+        pcat_pmu_manager_soc_lut_update(pmu_data);
+
+        failures += pcat_pmu_manager_test_soc_lut_compare("Charge",
+            &pmu_data->soc_charge_lut, pmu_data->battery_charge_table);
+        failures += pcat_pmu_manager_test_soc_lut_compare("Discharge",
+            &pmu_data->soc_discharge_normal_lut,
+            pmu_data->battery_discharge_table_normal);
+        failures += pcat_pmu_manager_test_soc_lut_compare("5G discharge",
+            &pmu_data->soc_discharge_5g_lut,
+            pmu_data->battery_discharge_table_5g);
+
+        if(pmu_data->soc_discharge_lut!=(i % 2==0 ?
+            &pmu_data->soc_discharge_normal_lut :
+            &pmu_data->soc_discharge_5g_lut))
+        {
+            fprintf(stderr, "Wrong discharge table for modem type %d!\n",
+                pmu_data->modem_device_type);
+            failures++;
+        }
+    }
+
+    pcat_pmu_manager_soc_lut_clear(&pmu_data->soc_charge_lut);
+    pcat_pmu_manager_soc_lut_clear(&pmu_data->soc_discharge_normal_lut);
+    pcat_pmu_manager_soc_lut_clear(&pmu_data->soc_discharge_5g_lut);
+    pmu_data->soc_discharge_lut = NULL;
+
+    printf("Compared %u table set(s) at every millivolt.\n",
+        (guint)G_N_ELEMENTS(custom_tables) + 1);
+
+    return failures;
+}
+
+/*
+ * A trace file holds one PMU status report per line: the seconds since
+ * the start, the battery and charger voltages in mV and the modem type
+ * (0 general, 1 5G), lines starting with '#' are comments.
+ */
+static GArray *pcat_pmu_manager_test_trace_load(const gchar *trace_dir,
+    const gchar *name)
+{
+    PCatPMUManagerTestTraceSample sample;
+    gchar *path, *contents = NULL;
+    gchar **lines;
+    GArray *trace;
+    GError *error = NULL;
+    guint i;
+
+    path = g_build_filename(trace_dir, name, NULL);
+    if(!g_file_get_contents(path, &contents, NULL, &error))
+    {
+        fprintf(stderr, "Failed to read trace file %s: %s\n", path,
+            error!=NULL ? error->message : "unknown error");
+        g_clear_error(&error);
+        g_free(path);
+
+        return NULL;
+    }
+
+    trace = g_array_new(FALSE, FALSE, sizeof(PCatPMUManagerTestTraceSample));
+    lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+
+    for(i=0;lines[i]!=NULL;i++)
+    {
+        g_strstrip(lines[i]);
+
+        if(lines[i][0]=='\0' || lines[i][0]=='#')
+        {
+            continue;
+        }
+
+        if(sscanf(lines[i], "%u %u %u %u", &sample.seconds,
+            &sample.battery_voltage, &sample.charger_voltage,
+            &sample.modem_5g)!=4 || sample.modem_5g > 1 ||
+            (trace->len > 0 && sample.seconds <= g_array_index(trace,
+            PCatPMUManagerTestTraceSample, trace->len - 1).seconds))
+        {
+            fprintf(stderr, "Invalid line %u in trace file %s!\n", i + 1,
+                path);
+            g_array_unref(trace);
+            trace = NULL;
+
+            break;
+        }
+
+        g_array_append_val(trace, sample);
+    }
+    g_strfreev(lines);
+
+    if(trace!=NULL && trace->len < 2)
+    {
+        fprintf(stderr, "Trace file %s is too short!\n", path);
+        g_array_unref(trace);
+        trace = NULL;
+    }
+    g_free(path);
+
+    return trace;
+}
+
+/*
+ * The voltage based SoC in percent of a status report, picked from the
+ * lookup tables the same way the status report handler does.
+ */
+static gdouble pcat_pmu_manager_test_trace_soc(
+    const PCatPMUManagerTestTraceSample *sample, gboolean *on_battery,
+    PCatBatteryEstimatorLoad *load)
+{
+    PCatPMUManagerData *pmu_data = &g_pcat_pmu_manager_data;
+    guint battery_percentage_i;
+
+    *on_battery = (sample->charger_voltage < 4200);
+    *load = sample->modem_5g ? PCAT_BATTERY_ESTIMATOR_LOAD_HIGH :
+        PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL;
+
+    if(!*on_battery)
+    {
+        battery_percentage_i = pcat_pmu_manager_soc_lut_lookup(
+            &pmu_data->soc_charge_lut, sample->battery_voltage);
+    }
+    else
+    {
+        battery_percentage_i = pcat_pmu_manager_soc_lut_lookup(
+            sample->modem_5g ? &pmu_data->soc_discharge_5g_lut :
+            &pmu_data->soc_discharge_normal_lut, sample->battery_voltage);
+    }
+
+    return battery_percentage_i / 100.0;
+}
+
+/*
+ * The average rate in %/h of a charge or discharge trace, up to the
+ * first full reading on the charger, which ends the segment.
+ */
+static gdouble pcat_pmu_manager_test_trace_rate(const GArray *trace)
+{
+    const PCatPMUManagerTestTraceSample *first, *last = NULL;
+    PCatBatteryEstimatorLoad load;
+    gboolean on_battery;
+    gdouble first_soc, soc = 0.0;
+    guint i;
+
+    first = &g_array_index(trace, PCatPMUManagerTestTraceSample, 0);
+    first_soc = pcat_pmu_manager_test_trace_soc(first, &on_battery, &load);
+
+    for(i=1;i<trace->len;i++)
+    {
+        last = &g_array_index(trace, PCatPMUManagerTestTraceSample, i);
+        soc = pcat_pmu_manager_test_trace_soc(last, &on_battery, &load);
+        if(!on_battery && soc >= 100.0)
+        {
+            break;
+        }
+    }
+
+    return fabs(soc - first_soc) * 3600.0 / (last->seconds - first->seconds);
+}
+
+/*
+ * Feed a trace to the estimator, continuing at *timestamp. Return the
+ * largest step of the estimate and of the measurement between two reports
+ * on the same side of the charger, the latter only across load changes.
+ */
+static gdouble pcat_pmu_manager_test_trace_replay(
+    PCatBatteryEstimator *estimator, const GArray *trace, gint64 *timestamp,
+    gdouble *measured_step_max)
+{
+    const PCatPMUManagerTestTraceSample *sample;
+    PCatBatteryEstimatorLoad load, last_load = PCAT_BATTERY_ESTIMATOR_LOAD_LAST;
+    gboolean on_battery, last_on_battery = FALSE;
+    gdouble measured, last_measured = 0.0, soc, last_soc = 0.0;
+    gdouble step_max = 0.0;
+    gint64 start = *timestamp;
+    guint i;
+
+    for(i=0;i<trace->len;i++)
+    {
+        sample = &g_array_index(trace, PCatPMUManagerTestTraceSample, i);
+        measured = pcat_pmu_manager_test_trace_soc(sample, &on_battery,
+            &load);
+        *timestamp = start + (gint64)sample->seconds * 1000000;
+
+        pcat_battery_estimator_update(estimator, *timestamp, measured,
+            on_battery, load);
+        soc = pcat_battery_estimator_soc_get(estimator);
+
+        if(i > 0 && on_battery==last_on_battery)
+        {
+            step_max = MAX(step_max, fabs(soc - last_soc));
+            if(load!=last_load && measured_step_max!=NULL)
+            {
+                *measured_step_max = MAX(*measured_step_max,
+                    fabs(measured - last_measured));
+            }
+        }
+
+        last_on_battery = on_battery;
+        last_load = load;
+        last_measured = measured;
+        last_soc = soc;
+    }
+
+    *timestamp += PCAT_PMU_MANAGER_TEST_TRACE_GAP;
+
+    return step_max;
+}
+
+static int pcat_pmu_manager_test_estimator(const gchar *trace_dir)
+{
+    PCatPMUManagerData *pmu_data = &g_pcat_pmu_manager_data;
+    PCatBatteryEstimator *estimator, *loaded;
+    PCatBatteryEstimatorCalibration calibration;
+    const PCatBatteryEstimatorCalibration *learned;
+    GArray *charge, *discharge, *discharge_5g;
+    GError *error = NULL;
+    gchar *path = NULL, *data, *loaded_data;
+    gsize length;
+    gdouble charge_rate, discharge_rate, offset;
+    gdouble charge_error = 0.0, discharge_error = 0.0;
+    gdouble last_charge_error = G_MAXDOUBLE;
+    gdouble last_discharge_error = G_MAXDOUBLE;
+    gdouble step_max, measured_step_max = 0.0;
+    gint64 timestamp = 0;
+    guint i;
+    gint fd;
+    int failures = 0;
+
+    charge = pcat_pmu_manager_test_trace_load(trace_dir, "charge.trace");
+    discharge = pcat_pmu_manager_test_trace_load(trace_dir,
+        "discharge.trace");
+    discharge_5g = pcat_pmu_manager_test_trace_load(trace_dir,
+        "discharge-5g.trace");
+    if(charge==NULL || discharge==NULL || discharge_5g==NULL)
+    {
+        if(charge!=NULL)
+        {
+            g_array_unref(charge);
+        }
+        if(discharge!=NULL)
+        {
+            g_array_unref(discharge);
+        }
+        if(discharge_5g!=NULL)
+        {
+            g_array_unref(discharge_5g);
+        }
+
+        return 1;
+    }
+
+    memcpy(pmu_data->battery_discharge_table_normal,
+        g_pat_pmu_manager_battery_discharge_table_normal,
+        sizeof(pmu_data->battery_discharge_table_normal));
+    memcpy(pmu_data->battery_discharge_table_5g,
+        g_pat_pmu_manager_battery_discharge_table_5g,
+        sizeof(pmu_data->battery_discharge_table_5g));
+    memcpy(pmu_data->battery_charge_table,
+        g_pat_pmu_manager_battery_charge_table,
+        sizeof(pmu_data->battery_charge_table));
+    pcat_pmu_manager_soc_lut_update(pmu_data);
+
+    /*
+     * Full cycles from the default calibration, the learned rates have to
+     * close in on the ones of the traces with every cycle.
+     */
+    charge_rate = pcat_pmu_manager_test_trace_rate(charge);
+    discharge_rate = pcat_pmu_manager_test_trace_rate(discharge);
+
+    estimator = pcat_battery_estimator_new();
+    learned = pcat_battery_estimator_calibration_get(estimator);
+
+    for(i=0;i<PCAT_PMU_MANAGER_TEST_TRACE_CYCLES;i++)
+    {
+        pcat_pmu_manager_test_trace_replay(estimator, discharge, &timestamp,
+            NULL);
+        pcat_pmu_manager_test_trace_replay(estimator, charge, &timestamp,
+            NULL);
+
+        charge_error = fabs(learned->charge_rate - charge_rate) /
+            charge_rate;
+        discharge_error = fabs(learned->discharge_rate[
+            PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL] - discharge_rate) /
+            discharge_rate;
+        if(charge_error > last_charge_error ||
+           discharge_error > last_discharge_error)
+        {
+            fprintf(stderr, "Learned rates moved away after cycle %u: "
+                "charge %.2f%%/h (trace %.2f%%/h), discharge %.2f%%/h "
+                "(trace %.2f%%/h)!\n", i + 1, learned->charge_rate,
+                charge_rate, learned->discharge_rate[
+                PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL], discharge_rate);
+            failures++;
+        }
+        last_charge_error = charge_error;
+        last_discharge_error = discharge_error;
+    }
+
+    if(charge_error > PCAT_PMU_MANAGER_TEST_RATE_TOLERANCE ||
+       discharge_error > PCAT_PMU_MANAGER_TEST_RATE_TOLERANCE)
+    {
+        fprintf(stderr, "Learned rates did not converge: charge %.2f%%/h "
+            "(trace %.2f%%/h), discharge %.2f%%/h (trace %.2f%%/h)!\n",
+            learned->charge_rate, charge_rate, learned->discharge_rate[
+            PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL], discharge_rate);
+        failures++;
+    }
+    if(learned->cycles!=PCAT_PMU_MANAGER_TEST_TRACE_CYCLES)
+    {
+        fprintf(stderr, "Counted %u cycle(s), expected %u!\n",
+            learned->cycles, PCAT_PMU_MANAGER_TEST_TRACE_CYCLES);
+        failures++;
+    }
+    if(!pcat_battery_estimator_calibration_dirty(estimator))
+    {
+        fprintf(stderr, "Learned calibration is not marked dirty!\n");
+        failures++;
+    }
+
+    /* The calibration file has to read back unchanged. */
+    calibration = *learned;
+    data = pcat_battery_estimator_calibration_to_data(estimator, &length);
+    loaded = pcat_battery_estimator_new();
+    fd = g_file_open_tmp("pcat-manager-batcab-XXXXXX.conf", &path, &error);
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+    if(fd < 0 || !g_file_set_contents(path, data, length, &error))
+    {
+        fprintf(stderr, "Failed to write calibration file: %s\n",
+            error!=NULL ? error->message : "unknown error");
+        g_clear_error(&error);
+        failures++;
+    }
+    else if(!pcat_battery_estimator_calibration_load(loaded, path))
+    {
+        fprintf(stderr, "Failed to load calibration file %s!\n", path);
+        failures++;
+    }
+    else
+    {
+        learned = pcat_battery_estimator_calibration_get(loaded);
+        loaded_data = pcat_battery_estimator_calibration_to_data(loaded,
+            &length);
+        if(learned->discharge_rate[PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL]!=
+           calibration.discharge_rate[PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL] ||
+           learned->discharge_rate[PCAT_BATTERY_ESTIMATOR_LOAD_HIGH]!=
+           calibration.discharge_rate[PCAT_BATTERY_ESTIMATOR_LOAD_HIGH] ||
+           learned->charge_rate!=calibration.charge_rate ||
+           learned->measurement_offset[PCAT_BATTERY_ESTIMATOR_LOAD_HIGH]!=
+           calibration.measurement_offset[PCAT_BATTERY_ESTIMATOR_LOAD_HIGH] ||
+           learned->cycles!=calibration.cycles ||
+           strcmp(loaded_data, data)!=0)
+        {
+            fprintf(stderr, "Calibration changed on the way through %s:\n"
+                "%s\nread back as:\n%s\n", path, data, loaded_data);
+            failures++;
+        }
+        g_free(loaded_data);
+    }
+    if(path!=NULL)
+    {
+        unlink(path);
+        g_free(path);
+    }
+    g_free(data);
+
+    if(pcat_battery_estimator_calibration_dirty(estimator))
+    {
+        fprintf(stderr, "Calibration is still dirty after saving!\n");
+        failures++;
+    }
+    pcat_battery_estimator_free(estimator);
+
+    /*
+     * The modem coming and going moves the voltage based SoC by 10-20%,
+     * the estimate must not follow it.
+     */
+    step_max = pcat_pmu_manager_test_trace_replay(loaded, discharge_5g,
+        &timestamp, &measured_step_max);
+    if(measured_step_max <= PCAT_PMU_MANAGER_TEST_SOC_STEP_MAX)
+    {
+        fprintf(stderr, "5G load trace only steps %.2f%% on load "
+            "changes!\n", measured_step_max);
+        failures++;
+    }
+    if(step_max > PCAT_PMU_MANAGER_TEST_SOC_STEP_MAX)
+    {
+        fprintf(stderr, "Estimate stepped by %.2f%% on the 5G load trace, "
+            "at most %.2f%% allowed!\n", step_max,
+            PCAT_PMU_MANAGER_TEST_SOC_STEP_MAX);
+        failures++;
+    }
+
+    /* The sag under the 5G load has to be learned as a measurement offset. */
+    learned = pcat_battery_estimator_calibration_get(loaded);
+    offset = learned->measurement_offset[PCAT_BATTERY_ESTIMATOR_LOAD_HIGH];
+    if(offset <= 0.0)
+    {
+        fprintf(stderr, "No measurement offset learned on the 5G load "
+            "trace!\n");
+        failures++;
+    }
+    pcat_battery_estimator_free(loaded);
+
+    pcat_pmu_manager_soc_lut_clear(&pmu_data->soc_charge_lut);
+    pcat_pmu_manager_soc_lut_clear(&pmu_data->soc_discharge_normal_lut);
+    pcat_pmu_manager_soc_lut_clear(&pmu_data->soc_discharge_5g_lut);
+    pmu_data->soc_discharge_lut = NULL;
+
+    g_array_unref(charge);
+    g_array_unref(discharge);
+    g_array_unref(discharge_5g);
+
+    printf("Learned charge %.2f%%/h (trace %.2f%%/h), discharge %.2f%%/h "
+        "(trace %.2f%%/h) in %u cycles, largest SoC step on the 5G load "
+        "trace %.2f%% (measured %.2f%%), 5G load offset %.2f%%.\n",
+        calibration.charge_rate, charge_rate, calibration.discharge_rate[
+        PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL], discharge_rate,
+        calibration.cycles, step_max, measured_step_max, offset);
+
+    return failures;
+}
+
+/*
+ * Check that a tier holds count buckets ending with the given one, with
+ * the counter column following the expected mean and last value rollup.
+ */
+static int pcat_pmu_manager_test_telemetry_tier_check(
+    PCatTelemetry *telemetry, PCatTelemetryTier tier, guint count,
+    gint64 last_bucket)
+{
+    static const gchar * const tier_names[PCAT_TELEMETRY_TIER_LAST] =
+    {
+        "Second", "Minute", "Hour"
+    };
+    PCatTelemetrySeries *series;
+    gint64 bucket;
+    gint32 mean, last;
+    guint i, interval;
+    int failures = 0;
+
+    series = pcat_telemetry_query(telemetry, tier, G_MININT64, G_MAXINT64);
+    interval = series->interval;
+    if(series->count!=count)
+    {
+        fprintf(stderr, "%s tier holds %u samples, expected %u!\n",
+            tier_names[tier], series->count, count);
+        pcat_telemetry_series_free(series);
+
+        return 1;
+    }
+
+    for(i=0;i<count && failures < 10;i++)
+    {
+        bucket = last_bucket - (count - 1 - i);
+
+        /*
+         * The counter is the second since the start, a minute averages
+         * to 60m + 29 (29.5 truncated), an hour of those to 3600h + 1799.
+         */
+        if(tier==PCAT_TELEMETRY_TIER_SECOND)
+        {
+            mean = bucket;
+        }
+        else
+        {
+            mean = bucket * interval + ((interval==60) ? 29 : 1799);
+        }
+        last = bucket * interval + interval - 1;
+
+        if(series->timestamps[i]!=PCAT_PMU_MANAGER_TEST_TELEMETRY_START +
+           bucket * interval ||
+           series->columns[PCAT_TELEMETRY_COLUMN_BATTERY_VOLTAGE][i]!=mean ||
+           series->columns[PCAT_TELEMETRY_COLUMN_GPIO_INPUT][i]!=last ||
+           series->columns[PCAT_TELEMETRY_COLUMN_BOARD_TEMP][i]!=40)
+        {
+            fprintf(stderr, "%s tier sample %u: %" G_GINT64_FORMAT
+                " %d/%d, expected %" G_GINT64_FORMAT " %d/%d!\n",
+                tier_names[tier], i, series->timestamps[i],
+                series->columns[PCAT_TELEMETRY_COLUMN_BATTERY_VOLTAGE][i],
+                series->columns[PCAT_TELEMETRY_COLUMN_GPIO_INPUT][i],
+                PCAT_PMU_MANAGER_TEST_TELEMETRY_START + bucket * interval,
+                mean, last);
+            failures++;
+        }
+    }
+
+    pcat_telemetry_series_free(series);
+
+    return failures;
+}
+
+static int pcat_pmu_manager_test_telemetry_range_check(
+    PCatTelemetry *telemetry, gint64 start, gint64 end, guint count,
+    gint64 first)
+{
+    PCatTelemetrySeries *series;
+    int failures = 0;
+
+    series = pcat_telemetry_query(telemetry, PCAT_TELEMETRY_TIER_MINUTE,
+        start, end);
+    if(series->count!=count ||
+       (count > 0 && series->timestamps[0]!=first))
+    {
+        fprintf(stderr, "Range [%" G_GINT64_FORMAT ", %" G_GINT64_FORMAT
+            "] gave %u samples from %" G_GINT64_FORMAT ", expected %u from %"
+            G_GINT64_FORMAT "!\n", start, end, series->count,
+            series->count > 0 ? series->timestamps[0] : 0, count, first);
+        failures++;
+    }
+    pcat_telemetry_series_free(series);
+
+    return failures;
+}
+
+static int pcat_pmu_manager_test_telemetry()
+{
+    const gint64 start = PCAT_PMU_MANAGER_TEST_TELEMETRY_START;
+    const gint64 seconds = PCAT_PMU_MANAGER_TEST_TELEMETRY_HOURS * 3600L +
+        30;
+    PCatTelemetry *telemetry;
+    PCatTelemetrySeries *series;
+    gint32 values[PCAT_TELEMETRY_COLUMN_LAST] = {0};
+    gint64 i, minute_last, minute_first;
+    guint tier;
+    int failures = 0;
+
+    telemetry = pcat_telemetry_new();
+
+    values[PCAT_TELEMETRY_COLUMN_BOARD_TEMP] = 40;
+    for(i=0;i<seconds;i++)
+    {
+        values[PCAT_TELEMETRY_COLUMN_BATTERY_VOLTAGE] = i;
+        values[PCAT_TELEMETRY_COLUMN_GPIO_INPUT] = i;
+        pcat_telemetry_append(telemetry, start + i, values);
+    }
+
+    /*
+     * A bucket is only stored once the next one started: the last second
+     * is still open, so is the minute it is in, and the hour before it
+     * waits for the first full minute of the current hour. All three
+     * rings wrapped.
+     */
+    failures += pcat_pmu_manager_test_telemetry_tier_check(telemetry,
+        PCAT_TELEMETRY_TIER_SECOND, 3600, seconds - 2);
+    minute_last = seconds / 60 - 1;
+    failures += pcat_pmu_manager_test_telemetry_tier_check(telemetry,
+        PCAT_TELEMETRY_TIER_MINUTE, 1440, minute_last);
+    failures += pcat_pmu_manager_test_telemetry_tier_check(telemetry,
+        PCAT_TELEMETRY_TIER_HOUR, 720, PCAT_PMU_MANAGER_TEST_TELEMETRY_HOURS -
+        2);
+
+    /* Both bounds are inclusive and need not be on a bucket. */
+    minute_first = minute_last - 1440 + 1;
+    failures += pcat_pmu_manager_test_telemetry_range_check(telemetry,
+        start + minute_first * 60, start + minute_last * 60, 1440,
+        start + minute_first * 60);
+    failures += pcat_pmu_manager_test_telemetry_range_check(telemetry,
+        start + 1000 * 60, start + 1009 * 60, 0, 0);
+    failures += pcat_pmu_manager_test_telemetry_range_check(telemetry,
+        start + (minute_first + 10) * 60, start + (minute_first + 19) * 60,
+        10, start + (minute_first + 10) * 60);
+    failures += pcat_pmu_manager_test_telemetry_range_check(telemetry,
+        start + (minute_first + 10) * 60 + 1,
+        start + (minute_first + 19) * 60 - 1, 8,
+        start + (minute_first + 11) * 60);
+    failures += pcat_pmu_manager_test_telemetry_range_check(telemetry,
+        start + minute_last * 60, G_MAXINT64, 1, start + minute_last * 60);
+    failures += pcat_pmu_manager_test_telemetry_range_check(telemetry,
+        start + minute_last * 60 + 1, G_MAXINT64, 0, 0);
+    failures += pcat_pmu_manager_test_telemetry_range_check(telemetry,
+        G_MININT64, start + minute_first * 60 - 1, 0, 0);
+    failures += pcat_pmu_manager_test_telemetry_range_check(telemetry,
+        start + minute_last * 60, start + minute_first * 60, 0, 0);
+
+    /* The system time being set back starts the history over. */
+    values[PCAT_TELEMETRY_COLUMN_BATTERY_VOLTAGE] = 0;
+    values[PCAT_TELEMETRY_COLUMN_GPIO_INPUT] = 0;
+    pcat_telemetry_append(telemetry, start, values);
+    for(tier=0;tier<PCAT_TELEMETRY_TIER_LAST;tier++)
+    {
+        series = pcat_telemetry_query(telemetry, tier, G_MININT64,
+            G_MAXINT64);
+        if(series->count!=0)
+        {
+            fprintf(stderr, "Tier %u still holds %u samples after the clock "
+                "stepped back!\n", tier, series->count);
+            failures++;
+        }
+        pcat_telemetry_series_free(series);
+    }
+    values[PCAT_TELEMETRY_COLUMN_BATTERY_VOLTAGE] = 1;
+    values[PCAT_TELEMETRY_COLUMN_GPIO_INPUT] = 1;
+    pcat_telemetry_append(telemetry, start + 1, values);
+    failures += pcat_pmu_manager_test_telemetry_tier_check(telemetry,
+        PCAT_TELEMETRY_TIER_SECOND, 1, 0);
+
+    pcat_telemetry_free(telemetry);
+
+    printf("Appended %" G_GINT64_FORMAT " telemetry samples.\n", seconds);
+
+    return failures;
+}
+
+int main(int argc, char *argv[])
+{
+    int failures = 0;
+
+    if(argc < 2 || ((strcmp(argv[1], "parser")==0 ||
+       strcmp(argv[1], "estimator")==0) && argc < 3))
+    {
+        fprintf(stderr, "Usage: %s parser <corpus-dir> | command-pool | "
+            "serial-baud | shutdown-request | soc-lut | "
+            "estimator <trace-dir> | telemetry\n", argv[0]);
+
+        return 2;
+    }
+
+    g_log_set_default_handler(pcat_pmu_manager_test_log_handler, NULL);
+
+    if(!pcat_pmu_manager_test_open())
+    {
+        return 1;
+    }
+
+    if(strcmp(argv[1], "parser")==0)
+    {
+        failures += pcat_pmu_manager_test_parser_corpus(argv[2]);
+        failures += pcat_pmu_manager_test_parser_fuzz();
+    }
+    else if(strcmp(argv[1], "command-pool")==0)
+    {
+        failures += pcat_pmu_manager_test_command_pool();
+    }
+    else if(strcmp(argv[1], "serial-baud")==0)
+    {
+        failures += pcat_pmu_manager_test_serial_baud();
+    }
+    else if(strcmp(argv[1], "shutdown-request")==0)
+    {
+        failures += pcat_pmu_manager_test_shutdown_request();
+    }
+    else if(strcmp(argv[1], "soc-lut")==0)
+    {
+        failures += pcat_pmu_manager_test_soc_lut();
+    }
+    else if(strcmp(argv[1], "estimator")==0)
+    {
+        failures += pcat_pmu_manager_test_estimator(argv[2]);
+    }
+    else if(strcmp(argv[1], "telemetry")==0)
+    {
+        failures += pcat_pmu_manager_test_telemetry();
+    }
+    else
+    {
+        fprintf(stderr, "Unknown test %s!\n", argv[1]);
+        failures++;
+    }
+
+    pcat_pmu_manager_test_close();
+
+    if(failures > 0)
+    {
+        fprintf(stderr, "%d PMU manager check(s) failed!\n", failures);
+
+        return 1;
+    }
+
+    printf("PMU manager checks passed.\n");
+
+    return 0;
+}
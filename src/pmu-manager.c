@@ -1,81 +1,166 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
-#include <termios.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "pmu-manager.h"
+#include "crc16.h"
+#include "serial.h"
+#include "seqlock.h"
+#include "battery-estimator.h"
+#include "telemetry.h"
+#include "journal.h"
 #include "modem-manager.h"
 #include "common.h"
 
 #define PCAT_PMU_MANAGER_STATEFS_BATTERY_PATH "/run/state/namespaces/Battery"
+#define PCAT_PMU_MANAGER_STATEFS_FLUSH_DELAY 200
+#define PCAT_PMU_MANAGER_STATEFS_VALUE_SIZE 32
 #define PCAT_PMU_MANAGER_COMMAND_TIMEOUT 1000000L
+#define PCAT_PMU_MANAGER_SERIAL_BAUD_CHECK_TIMEOUT 3
 #define PCAT_PMU_MANAGER_COMMAND_QUEUE_MAX 128
 
+/*
+ * Retransmit timeout bounds, the timeout starts at
+ * PCAT_PMU_MANAGER_COMMAND_TIMEOUT until the first RTT sample arrives.
+ */
+#define PCAT_PMU_MANAGER_COMMAND_RTO_MIN 50000L
+#define PCAT_PMU_MANAGER_COMMAND_RTO_MAX 4000000L
+
+/*
+ * Number of acknowledged frames which may be outstanding at the same time,
+ * a window of 1 gives the old stop-and-wait behaviour.
+ */
+#define PCAT_PMU_MANAGER_COMMAND_WINDOW_DEFAULT 8
+#define PCAT_PMU_MANAGER_COMMAND_WINDOW_MAX 32
+
+/*
+ * Command slots are preallocated for the queue, the in-flight window and
+ * the frame being written, every frame sent by this program fits in the
+ * inline buffer, only larger payloads fall back to a heap buffer.
+ */
+#define PCAT_PMU_MANAGER_COMMAND_POOL_SIZE \
+    (PCAT_PMU_MANAGER_COMMAND_QUEUE_MAX + \
+    PCAT_PMU_MANAGER_COMMAND_WINDOW_MAX + 1)
+#define PCAT_PMU_MANAGER_COMMAND_INLINE_BUFFER_SIZE 64
+
+/* Maximum number of frames gathered into a single writev() call. */
+#define PCAT_PMU_MANAGER_SERIAL_WRITE_IOV_MAX 16
+
+/* Must be a power of two, the ring indices are masked instead of wrapped. */
+#define PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE 131072
+#define PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_MASK \
+    (PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE - 1)
+#define PCAT_PMU_MANAGER_SERIAL_FRAME_MAX (65532 + 10)
+
 #define PCAT_PMU_MANAGER_BATTERY_CALIBRATION_FILE \
     "/etc/pcat-manager-batcab.conf"
 
 typedef enum
 {
-    PCAT_PMU_MANAGER_COMMAND_HEARTBEAT = 0x1,
-    PCAT_PMU_MANAGER_COMMAND_HEARTBEAT_ACK = 0x2,
-    PCAT_PMU_MANAGER_COMMAND_PMU_HW_VERSION_GET = 0x3,
-    PCAT_PMU_MANAGER_COMMAND_PMU_HW_VERSION_GET_ACK = 0x4,
-    PCAT_PMU_MANAGER_COMMAND_PMU_FW_VERSION_GET = 0x5,
-    PCAT_PMU_MANAGER_COMMAND_PMU_FW_VERSION_GET_ACK = 0x6,
-    PCAT_PMU_MANAGER_COMMAND_STATUS_REPORT = 0x7,
-    PCAT_PMU_MANAGER_COMMAND_STATUS_REPORT_ACK = 0x8,
-    PCAT_PMU_MANAGER_COMMAND_DATE_TIME_SYNC = 0x9,
-    PCAT_PMU_MANAGER_COMMAND_DATE_TIME_SYNC_ACK = 0xA,
-    PCAT_PMU_MANAGER_COMMAND_SCHEDULE_STARTUP_TIME_SET = 0xB,
-    PCAT_PMU_MANAGER_COMMAND_SCHEDULE_STARTUP_TIME_SET_ACK = 0xC,
-    PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_SHUTDOWN = 0xD,
-    PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_SHUTDOWN_ACK = 0xE,
-    PCAT_PMU_MANAGER_COMMAND_HOST_REQUEST_SHUTDOWN = 0xF,
-    PCAT_PMU_MANAGER_COMMAND_HOST_REQUEST_SHUTDOWN_ACK = 0x10,
-    PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_FACTORY_RESET = 0x11,
-    PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_FACTORY_RESET_ACK = 0x12,
-    PCAT_PMU_MANAGER_COMMAND_WATCHDOG_TIMEOUT_SET = 0x13,
-    PCAT_PMU_MANAGER_COMMAND_WATCHDOG_TIMEOUT_SET_ACK = 0x14,
-    PCAT_PMU_MANAGER_COMMAND_CHARGER_ON_AUTO_START = 0x15,
-    PCAT_PMU_MANAGER_COMMAND_CHARGER_ON_AUTO_START_ACK = 0x16,
-    PCAT_PMU_MANAGER_COMMAND_VOLTAGE_THRESHOLD_SET = 0x17,
-    PCAT_PMU_MANAGER_COMMAND_VOLTAGE_THRESHOLD_SET_ACK = 0x18,
-    PCAT_PMU_MANAGER_COMMAND_NET_STATUS_LED_SETUP = 0x19,
-    PCAT_PMU_MANAGER_COMMAND_NET_STATUS_LED_SETUP_ACK = 0x1A,
-    PCAT_PMU_MANAGER_COMMAND_POWER_ON_EVENT_GET = 0x1B,
-    PCAT_PMU_MANAGER_COMMAND_POWER_ON_EVENT_GET_ACK = 0x1C,
-}PCatPMUManagerCommandType;
+    PCAT_PMU_MANAGER_SERIAL_PARSE_SYNC,
+    PCAT_PMU_MANAGER_SERIAL_PARSE_HEADER,
+    PCAT_PMU_MANAGER_SERIAL_PARSE_PAYLOAD,
+    PCAT_PMU_MANAGER_SERIAL_PARSE_CHECKSUM
+}PCatPMUManagerSerialParseState;
 
 typedef struct _PCatPMUManagerCommandData
 {
-    GByteArray *buffer;
+    GList link;
+    guint8 *buffer;
+    gsize buffer_size;
+    guint8 inline_buffer[PCAT_PMU_MANAGER_COMMAND_INLINE_BUFFER_SIZE];
+    gboolean pooled;
+    PCatPMUManagerCommandPriority priority;
     gsize written_size;
     guint16 command;
     gboolean need_ack;
     guint retry_count;
     guint16 frame_num;
     gint64 timestamp;
-    gboolean firstrun;
+    gint64 rto;
+    gboolean retransmitted;
 }PCatPMUManagerCommandData;
 
+typedef enum
+{
+    PCAT_PMU_MANAGER_STATEFS_CHARGE_PERCENTAGE = 0,
+    PCAT_PMU_MANAGER_STATEFS_VOLTAGE,
+    PCAT_PMU_MANAGER_STATEFS_ON_BATTERY,
+    PCAT_PMU_MANAGER_STATEFS_LAST
+}PCatPMUManagerStatefsFile;
+
+typedef struct _PCatPMUManagerSoCLUT
+{
+    guint min_voltage;
+    guint max_voltage;
+    guint16 *data;
+}PCatPMUManagerSoCLUT;
+
 typedef struct _PCatPMUManagerData
 {
     gboolean initialized;
+    gint64 init_start_timestamp;
+    gboolean link_stats_cpu_time;
+    PCatPMUManagerLinkStats link_stats;
+    gboolean init_latency_reported;
 
     guint check_timeout_id;
 
+    GMutex mutex;
+    GThread *io_thread;
+    GMainContext *io_context;
+    GMainLoop *io_loop;
+    guint heartbeat_timeout_id;
+    GPtrArray *pmu_fw_version_retired;
+
     int serial_fd;
     GIOChannel *serial_channel;
     guint serial_read_source;
     guint serial_write_source;
-    GByteArray *serial_read_buffer;
+    guint serial_write_flush_source;
+    gboolean serial_write_deferred;
+    guint8 *serial_read_buffer;
+    gsize serial_read_head;
+    gsize serial_read_tail;
+    guint8 *serial_read_frame_buffer;
+    PCatPMUManagerSerialParseState serial_read_parse_state;
+    gsize serial_read_parse_offset;
+    guint16 serial_read_parse_expect_len;
+    guint16 serial_read_parse_crc;
 
     PCatPMUManagerCommandData *serial_write_current_command_data;
-    GQueue *serial_write_command_queue;
+    GQueue serial_write_command_queue[PCAT_PMU_MANAGER_COMMAND_PRIORITY_LAST];
+    guint serial_write_command_queue_length;
+    guint64 serial_write_command_dropped[
+        PCAT_PMU_MANAGER_COMMAND_PRIORITY_LAST];
+    guint64 serial_write_command_coalesced[
+        PCAT_PMU_MANAGER_COMMAND_PRIORITY_LAST];
+    GQueue serial_write_inflight_queue;
+    guint serial_write_window;
+    gint64 serial_write_srtt;
+    gint64 serial_write_rttvar;
+    gint64 serial_write_rto;
+    guint serial_write_retransmit_timeout_id;
+    gint64 serial_write_retransmit_deadline;
+
+    guint serial_baud;
+    guint serial_baud_pending;
+    guint serial_baud_check_timeout_id;
+    guint64 serial_baud_check_rx_frames;
+    PCatPMUManagerCommandData *command_pool;
+    GQueue command_pool_free_queue;
     guint16 serial_write_frame_num;
 
     gboolean shutdown_request;
@@ -90,6 +175,17 @@ typedef struct _PCatPMUManagerData
     guint last_battery_percentage;
     guint last_battery_percentage_cap;
 
+    guint status_sequence;
+    PCatPMUManagerStatus status;
+
+    GMutex statefs_mutex;
+    guint statefs_flush_timeout_id;
+    gchar statefs_pending[PCAT_PMU_MANAGER_STATEFS_LAST][
+        PCAT_PMU_MANAGER_STATEFS_VALUE_SIZE];
+    gchar statefs_written[PCAT_PMU_MANAGER_STATEFS_LAST][
+        PCAT_PMU_MANAGER_STATEFS_VALUE_SIZE];
+    int statefs_fds[PCAT_PMU_MANAGER_STATEFS_LAST];
+
     gchar *pmu_fw_version;
     gint64 charger_on_auto_start_last_timestamp;
     gboolean system_time_set_flag;
@@ -101,6 +197,17 @@ typedef struct _PCatPMUManagerData
     guint battery_discharge_table_normal[11];
     guint battery_discharge_table_5g[11];
     guint battery_charge_table[11];
+
+    PCatPMUManagerSoCLUT soc_charge_lut;
+    PCatPMUManagerSoCLUT soc_discharge_normal_lut;
+    PCatPMUManagerSoCLUT soc_discharge_5g_lut;
+    const PCatPMUManagerSoCLUT *soc_discharge_lut;
+
+    PCatBatteryEstimator *battery_estimator;
+    guint battery_percentage_confidence;
+
+    PCatTelemetry *telemetry;
+    gint64 journal_status_timestamp;
 }PCatPMUManagerData;
 
 static PCatPMUManagerData g_pcat_pmu_manager_data = {0};
@@ -115,331 +222,883 @@ static guint g_pat_pmu_manager_battery_discharge_table_5g[11] =
     4200, 4060, 3980, 3920, 3870, 3820, 3790, 3770, 3740, 3680, 3600
 };
 
+static const gchar * const g_pcat_pmu_manager_statefs_file_names[
+    PCAT_PMU_MANAGER_STATEFS_LAST] =
+{
+    PCAT_PMU_MANAGER_STATEFS_BATTERY_PATH"/ChargePercentage",
+    PCAT_PMU_MANAGER_STATEFS_BATTERY_PATH"/Voltage",
+    PCAT_PMU_MANAGER_STATEFS_BATTERY_PATH"/OnBattery"
+};
+
 static guint g_pat_pmu_manager_battery_charge_table[11] =
 {
     4200, 4150, 4100, 4050, 4000, 3950, 3900, 3850, 3800, 3750, 3700
 };
 
-static void pcat_pmu_manager_command_data_free(
-    PCatPMUManagerCommandData *data)
+/*
+ * CPU time spent in the serial watches is only sampled when
+ * [Debug] PMULinkStats is set, as it costs two extra syscalls per wakeup.
+ */
+static gint64 pcat_pmu_serial_cpu_time_get()
 {
-    if(data==NULL)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return (gint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * All serial sources live on the PMU I/O context, so heartbeats and ACKs
+ * are not held up by whatever the default main loop is busy with.
+ */
+static guint pcat_pmu_manager_io_source_attach(PCatPMUManagerData *pmu_data,
+    GSource *source, GSourceFunc func)
+{
+    guint id;
+
+    g_source_set_callback(source, func, pmu_data, NULL);
+    id = g_source_attach(source, pmu_data->io_context);
+    g_source_unref(source);
+
+    return id;
+}
+
+static guint pcat_pmu_manager_io_watch_add(PCatPMUManagerData *pmu_data,
+    GIOCondition condition, GIOFunc func)
+{
+    return pcat_pmu_manager_io_source_attach(pmu_data,
+        g_io_create_watch(pmu_data->serial_channel, condition),
+        (GSourceFunc)func);
+}
+
+static guint pcat_pmu_manager_io_idle_add(PCatPMUManagerData *pmu_data,
+    GSourceFunc func)
+{
+    GSource *source;
+
+    source = g_idle_source_new();
+    g_source_set_priority(source, G_PRIORITY_DEFAULT);
+
+    return pcat_pmu_manager_io_source_attach(pmu_data, source, func);
+}
+
+static guint pcat_pmu_manager_io_timeout_add(PCatPMUManagerData *pmu_data,
+    guint interval, GSourceFunc func)
+{
+    return pcat_pmu_manager_io_source_attach(pmu_data,
+        g_timeout_source_new(interval), func);
+}
+
+static guint pcat_pmu_manager_io_timeout_add_seconds(
+    PCatPMUManagerData *pmu_data, guint interval, GSourceFunc func)
+{
+    return pcat_pmu_manager_io_source_attach(pmu_data,
+        g_timeout_source_new_seconds(interval), func);
+}
+
+static void pcat_pmu_manager_io_source_remove(PCatPMUManagerData *pmu_data,
+    guint id)
+{
+    GSource *source;
+
+    source = g_main_context_find_source_by_id(pmu_data->io_context, id);
+    if(source!=NULL)
     {
-        return;
+        g_source_destroy(source);
+    }
+}
+
+static PCatPMUManagerCommandData *pcat_pmu_manager_command_data_new(
+    PCatPMUManagerData *pmu_data, gsize frame_size)
+{
+    PCatPMUManagerCommandData *data;
+    GList *link;
+
+    link = g_queue_pop_head_link(&pmu_data->command_pool_free_queue);
+    if(link!=NULL)
+    {
+        data = link->data;
+    }
+    else
+    {
+        data = g_new0(PCatPMUManagerCommandData, 1);
+        data->link.data = data;
+        data->pooled = FALSE;
+        pmu_data->link_stats.allocations++;
     }
 
-    if(data->buffer!=NULL)
+    if(frame_size <= PCAT_PMU_MANAGER_COMMAND_INLINE_BUFFER_SIZE)
+    {
+        data->buffer = data->inline_buffer;
+    }
+    else
     {
-        g_byte_array_unref(data->buffer);
+        data->buffer = g_malloc(frame_size);
+        pmu_data->link_stats.allocations++;
     }
+    data->buffer_size = frame_size;
+    data->written_size = 0;
 
-    g_free(data);
+    return data;
 }
 
-static inline guint16 pcat_pmu_serial_compute_crc16(const guint8 *data,
-    gsize len)
+static void pcat_pmu_manager_command_data_free(
+    PCatPMUManagerData *pmu_data, PCatPMUManagerCommandData *data)
 {
-    guint16 crc = 0xFFFF;
-    gsize i;
-    guint j;
+    if(data==NULL)
+    {
+        return;
+    }
 
-    for(i=0;i<len;i++)
+    if(data->buffer!=NULL && data->buffer!=data->inline_buffer)
     {
-        crc ^= data[i];
-        for(j=0;j<8;j++)
-        {
-            if(crc & 1)
-            {
-                crc = (crc >> 1) ^ 0xA001;
-            }
-            else
-            {
-                crc >>= 1;
-            }
-        }
+        g_free(data->buffer);
     }
+    data->buffer = NULL;
 
-    return crc;
+    if(data->pooled)
+    {
+        g_queue_push_head_link(&pmu_data->command_pool_free_queue,
+            &data->link);
+    }
+    else
+    {
+        g_free(data);
+    }
 }
 
-static gboolean pcat_pmu_serial_write_watch_func(GIOChannel *source,
-    GIOCondition condition, gpointer user_data)
+/*
+ * Free a command which is given up on before it was acknowledged, state
+ * waiting for its ACK must not be left behind.
+ */
+static void pcat_pmu_manager_command_data_drop(
+    PCatPMUManagerData *pmu_data, PCatPMUManagerCommandData *data)
 {
-    PCatPMUManagerData *pmu_data = (PCatPMUManagerData *)user_data;
-    gssize wsize;
-    guint remaining_size;
-    gboolean ret = FALSE;
-    gint64 now;
-    GByteArray *buffer;
+    if(data->command==PCAT_PMU_MANAGER_COMMAND_SERIAL_BAUD_SET &&
+       pmu_data->serial_baud_pending!=0)
+    {
+        g_message("PMU serial speed change to %u was dropped, keep %u.",
+            pmu_data->serial_baud_pending, pmu_data->serial_baud);
+        pmu_data->serial_baud_pending = 0;
+    }
 
-    now = g_get_monotonic_time();
+    pcat_pmu_manager_command_data_free(pmu_data, data);
+}
 
-    do
+static PCatPMUManagerCommandPriority pcat_pmu_manager_command_priority_get(
+    guint16 command)
+{
+    switch(command)
     {
-        if(pmu_data->serial_write_current_command_data==NULL)
+        case PCAT_PMU_MANAGER_COMMAND_HEARTBEAT:
+        case PCAT_PMU_MANAGER_COMMAND_HOST_REQUEST_SHUTDOWN:
+        case PCAT_PMU_MANAGER_COMMAND_WATCHDOG_TIMEOUT_SET:
         {
-            pmu_data->serial_write_current_command_data =
-                g_queue_pop_head(pmu_data->serial_write_command_queue);
+            return PCAT_PMU_MANAGER_COMMAND_PRIORITY_SAFETY;
         }
-        if(pmu_data->serial_write_current_command_data==NULL)
+        case PCAT_PMU_MANAGER_COMMAND_NET_STATUS_LED_SETUP:
         {
-            break;
-        }
-        if(!pmu_data->serial_write_current_command_data->firstrun &&
-            pmu_data->serial_write_current_command_data->written_size==0)
-        {
-            if(now <= pmu_data->serial_write_current_command_data->timestamp +
-                PCAT_PMU_MANAGER_COMMAND_TIMEOUT)
-            {
-                break;
-            }
-            else if(
-                pmu_data->serial_write_current_command_data->retry_count==0)
-            {
-                pcat_pmu_manager_command_data_free(
-                    pmu_data->serial_write_current_command_data);
-                pmu_data->serial_write_current_command_data = NULL;
-
-                continue;
-            }
+            return PCAT_PMU_MANAGER_COMMAND_PRIORITY_COSMETIC;
         }
-
-        buffer = pmu_data->serial_write_current_command_data->buffer;
-
-        if(buffer->len <=
-           pmu_data->serial_write_current_command_data->written_size)
+        default:
         {
-            if(pmu_data->serial_write_current_command_data->need_ack)
-            {
-                break;
-            }
-            else
-            {
-                pcat_pmu_manager_command_data_free(
-                    pmu_data->serial_write_current_command_data);
-                pmu_data->serial_write_current_command_data = NULL;
-
-                continue;
-            }
+            break;
         }
+    }
 
-        remaining_size = buffer->len -
-            pmu_data->serial_write_current_command_data->written_size;
+    /* Replies to PMU requests always use the even command number. */
+    if((command & 0x1)==0)
+    {
+        return PCAT_PMU_MANAGER_COMMAND_PRIORITY_ACK;
+    }
 
-        wsize = write(pmu_data->serial_fd,
-            buffer->data +
-            pmu_data->serial_write_current_command_data->written_size,
-            remaining_size > 4096 ? 4096 : remaining_size);
+    return PCAT_PMU_MANAGER_COMMAND_PRIORITY_CONFIG;
+}
 
-        if(wsize > 0)
+static gboolean pcat_pmu_manager_command_coalescable(guint16 command)
+{
+    switch(command)
+    {
+        case PCAT_PMU_MANAGER_COMMAND_NET_STATUS_LED_SETUP:
+        case PCAT_PMU_MANAGER_COMMAND_VOLTAGE_THRESHOLD_SET:
+        case PCAT_PMU_MANAGER_COMMAND_DATE_TIME_SYNC:
         {
-            pmu_data->serial_write_current_command_data->written_size += wsize;
-            pmu_data->serial_write_current_command_data->timestamp = now;
-            pmu_data->serial_write_current_command_data->firstrun = FALSE;
+            return TRUE;
         }
-        else
+        default:
         {
             break;
         }
     }
-    while(1);
 
-    if(pmu_data->serial_write_current_command_data!=NULL &&
-       pmu_data->serial_write_current_command_data->written_size >=
-       pmu_data->serial_write_current_command_data->buffer->len)
+    return FALSE;
+}
+
+static void pcat_pmu_manager_command_queue_push_head(
+    PCatPMUManagerData *pmu_data, PCatPMUManagerCommandData *data)
+{
+    g_queue_push_head_link(
+        &pmu_data->serial_write_command_queue[data->priority], &data->link);
+    pmu_data->serial_write_command_queue_length++;
+}
+
+static void pcat_pmu_manager_command_queue_push_tail(
+    PCatPMUManagerData *pmu_data, PCatPMUManagerCommandData *data)
+{
+    g_queue_push_tail_link(
+        &pmu_data->serial_write_command_queue[data->priority], &data->link);
+    pmu_data->serial_write_command_queue_length++;
+}
+
+static void pcat_pmu_manager_command_queue_unlink(
+    PCatPMUManagerData *pmu_data, PCatPMUManagerCommandData *data)
+{
+    g_queue_unlink(&pmu_data->serial_write_command_queue[data->priority],
+        &data->link);
+    pmu_data->serial_write_command_queue_length--;
+}
+
+static PCatPMUManagerCommandData *pcat_pmu_manager_command_queue_pop(
+    PCatPMUManagerData *pmu_data)
+{
+    GList *link;
+    guint i;
+
+    for(i=0;i<PCAT_PMU_MANAGER_COMMAND_PRIORITY_LAST;i++)
     {
-        if(pmu_data->serial_write_current_command_data->need_ack &&
-           pmu_data->serial_write_current_command_data->retry_count > 0)
-        {
-            pmu_data->serial_write_current_command_data->retry_count--;
-            pmu_data->serial_write_current_command_data->written_size = 0;
-        }
-        else
+        link = g_queue_pop_head_link(
+            &pmu_data->serial_write_command_queue[i]);
+        if(link!=NULL)
         {
-            pcat_pmu_manager_command_data_free(
-                pmu_data->serial_write_current_command_data);
-            pmu_data->serial_write_current_command_data = NULL;
+            pmu_data->serial_write_command_queue_length--;
+
+            return link->data;
         }
     }
 
-    if(wsize < 0)
+    return NULL;
+}
+
+static gboolean pcat_pmu_manager_command_queue_is_empty(
+    PCatPMUManagerData *pmu_data)
+{
+    return (pmu_data->serial_write_command_queue_length==0);
+}
+
+/*
+ * Make room for a command of the given priority by dropping the oldest
+ * command from the lowest priority lane which is not more important than
+ * it, return FALSE if only more important commands are queued.
+ */
+static gboolean pcat_pmu_manager_command_queue_reserve(
+    PCatPMUManagerData *pmu_data, PCatPMUManagerCommandPriority priority)
+{
+    PCatPMUManagerCommandData *old_data;
+    GList *link;
+    gint i;
+
+    while(pmu_data->serial_write_command_queue_length >=
+        PCAT_PMU_MANAGER_COMMAND_QUEUE_MAX)
     {
-        if(errno==EAGAIN)
+        link = NULL;
+        for(i=PCAT_PMU_MANAGER_COMMAND_PRIORITY_LAST-1;i>=(gint)priority;i--)
         {
-            ret = TRUE;
+            link = g_queue_peek_head_link(
+                &pmu_data->serial_write_command_queue[i]);
+            if(link!=NULL)
+            {
+                break;
+            }
         }
-        else
+        if(link==NULL)
         {
-            g_warning("Serial port write error: %s", strerror(errno));
+            return FALSE;
         }
-    }
 
-    if(!ret)
-    {
-        pmu_data->serial_write_source = 0;
+        old_data = link->data;
+        pcat_pmu_manager_command_queue_unlink(pmu_data, old_data);
+        pmu_data->serial_write_command_dropped[old_data->priority]++;
+        pcat_pmu_manager_command_data_drop(pmu_data, old_data);
     }
 
-    return ret;
+    return TRUE;
 }
 
-static void pcat_pmu_serial_write_data_request(
-    PCatPMUManagerData *pmu_data, guint16 command, gboolean frame_num_set,
-    guint16 frame_num, const guint8 *extra_data, guint16 extra_data_len,
-    gboolean need_ack)
+/*
+ * Drop a queued command which would be overridden by a newer one anyway,
+ * frames already on the wire are left alone.
+ */
+static void pcat_pmu_manager_command_queue_coalesce(
+    PCatPMUManagerData *pmu_data, PCatPMUManagerCommandPriority priority,
+    guint16 command)
 {
-    GByteArray *ba;
-    guint16 sv;
-    guint16 dp_size;
-    PCatPMUManagerCommandData *new_data, *old_data;
+    GList *link;
+    PCatPMUManagerCommandData *old_data;
 
-    ba = g_byte_array_new();
+    for(link=g_queue_peek_head_link(
+        &pmu_data->serial_write_command_queue[priority]);link!=NULL;
+        link=link->next)
+    {
+        old_data = link->data;
+        if(old_data->command==command)
+        {
+            pcat_pmu_manager_command_queue_unlink(pmu_data, old_data);
+            pmu_data->serial_write_command_coalesced[priority]++;
+            pcat_pmu_manager_command_data_free(pmu_data, old_data);
+
+            break;
+        }
+    }
+}
+
+static void pcat_pmu_serial_write_data_kick(PCatPMUManagerData *pmu_data);
 
-    g_byte_array_append(ba, (const guint8 *)"\xA5\x01\x81", 3);
-    if(frame_num_set)
+/*
+ * RTT estimation in the style of RFC 6298, samples are only taken from
+ * frames which were not retransmitted (Karn's algorithm).
+ */
+static void pcat_pmu_serial_write_rtt_sample(PCatPMUManagerData *pmu_data,
+    gint64 rtt)
+{
+    gint64 delta;
+    gint64 rto;
+
+    if(pmu_data->serial_write_srtt==0)
     {
-        sv = frame_num;
-        sv = GUINT16_TO_LE(sv);
-        g_byte_array_append(ba, (const guint8 *)&sv, 2);
+        pmu_data->serial_write_srtt = rtt;
+        pmu_data->serial_write_rttvar = rtt / 2;
     }
     else
     {
-        frame_num = pmu_data->serial_write_frame_num;
-        sv = pmu_data->serial_write_frame_num;
-        sv = GUINT16_TO_LE(sv);
-        g_byte_array_append(ba, (const guint8 *)&sv, 2);
-        pmu_data->serial_write_frame_num++;
+        delta = pmu_data->serial_write_srtt - rtt;
+        if(delta < 0)
+        {
+            delta = -delta;
+        }
+        pmu_data->serial_write_rttvar =
+            (3 * pmu_data->serial_write_rttvar + delta) / 4;
+        pmu_data->serial_write_srtt =
+            (7 * pmu_data->serial_write_srtt + rtt) / 8;
     }
 
-    if(extra_data!=NULL && extra_data_len > 0 && extra_data_len <= 65532)
-    {
-        sv = extra_data_len + 3;
-        sv = GUINT16_TO_LE(sv);
-        g_byte_array_append(ba, (const guint8 *)&sv, 2);
-
-        sv = command;
-        sv = GUINT16_TO_LE(sv);
-        g_byte_array_append(ba, (const guint8 *)&sv, 2);
+    rto = pmu_data->serial_write_srtt + 4 * pmu_data->serial_write_rttvar;
 
-        g_byte_array_append(ba, extra_data, extra_data_len);
+    pmu_data->serial_write_rto = CLAMP(rto,
+        PCAT_PMU_MANAGER_COMMAND_RTO_MIN, PCAT_PMU_MANAGER_COMMAND_RTO_MAX);
+}
 
-        dp_size = extra_data_len + 3;
-    }
-    else
-    {
-        sv = 3;
-        sv = GUINT16_TO_LE(sv);
+static gboolean pcat_pmu_serial_write_retransmit_timeout_func(
+    gpointer user_data)
+{
+    PCatPMUManagerData *pmu_data = (PCatPMUManagerData *)user_data;
 
-        g_byte_array_append(ba, (const guint8 *)&sv, 2);
+    g_mutex_lock(&pmu_data->mutex);
 
-        sv = command;
-        sv = GUINT16_TO_LE(sv);
-        g_byte_array_append(ba, (const guint8 *)&sv, 2);
+    pmu_data->serial_write_retransmit_timeout_id = 0;
 
-        dp_size = 3;
-    }
+    pcat_pmu_serial_write_data_kick(pmu_data);
 
-    g_byte_array_append(ba,
-        need_ack ? (const guint8 *)"\x01" : (const guint8 *)"\x00", 1);
+    g_mutex_unlock(&pmu_data->mutex);
 
-    sv = pcat_pmu_serial_compute_crc16(ba->data + 1, dp_size + 6);
-    sv = GUINT16_TO_LE(sv);
-    g_byte_array_append(ba, (const guint8 *)&sv, 2);
+    return FALSE;
+}
 
-    g_byte_array_append(ba, (const guint8 *)"\x5A", 1);
+/*
+ * Arm a one-shot timer at the earliest retransmit deadline of the in-flight
+ * frames. A timer which fires too early is harmless, so it is only moved
+ * when a frame needs to be retransmitted sooner.
+ */
+static void pcat_pmu_serial_write_retransmit_timer_update(
+    PCatPMUManagerData *pmu_data, gint64 now)
+{
+    GList *link;
+    PCatPMUManagerCommandData *command_data;
+    gint64 deadline = G_MAXINT64;
+    gint64 timeout;
 
-    while(g_queue_get_length(pmu_data->serial_write_command_queue) >
-       PCAT_PMU_MANAGER_COMMAND_QUEUE_MAX)
+    for(link=g_queue_peek_head_link(&pmu_data->serial_write_inflight_queue);
+        link!=NULL;link=link->next)
     {
-        old_data = g_queue_pop_head(pmu_data->serial_write_command_queue);
-        pcat_pmu_manager_command_data_free(old_data);
+        command_data = link->data;
+        if(command_data->timestamp + command_data->rto < deadline)
+        {
+            deadline = command_data->timestamp + command_data->rto;
+        }
     }
 
-    new_data = g_new0(PCatPMUManagerCommandData, 1);
-    new_data->buffer = ba;
-    new_data->timestamp = g_get_monotonic_time();
-    new_data->need_ack = need_ack;
-    new_data->retry_count = need_ack ? 3 : 1;
-    new_data->frame_num = frame_num;
-    new_data->command = command;
-    new_data->firstrun = TRUE;
-
-    g_queue_push_tail(pmu_data->serial_write_command_queue, new_data);
+    if(deadline==G_MAXINT64)
+    {
+        return;
+    }
 
-    if(pmu_data->serial_write_current_command_data==NULL)
+    if(pmu_data->serial_write_retransmit_timeout_id > 0)
     {
-        pmu_data->serial_write_current_command_data = g_queue_pop_head(
-            pmu_data->serial_write_command_queue);
+        if(pmu_data->serial_write_retransmit_deadline <= deadline)
+        {
+            return;
+        }
+
+        pcat_pmu_manager_io_source_remove(pmu_data,
+            pmu_data->serial_write_retransmit_timeout_id);
+        pmu_data->serial_write_retransmit_timeout_id = 0;
     }
 
-    if(pmu_data->serial_write_source==0)
+    timeout = (deadline - now + 999) / 1000;
+    if(timeout < 1)
     {
-        pmu_data->serial_write_source = g_io_add_watch(
-            pmu_data->serial_channel, G_IO_OUT,
-            pcat_pmu_serial_write_watch_func, pmu_data);
+        timeout = 1;
     }
+
+    pmu_data->serial_write_retransmit_deadline = deadline;
+    pmu_data->serial_write_retransmit_timeout_id =
+        pcat_pmu_manager_io_timeout_add(pmu_data, timeout,
+        pcat_pmu_serial_write_retransmit_timeout_func);
 }
 
-static void pcat_pmu_manager_date_time_sync(PCatPMUManagerData *pmu_data)
+static void pcat_pmu_serial_write_init_latency_check(
+    PCatPMUManagerData *pmu_data)
 {
-    guint8 data[7];
-    GDateTime *dt;
-    gint y, m, d, h, min, sec;
-
-    dt = g_date_time_new_now_utc();
-    g_date_time_get_ymd(dt, &y, &m, &d);
-    h = g_date_time_get_hour(dt);
-    min = g_date_time_get_minute(dt);
-    sec = g_date_time_get_second(dt);
+    if(pmu_data->init_latency_reported || pmu_data->init_start_timestamp==0)
+    {
+        return;
+    }
 
-    data[0] = y & 0xFF;
-    data[1] = (y >> 8) & 0xFF;
-    data[2] = m;
-    data[3] = d;
-    data[4] = h;
-    data[5] = min;
-    data[6] = sec;
+    if(pmu_data->serial_write_current_command_data!=NULL ||
+       !pcat_pmu_manager_command_queue_is_empty(pmu_data) ||
+       !g_queue_is_empty(&pmu_data->serial_write_inflight_queue))
+    {
+        return;
+    }
 
-    g_date_time_unref(dt);
+    pmu_data->init_latency_reported = TRUE;
 
-    pcat_pmu_serial_write_data_request(pmu_data,
-        PCAT_PMU_MANAGER_COMMAND_DATE_TIME_SYNC, FALSE, 0,
-        data, 7, TRUE);
+    g_message("PMU init commands completed in %"G_GINT64_FORMAT" ms "
+        "with command window %u.", (g_get_monotonic_time() -
+        pmu_data->init_start_timestamp) / 1000,
+        pmu_data->serial_write_window);
 }
 
-static void pcat_pmu_manager_schedule_time_update_internal(
-    PCatPMUManagerData *pmu_data)
+static void pcat_pmu_serial_write_inflight_expire(
+    PCatPMUManagerData *pmu_data, gint64 now)
 {
-    guint i;
-    const PCatManagerUserConfigData *uconfig_data;
-    const PCatManagerPowerScheduleData *sdata;
-    GByteArray *startup_setup_buffer;
-    guint8 v;
+    GList *link, *prev;
+    PCatPMUManagerCommandData *command_data;
 
-    uconfig_data = pcat_main_user_config_data_get();
-    if(uconfig_data->power_schedule_data!=NULL)
+    /*
+     * Walk backwards so expired frames keep their original order when they
+     * are put back at the head of the pending queue.
+     */
+    for(link=g_queue_peek_tail_link(&pmu_data->serial_write_inflight_queue);
+        link!=NULL;link=prev)
     {
-        startup_setup_buffer = g_byte_array_new();
+        prev = link->prev;
+        command_data = link->data;
 
-        for(i=0;i<uconfig_data->power_schedule_data->len;i++)
+        if(now < command_data->timestamp + command_data->rto)
         {
-            sdata = g_ptr_array_index(uconfig_data->power_schedule_data, i);
-            if(!sdata->enabled || !sdata->action)
-            {
-                continue;
-            }
+            continue;
+        }
 
-            v = sdata->year & 0xFF;
-            g_byte_array_append(startup_setup_buffer, &v, 1);
-            v = (sdata->year >> 8) & 0xFF;
-            g_byte_array_append(startup_setup_buffer, &v, 1);
+        g_queue_unlink(&pmu_data->serial_write_inflight_queue, link);
 
-            v = sdata->month;
-            g_byte_array_append(startup_setup_buffer, &v, 1);
+        if(command_data->retry_count==0)
+        {
+            g_warning("PMU command %X (frame %u) was not acknowledged!",
+                command_data->command, command_data->frame_num);
+            pcat_pmu_manager_command_data_drop(pmu_data, command_data);
 
-            v = sdata->day;
-            g_byte_array_append(startup_setup_buffer, &v, 1);
+            continue;
+        }
 
-            v = sdata->hour;
+        command_data->retry_count--;
+        command_data->written_size = 0;
+        command_data->retransmitted = TRUE;
+        pmu_data->link_stats.retransmits++;
+        command_data->rto = MIN(command_data->rto * 2,
+            PCAT_PMU_MANAGER_COMMAND_RTO_MAX);
+        pcat_pmu_manager_command_queue_push_head(pmu_data, command_data);
+    }
+}
+
+static void pcat_pmu_serial_write_frame_sent(PCatPMUManagerData *pmu_data,
+    PCatPMUManagerCommandData *command_data, gint64 now)
+{
+    pmu_data->link_stats.tx_frames++;
+
+    if(command_data->need_ack)
+    {
+        command_data->timestamp = now;
+        if(!command_data->retransmitted)
+        {
+            command_data->rto = pmu_data->serial_write_rto;
+        }
+        g_queue_push_tail_link(&pmu_data->serial_write_inflight_queue,
+            &command_data->link);
+    }
+    else
+    {
+        pcat_pmu_manager_command_data_free(pmu_data, command_data);
+    }
+}
+
+/*
+ * Gather the partially written frame and as many queued frames as the ACK
+ * window allows into one I/O vector, queued frames are only peeked here and
+ * get popped once writev() has accepted at least part of them.
+ */
+static guint pcat_pmu_serial_write_iov_gather(PCatPMUManagerData *pmu_data,
+    struct iovec *iov, PCatPMUManagerCommandData **batch)
+{
+    PCatPMUManagerCommandData *command_data;
+    GList *link;
+    guint count = 0;
+    guint ack_count;
+    guint i;
+
+    ack_count = g_queue_get_length(&pmu_data->serial_write_inflight_queue);
+
+    command_data = pmu_data->serial_write_current_command_data;
+    if(command_data!=NULL)
+    {
+        iov[0].iov_base = command_data->buffer + command_data->written_size;
+        iov[0].iov_len = command_data->buffer_size -
+            command_data->written_size;
+        batch[0] = command_data;
+        count = 1;
+
+        if(command_data->need_ack)
+        {
+            ack_count++;
+        }
+    }
+
+    for(i=0;i<PCAT_PMU_MANAGER_COMMAND_PRIORITY_LAST;i++)
+    {
+        for(link=g_queue_peek_head_link(
+            &pmu_data->serial_write_command_queue[i]);link!=NULL;
+            link=link->next)
+        {
+            command_data = link->data;
+
+            if(count >= PCAT_PMU_MANAGER_SERIAL_WRITE_IOV_MAX ||
+               (command_data->need_ack &&
+               ack_count >= pmu_data->serial_write_window))
+            {
+                return count;
+            }
+
+            iov[count].iov_base = command_data->buffer;
+            iov[count].iov_len = command_data->buffer_size;
+            batch[count] = command_data;
+            count++;
+
+            if(command_data->need_ack)
+            {
+                ack_count++;
+            }
+        }
+    }
+
+    return count;
+}
+
+static gboolean pcat_pmu_serial_write_data_flush(
+    PCatPMUManagerData *pmu_data)
+{
+    struct iovec iov[PCAT_PMU_MANAGER_SERIAL_WRITE_IOV_MAX];
+    PCatPMUManagerCommandData *batch[PCAT_PMU_MANAGER_SERIAL_WRITE_IOV_MAX];
+    gssize wsize = 0;
+    gsize remaining_size;
+    gboolean ret = FALSE;
+    gint64 now;
+    guint count;
+    guint i;
+    PCatPMUManagerCommandData *command_data;
+
+    now = g_get_monotonic_time();
+
+    pcat_pmu_serial_write_inflight_expire(pmu_data, now);
+
+    do
+    {
+        count = pcat_pmu_serial_write_iov_gather(pmu_data, iov, batch);
+        if(count==0)
+        {
+            break;
+        }
+
+        wsize = writev(pmu_data->serial_fd, iov, count);
+        pmu_data->link_stats.tx_syscalls++;
+        if(wsize <= 0)
+        {
+            break;
+        }
+        pmu_data->link_stats.tx_bytes += wsize;
+
+        remaining_size = wsize;
+        for(i=0;i<count && remaining_size > 0;i++)
+        {
+            command_data = batch[i];
+            if(command_data!=pmu_data->serial_write_current_command_data)
+            {
+                pmu_data->serial_write_current_command_data =
+                    pcat_pmu_manager_command_queue_pop(pmu_data);
+            }
+
+            if(remaining_size < iov[i].iov_len)
+            {
+                command_data->written_size += remaining_size;
+                break;
+            }
+
+            remaining_size -= iov[i].iov_len;
+            command_data->written_size = command_data->buffer_size;
+            pmu_data->serial_write_current_command_data = NULL;
+
+            pcat_pmu_serial_write_frame_sent(pmu_data, command_data, now);
+        }
+    }
+    while(1);
+
+    if(wsize < 0)
+    {
+        if(errno==EAGAIN)
+        {
+            ret = TRUE;
+        }
+        else
+        {
+            g_warning("Serial port write error: %s", strerror(errno));
+        }
+    }
+
+    pcat_pmu_serial_write_retransmit_timer_update(pmu_data, now);
+    pcat_pmu_serial_write_init_latency_check(pmu_data);
+
+    return ret;
+}
+
+static gboolean pcat_pmu_serial_write_watch_func(GIOChannel *source,
+    GIOCondition condition, gpointer user_data)
+{
+    PCatPMUManagerData *pmu_data = (PCatPMUManagerData *)user_data;
+    gboolean ret;
+    gint64 cpu_time = 0;
+
+    g_mutex_lock(&pmu_data->mutex);
+
+    if(pmu_data->link_stats_cpu_time)
+    {
+        cpu_time = pcat_pmu_serial_cpu_time_get();
+    }
+
+    ret = pcat_pmu_serial_write_data_flush(pmu_data);
+
+    if(pmu_data->link_stats_cpu_time)
+    {
+        pmu_data->link_stats.cpu_time += pcat_pmu_serial_cpu_time_get() -
+            cpu_time;
+    }
+    if(!ret)
+    {
+        pmu_data->serial_write_source = 0;
+    }
+
+    g_mutex_unlock(&pmu_data->mutex);
+
+    return ret;
+}
+
+static gboolean pcat_pmu_serial_write_flush_func(gpointer user_data)
+{
+    PCatPMUManagerData *pmu_data = (PCatPMUManagerData *)user_data;
+
+    g_mutex_lock(&pmu_data->mutex);
+
+    pmu_data->serial_write_flush_source = 0;
+    pcat_pmu_serial_write_data_kick(pmu_data);
+
+    g_mutex_unlock(&pmu_data->mutex);
+
+    return FALSE;
+}
+
+/*
+ * Write as much as possible right away and only fall back to a G_IO_OUT
+ * watch when the UART buffer is full, so the usual case does not create
+ * a new GSource per frame. While received frames are being dispatched the
+ * replies are only queued, and get sent together afterwards.
+ *
+ * Only the I/O thread touches the serial port: commands submitted from
+ * any other thread are queued and the I/O context is woken up to send
+ * them.
+ */
+static void pcat_pmu_serial_write_data_kick(PCatPMUManagerData *pmu_data)
+{
+    if(pmu_data->serial_write_source!=0 || pmu_data->serial_write_deferred)
+    {
+        return;
+    }
+
+    if(!g_main_context_is_owner(pmu_data->io_context))
+    {
+        if(pmu_data->serial_write_flush_source==0)
+        {
+            pmu_data->serial_write_flush_source =
+                pcat_pmu_manager_io_idle_add(pmu_data,
+                pcat_pmu_serial_write_flush_func);
+        }
+
+        return;
+    }
+
+    if(pcat_pmu_serial_write_data_flush(pmu_data))
+    {
+        pmu_data->serial_write_source = pcat_pmu_manager_io_watch_add(
+            pmu_data, G_IO_OUT, pcat_pmu_serial_write_watch_func);
+    }
+}
+
+static gboolean pcat_pmu_serial_write_data_request(
+    PCatPMUManagerData *pmu_data, guint16 command, gboolean frame_num_set,
+    guint16 frame_num, const guint8 *extra_data, guint16 extra_data_len,
+    gboolean need_ack)
+{
+    guint8 *p;
+    guint16 crc;
+    guint16 dp_size;
+    PCatPMUManagerCommandPriority priority;
+    PCatPMUManagerCommandData *new_data;
+
+    if(extra_data==NULL || extra_data_len==0 || extra_data_len > 65532)
+    {
+        extra_data_len = 0;
+    }
+    dp_size = extra_data_len + 3;
+
+    priority = pcat_pmu_manager_command_priority_get(command);
+
+    if(pcat_pmu_manager_command_coalescable(command))
+    {
+        pcat_pmu_manager_command_queue_coalesce(pmu_data, priority, command);
+    }
+
+    if(!pcat_pmu_manager_command_queue_reserve(pmu_data, priority))
+    {
+        pmu_data->serial_write_command_dropped[priority]++;
+
+        return FALSE;
+    }
+
+    /* Only commands which make it into the queue use up a frame number. */
+    if(!frame_num_set)
+    {
+        frame_num = pmu_data->serial_write_frame_num;
+        pmu_data->serial_write_frame_num++;
+    }
+
+    new_data = pcat_pmu_manager_command_data_new(pmu_data,
+        (gsize)extra_data_len + 13);
+    p = new_data->buffer;
+
+    p[0] = 0xA5;
+    p[1] = 0x01;
+    p[2] = 0x81;
+    p[3] = frame_num & 0xFF;
+    p[4] = (frame_num >> 8) & 0xFF;
+    p[5] = dp_size & 0xFF;
+    p[6] = (dp_size >> 8) & 0xFF;
+    p[7] = command & 0xFF;
+    p[8] = (command >> 8) & 0xFF;
+    if(extra_data_len > 0)
+    {
+        memcpy(p + 9, extra_data, extra_data_len);
+    }
+    p[9 + extra_data_len] = need_ack ? 1 : 0;
+
+    crc = pcat_crc16_compute(p + 1, dp_size + 6);
+    p[10 + extra_data_len] = crc & 0xFF;
+    p[11 + extra_data_len] = (crc >> 8) & 0xFF;
+    p[12 + extra_data_len] = 0x5A;
+
+    new_data->timestamp = g_get_monotonic_time();
+    new_data->need_ack = need_ack;
+    new_data->retry_count = need_ack ? 3 : 1;
+    new_data->frame_num = frame_num;
+    new_data->command = command;
+    new_data->priority = priority;
+    new_data->rto = pmu_data->serial_write_rto;
+    new_data->retransmitted = FALSE;
+
+    pcat_pmu_manager_command_queue_push_tail(pmu_data, new_data);
+
+    pcat_pmu_serial_write_data_kick(pmu_data);
+
+    return TRUE;
+}
+
+static void pcat_pmu_manager_date_time_sync(PCatPMUManagerData *pmu_data)
+{
+    guint8 data[7];
+    GDateTime *dt;
+    gint y, m, d, h, min, sec;
+
+    dt = g_date_time_new_now_utc();
+    g_date_time_get_ymd(dt, &y, &m, &d);
+    h = g_date_time_get_hour(dt);
+    min = g_date_time_get_minute(dt);
+    sec = g_date_time_get_second(dt);
+
+    data[0] = y & 0xFF;
+    data[1] = (y >> 8) & 0xFF;
+    data[2] = m;
+    data[3] = d;
+    data[4] = h;
+    data[5] = min;
+    data[6] = sec;
+
+    g_date_time_unref(dt);
+
+    pcat_pmu_serial_write_data_request(pmu_data,
+        PCAT_PMU_MANAGER_COMMAND_DATE_TIME_SYNC, FALSE, 0,
+        data, 7, TRUE);
+}
+
+static void pcat_pmu_manager_schedule_time_update_internal(
+    PCatPMUManagerData *pmu_data)
+{
+    guint i;
+    const PCatManagerUserConfigData *uconfig_data;
+    const PCatManagerPowerScheduleData *sdata;
+    GByteArray *startup_setup_buffer;
+    guint8 v;
+
+    uconfig_data = pcat_main_user_config_data_get();
+    if(uconfig_data->power_schedule_data!=NULL)
+    {
+        startup_setup_buffer = g_byte_array_new();
+
+        for(i=0;i<uconfig_data->power_schedule_data->len;i++)
+        {
+            sdata = g_ptr_array_index(uconfig_data->power_schedule_data, i);
+            if(!sdata->enabled || !sdata->action)
+            {
+                continue;
+            }
+
+            v = sdata->year & 0xFF;
+            g_byte_array_append(startup_setup_buffer, &v, 1);
+            v = (sdata->year >> 8) & 0xFF;
+            g_byte_array_append(startup_setup_buffer, &v, 1);
+
+            v = sdata->month;
+            g_byte_array_append(startup_setup_buffer, &v, 1);
+
+            v = sdata->day;
+            g_byte_array_append(startup_setup_buffer, &v, 1);
+
+            v = sdata->hour;
             g_byte_array_append(startup_setup_buffer, &v, 1);
 
             v = sdata->minute;
@@ -588,35 +1247,285 @@ static void pcat_pmu_manager_voltage_threshold_set_interval(
         buffer, 18, TRUE);
 }
 
-static void pcat_pmu_serial_status_data_parse(PCatPMUManagerData *pmu_data,
-    const guint8 *data, guint len)
+/*
+ * Piecewise linear SoC from an 11 point voltage table (100% down to 0% in
+ * 10% steps), only used to fill the lookup tables below.
+ */
+static gdouble pcat_pmu_manager_soc_interpolate(const guint *table,
+    guint battery_voltage)
 {
-    guint16 battery_voltage, charger_voltage;
-    guint16 gpio_input, gpio_output;
-    gint y, m, d, h, min, s;
-    GDateTime *pmu_dt, *host_dt;
-    gint64 pmu_unix_time, host_unix_time;
-    FILE *fp;
-    gdouble battery_percentage;
-    guint battery_percentage_i;
-    gboolean on_battery;
-    struct timeval tv;
-    guint8 board_temp = 0;
+    gdouble battery_percentage = 0.0f;
     guint i;
 
-    if(len < 16)
+    if(battery_voltage > table[0])
     {
-        return;
+        return 100.0f;
+    }
+    if(battery_voltage <= table[10])
+    {
+        return 0.0f;
     }
 
-    battery_voltage = data[0] + ((guint16)data[1] << 8);
-    charger_voltage = data[2] + ((guint16)data[3] << 8);
-    gpio_input = data[4] + ((guint16)data[5] << 8);
-    gpio_output = data[6] + ((guint16)data[7] << 8);
-    y = data[8] + ((guint16)data[9] << 8);
-    m = data[10];
-    d = data[11];
-    h = data[12];
+    for(i=0;i<10;i++)
+    {
+        if(battery_voltage >= table[i+1])
+        {
+            battery_percentage = (90.0f - 10 * i) +
+                ((gdouble)battery_voltage - table[i+1]) * 10 /
+                (table[i] - table[i+1]);
+
+            break;
+        }
+    }
+
+    return battery_percentage;
+}
+
+/*
+ * Expand a voltage table into one entry per millivolt between its lowest
+ * and highest point, in 1/100 percent as reported to clients.
+ */
+static void pcat_pmu_manager_soc_lut_build(PCatPMUManagerSoCLUT *lut,
+    const guint *table)
+{
+    guint v;
+
+    g_free(lut->data);
+
+    lut->min_voltage = table[10];
+    lut->max_voltage = table[0];
+    lut->data = g_new(guint16, lut->max_voltage - lut->min_voltage + 1);
+
+    for(v=lut->min_voltage;v<=lut->max_voltage;v++)
+    {
+        lut->data[v - lut->min_voltage] =
+            (guint)(pcat_pmu_manager_soc_interpolate(table, v) * 100);
+    }
+}
+
+static void pcat_pmu_manager_soc_lut_clear(PCatPMUManagerSoCLUT *lut)
+{
+    g_free(lut->data);
+    lut->data = NULL;
+}
+
+static inline guint pcat_pmu_manager_soc_lut_lookup(
+    const PCatPMUManagerSoCLUT *lut, guint battery_voltage)
+{
+    if(battery_voltage > lut->max_voltage)
+    {
+        return 10000;
+    }
+    if(battery_voltage < lut->min_voltage)
+    {
+        return 0;
+    }
+
+    return lut->data[battery_voltage - lut->min_voltage];
+}
+
+/*
+ * (Re)build all SoC lookup tables, must be called whenever the voltage
+ * tables change.
+ */
+static void pcat_pmu_manager_soc_lut_update(PCatPMUManagerData *pmu_data)
+{
+    pcat_pmu_manager_soc_lut_build(&pmu_data->soc_charge_lut,
+        pmu_data->battery_charge_table);
+    pcat_pmu_manager_soc_lut_build(&pmu_data->soc_discharge_normal_lut,
+        pmu_data->battery_discharge_table_normal);
+    pcat_pmu_manager_soc_lut_build(&pmu_data->soc_discharge_5g_lut,
+        pmu_data->battery_discharge_table_5g);
+
+    if(pmu_data->modem_device_type==PCAT_MODEM_MANAGER_DEVICE_5G)
+    {
+        pmu_data->soc_discharge_lut = &pmu_data->soc_discharge_5g_lut;
+    }
+    else
+    {
+        pmu_data->soc_discharge_lut = &pmu_data->soc_discharge_normal_lut;
+    }
+}
+
+/*
+ * Write the changed statefs battery files on the default main loop. The
+ * files are kept open and rewritten in place, so an update costs a
+ * pwrite() and an ftruncate() and nothing at all if the value is the same.
+ */
+static void pcat_pmu_manager_statefs_flush(PCatPMUManagerData *pmu_data)
+{
+    gchar values[PCAT_PMU_MANAGER_STATEFS_LAST][
+        PCAT_PMU_MANAGER_STATEFS_VALUE_SIZE];
+    gsize len;
+    guint i;
+
+    g_mutex_lock(&pmu_data->statefs_mutex);
+    memcpy(values, pmu_data->statefs_pending, sizeof(values));
+    g_mutex_unlock(&pmu_data->statefs_mutex);
+
+    for(i=0;i<PCAT_PMU_MANAGER_STATEFS_LAST;i++)
+    {
+        if(values[i][0]=='\0' ||
+           strcmp(values[i], pmu_data->statefs_written[i])==0)
+        {
+            continue;
+        }
+
+        if(pmu_data->statefs_fds[i] < 0)
+        {
+            pmu_data->statefs_fds[i] = open(
+                g_pcat_pmu_manager_statefs_file_names[i],
+                O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            if(pmu_data->statefs_fds[i] < 0)
+            {
+                continue;
+            }
+        }
+
+        len = strlen(values[i]);
+        if(pwrite(pmu_data->statefs_fds[i], values[i], len, 0)!=(gssize)len ||
+           ftruncate(pmu_data->statefs_fds[i], len)!=0)
+        {
+            g_warning("Failed to write %s: %s",
+                g_pcat_pmu_manager_statefs_file_names[i], strerror(errno));
+            close(pmu_data->statefs_fds[i]);
+            pmu_data->statefs_fds[i] = -1;
+
+            continue;
+        }
+
+        memcpy(pmu_data->statefs_written[i], values[i], len + 1);
+    }
+}
+
+static gboolean pcat_pmu_manager_statefs_flush_timeout_func(
+    gpointer user_data)
+{
+    PCatPMUManagerData *pmu_data = (PCatPMUManagerData *)user_data;
+
+    g_mutex_lock(&pmu_data->statefs_mutex);
+    pmu_data->statefs_flush_timeout_id = 0;
+    g_mutex_unlock(&pmu_data->statefs_mutex);
+
+    pcat_pmu_manager_statefs_flush(pmu_data);
+
+    return FALSE;
+}
+
+/*
+ * Called from the PMU I/O thread, only formats the values and leaves the
+ * file writes to a deferred flush on the default main loop, so reports
+ * arriving close together are written once.
+ */
+static void pcat_pmu_manager_statefs_update(PCatPMUManagerData *pmu_data,
+    gdouble battery_percentage, guint battery_voltage, gboolean on_battery)
+{
+    g_mutex_lock(&pmu_data->statefs_mutex);
+
+    g_snprintf(pmu_data->statefs_pending[
+        PCAT_PMU_MANAGER_STATEFS_CHARGE_PERCENTAGE],
+        PCAT_PMU_MANAGER_STATEFS_VALUE_SIZE, "%lf\n", battery_percentage);
+    g_snprintf(pmu_data->statefs_pending[PCAT_PMU_MANAGER_STATEFS_VOLTAGE],
+        PCAT_PMU_MANAGER_STATEFS_VALUE_SIZE, "%u\n", battery_voltage * 1000);
+    g_snprintf(pmu_data->statefs_pending[
+        PCAT_PMU_MANAGER_STATEFS_ON_BATTERY],
+        PCAT_PMU_MANAGER_STATEFS_VALUE_SIZE, "%u\n", on_battery ? 1 : 0);
+
+    if(pmu_data->statefs_flush_timeout_id==0)
+    {
+        pmu_data->statefs_flush_timeout_id = g_timeout_add(
+            PCAT_PMU_MANAGER_STATEFS_FLUSH_DELAY,
+            pcat_pmu_manager_statefs_flush_timeout_func, pmu_data);
+    }
+
+    g_mutex_unlock(&pmu_data->statefs_mutex);
+}
+
+/*
+ * Publish the status for lock-free readers on other threads, the sequence
+ * number only moves when a value actually changed.
+ */
+static void pcat_pmu_manager_status_publish(PCatPMUManagerData *pmu_data)
+{
+    PCatPMUManagerStatus status;
+
+    memset(&status, 0, sizeof(status));
+    status.battery_voltage = pmu_data->last_battery_voltage;
+    status.charger_voltage = pmu_data->last_charger_voltage;
+    status.on_battery = pmu_data->last_on_battery_state;
+    status.battery_percentage = pmu_data->last_battery_percentage;
+    status.battery_percentage_confidence =
+        pmu_data->battery_percentage_confidence;
+    status.board_temp = pmu_data->board_temp;
+
+    if(memcmp(&status, &pmu_data->status, sizeof(status))==0)
+    {
+        return;
+    }
+
+    pcat_seqlock_write(&pmu_data->status_sequence, &pmu_data->status,
+        &status, sizeof(status));
+}
+
+/*
+ * Status reports arrive every second, only journal one per configured
+ * interval (and on charger plug events) to keep the flash writes low.
+ */
+static void pcat_pmu_manager_journal_status(PCatPMUManagerData *pmu_data,
+    gboolean force)
+{
+    const PCatManagerMainConfigData *config_data;
+    gint32 values[5];
+    gint64 now;
+
+    config_data = pcat_main_config_data_get();
+    now = g_get_monotonic_time();
+
+    if(!force && pmu_data->journal_status_timestamp!=0 &&
+       now < pmu_data->journal_status_timestamp +
+       (gint64)config_data->journal_status_interval * 1000000L)
+    {
+        return;
+    }
+    pmu_data->journal_status_timestamp = now;
+
+    values[0] = pmu_data->last_battery_voltage;
+    values[1] = pmu_data->last_charger_voltage;
+    values[2] = pmu_data->last_on_battery_state ? 1 : 0;
+    values[3] = pmu_data->last_battery_percentage;
+    values[4] = pmu_data->board_temp;
+    pcat_journal_append(PCAT_JOURNAL_RECORD_PMU_STATUS, values, 5);
+}
+
+static void pcat_pmu_serial_status_data_parse(PCatPMUManagerData *pmu_data,
+    const guint8 *data, guint len)
+{
+    guint16 battery_voltage, charger_voltage;
+    guint16 gpio_input, gpio_output;
+    gint y, m, d, h, min, s;
+    GDateTime *pmu_dt, *host_dt;
+    gint64 pmu_unix_time, host_unix_time;
+    gdouble battery_percentage;
+    guint battery_percentage_i;
+    gboolean on_battery;
+    struct timeval tv;
+    guint8 board_temp = 0;
+    gint32 telemetry_values[PCAT_TELEMETRY_COLUMN_LAST];
+    gboolean on_battery_changed;
+
+    if(len < 16)
+    {
+        return;
+    }
+
+    battery_voltage = data[0] + ((guint16)data[1] << 8);
+    charger_voltage = data[2] + ((guint16)data[3] << 8);
+    gpio_input = data[4] + ((guint16)data[5] << 8);
+    gpio_output = data[6] + ((guint16)data[7] << 8);
+    y = data[8] + ((guint16)data[9] << 8);
+    m = data[10];
+    d = data[11];
+    h = data[12];
     min = data[13];
     s = data[14];
 
@@ -678,361 +1587,733 @@ static void pcat_pmu_serial_status_data_parse(PCatPMUManagerData *pmu_data,
         charger_voltage, gpio_input, gpio_output);
 
     on_battery = (charger_voltage < 4200);
-    battery_percentage = 100.0f;
 
     if(!on_battery)
     {
-        if(battery_voltage > pmu_data->battery_charge_table[0])
-        {
-            battery_percentage = 100.0f;
-        }
-        else if(battery_voltage > pmu_data->battery_charge_table[10])
-        {
-            battery_percentage = 0.0f;
-            for(i=0;i<10;i++)
-            {
-                if(battery_voltage >= pmu_data->battery_charge_table[i+1])
-                {
-                    battery_percentage = (90.0f - 10 * i) +
-                        ((gdouble)battery_voltage -
-                         pmu_data->battery_charge_table[i+1]) * 10 /
-                        (pmu_data->battery_charge_table[i] -
-                         pmu_data->battery_charge_table[i+1]);
+        battery_percentage_i = pcat_pmu_manager_soc_lut_lookup(
+            &pmu_data->soc_charge_lut, battery_voltage);
+    }
+    else
+    {
+        battery_percentage_i = pcat_pmu_manager_soc_lut_lookup(
+            pmu_data->soc_discharge_lut, battery_voltage);
+    }
 
-                    break;
-                }
-            }
-        }
-        else
-        {
-            battery_percentage = 0.0f;
-        }
+    if(pmu_data->battery_estimator!=NULL)
+    {
+        pcat_battery_estimator_update(pmu_data->battery_estimator,
+            g_get_monotonic_time(), battery_percentage_i / 100.0, on_battery,
+            pmu_data->modem_device_type==PCAT_MODEM_MANAGER_DEVICE_5G ?
+            PCAT_BATTERY_ESTIMATOR_LOAD_HIGH :
+            PCAT_BATTERY_ESTIMATOR_LOAD_NORMAL);
+        battery_percentage_i = pcat_battery_estimator_soc_get(
+            pmu_data->battery_estimator) * 100.0 + 0.5;
+        pmu_data->battery_percentage_confidence =
+            pcat_battery_estimator_confidence_get(
+            pmu_data->battery_estimator);
     }
-    else if(pcat_modem_manager_device_type_get()==
-        PCAT_MODEM_MANAGER_DEVICE_5G)
+    battery_percentage = battery_percentage_i / 100.0;
+
+    on_battery_changed = (on_battery!=pmu_data->last_on_battery_state);
+    pmu_data->last_battery_voltage = battery_voltage;
+    pmu_data->last_charger_voltage = charger_voltage;
+    pmu_data->last_on_battery_state = on_battery;
+    pmu_data->board_temp = board_temp;
+    pmu_data->board_temp -= 40;
+
+    if(on_battery)
     {
-        if(battery_voltage > pmu_data->battery_discharge_table_5g[0])
-        {
-            battery_percentage = 100.0f;
-        }
-        else if(battery_voltage > pmu_data->battery_discharge_table_5g[10])
+        if(battery_percentage_i < pmu_data->last_battery_percentage_cap)
         {
-            battery_percentage = 0.0f;
-            for(i=0;i<10;i++)
-            {
-                if(battery_voltage >=
-                    pmu_data->battery_discharge_table_5g[i+1])
-                {
-                    battery_percentage = (90.0f - 10 * i) +
-                        ((gdouble)battery_voltage -
-                         pmu_data->battery_discharge_table_5g[i+1]) * 10 /
-                        (pmu_data->battery_discharge_table_5g[i] -
-                         pmu_data->battery_discharge_table_5g[i+1]);
-
-                    break;
-                }
-            }
+            pmu_data->last_battery_percentage_cap = battery_percentage_i;
+            pmu_data->last_battery_percentage = battery_percentage_i;
         }
         else
         {
-            battery_percentage = 0.0f;
+            pmu_data->last_battery_percentage =
+                pmu_data->last_battery_percentage_cap;
         }
     }
     else
     {
-        if(battery_voltage > pmu_data->battery_discharge_table_normal[0])
+        pmu_data->last_battery_percentage_cap = 10000;
+        pmu_data->last_battery_percentage = battery_percentage_i;
+    }
+
+    pcat_pmu_manager_status_publish(pmu_data);
+
+    telemetry_values[PCAT_TELEMETRY_COLUMN_BATTERY_VOLTAGE] = battery_voltage;
+    telemetry_values[PCAT_TELEMETRY_COLUMN_CHARGER_VOLTAGE] = charger_voltage;
+    telemetry_values[PCAT_TELEMETRY_COLUMN_GPIO_INPUT] = gpio_input;
+    telemetry_values[PCAT_TELEMETRY_COLUMN_GPIO_OUTPUT] = gpio_output;
+    telemetry_values[PCAT_TELEMETRY_COLUMN_BOARD_TEMP] = pmu_data->board_temp;
+    telemetry_values[PCAT_TELEMETRY_COLUMN_BATTERY_PERCENTAGE] =
+        pmu_data->last_battery_percentage;
+    pcat_telemetry_append(pmu_data->telemetry,
+        g_get_real_time() / G_USEC_PER_SEC, telemetry_values);
+
+    pcat_pmu_manager_journal_status(pmu_data, on_battery_changed);
+
+    pcat_pmu_manager_statefs_update(pmu_data, battery_percentage,
+        battery_voltage, on_battery);
+}
+
+static inline guint8 pcat_pmu_serial_read_buffer_get(
+    const PCatPMUManagerData *pmu_data, gsize offset)
+{
+    return pmu_data->serial_read_buffer[(pmu_data->serial_read_tail + offset) &
+        PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_MASK];
+}
+
+static gboolean pcat_pmu_serial_read_buffer_find_sync(
+    const PCatPMUManagerData *pmu_data, gsize *sync_offset)
+{
+    gsize used_size, offset = 0, start, len;
+    const guint8 *p;
+
+    used_size = pmu_data->serial_read_head - pmu_data->serial_read_tail;
+
+    while(offset < used_size)
+    {
+        start = (pmu_data->serial_read_tail + offset) &
+            PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_MASK;
+        len = used_size - offset;
+        if(len > PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE - start)
         {
-            battery_percentage = 100.0f;
+            len = PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE - start;
         }
-        else if(battery_voltage >
-            pmu_data->battery_discharge_table_normal[10])
+
+        p = memchr(pmu_data->serial_read_buffer + start, 0xA5, len);
+        if(p!=NULL)
         {
-            battery_percentage = 0.0f;
-            for(i=0;i<10;i++)
-            {
-                if(battery_voltage >=
-                    pmu_data->battery_discharge_table_normal[i+1])
-                {
-                    battery_percentage = (90.0f - 10 * i) +
-                        ((gdouble)battery_voltage -
-                         pmu_data->battery_discharge_table_normal[i+1]) * 10 /
-                        (pmu_data->battery_discharge_table_normal[i] -
-                         pmu_data->battery_discharge_table_normal[i+1]);
+            *sync_offset = offset + (p - pmu_data->serial_read_buffer - start);
 
-                    break;
-                }
-            }
+            return TRUE;
         }
-        else
+
+        offset += len;
+    }
+
+    return FALSE;
+}
+
+static guint16 pcat_pmu_serial_read_buffer_crc_update(
+    const PCatPMUManagerData *pmu_data, guint16 crc, gsize offset, gsize len)
+{
+    gsize start, first_len;
+
+    start = (pmu_data->serial_read_tail + offset) &
+        PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_MASK;
+    first_len = PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE - start;
+
+    if(len <= first_len)
+    {
+        return pcat_crc16_update(crc, pmu_data->serial_read_buffer + start,
+            len);
+    }
+
+    crc = pcat_crc16_update(crc, pmu_data->serial_read_buffer + start,
+        first_len);
+
+    return pcat_crc16_update(crc, pmu_data->serial_read_buffer,
+        len - first_len);
+}
+
+/*
+ * Return a contiguous view of a frame at the read tail. Frames are parsed
+ * in place unless they straddle the end of the ring, in which case they
+ * are copied into the frame buffer first.
+ */
+static const guint8 *pcat_pmu_serial_read_buffer_frame_get(
+    PCatPMUManagerData *pmu_data, gsize len)
+{
+    gsize start, first_len;
+
+    start = pmu_data->serial_read_tail &
+        PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_MASK;
+    if(start + len <= PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE)
+    {
+        return pmu_data->serial_read_buffer + start;
+    }
+
+    first_len = PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE - start;
+    memcpy(pmu_data->serial_read_frame_buffer,
+        pmu_data->serial_read_buffer + start, first_len);
+    memcpy(pmu_data->serial_read_frame_buffer + first_len,
+        pmu_data->serial_read_buffer, len - first_len);
+
+    return pmu_data->serial_read_frame_buffer;
+}
+
+static PCatPMUManagerCommandData *pcat_pmu_serial_write_ack_queue_find(
+    GQueue *queue, guint16 command, guint16 frame_num)
+{
+    GList *link;
+    PCatPMUManagerCommandData *command_data;
+
+    for(link=g_queue_peek_head_link(queue);link!=NULL;link=link->next)
+    {
+        command_data = link->data;
+
+        if(command_data->need_ack && command_data->command + 1==command &&
+           command_data->frame_num==frame_num)
         {
-            battery_percentage = 0.0f;
+            return command_data;
         }
     }
 
-    pmu_data->last_battery_voltage = battery_voltage;
-    pmu_data->last_charger_voltage = charger_voltage;
-    pmu_data->last_on_battery_state = on_battery;
-    pmu_data->board_temp = board_temp;
-    pmu_data->board_temp -= 40;
+    return NULL;
+}
 
-    if(on_battery)
+static void pcat_pmu_serial_write_ack_process(PCatPMUManagerData *pmu_data,
+    guint16 command, guint16 frame_num)
+{
+    PCatPMUManagerCommandData *command_data;
+
+    command_data = pcat_pmu_serial_write_ack_queue_find(
+        &pmu_data->serial_write_inflight_queue, command, frame_num);
+    if(command_data!=NULL)
     {
-        battery_percentage_i = battery_percentage * 100;
+        g_queue_unlink(&pmu_data->serial_write_inflight_queue,
+            &command_data->link);
+        if(!command_data->retransmitted)
+        {
+            pcat_pmu_serial_write_rtt_sample(pmu_data,
+                g_get_monotonic_time() - command_data->timestamp);
+        }
+        pcat_pmu_manager_command_data_free(pmu_data, command_data);
 
-        if(battery_percentage_i < pmu_data->last_battery_percentage_cap)
+        pcat_pmu_serial_write_data_kick(pmu_data);
+        pcat_pmu_serial_write_init_latency_check(pmu_data);
+
+        return;
+    }
+
+    /*
+     * A late ACK can arrive after the frame has already been put back for
+     * retransmission, drop the pending copy in that case.
+     */
+    command_data = pmu_data->serial_write_current_command_data;
+    if(command_data!=NULL && command_data->need_ack &&
+       command_data->command + 1==command &&
+       command_data->frame_num==frame_num)
+    {
+        if(command_data->written_size==0)
         {
-            pmu_data->last_battery_percentage_cap = battery_percentage_i;
-            pmu_data->last_battery_percentage = battery_percentage_i;
+            pcat_pmu_manager_command_data_free(pmu_data, command_data);
+            pmu_data->serial_write_current_command_data = NULL;
         }
         else
         {
-            pmu_data->last_battery_percentage =
-                pmu_data->last_battery_percentage_cap;
+            command_data->need_ack = FALSE;
         }
+
+        return;
     }
-    else
+
+    command_data = pcat_pmu_serial_write_ack_queue_find(
+        &pmu_data->serial_write_command_queue[
+        pcat_pmu_manager_command_priority_get(command - 1)],
+        command, frame_num);
+    if(command_data!=NULL)
     {
-        pmu_data->last_battery_percentage_cap = 10000;
-        pmu_data->last_battery_percentage = battery_percentage * 100;
+        pcat_pmu_manager_command_queue_unlink(pmu_data, command_data);
+        pcat_pmu_manager_command_data_free(pmu_data, command_data);
     }
+}
 
-    fp = fopen(PCAT_PMU_MANAGER_STATEFS_BATTERY_PATH"/ChargePercentage", "w");
-    if(fp!=NULL)
+static void pcat_pmu_serial_baud_switch(PCatPMUManagerData *pmu_data,
+    guint baud, gboolean check);
+
+static gboolean pcat_pmu_serial_baud_check_timeout_func(gpointer user_data)
+{
+    PCatPMUManagerData *pmu_data = (PCatPMUManagerData *)user_data;
+    PCatManagerMainConfigData *main_config_data;
+    guint baud;
+
+    g_mutex_lock(&pmu_data->mutex);
+
+    pmu_data->serial_baud_check_timeout_id = 0;
+
+    if(pmu_data->link_stats.rx_frames!=pmu_data->serial_baud_check_rx_frames)
     {
-        fprintf(fp, "%lf\n", battery_percentage);
-        fclose(fp);
+        g_message("PMU serial link works at %u.", pmu_data->serial_baud);
+        g_mutex_unlock(&pmu_data->mutex);
+
+        return FALSE;
+    }
+
+    main_config_data = pcat_main_config_data_get();
+    baud = main_config_data->pm_serial_baud;
+    if(pcat_serial_speed_get(baud)==B0)
+    {
+        baud = PCAT_SERIAL_BAUD_DEFAULT;
+    }
+
+    g_warning("No PMU frames received at serial speed %u, fall back to %u!",
+        pmu_data->serial_baud, baud);
+    pcat_pmu_serial_baud_switch(pmu_data, baud, FALSE);
+
+    g_mutex_unlock(&pmu_data->mutex);
+
+    return FALSE;
+}
+
+/*
+ * Change the local line speed once the PMU acknowledged the switch. If no
+ * valid frame arrives at the new speed in time, go back to the configured
+ * base speed, firmware listed in SerialBaudFirmware has to do the same on
+ * its own.
+ */
+static void pcat_pmu_serial_baud_switch(PCatPMUManagerData *pmu_data,
+    guint baud, gboolean check)
+{
+    if(pcat_serial_speed_set(pmu_data->serial_fd, baud)!=0)
+    {
+        g_warning("Failed to set PMU serial speed to %u: %s", baud,
+            strerror(errno));
+
+        return;
     }
 
-    fp = fopen(PCAT_PMU_MANAGER_STATEFS_BATTERY_PATH"/Voltage", "w");
-    if(fp!=NULL)
+    g_message("PMU serial speed changed from %u to %u.",
+        pmu_data->serial_baud, baud);
+    pmu_data->serial_baud = baud;
+
+    if(pmu_data->serial_baud_check_timeout_id > 0)
     {
-        fprintf(fp, "%u\n", battery_voltage * 1000);
-        fclose(fp);
+        pcat_pmu_manager_io_source_remove(pmu_data,
+            pmu_data->serial_baud_check_timeout_id);
+        pmu_data->serial_baud_check_timeout_id = 0;
     }
 
-    fp = fopen(PCAT_PMU_MANAGER_STATEFS_BATTERY_PATH"/OnBattery", "w");
-    if(fp!=NULL)
+    if(check)
     {
-        fprintf(fp, "%u\n", on_battery ? 1 : 0);
-        fclose(fp);
+        pmu_data->serial_baud_check_rx_frames =
+            pmu_data->link_stats.rx_frames;
+        pmu_data->serial_baud_check_timeout_id =
+            pcat_pmu_manager_io_timeout_add_seconds(pmu_data,
+            PCAT_PMU_MANAGER_SERIAL_BAUD_CHECK_TIMEOUT,
+            pcat_pmu_serial_baud_check_timeout_func);
     }
 }
 
-static void pcat_pmu_serial_read_data_parse(PCatPMUManagerData *pmu_data)
+static gboolean pcat_pmu_serial_baud_firmware_supported(
+    const PCatManagerMainConfigData *main_config_data,
+    const gchar *fw_version)
 {
     guint i;
-    gsize used_size = 0, remaining_size;
-    GByteArray *buffer = pmu_data->serial_read_buffer;
-    guint16 expect_len, extra_data_len;
-    const guint8 *p, *extra_data;
-    guint16 checksum, rchecksum;
+
+    if(main_config_data->pm_serial_baud_firmware==NULL || fw_version==NULL)
+    {
+        return FALSE;
+    }
+
+    for(i=0;main_config_data->pm_serial_baud_firmware[i]!=NULL;i++)
+    {
+        if(main_config_data->pm_serial_baud_firmware[i][0]!='\0' &&
+           g_str_has_prefix(fw_version,
+           main_config_data->pm_serial_baud_firmware[i]))
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static void pcat_pmu_serial_baud_upgrade_request(
+    PCatPMUManagerData *pmu_data)
+{
+    PCatManagerMainConfigData *main_config_data;
+    guint baud;
+    guint8 buffer[4];
+
+    main_config_data = pcat_main_config_data_get();
+    baud = main_config_data->pm_serial_baud_max;
+
+    if(baud <= pmu_data->serial_baud || pmu_data->serial_baud_pending!=0)
+    {
+        return;
+    }
+    if(!pcat_pmu_serial_baud_firmware_supported(main_config_data,
+        pmu_data->pmu_fw_version))
+    {
+        g_message("PMU firmware %s is not listed in SerialBaudFirmware, "
+            "keep serial speed %u.", pmu_data->pmu_fw_version,
+            pmu_data->serial_baud);
+
+        return;
+    }
+    if(pcat_serial_speed_get(baud)==B0)
+    {
+        g_warning("Unsupported PMU serial speed %u, skip speed upgrade!",
+            baud);
+
+        return;
+    }
+
+    buffer[0] = baud & 0xFF;
+    buffer[1] = (baud >> 8) & 0xFF;
+    buffer[2] = (baud >> 16) & 0xFF;
+    buffer[3] = (baud >> 24) & 0xFF;
+
+    if(pcat_pmu_serial_write_data_request(pmu_data,
+        PCAT_PMU_MANAGER_COMMAND_SERIAL_BAUD_SET, FALSE, 0,
+        buffer, 4, TRUE))
+    {
+        pmu_data->serial_baud_pending = baud;
+    }
+}
+
+static void pcat_pmu_manager_journal_shutdown(PCatPMUManagerData *pmu_data,
+    PCatJournalCause cause)
+{
+    gint32 values[3];
+
+    values[0] = cause;
+    values[1] = pmu_data->last_battery_voltage;
+    values[2] = pmu_data->last_charger_voltage;
+    pcat_journal_append(PCAT_JOURNAL_RECORD_SHUTDOWN, values, 3);
+}
+
+static gboolean pcat_pmu_manager_main_shutdown_request_func(
+    gpointer user_data)
+{
+    pcat_main_request_shutdown(FALSE);
+
+    return FALSE;
+}
+
+static void pcat_pmu_serial_read_frame_process(PCatPMUManagerData *pmu_data,
+    const guint8 *p, guint16 expect_len)
+{
+    guint16 extra_data_len;
+    const guint8 *extra_data;
     guint16 command;
     guint8 src, dst;
     gboolean need_ack;
     guint16 frame_num;
+    gint32 value;
 
-    if(buffer->len < 13)
+    src = p[1];
+    dst = p[2];
+    frame_num = p[3] + ((guint16)p[4] << 8);
+
+    command = p[7] + ((guint16)p[8] << 8);
+    extra_data_len = expect_len - 3;
+    if(expect_len > 3)
     {
-        return;
+        extra_data = p + 9;
+    }
+    else
+    {
+        extra_data = NULL;
     }
+    need_ack = (p[6 + expect_len]!=0);
 
-    for(i=0;i<buffer->len;i++)
+    pmu_data->link_stats.rx_frames++;
+
+    g_debug("Got command %X from %X to %X.", command, src, dst);
+
+    pcat_pmu_serial_write_ack_process(pmu_data, command, frame_num);
+
+    if(dst==0x1 || dst==0x80 || dst==0xFF)
     {
-        if(buffer->data[i]==0xA5)
+        switch(command)
         {
-            p = buffer->data + i;
-            remaining_size = buffer->len - i;
-            used_size = i;
-
-            if(remaining_size < 13)
+            case PCAT_PMU_MANAGER_COMMAND_STATUS_REPORT:
             {
+                if(extra_data_len < 16)
+                {
+                    break;
+                }
+
+                pcat_pmu_serial_status_data_parse(pmu_data,
+                    extra_data, extra_data_len);
+
+                if(need_ack)
+                {
+                    pcat_pmu_serial_write_data_request(pmu_data,
+                        command+1, TRUE, frame_num, NULL, 0, FALSE);
+                }
+
                 break;
             }
-
-            expect_len = p[5] + ((guint16)p[6] << 8);
-            if(expect_len < 3 || expect_len > 65532)
+            case PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_SHUTDOWN:
             {
-                used_size = i;
-                continue;
+                g_main_context_invoke(NULL,
+                    pcat_pmu_manager_main_shutdown_request_func, NULL);
+                pcat_pmu_manager_journal_shutdown(pmu_data,
+                    PCAT_JOURNAL_CAUSE_PMU_REQUEST);
+
+                if(need_ack)
+                {
+                    pcat_pmu_serial_write_data_request(pmu_data,
+                        command+1, TRUE, frame_num, NULL, 0, FALSE);
+                }
+
+                break;
             }
-            if(expect_len + 10 > remaining_size)
+            case PCAT_PMU_MANAGER_COMMAND_HOST_REQUEST_SHUTDOWN_ACK:
             {
-                if(used_size > 0)
+                if(pmu_data->shutdown_request)
                 {
-                    g_byte_array_remove_range(
-                        pmu_data->serial_read_buffer, 0, used_size);
+                    g_atomic_int_set(&pmu_data->shutdown_process_completed,
+                        TRUE);
                 }
 
-                return;
+                break;
             }
-
-            if(p[9+expect_len]!=0x5A)
+            case PCAT_PMU_MANAGER_COMMAND_WATCHDOG_TIMEOUT_SET_ACK:
             {
-                used_size = i;
-                continue;
+                if(pmu_data->reboot_request)
+                {
+                    g_atomic_int_set(&pmu_data->reboot_process_completed,
+                        TRUE);
+                }
+                break;
             }
+            case PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_FACTORY_RESET:
+            {
+                guint8 state = 0;
+
+                g_spawn_command_line_async(
+                    "pcat-factory-reset.sh", NULL);
 
-            checksum = p[7+expect_len] + ((guint16)p[8+expect_len] << 8);
-            rchecksum = pcat_pmu_serial_compute_crc16(p+1, 6+expect_len);
+                if(need_ack)
+                {
+                    pcat_pmu_serial_write_data_request(pmu_data,
+                        command+1, TRUE, frame_num, &state, 1, FALSE);
+                }
 
-            if(checksum!=rchecksum)
+                break;
+            }
+            case PCAT_PMU_MANAGER_COMMAND_PMU_FW_VERSION_GET_ACK:
             {
-                g_warning("Serial port got incorrect checksum %X, "
-                    "should be %X!", checksum ,rchecksum);
+                if(extra_data_len < 14)
+                {
+                    break;
+                }
 
-                i += 9 + expect_len;
-                used_size = i + 1;
-                continue;
+                /*
+                 * The version string is handed out to other threads, so a
+                 * replaced one is only freed on uninit.
+                 */
+                if(pmu_data->pmu_fw_version!=NULL)
+                {
+                    g_ptr_array_add(pmu_data->pmu_fw_version_retired,
+                        pmu_data->pmu_fw_version);
+                }
+                g_atomic_pointer_set(&pmu_data->pmu_fw_version,
+                    g_strndup((const gchar *)extra_data, extra_data_len));
+
+                g_message("PMU FW Version: %s",
+                    pmu_data->pmu_fw_version);
+
+                pcat_pmu_serial_baud_upgrade_request(pmu_data);
+
+                break;
             }
+            case PCAT_PMU_MANAGER_COMMAND_SERIAL_BAUD_SET_ACK:
+            {
+                /*
+                 * Firmware without speed negotiation may acknowledge the
+                 * frame without a status byte, only 0 means accepted.
+                 */
+                if(pmu_data->serial_baud_pending==0)
+                {
+                    break;
+                }
 
-            src = p[1];
-            dst = p[2];
-            frame_num = p[3] + ((guint16)p[4] << 8);
+                if(extra_data_len >= 1 && extra_data[0]==0)
+                {
+                    pcat_pmu_serial_baud_switch(pmu_data,
+                        pmu_data->serial_baud_pending, TRUE);
+                }
+                else
+                {
+                    g_message("PMU rejected serial speed %u, keep %u.",
+                        pmu_data->serial_baud_pending,
+                        pmu_data->serial_baud);
+                }
+                pmu_data->serial_baud_pending = 0;
 
-            command = p[7] + ((guint16)p[8] << 8);
-            extra_data_len = expect_len - 3;
-            if(expect_len > 3)
+                break;
+            }
+            case PCAT_PMU_MANAGER_COMMAND_POWER_ON_EVENT_GET_ACK:
             {
-                extra_data = p + 9;
+                if(extra_data_len < 1)
+                {
+                    break;
+                }
+
+                pmu_data->power_on_event = extra_data[0];
+                value = pmu_data->power_on_event;
+                pcat_journal_append(PCAT_JOURNAL_RECORD_POWER_ON_EVENT,
+                    &value, 1);
+
+                break;
             }
-            else
+            default:
             {
-                extra_data = NULL;
+                break;
             }
-            need_ack = (p[6 + expect_len]!=0);
+        }
+    }
+}
 
-            g_debug("Got command %X from %X to %X.", command, src, dst);
+/*
+ * Frame layout: 0xA5, src, dst, frame number (2), length (2), command (2),
+ * extra data, need ACK flag, CRC16 (2), 0x5A. The length field counts the
+ * command, extra data and need ACK flag.
+ *
+ * The parser keeps its state and position across reads, so every received
+ * byte is only looked at once unless a broken frame forces a resync.
+ */
+static void pcat_pmu_serial_read_data_parse(PCatPMUManagerData *pmu_data)
+{
+    gsize used_size, sync_offset, frame_len, len;
+    guint16 expect_len;
+    const guint8 *p;
+    guint16 checksum;
+
+    while(1)
+    {
+        used_size = pmu_data->serial_read_head - pmu_data->serial_read_tail;
+        expect_len = pmu_data->serial_read_parse_expect_len;
+        frame_len = (gsize)expect_len + 10;
 
-            if(pmu_data->serial_write_current_command_data!=NULL)
+        switch(pmu_data->serial_read_parse_state)
+        {
+            case PCAT_PMU_MANAGER_SERIAL_PARSE_SYNC:
             {
-                if(pmu_data->serial_write_current_command_data->command + 1==
-                    command &&
-                    pmu_data->serial_write_current_command_data->frame_num==
-                    frame_num)
+                if(!pcat_pmu_serial_read_buffer_find_sync(pmu_data,
+                    &sync_offset))
                 {
-                    pcat_pmu_manager_command_data_free(
-                        pmu_data->serial_write_current_command_data);
-                    pmu_data->serial_write_current_command_data = NULL;
+                    pmu_data->serial_read_tail = pmu_data->serial_read_head;
+
+                    return;
                 }
+
+                pmu_data->serial_read_tail += sync_offset;
+                pmu_data->serial_read_parse_offset = 1;
+                pmu_data->serial_read_parse_crc = PCAT_CRC16_INIT;
+                pmu_data->serial_read_parse_state =
+                    PCAT_PMU_MANAGER_SERIAL_PARSE_HEADER;
+
+                break;
             }
+            case PCAT_PMU_MANAGER_SERIAL_PARSE_HEADER:
+            {
+                if(used_size < 7)
+                {
+                    return;
+                }
+
+                expect_len = pcat_pmu_serial_read_buffer_get(pmu_data, 5) +
+                    ((guint16)pcat_pmu_serial_read_buffer_get(pmu_data, 6) <<
+                    8);
+                if(expect_len < 3 || expect_len > 65532)
+                {
+                    pmu_data->link_stats.rx_errors++;
+                    pmu_data->serial_read_tail++;
+                    pmu_data->serial_read_parse_state =
+                        PCAT_PMU_MANAGER_SERIAL_PARSE_SYNC;
+
+                    break;
+                }
 
-            if(dst==0x1 || dst==0x80 || dst==0xFF)
+                pmu_data->serial_read_parse_expect_len = expect_len;
+                pmu_data->serial_read_parse_crc =
+                    pcat_pmu_serial_read_buffer_crc_update(pmu_data,
+                    pmu_data->serial_read_parse_crc, 1, 6);
+                pmu_data->serial_read_parse_offset = 7;
+                pmu_data->serial_read_parse_state =
+                    PCAT_PMU_MANAGER_SERIAL_PARSE_PAYLOAD;
+
+                break;
+            }
+            case PCAT_PMU_MANAGER_SERIAL_PARSE_PAYLOAD:
             {
-                switch(command)
+                if(used_size <= pmu_data->serial_read_parse_offset)
                 {
-                    case PCAT_PMU_MANAGER_COMMAND_STATUS_REPORT:
-                    {
-                        if(extra_data_len < 16)
-                        {
-                            break;
-                        }
+                    return;
+                }
 
-                        pcat_pmu_serial_status_data_parse(pmu_data,
-                            extra_data, extra_data_len);
+                len = used_size - pmu_data->serial_read_parse_offset;
+                if(len > 7 + expect_len - pmu_data->serial_read_parse_offset)
+                {
+                    len = 7 + expect_len - pmu_data->serial_read_parse_offset;
+                }
 
-                        if(need_ack)
-                        {
-                            pcat_pmu_serial_write_data_request(pmu_data,
-                                command+1, TRUE, frame_num, NULL, 0, FALSE);
-                        }
+                pmu_data->serial_read_parse_crc =
+                    pcat_pmu_serial_read_buffer_crc_update(pmu_data,
+                    pmu_data->serial_read_parse_crc,
+                    pmu_data->serial_read_parse_offset, len);
+                pmu_data->serial_read_parse_offset += len;
 
-                        break;
-                    }
-                    case PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_SHUTDOWN:
-                    {
-                        pcat_main_request_shutdown(FALSE);
+                if(pmu_data->serial_read_parse_offset==7 + (gsize)expect_len)
+                {
+                    pmu_data->serial_read_parse_state =
+                        PCAT_PMU_MANAGER_SERIAL_PARSE_CHECKSUM;
+                }
 
-                        if(need_ack)
-                        {
-                            pcat_pmu_serial_write_data_request(pmu_data,
-                                command+1, TRUE, frame_num, NULL, 0, FALSE);
-                        }
+                break;
+            }
+            case PCAT_PMU_MANAGER_SERIAL_PARSE_CHECKSUM:
+            {
+                if(used_size < frame_len)
+                {
+                    return;
+                }
 
-                        break;
-                    }
-                    case PCAT_PMU_MANAGER_COMMAND_HOST_REQUEST_SHUTDOWN_ACK:
-                    {
-                        if(pmu_data->shutdown_request)
-                        {
-                            pmu_data->shutdown_process_completed = TRUE;
-                        }
+                pmu_data->serial_read_parse_state =
+                    PCAT_PMU_MANAGER_SERIAL_PARSE_SYNC;
 
-                        break;
-                    }
-                    case PCAT_PMU_MANAGER_COMMAND_WATCHDOG_TIMEOUT_SET_ACK:
-                    {
-                        if(pmu_data->reboot_request)
-                        {
-                            pmu_data->reboot_process_completed = TRUE;
-                        }
-                        break;
-                    }
-                    case PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_FACTORY_RESET:
-                    {
-                        guint8 state = 0;
+                if(pcat_pmu_serial_read_buffer_get(pmu_data,
+                    9 + expect_len)!=0x5A)
+                {
+                    pmu_data->link_stats.rx_errors++;
+                    pmu_data->serial_read_tail++;
 
-                        g_spawn_command_line_async(
-                            "pcat-factory-reset.sh", NULL);
+                    break;
+                }
 
-                        if(need_ack)
-                        {
-                            pcat_pmu_serial_write_data_request(pmu_data,
-                                command+1, TRUE, frame_num, &state, 1, FALSE);
-                        }
+                checksum = pcat_pmu_serial_read_buffer_get(pmu_data,
+                    7 + expect_len) + ((guint16)
+                    pcat_pmu_serial_read_buffer_get(pmu_data,
+                    8 + expect_len) << 8);
 
-                        break;
-                    }
-                    case PCAT_PMU_MANAGER_COMMAND_PMU_FW_VERSION_GET_ACK:
-                    {
-                        if(extra_data_len < 14)
-                        {
-                            break;
-                        }
-
-                        if(pmu_data->pmu_fw_version!=NULL)
-                        {
-                            g_free(pmu_data->pmu_fw_version);
-                        }
-                        pmu_data->pmu_fw_version =
-                            g_strndup((const gchar *)extra_data,
-                            extra_data_len);
-
-                        g_message("PMU FW Version: %s",
-                            pmu_data->pmu_fw_version);
-
-                        break;
-                    }
-                    case PCAT_PMU_MANAGER_COMMAND_POWER_ON_EVENT_GET_ACK:
-                    {
-                        if(extra_data_len < 1)
-                        {
-                            break;
-                        }
+                if(checksum!=pmu_data->serial_read_parse_crc)
+                {
+                    g_warning("Serial port got incorrect checksum %X, "
+                        "should be %X!", checksum,
+                        pmu_data->serial_read_parse_crc);
 
-                        pmu_data->power_on_event = extra_data[0];
+                    pmu_data->link_stats.rx_errors++;
+                    pmu_data->serial_read_tail += frame_len;
 
-                        break;
-                    }
-                    default:
-                    {
-                        break;
-                    }
+                    break;
                 }
+
+                p = pcat_pmu_serial_read_buffer_frame_get(pmu_data,
+                    frame_len);
+                pcat_pmu_serial_read_frame_process(pmu_data, p, expect_len);
+
+                pmu_data->serial_read_tail += frame_len;
+
+                break;
             }
+            default:
+            {
+                pmu_data->serial_read_parse_state =
+                    PCAT_PMU_MANAGER_SERIAL_PARSE_SYNC;
 
-            i += 9 + expect_len;
-            used_size = i + 1;
-        }
-        else
-        {
-            used_size = i;
+                break;
+            }
         }
     }
-
-    if(used_size > 0)
-    {
-        g_byte_array_remove_range(pmu_data->serial_read_buffer, 0, used_size);
-    }
 }
 
 static gboolean pcat_pmu_serial_read_watch_func(GIOChannel *source,
@@ -1040,20 +2321,61 @@ static gboolean pcat_pmu_serial_read_watch_func(GIOChannel *source,
 {
     PCatPMUManagerData *pmu_data = (PCatPMUManagerData *)user_data;
     gssize rsize;
-    guint8 buffer[4096];
+    gsize used_size, start, space;
+    gint64 cpu_time = 0;
 
-    while((rsize=read(pmu_data->serial_fd, buffer, 4096))>0)
+    g_mutex_lock(&pmu_data->mutex);
+
+    if(pmu_data->link_stats_cpu_time)
     {
-        g_byte_array_append(pmu_data->serial_read_buffer, buffer, rsize);
-        if(pmu_data->serial_read_buffer->len > 131072)
+        cpu_time = pcat_pmu_serial_cpu_time_get();
+    }
+
+    pmu_data->serial_write_deferred = TRUE;
+
+    do
+    {
+        used_size = pmu_data->serial_read_head - pmu_data->serial_read_tail;
+        if(used_size >= PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE)
+        {
+            pmu_data->serial_read_tail = pmu_data->serial_read_head -
+                PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE / 2;
+            pmu_data->serial_read_parse_state =
+                PCAT_PMU_MANAGER_SERIAL_PARSE_SYNC;
+            used_size = PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE / 2;
+        }
+
+        start = pmu_data->serial_read_head &
+            PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_MASK;
+        space = PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE - used_size;
+        if(space > PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE - start)
         {
-            g_byte_array_remove_range(pmu_data->serial_read_buffer, 0,
-                pmu_data->serial_read_buffer->len - 65536);
+            space = PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE - start;
         }
 
-        pcat_pmu_serial_read_data_parse(pmu_data);
+        rsize = read(pmu_data->serial_fd,
+            pmu_data->serial_read_buffer + start, space);
+        if(rsize > 0)
+        {
+            pmu_data->serial_read_head += rsize;
+            pmu_data->link_stats.rx_bytes += rsize;
+
+            pcat_pmu_serial_read_data_parse(pmu_data);
+        }
+    }
+    while(rsize > 0);
+
+    pmu_data->serial_write_deferred = FALSE;
+    pcat_pmu_serial_write_data_kick(pmu_data);
+
+    if(pmu_data->link_stats_cpu_time)
+    {
+        pmu_data->link_stats.cpu_time += pcat_pmu_serial_cpu_time_get() -
+            cpu_time;
     }
 
+    g_mutex_unlock(&pmu_data->mutex);
+
     return TRUE;
 }
 
@@ -1062,8 +2384,8 @@ static gboolean pcat_pmu_serial_open(PCatPMUManagerData *pmu_data)
     PCatManagerMainConfigData *main_config_data;
     int fd;
     GIOChannel *channel;
-    struct termios options;
-    int rspeed = B115200;
+    guint baud;
+    guint i;
 
     main_config_data = pcat_main_config_data_get();
 
@@ -1077,65 +2399,27 @@ static gboolean pcat_pmu_serial_open(PCatPMUManagerData *pmu_data)
         return FALSE;
     }
 
-    switch(main_config_data->pm_serial_baud)
+    baud = main_config_data->pm_serial_baud;
+    if(pcat_serial_speed_get(baud)==B0)
+    {
+        g_warning("Invalid serial speed, set to default speed at %u.",
+            PCAT_SERIAL_BAUD_DEFAULT);
+        baud = PCAT_SERIAL_BAUD_DEFAULT;
+    }
+
+    if(pcat_serial_setup(fd, baud, main_config_data->pm_serial_read_min,
+        main_config_data->pm_serial_read_timeout)!=0)
     {
-        case 4800:
-        {
-            rspeed = B4800;
-            break;
-        }
-        case 9600:
-        {
-            rspeed = B9600;
-            break;
-        }
-        case 19200:
-        {
-            rspeed = B19200;
-            break;
-        }
-        case 38400:
-        {
-            rspeed = B38400;
-            break;
-        }
-        case 57600:
-        {
-            rspeed = B57600;
-            break;
-        }
-        case 115200:
-        {
-            rspeed = B115200;
-            break;
-        }
-        default:
-        {
-            g_warning("Invalid serial speed, set to default speed at %u.",
-                115200);
-            break;
-        }
+        g_warning("Failed to set up serial port %s: %s",
+            main_config_data->pm_serial_device, strerror(errno));
     }
 
-    tcgetattr(fd, &options);
-    cfmakeraw(&options);
-    cfsetispeed(&options, rspeed);
-    cfsetospeed(&options, rspeed);
-    options.c_cflag &= ~CSIZE;
-    options.c_cflag &= ~PARENB;
-    options.c_cflag &= ~PARODD;
-    options.c_cflag &= ~CSTOPB;
-    options.c_cflag &= ~CRTSCTS;
-    options.c_cflag |= CS8;
-    options.c_cflag |= (CLOCAL | CREAD);
-    options.c_iflag &= ~(IGNBRK | BRKINT | ICRNL |
-        INLCR | PARMRK | INPCK | ISTRIP | IXON | IXOFF | IXANY);
-    options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG | IEXTEN);
-    options.c_oflag &= ~OPOST;
-    options.c_cc[VMIN] = 1;
-    options.c_cc[VTIME] = 0;
-    tcflush(fd, TCIOFLUSH);
-    tcsetattr(fd, TCSANOW, &options);
+    if(main_config_data->pm_serial_low_latency &&
+       pcat_serial_low_latency_set(fd, 1)!=0)
+    {
+        g_warning("Failed to enable low latency mode on serial port %s: %s",
+            main_config_data->pm_serial_device, strerror(errno));
+    }
 
     channel = g_io_channel_unix_new(fd);
     if(channel==NULL)
@@ -1150,12 +2434,54 @@ static gboolean pcat_pmu_serial_open(PCatPMUManagerData *pmu_data)
 
     pmu_data->serial_fd = fd;
     pmu_data->serial_channel = channel;
+    pmu_data->serial_baud = baud;
+    pmu_data->serial_baud_pending = 0;
     pmu_data->serial_write_current_command_data = NULL;
-    pmu_data->serial_read_buffer = g_byte_array_new();
-    pmu_data->serial_write_command_queue = g_queue_new();
+    pmu_data->serial_read_buffer = g_malloc(
+        PCAT_PMU_MANAGER_SERIAL_READ_BUFFER_SIZE);
+    pmu_data->serial_read_head = 0;
+    pmu_data->serial_read_tail = 0;
+    pmu_data->serial_read_parse_state = PCAT_PMU_MANAGER_SERIAL_PARSE_SYNC;
+    pmu_data->serial_read_frame_buffer = g_malloc(
+        PCAT_PMU_MANAGER_SERIAL_FRAME_MAX);
+    for(i=0;i<PCAT_PMU_MANAGER_COMMAND_PRIORITY_LAST;i++)
+    {
+        g_queue_init(&pmu_data->serial_write_command_queue[i]);
+    }
+    pmu_data->serial_write_command_queue_length = 0;
+    g_queue_init(&pmu_data->serial_write_inflight_queue);
+
+    pmu_data->serial_write_window = main_config_data->pm_command_window;
+    if(pmu_data->serial_write_window==0)
+    {
+        pmu_data->serial_write_window =
+            PCAT_PMU_MANAGER_COMMAND_WINDOW_DEFAULT;
+    }
+    else if(pmu_data->serial_write_window >
+        PCAT_PMU_MANAGER_COMMAND_WINDOW_MAX)
+    {
+        pmu_data->serial_write_window = PCAT_PMU_MANAGER_COMMAND_WINDOW_MAX;
+    }
+
+    pmu_data->link_stats_cpu_time = main_config_data->debug_pmu_link_stats;
+
+    pmu_data->serial_write_srtt = 0;
+    pmu_data->serial_write_rttvar = 0;
+    pmu_data->serial_write_rto = PCAT_PMU_MANAGER_COMMAND_TIMEOUT;
+
+    pmu_data->command_pool = g_new0(PCatPMUManagerCommandData,
+        PCAT_PMU_MANAGER_COMMAND_POOL_SIZE);
+    g_queue_init(&pmu_data->command_pool_free_queue);
+    for(i=0;i<PCAT_PMU_MANAGER_COMMAND_POOL_SIZE;i++)
+    {
+        pmu_data->command_pool[i].link.data = &pmu_data->command_pool[i];
+        pmu_data->command_pool[i].pooled = TRUE;
+        g_queue_push_tail_link(&pmu_data->command_pool_free_queue,
+            &pmu_data->command_pool[i].link);
+    }
 
-    pmu_data->serial_read_source = g_io_add_watch(channel,
-        G_IO_IN, pcat_pmu_serial_read_watch_func, pmu_data);
+    pmu_data->serial_read_source = pcat_pmu_manager_io_watch_add(pmu_data,
+        G_IO_IN, pcat_pmu_serial_read_watch_func);
 
     g_message("Open PMU serial port %s successfully.",
         main_config_data->pm_serial_device);
@@ -1165,15 +2491,40 @@ static gboolean pcat_pmu_serial_open(PCatPMUManagerData *pmu_data)
 
 static void pcat_pmu_serial_close(PCatPMUManagerData *pmu_data)
 {
+    PCatPMUManagerCommandData *command_data;
+
     if(pmu_data->serial_write_source > 0)
     {
-        g_source_remove(pmu_data->serial_write_source);
+        pcat_pmu_manager_io_source_remove(pmu_data,
+            pmu_data->serial_write_source);
         pmu_data->serial_write_source = 0;
     }
 
+    if(pmu_data->serial_write_flush_source > 0)
+    {
+        pcat_pmu_manager_io_source_remove(pmu_data,
+            pmu_data->serial_write_flush_source);
+        pmu_data->serial_write_flush_source = 0;
+    }
+
+    if(pmu_data->serial_baud_check_timeout_id > 0)
+    {
+        pcat_pmu_manager_io_source_remove(pmu_data,
+            pmu_data->serial_baud_check_timeout_id);
+        pmu_data->serial_baud_check_timeout_id = 0;
+    }
+
+    if(pmu_data->serial_write_retransmit_timeout_id > 0)
+    {
+        pcat_pmu_manager_io_source_remove(pmu_data,
+            pmu_data->serial_write_retransmit_timeout_id);
+        pmu_data->serial_write_retransmit_timeout_id = 0;
+    }
+
     if(pmu_data->serial_read_source > 0)
     {
-        g_source_remove(pmu_data->serial_read_source);
+        pcat_pmu_manager_io_source_remove(pmu_data,
+            pmu_data->serial_read_source);
         pmu_data->serial_read_source = 0;
     }
 
@@ -1191,22 +2542,79 @@ static void pcat_pmu_serial_close(PCatPMUManagerData *pmu_data)
 
     if(pmu_data->serial_write_current_command_data!=NULL)
     {
-        pcat_pmu_manager_command_data_free(
+        pcat_pmu_manager_command_data_free(pmu_data,
             pmu_data->serial_write_current_command_data);
         pmu_data->serial_write_current_command_data = NULL;
     }
-    if(pmu_data->serial_write_command_queue!=NULL)
+    while((command_data=pcat_pmu_manager_command_queue_pop(
+        pmu_data))!=NULL)
     {
-        g_queue_free_full(pmu_data->serial_write_command_queue,
-            (GDestroyNotify)pcat_pmu_manager_command_data_free);
-        pmu_data->serial_write_command_queue = NULL;
+        pcat_pmu_manager_command_data_free(pmu_data, command_data);
+    }
+    while(!g_queue_is_empty(&pmu_data->serial_write_inflight_queue))
+    {
+        command_data = g_queue_pop_head_link(
+            &pmu_data->serial_write_inflight_queue)->data;
+        pcat_pmu_manager_command_data_free(pmu_data, command_data);
+    }
+
+    if(pmu_data->command_pool!=NULL)
+    {
+        g_queue_init(&pmu_data->command_pool_free_queue);
+        g_free(pmu_data->command_pool);
+        pmu_data->command_pool = NULL;
     }
 
     if(pmu_data->serial_read_buffer!=NULL)
     {
-        g_byte_array_unref(pmu_data->serial_read_buffer);
+        g_free(pmu_data->serial_read_buffer);
         pmu_data->serial_read_buffer = NULL;
     }
+    if(pmu_data->serial_read_frame_buffer!=NULL)
+    {
+        g_free(pmu_data->serial_read_frame_buffer);
+        pmu_data->serial_read_frame_buffer = NULL;
+    }
+}
+
+/*
+ * Save the learned battery calibration, the data is taken under the lock
+ * but written to the disk without holding it.
+ */
+static void pcat_pmu_manager_battery_calibration_save(
+    PCatPMUManagerData *pmu_data)
+{
+    gchar *data = NULL;
+    gsize length = 0;
+    GError *error = NULL;
+
+    if(pmu_data->battery_estimator==NULL)
+    {
+        return;
+    }
+
+    g_mutex_lock(&pmu_data->mutex);
+    if(pcat_battery_estimator_calibration_dirty(pmu_data->battery_estimator))
+    {
+        data = pcat_battery_estimator_calibration_to_data(
+            pmu_data->battery_estimator, &length);
+    }
+    g_mutex_unlock(&pmu_data->mutex);
+
+    if(data==NULL)
+    {
+        return;
+    }
+
+    if(!g_file_set_contents(PCAT_PMU_MANAGER_BATTERY_CALIBRATION_FILE,
+        data, length, &error))
+    {
+        g_warning("Failed to save battery calibration data: %s!",
+            error->message);
+        g_clear_error(&error);
+    }
+
+    g_free(data);
 }
 
 static gboolean pcat_pmu_manager_check_timeout_func(gpointer user_data)
@@ -1222,36 +2630,49 @@ static gboolean pcat_pmu_manager_check_timeout_func(gpointer user_data)
     gint64 now;
     PCatModemManagerDeviceType modem_device_type;
     guint shutdown_voltage = 0;
+    gboolean power_requested, shutdown_planned, modem_changed = FALSE;
+    guint power_on_event;
+    gint64 charger_on_timestamp;
+    gint shutdown_cause = -1;
 
     if(pmu_data->serial_channel==NULL)
     {
         return TRUE;
     }
 
+    /*
+     * The I/O thread takes the same mutex for every frame, so only copy
+     * the state out here. The schedule is evaluated and the shutdown
+     * (which forks) requested without holding it.
+     */
+    g_mutex_lock(&pmu_data->mutex);
+
     now = g_get_monotonic_time();
     if(pmu_data->last_charger_voltage >= 4200)
     {
         pmu_data->charger_on_auto_start_last_timestamp = now;
     }
+    power_requested = (pmu_data->reboot_request ||
+        pmu_data->shutdown_request);
+    shutdown_planned = pmu_data->shutdown_planned;
+    power_on_event = pmu_data->power_on_event;
+    charger_on_timestamp = pmu_data->charger_on_auto_start_last_timestamp;
 
-    if(!pmu_data->reboot_request && !pmu_data->shutdown_request)
-    {
-        pcat_pmu_serial_write_data_request(pmu_data,
-            PCAT_PMU_MANAGER_COMMAND_HEARTBEAT, FALSE, 0, NULL, 0, FALSE);
+    g_mutex_unlock(&pmu_data->mutex);
 
+    if(!power_requested)
+    {
         uconfig_data = pcat_main_user_config_data_get();
         if(uconfig_data->charger_on_auto_start)
         {
-            if((pmu_data->power_on_event==3 || pmu_data->power_on_event==4) &&
-               now > pmu_data->charger_on_auto_start_last_timestamp +
+            if((power_on_event==3 || power_on_event==4) &&
+               now > charger_on_timestamp +
                (gint64)uconfig_data->charger_on_auto_start_timeout * 1000000L)
             {
-                pcat_main_request_shutdown(TRUE);
-                pmu_data->shutdown_planned = TRUE;
+                shutdown_cause = PCAT_JOURNAL_CAUSE_CHARGER_ON_AUTO_START;
             }
         }
-        else if(uconfig_data->power_schedule_data!=NULL &&
-            !pmu_data->shutdown_planned)
+        else if(uconfig_data->power_schedule_data!=NULL && !shutdown_planned)
         {
             dt = g_date_time_new_now_utc();
 
@@ -1336,8 +2757,8 @@ static gboolean pcat_pmu_manager_check_timeout_func(gpointer user_data)
 
                 if(need_action)
                 {
-                    pcat_main_request_shutdown(TRUE);
-                    pmu_data->shutdown_planned = TRUE;
+                    shutdown_cause = PCAT_JOURNAL_CAUSE_SCHEDULE;
+                    break;
                 }
             }
 
@@ -1345,9 +2766,23 @@ static gboolean pcat_pmu_manager_check_timeout_func(gpointer user_data)
         }
     }
 
+    if(shutdown_cause >= 0)
+    {
+        g_mutex_lock(&pmu_data->mutex);
+        pcat_pmu_manager_journal_shutdown(pmu_data,
+            (PCatJournalCause)shutdown_cause);
+        pmu_data->shutdown_planned = TRUE;
+        g_mutex_unlock(&pmu_data->mutex);
+
+        pcat_main_request_shutdown(TRUE);
+    }
+
     config_data = pcat_main_config_data_get();
 
     modem_device_type = pcat_modem_manager_device_type_get();
+
+    g_mutex_lock(&pmu_data->mutex);
+
     if(pmu_data->modem_device_type!=modem_device_type)
     {
         switch(modem_device_type)
@@ -1371,34 +2806,111 @@ static gboolean pcat_pmu_manager_check_timeout_func(gpointer user_data)
         }
 
         pmu_data->modem_device_type = modem_device_type;
+        if(modem_device_type==PCAT_MODEM_MANAGER_DEVICE_5G)
+        {
+            pmu_data->soc_discharge_lut = &pmu_data->soc_discharge_5g_lut;
+        }
+        else
+        {
+            pmu_data->soc_discharge_lut =
+                &pmu_data->soc_discharge_normal_lut;
+        }
         pcat_pmu_manager_voltage_threshold_set_interval(pmu_data,
             0, 0, 0, 0, 0, shutdown_voltage, 0, 0);
+        modem_changed = TRUE;
+    }
 
+    if(pmu_data->serial_write_source==0 &&
+       (pmu_data->serial_write_current_command_data!=NULL ||
+       !pcat_pmu_manager_command_queue_is_empty(pmu_data) ||
+       !g_queue_is_empty(&pmu_data->serial_write_inflight_queue)))
+    {
+        pcat_pmu_serial_write_data_kick(pmu_data);
+    }
+
+    g_mutex_unlock(&pmu_data->mutex);
+
+    if(modem_changed)
+    {
         g_message("Detected modem type %u, set shutdown voltage to %u.",
             modem_device_type, shutdown_voltage);
     }
 
-    if(pmu_data->serial_write_source==0 &&
-       pmu_data->serial_write_current_command_data==NULL &&
-       !g_queue_is_empty(pmu_data->serial_write_command_queue))
+    pcat_pmu_manager_battery_calibration_save(pmu_data);
+
+    return TRUE;
+}
+
+/*
+ * Heartbeats keep the PMU watchdog fed, they are sent from the I/O thread
+ * so a busy default main loop cannot delay them.
+ */
+static gboolean pcat_pmu_manager_heartbeat_timeout_func(gpointer user_data)
+{
+    PCatPMUManagerData *pmu_data = (PCatPMUManagerData *)user_data;
+
+    g_mutex_lock(&pmu_data->mutex);
+
+    if(!pmu_data->reboot_request && !pmu_data->shutdown_request)
     {
-        pmu_data->serial_write_source = g_io_add_watch(
-            pmu_data->serial_channel, G_IO_OUT,
-            pcat_pmu_serial_write_watch_func, pmu_data);
+        pcat_pmu_serial_write_data_request(pmu_data,
+            PCAT_PMU_MANAGER_COMMAND_HEARTBEAT, FALSE, 0, NULL, 0, FALSE);
     }
 
-    if(pmu_data->serial_write_source==0 &&
-       pmu_data->serial_write_current_command_data!=NULL &&
-        (pmu_data->serial_write_current_command_data->firstrun ||
-        now > pmu_data->serial_write_current_command_data->timestamp +
-        PCAT_PMU_MANAGER_COMMAND_TIMEOUT))
+    g_mutex_unlock(&pmu_data->mutex);
+
+    return TRUE;
+}
+
+static gpointer pcat_pmu_manager_io_thread_func(gpointer user_data)
+{
+    PCatPMUManagerData *pmu_data = (PCatPMUManagerData *)user_data;
+    const PCatManagerMainConfigData *config_data;
+    struct sched_param param;
+    cpu_set_t cpu_set;
+    guint i;
+    int errcode;
+
+    config_data = pcat_main_config_data_get();
+
+    if(config_data->pm_io_thread_cpu_mask!=0)
+    {
+        CPU_ZERO(&cpu_set);
+        for(i=0;i<32;i++)
+        {
+            if(config_data->pm_io_thread_cpu_mask & (1U << i))
+            {
+                CPU_SET(i, &cpu_set);
+            }
+        }
+
+        errcode = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set),
+            &cpu_set);
+        if(errcode!=0)
+        {
+            g_warning("Failed to set PMU I/O thread CPU affinity: %s",
+                strerror(errcode));
+        }
+    }
+
+    if(config_data->pm_io_thread_priority > 0)
     {
-        pmu_data->serial_write_source = g_io_add_watch(
-            pmu_data->serial_channel, G_IO_OUT,
-            pcat_pmu_serial_write_watch_func, pmu_data);
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config_data->pm_io_thread_priority;
+
+        errcode = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if(errcode!=0)
+        {
+            g_warning("Failed to set PMU I/O thread real-time priority: %s",
+                strerror(errcode));
+        }
     }
 
-    return TRUE;
+    g_main_context_push_thread_default(pmu_data->io_context);
+    g_main_loop_run(pmu_data->io_loop);
+    g_main_context_pop_thread_default(pmu_data->io_context);
+
+    return NULL;
 }
 
 gboolean pcat_pmu_manager_init()
@@ -1418,6 +2930,7 @@ gboolean pcat_pmu_manager_init()
     g_pcat_pmu_manager_data.reboot_request = FALSE;
     g_pcat_pmu_manager_data.shutdown_process_completed = FALSE;
     g_pcat_pmu_manager_data.reboot_process_completed = FALSE;
+    g_pcat_pmu_manager_data.serial_fd = -1;
     g_pcat_pmu_manager_data.charger_on_auto_start_last_timestamp =
         g_get_monotonic_time();
     g_pcat_pmu_manager_data.system_time_set_flag = FALSE;
@@ -1426,8 +2939,29 @@ gboolean pcat_pmu_manager_init()
 
     g_mkdir_with_parents(PCAT_PMU_MANAGER_STATEFS_BATTERY_PATH, 0755);
 
+    g_mutex_init(&g_pcat_pmu_manager_data.mutex);
+    g_mutex_init(&g_pcat_pmu_manager_data.statefs_mutex);
+    for(i=0;i<PCAT_PMU_MANAGER_STATEFS_LAST;i++)
+    {
+        g_pcat_pmu_manager_data.statefs_fds[i] = -1;
+    }
+    g_pcat_pmu_manager_data.io_context = g_main_context_new();
+    g_pcat_pmu_manager_data.io_loop = g_main_loop_new(
+        g_pcat_pmu_manager_data.io_context, FALSE);
+    g_pcat_pmu_manager_data.pmu_fw_version_retired =
+        g_ptr_array_new_with_free_func(g_free);
+
     if(!pcat_pmu_serial_open(&g_pcat_pmu_manager_data))
     {
+        g_main_loop_unref(g_pcat_pmu_manager_data.io_loop);
+        g_pcat_pmu_manager_data.io_loop = NULL;
+        g_main_context_unref(g_pcat_pmu_manager_data.io_context);
+        g_pcat_pmu_manager_data.io_context = NULL;
+        g_ptr_array_unref(g_pcat_pmu_manager_data.pmu_fw_version_retired);
+        g_pcat_pmu_manager_data.pmu_fw_version_retired = NULL;
+        g_mutex_clear(&g_pcat_pmu_manager_data.statefs_mutex);
+        g_mutex_clear(&g_pcat_pmu_manager_data.mutex);
+
         return FALSE;
     }
 
@@ -1503,10 +3037,29 @@ gboolean pcat_pmu_manager_init()
         }
     }
 
+    pcat_pmu_manager_soc_lut_update(&g_pcat_pmu_manager_data);
+
+    g_pcat_pmu_manager_data.telemetry = pcat_telemetry_new();
+
+    if(config_data->pm_battery_estimator_enabled)
+    {
+        g_pcat_pmu_manager_data.battery_estimator =
+            pcat_battery_estimator_new();
+        if(pcat_battery_estimator_calibration_load(
+            g_pcat_pmu_manager_data.battery_estimator,
+            PCAT_PMU_MANAGER_BATTERY_CALIBRATION_FILE))
+        {
+            g_message("Loaded battery calibration data, %u full cycles.",
+                pcat_battery_estimator_calibration_get(
+                g_pcat_pmu_manager_data.battery_estimator)->cycles);
+        }
+    }
+
     g_pcat_pmu_manager_data.check_timeout_id = g_timeout_add_seconds(1,
         pcat_pmu_manager_check_timeout_func, &g_pcat_pmu_manager_data);
 
     g_pcat_pmu_manager_data.initialized = TRUE;
+    g_pcat_pmu_manager_data.init_start_timestamp = g_get_monotonic_time();
 
     pcat_pmu_manager_schedule_time_update_internal(&g_pcat_pmu_manager_data);
     pcat_pmu_manager_date_time_sync(&g_pcat_pmu_manager_data);
@@ -1525,11 +3078,21 @@ gboolean pcat_pmu_manager_init()
 
     pcat_pmu_manager_watchdog_timeout_set(5);
 
+    g_pcat_pmu_manager_data.heartbeat_timeout_id =
+        pcat_pmu_manager_io_timeout_add_seconds(&g_pcat_pmu_manager_data, 1,
+        pcat_pmu_manager_heartbeat_timeout_func);
+
+    g_pcat_pmu_manager_data.io_thread = g_thread_new(
+        "pcat-pmu-manager-io-thread", pcat_pmu_manager_io_thread_func,
+        &g_pcat_pmu_manager_data);
+
     return TRUE;
 }
 
 void pcat_pmu_manager_uninit()
 {
+    guint i;
+
     if(!g_pcat_pmu_manager_data.initialized)
     {
         return;
@@ -1541,84 +3104,190 @@ void pcat_pmu_manager_uninit()
         g_pcat_pmu_manager_data.check_timeout_id = 0;
     }
 
+    if(g_pcat_pmu_manager_data.io_thread!=NULL)
+    {
+        g_main_loop_quit(g_pcat_pmu_manager_data.io_loop);
+        g_thread_join(g_pcat_pmu_manager_data.io_thread);
+        g_pcat_pmu_manager_data.io_thread = NULL;
+    }
+
+    if(g_pcat_pmu_manager_data.heartbeat_timeout_id > 0)
+    {
+        pcat_pmu_manager_io_source_remove(&g_pcat_pmu_manager_data,
+            g_pcat_pmu_manager_data.heartbeat_timeout_id);
+        g_pcat_pmu_manager_data.heartbeat_timeout_id = 0;
+    }
+
     pcat_pmu_serial_close(&g_pcat_pmu_manager_data);
 
+    if(g_pcat_pmu_manager_data.statefs_flush_timeout_id > 0)
+    {
+        g_source_remove(g_pcat_pmu_manager_data.statefs_flush_timeout_id);
+        g_pcat_pmu_manager_data.statefs_flush_timeout_id = 0;
+    }
+    pcat_pmu_manager_statefs_flush(&g_pcat_pmu_manager_data);
+    for(i=0;i<PCAT_PMU_MANAGER_STATEFS_LAST;i++)
+    {
+        if(g_pcat_pmu_manager_data.statefs_fds[i] >= 0)
+        {
+            close(g_pcat_pmu_manager_data.statefs_fds[i]);
+            g_pcat_pmu_manager_data.statefs_fds[i] = -1;
+        }
+    }
+
+    g_main_loop_unref(g_pcat_pmu_manager_data.io_loop);
+    g_pcat_pmu_manager_data.io_loop = NULL;
+    g_main_context_unref(g_pcat_pmu_manager_data.io_context);
+    g_pcat_pmu_manager_data.io_context = NULL;
+
     if(g_pcat_pmu_manager_data.pmu_fw_version!=NULL)
     {
         g_free(g_pcat_pmu_manager_data.pmu_fw_version);
         g_pcat_pmu_manager_data.pmu_fw_version = NULL;
     }
+    g_ptr_array_unref(g_pcat_pmu_manager_data.pmu_fw_version_retired);
+    g_pcat_pmu_manager_data.pmu_fw_version_retired = NULL;
+
+    pcat_pmu_manager_soc_lut_clear(&g_pcat_pmu_manager_data.soc_charge_lut);
+    pcat_pmu_manager_soc_lut_clear(
+        &g_pcat_pmu_manager_data.soc_discharge_normal_lut);
+    pcat_pmu_manager_soc_lut_clear(
+        &g_pcat_pmu_manager_data.soc_discharge_5g_lut);
+
+    if(g_pcat_pmu_manager_data.battery_estimator!=NULL)
+    {
+        pcat_pmu_manager_battery_calibration_save(&g_pcat_pmu_manager_data);
+        pcat_battery_estimator_free(
+            g_pcat_pmu_manager_data.battery_estimator);
+        g_pcat_pmu_manager_data.battery_estimator = NULL;
+    }
+
+    pcat_telemetry_free(g_pcat_pmu_manager_data.telemetry);
+    g_pcat_pmu_manager_data.telemetry = NULL;
+
+    g_mutex_clear(&g_pcat_pmu_manager_data.statefs_mutex);
+    g_mutex_clear(&g_pcat_pmu_manager_data.mutex);
 
     g_pcat_pmu_manager_data.initialized = FALSE;
 }
 
+/*
+ * The serial port is only opened by pcat_pmu_manager_init() and closed by
+ * pcat_pmu_manager_uninit(), a request arriving after uninit closed it
+ * must not queue anything. serial_fd is read under the mutex like every
+ * other field the I/O thread uses.
+ */
 void pcat_pmu_manager_shutdown_request()
 {
+    if(!g_pcat_pmu_manager_data.initialized)
+    {
+        return;
+    }
+
+    g_mutex_lock(&g_pcat_pmu_manager_data.mutex);
+    if(g_pcat_pmu_manager_data.serial_fd < 0)
+    {
+        g_mutex_unlock(&g_pcat_pmu_manager_data.mutex);
+
+        return;
+    }
     pcat_pmu_serial_write_data_request(&g_pcat_pmu_manager_data,
         PCAT_PMU_MANAGER_COMMAND_HOST_REQUEST_SHUTDOWN,
         FALSE, 0, NULL, 0, TRUE);
     g_pcat_pmu_manager_data.shutdown_request = TRUE;
+    g_mutex_unlock(&g_pcat_pmu_manager_data.mutex);
+}
+
+static void pcat_pmu_manager_watchdog_timeout_request(
+    PCatPMUManagerData *pmu_data, guint timeout)
+{
+    guint8 timeouts[3] = {60, 60, timeout};
+
+    pcat_pmu_serial_write_data_request(pmu_data,
+        PCAT_PMU_MANAGER_COMMAND_WATCHDOG_TIMEOUT_SET, FALSE, 0,
+        timeouts, 3, TRUE);
 }
 
 void pcat_pmu_manager_reboot_request()
 {
-    pcat_pmu_manager_watchdog_timeout_set(60);
+    if(!g_pcat_pmu_manager_data.initialized)
+    {
+        return;
+    }
+
+    g_mutex_lock(&g_pcat_pmu_manager_data.mutex);
+    if(g_pcat_pmu_manager_data.serial_fd < 0)
+    {
+        g_mutex_unlock(&g_pcat_pmu_manager_data.mutex);
+
+        return;
+    }
+
+    /*
+     * The ACK is parsed on the IO thread under this mutex, so the flag
+     * has to be visible before the frame can reach the PMU.
+     */
     g_pcat_pmu_manager_data.reboot_request = TRUE;
+    pcat_pmu_manager_watchdog_timeout_request(&g_pcat_pmu_manager_data, 60);
+    g_mutex_unlock(&g_pcat_pmu_manager_data.mutex);
 }
 
 gboolean pcat_pmu_manager_shutdown_completed()
 {
-    return g_pcat_pmu_manager_data.shutdown_process_completed;
+    return g_atomic_int_get(
+        &g_pcat_pmu_manager_data.shutdown_process_completed);
 }
 
 gboolean pcat_pmu_manager_reboot_completed()
 {
-    return g_pcat_pmu_manager_data.reboot_process_completed;
+    return g_atomic_int_get(
+        &g_pcat_pmu_manager_data.reboot_process_completed);
 }
 
 void pcat_pmu_manager_watchdog_timeout_set(guint timeout)
 {
-    guint8 timeouts[3] = {60, 60, timeout};
-
     if(!g_pcat_pmu_manager_data.initialized)
     {
         return;
     }
 
-    if(g_pcat_pmu_manager_data.serial_channel==NULL ||
-        g_pcat_pmu_manager_data.serial_write_command_queue==NULL)
+    g_mutex_lock(&g_pcat_pmu_manager_data.mutex);
+    if(g_pcat_pmu_manager_data.serial_fd < 0)
     {
+        g_mutex_unlock(&g_pcat_pmu_manager_data.mutex);
+
         return;
     }
-
-    pcat_pmu_serial_write_data_request(&g_pcat_pmu_manager_data,
-        PCAT_PMU_MANAGER_COMMAND_WATCHDOG_TIMEOUT_SET, FALSE, 0,
-        timeouts, 3, TRUE);
+    pcat_pmu_manager_watchdog_timeout_request(&g_pcat_pmu_manager_data,
+        timeout);
+    g_mutex_unlock(&g_pcat_pmu_manager_data.mutex);
 }
 
 gboolean pcat_pmu_manager_pmu_status_get(guint *battery_voltage,
     guint *charger_voltage, gboolean *on_battery, guint *battery_percentage)
 {
-    if(!g_pcat_pmu_manager_data.initialized)
+    PCatPMUManagerStatus status;
+
+    if(!pcat_pmu_manager_status_snapshot_get(&status))
     {
         return FALSE;
     }
 
     if(battery_voltage!=NULL)
     {
-        *battery_voltage = g_pcat_pmu_manager_data.last_battery_voltage;
+        *battery_voltage = status.battery_voltage;
     }
     if(charger_voltage!=NULL)
     {
-        *charger_voltage = g_pcat_pmu_manager_data.last_charger_voltage;
+        *charger_voltage = status.charger_voltage;
     }
     if(on_battery!=NULL)
     {
-        *on_battery = g_pcat_pmu_manager_data.last_on_battery_state;
+        *on_battery = status.on_battery;
     }
     if(battery_percentage!=NULL)
     {
-        *battery_percentage = g_pcat_pmu_manager_data.last_battery_percentage;
+        *battery_percentage = status.battery_percentage;
     }
 
     return TRUE;
@@ -1631,7 +3300,9 @@ void pcat_pmu_manager_schedule_time_update()
         return;
     }
 
+    g_mutex_lock(&g_pcat_pmu_manager_data.mutex);
     pcat_pmu_manager_schedule_time_update_internal(&g_pcat_pmu_manager_data);
+    g_mutex_unlock(&g_pcat_pmu_manager_data.mutex);
 }
 
 void pcat_pmu_manager_charger_on_auto_start(gboolean state)
@@ -1641,8 +3312,10 @@ void pcat_pmu_manager_charger_on_auto_start(gboolean state)
         return;
     }
 
+    g_mutex_lock(&g_pcat_pmu_manager_data.mutex);
     pcat_pmu_manager_charger_on_auto_start_internal(&g_pcat_pmu_manager_data,
         state);
+    g_mutex_unlock(&g_pcat_pmu_manager_data.mutex);
 }
 
 void pcat_pmu_manager_net_status_led_setup(guint on_time, guint down_time,
@@ -1653,13 +3326,15 @@ void pcat_pmu_manager_net_status_led_setup(guint on_time, guint down_time,
         return;
     }
 
+    g_mutex_lock(&g_pcat_pmu_manager_data.mutex);
     pcat_pmu_manager_net_status_led_setup_internal(&g_pcat_pmu_manager_data,
         on_time, down_time, repeat);
+    g_mutex_unlock(&g_pcat_pmu_manager_data.mutex);
 }
 
 const gchar *pcat_pmu_manager_pmu_fw_version_get()
 {
-    return g_pcat_pmu_manager_data.pmu_fw_version;
+    return g_atomic_pointer_get(&g_pcat_pmu_manager_data.pmu_fw_version);
 }
 
 gint64 pcat_pmu_manager_charger_on_auto_start_last_timestamp_get()
@@ -1676,12 +3351,99 @@ void pcat_pmu_manager_voltage_threshold_set(guint led_vh, guint led_vm,
         return;
     }
 
+    g_mutex_lock(&g_pcat_pmu_manager_data.mutex);
     pcat_pmu_manager_voltage_threshold_set_interval(&g_pcat_pmu_manager_data,
         led_vh, led_vm, led_vl, startup_voltage, charger_voltage,
         shutdown_voltage, led_work_vl, charger_fast_voltage);
+    g_mutex_unlock(&g_pcat_pmu_manager_data.mutex);
 }
 
 gint pcat_pmu_manager_board_temp_get()
 {
-    return g_pcat_pmu_manager_data.board_temp;
+    PCatPMUManagerStatus status;
+
+    status.board_temp = 0;
+    pcat_pmu_manager_status_snapshot_get(&status);
+
+    return status.board_temp;
+}
+
+gboolean pcat_pmu_manager_status_snapshot_get(PCatPMUManagerStatus *status)
+{
+    if(!g_pcat_pmu_manager_data.initialized || status==NULL)
+    {
+        return FALSE;
+    }
+
+    status->sequence = pcat_seqlock_read(
+        &g_pcat_pmu_manager_data.status_sequence, status,
+        &g_pcat_pmu_manager_data.status, sizeof(PCatPMUManagerStatus));
+
+    return TRUE;
+}
+
+guint pcat_pmu_manager_status_sequence_get()
+{
+    return pcat_seqlock_sequence_get(
+        &g_pcat_pmu_manager_data.status_sequence);
+}
+
+gboolean pcat_pmu_manager_command_queue_stats_get(
+    PCatPMUManagerCommandPriority priority, guint *depth, guint64 *dropped,
+    guint64 *coalesced)
+{
+    if(priority >= PCAT_PMU_MANAGER_COMMAND_PRIORITY_LAST)
+    {
+        return FALSE;
+    }
+
+    g_mutex_lock(&g_pcat_pmu_manager_data.mutex);
+
+    if(depth!=NULL)
+    {
+        *depth = g_queue_get_length(
+            &g_pcat_pmu_manager_data.serial_write_command_queue[priority]);
+    }
+    if(dropped!=NULL)
+    {
+        *dropped =
+            g_pcat_pmu_manager_data.serial_write_command_dropped[priority];
+    }
+    if(coalesced!=NULL)
+    {
+        *coalesced =
+            g_pcat_pmu_manager_data.serial_write_command_coalesced[priority];
+    }
+
+    g_mutex_unlock(&g_pcat_pmu_manager_data.mutex);
+
+    return TRUE;
+}
+
+void pcat_pmu_manager_link_stats_get(PCatPMUManagerLinkStats *stats)
+{
+    if(stats==NULL)
+    {
+        return;
+    }
+
+    g_mutex_lock(&g_pcat_pmu_manager_data.mutex);
+    *stats = g_pcat_pmu_manager_data.link_stats;
+    g_mutex_unlock(&g_pcat_pmu_manager_data.mutex);
+}
+
+/*
+ * Query the telemetry history, the result is a copy owned by the caller,
+ * free it with pcat_telemetry_series_free().
+ */
+PCatTelemetrySeries *pcat_pmu_manager_telemetry_query(PCatTelemetryTier tier,
+    gint64 start, gint64 end)
+{
+    if(g_pcat_pmu_manager_data.telemetry==NULL)
+    {
+        return NULL;
+    }
+
+    return pcat_telemetry_query(g_pcat_pmu_manager_data.telemetry, tier,
+        start, end);
 }
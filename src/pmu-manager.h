@@ -2,9 +2,77 @@
 #define HAVE_PCAT_PMU_MANAGER_H
 
 #include <glib.h>
+#include "telemetry.h"
 
 G_BEGIN_DECLS
 
+typedef enum
+{
+    PCAT_PMU_MANAGER_COMMAND_HEARTBEAT = 0x1,
+    PCAT_PMU_MANAGER_COMMAND_HEARTBEAT_ACK = 0x2,
+    PCAT_PMU_MANAGER_COMMAND_PMU_HW_VERSION_GET = 0x3,
+    PCAT_PMU_MANAGER_COMMAND_PMU_HW_VERSION_GET_ACK = 0x4,
+    PCAT_PMU_MANAGER_COMMAND_PMU_FW_VERSION_GET = 0x5,
+    PCAT_PMU_MANAGER_COMMAND_PMU_FW_VERSION_GET_ACK = 0x6,
+    PCAT_PMU_MANAGER_COMMAND_STATUS_REPORT = 0x7,
+    PCAT_PMU_MANAGER_COMMAND_STATUS_REPORT_ACK = 0x8,
+    PCAT_PMU_MANAGER_COMMAND_DATE_TIME_SYNC = 0x9,
+    PCAT_PMU_MANAGER_COMMAND_DATE_TIME_SYNC_ACK = 0xA,
+    PCAT_PMU_MANAGER_COMMAND_SCHEDULE_STARTUP_TIME_SET = 0xB,
+    PCAT_PMU_MANAGER_COMMAND_SCHEDULE_STARTUP_TIME_SET_ACK = 0xC,
+    PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_SHUTDOWN = 0xD,
+    PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_SHUTDOWN_ACK = 0xE,
+    PCAT_PMU_MANAGER_COMMAND_HOST_REQUEST_SHUTDOWN = 0xF,
+    PCAT_PMU_MANAGER_COMMAND_HOST_REQUEST_SHUTDOWN_ACK = 0x10,
+    PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_FACTORY_RESET = 0x11,
+    PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_FACTORY_RESET_ACK = 0x12,
+    PCAT_PMU_MANAGER_COMMAND_WATCHDOG_TIMEOUT_SET = 0x13,
+    PCAT_PMU_MANAGER_COMMAND_WATCHDOG_TIMEOUT_SET_ACK = 0x14,
+    PCAT_PMU_MANAGER_COMMAND_CHARGER_ON_AUTO_START = 0x15,
+    PCAT_PMU_MANAGER_COMMAND_CHARGER_ON_AUTO_START_ACK = 0x16,
+    PCAT_PMU_MANAGER_COMMAND_VOLTAGE_THRESHOLD_SET = 0x17,
+    PCAT_PMU_MANAGER_COMMAND_VOLTAGE_THRESHOLD_SET_ACK = 0x18,
+    PCAT_PMU_MANAGER_COMMAND_NET_STATUS_LED_SETUP = 0x19,
+    PCAT_PMU_MANAGER_COMMAND_NET_STATUS_LED_SETUP_ACK = 0x1A,
+    PCAT_PMU_MANAGER_COMMAND_POWER_ON_EVENT_GET = 0x1B,
+    PCAT_PMU_MANAGER_COMMAND_POWER_ON_EVENT_GET_ACK = 0x1C,
+    PCAT_PMU_MANAGER_COMMAND_SERIAL_BAUD_SET = 0x1D,
+    PCAT_PMU_MANAGER_COMMAND_SERIAL_BAUD_SET_ACK = 0x1E,
+}PCatPMUManagerCommandType;
+
+typedef enum
+{
+    PCAT_PMU_MANAGER_COMMAND_PRIORITY_SAFETY = 0,
+    PCAT_PMU_MANAGER_COMMAND_PRIORITY_ACK,
+    PCAT_PMU_MANAGER_COMMAND_PRIORITY_CONFIG,
+    PCAT_PMU_MANAGER_COMMAND_PRIORITY_COSMETIC,
+    PCAT_PMU_MANAGER_COMMAND_PRIORITY_LAST
+}PCatPMUManagerCommandPriority;
+
+typedef struct _PCatPMUManagerStatus
+{
+    guint sequence;
+    guint battery_voltage;
+    guint charger_voltage;
+    gboolean on_battery;
+    guint battery_percentage;
+    guint battery_percentage_confidence;
+    gint board_temp;
+}PCatPMUManagerStatus;
+
+typedef struct _PCatPMUManagerLinkStats
+{
+    guint64 rx_bytes;
+    guint64 rx_frames;
+    guint64 rx_errors;
+    guint64 tx_bytes;
+    guint64 tx_frames;
+    guint64 tx_syscalls;
+    guint64 retransmits;
+    guint64 allocations;
+    gint64 cpu_time;
+}PCatPMUManagerLinkStats;
+
 gboolean pcat_pmu_manager_init();
 void pcat_pmu_manager_uninit();
 void pcat_pmu_manager_shutdown_request();
@@ -24,6 +92,14 @@ void pcat_pmu_manager_voltage_threshold_set(guint led_vh, guint led_vm,
     guint led_vl, guint startup_voltage, guint charger_voltage,
     guint shutdown_voltage, guint led_work_vl, guint charger_fast_voltage);
 gint pcat_pmu_manager_board_temp_get();
+gboolean pcat_pmu_manager_status_snapshot_get(PCatPMUManagerStatus *status);
+guint pcat_pmu_manager_status_sequence_get();
+void pcat_pmu_manager_link_stats_get(PCatPMUManagerLinkStats *stats);
+gboolean pcat_pmu_manager_command_queue_stats_get(
+    PCatPMUManagerCommandPriority priority, guint *depth, guint64 *dropped,
+    guint64 *coalesced);
+PCatTelemetrySeries *pcat_pmu_manager_telemetry_query(PCatTelemetryTier tier,
+    gint64 start, gint64 end);
 
 G_END_DECLS
 
@@ -0,0 +1,148 @@
+#!/bin/sh
+#
+# Benchmark pcat-manager's PMU path over a grid of status report payload
+# sizes and UART baud rates. Each point runs a fresh pcat-manager against
+# pcat-pmu-simulator in window mode for a few seconds and prints one table
+# row: acked status reports and their rate, link utilisation of the
+# report direction and the ACK latency percentiles in ms. Baud 0 leaves
+# the PTY unpaced.
+#
+# Usage: pmu-simulator-sweep.sh <pcat-manager> <pcat-pmu-simulator>
+#
+# The default grid is 18 to 65532 byte payloads at 4800 to 921600 baud
+# plus the unpaced PTY. Those are the smallest and largest status report
+# payloads of the protocol: a report carries at least 18 bytes and a
+# frame at most 65532, so 0 byte and full 64 KiB points do not exist.
+#
+# A point runs for at least two reports on the simulated UART, longer
+# than PCAT_SWEEP_DURATION if needed. Points which would need more than
+# PCAT_SWEEP_DURATION_MAX seconds (e.g. 16 KiB at 4800 baud) are printed
+# as skipped.
+#
+# PCAT_SWEEP_SIZES, PCAT_SWEEP_BAUDS, PCAT_SWEEP_WINDOW,
+# PCAT_SWEEP_DURATION and PCAT_SWEEP_DURATION_MAX override the grid, the
+# number of outstanding reports and the seconds per point. Like
+# pmu-simulator-test.sh this runs the real daemon, do not use it on a
+# device running pcat-manager.
+
+set -u
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 <pcat-manager> <pcat-pmu-simulator>" >&2
+    exit 2
+fi
+
+manager=$1
+simulator=$2
+sizes=${PCAT_SWEEP_SIZES:-18 64 256 1024 4096 16384 65532}
+bauds=${PCAT_SWEEP_BAUDS:-4800 9600 115200 460800 921600 0}
+window=${PCAT_SWEEP_WINDOW:-4}
+duration=${PCAT_SWEEP_DURATION:-5}
+duration_max=${PCAT_SWEEP_DURATION_MAX:-60}
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/pcat-pmu-simulator-sweep.XXXXXX") || exit 1
+manager_pid=
+simulator_pid=
+
+# SIGTERM makes pcat-manager ask the PMU for a reboot, which nothing
+# answers once the simulator is gone.
+stop()
+{
+    if [ -n "$manager_pid" ]; then
+        kill -KILL "$manager_pid" 2>/dev/null
+        wait "$manager_pid" 2>/dev/null
+        manager_pid=
+    fi
+    if [ -n "$simulator_pid" ]; then
+        kill "$simulator_pid" 2>/dev/null
+        wait "$simulator_pid" 2>/dev/null
+        simulator_pid=
+    fi
+}
+
+cleanup()
+{
+    stop
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+trap 'exit 1' HUP INT PIPE TERM
+
+value()
+{
+    sed -n "s/.*\"$1\":\([0-9.]*\).*/\1/p" "$dir/simulator.json"
+}
+
+cat > "$dir/pcat-manager.conf" <<EOF
+[PowerManager]
+SerialDevice=$dir/pmu
+
+[Journal]
+File=$dir/journal.bin
+EOF
+
+printf "%8s %8s %8s %10s %8s %10s %10s %10s\n" "payload" "baud" "acked" \
+    "reports/s" "link%" "p50(ms)" "p99(ms)" "max(ms)"
+
+failures=0
+for size in $sizes; do
+    for baud in $bauds; do
+        rm -f "$dir/pmu" "$dir/simulator.json"
+
+        # A status report is the payload plus 13 bytes of framing, sent
+        # as 10 bits per byte on the UART.
+        point_duration=$duration
+        if [ "$baud" -gt 0 ]; then
+            point_duration=$(awk -v s="$size" -v b="$baud" -v d="$duration" \
+                'BEGIN { t = int(2 * (s + 13) * 10 / b) + 1;
+                    print (t > d) ? t : d }')
+        fi
+        if [ "$point_duration" -gt "$duration_max" ]; then
+            printf "%8s %8s %8s %10s %8s %10s %10s %10s\n" "$size" "$baud" \
+                "skipped" "-" "-" "-" "-" "-"
+            continue
+        fi
+
+        "$simulator" --link "$dir/pmu" --window "$window" \
+            --payload-size "$size" --baud "$baud" \
+            --duration "$point_duration" \
+            --json > "$dir/simulator.json" 2> "$dir/simulator.log" &
+        simulator_pid=$!
+
+        count=50
+        while [ ! -e "$dir/pmu" ] && [ $count -gt 0 ]; do
+            count=$((count - 1))
+            sleep 0.1
+        done
+
+        "$manager" --distro --config "$dir/pcat-manager.conf" \
+            --user-config "$dir/pcat-manager-userdata.conf" \
+            > "$dir/manager.log" 2>&1 &
+        manager_pid=$!
+
+        wait "$simulator_pid"
+        simulator_pid=
+        stop
+
+        rate=$(value frames-per-second)
+        if [ -z "$rate" ]; then
+            echo "No results for payload $size at baud $baud:" >&2
+            tail -n 5 "$dir/simulator.log" >&2
+            failures=$((failures + 1))
+            continue
+        fi
+
+        link=-
+        if [ "$baud" -gt 0 ]; then
+            link=$(awk -v r="$rate" -v s="$size" -v b="$baud" \
+                'BEGIN { printf "%.1f", r * (s + 13) * 10 * 100 / b }')
+        fi
+
+        printf "%8s %8s %8s %10s %8s %10s %10s %10s\n" "$size" "$baud" \
+            "$(value status-reports-acked)" "$rate" "$link" \
+            "$(value ack-latency-p50)" "$(value ack-latency-p99)" \
+            "$(value ack-latency-max)"
+    done
+done
+
+[ $failures -eq 0 ]
@@ -0,0 +1,142 @@
+#!/bin/sh
+#
+# Run pcat-manager against pcat-pmu-simulator: the manager gets its own
+# config pointing [PowerManager] SerialDevice at the simulator PTY, the
+# simulator sends status reports and asks for a shutdown after a few
+# seconds. Checks the firmware version handshake, that status reports are
+# acked, and that the PMU shutdown request is acked and ends with the
+# manager running poweroff (faked here) and exiting cleanly.
+#
+# Usage: pmu-simulator-test.sh <pcat-manager> <pcat-pmu-simulator>
+#
+# This runs the real daemon, including the modem scan and the control
+# socket in /tmp, so do not use it on a device running pcat-manager.
+
+set -u
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 <pcat-manager> <pcat-pmu-simulator>" >&2
+    exit 2
+fi
+
+manager=$1
+simulator=$2
+shutdown_after=${PCAT_TEST_SHUTDOWN_AFTER:-3}
+timeout=30
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/pcat-pmu-simulator-test.XXXXXX") || exit 1
+manager_pid=
+simulator_pid=
+
+# SIGTERM makes pcat-manager ask the PMU for a reboot, do not wait for it.
+cleanup()
+{
+    if [ -n "$manager_pid" ]; then
+        kill -KILL "$manager_pid" 2>/dev/null
+    fi
+    if [ -n "$simulator_pid" ]; then
+        kill "$simulator_pid" 2>/dev/null
+    fi
+    wait 2>/dev/null
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+trap 'exit 1' HUP INT PIPE TERM
+
+fail()
+{
+    echo "FAIL: $*" >&2
+    for f in "$dir/simulator.log" "$dir/manager.log"; do
+        if [ -s "$f" ]; then
+            echo "--- $f" >&2
+            tail -n 20 "$f" >&2
+        fi
+    done
+    exit 1
+}
+
+# Wait up to $1 tenths of a second for the command in $2... to succeed.
+wait_for()
+{
+    count=$1
+    shift
+    while ! "$@"; do
+        count=$((count - 1))
+        if [ $count -le 0 ]; then
+            return 1
+        fi
+        sleep 0.1
+    done
+}
+
+running()
+{
+    kill -0 "$1" 2>/dev/null
+}
+
+stopped()
+{
+    ! kill -0 "$1" 2>/dev/null
+}
+
+value()
+{
+    sed -n "s/.*\"$1\":\([0-9]*\).*/\1/p" "$dir/simulator.json"
+}
+
+# The manager runs poweroff once the PMU asked for a shutdown, stand in
+# for it with the SIGTERM a real poweroff would send.
+mkdir "$dir/bin"
+cat > "$dir/bin/poweroff" <<EOF
+#!/bin/sh
+touch "$dir/poweroff"
+kill -TERM \$(cat "$dir/manager.pid")
+EOF
+chmod +x "$dir/bin/poweroff"
+
+cat > "$dir/pcat-manager.conf" <<EOF
+[PowerManager]
+SerialDevice=$dir/pmu
+
+[Journal]
+File=$dir/journal.bin
+EOF
+
+"$simulator" --link "$dir/pmu" --shutdown-after "$shutdown_after" \
+    --duration "$timeout" --json > "$dir/simulator.json" \
+    2> "$dir/simulator.log" &
+simulator_pid=$!
+
+wait_for 50 test -e "$dir/pmu" || fail "simulator did not create its PTY"
+
+PATH="$dir/bin:$PATH" "$manager" --distro \
+    --config "$dir/pcat-manager.conf" \
+    --user-config "$dir/pcat-manager-userdata.conf" \
+    > "$dir/manager.log" 2>&1 &
+manager_pid=$!
+echo "$manager_pid" > "$dir/manager.pid"
+
+wait_for $((timeout * 10)) stopped "$manager_pid" ||
+    fail "pcat-manager did not exit after the shutdown request"
+wait "$manager_pid"
+status=$?
+manager_pid=
+[ $status -eq 0 ] || fail "pcat-manager exited with status $status"
+
+running "$simulator_pid" || fail "simulator exited early"
+kill -TERM "$simulator_pid"
+wait "$simulator_pid"
+simulator_pid=
+
+[ -e "$dir/poweroff" ] || fail "pcat-manager did not run poweroff"
+[ "$(value fw-version-requests)" -ge 1 ] 2>/dev/null ||
+    fail "no firmware version handshake"
+[ "$(value status-reports-acked)" -ge 1 ] 2>/dev/null ||
+    fail "no status report acked"
+[ "$(value shutdown-requests-acked)" -eq 1 ] 2>/dev/null ||
+    fail "shutdown request not acked"
+[ "$(value rx-errors)" -eq 0 ] 2>/dev/null ||
+    fail "simulator received corrupted frames"
+
+echo "PASS: handshake, $(value status-reports-acked)/$(value \
+status-reports-sent) status reports acked, shutdown acked, poweroff run"
@@ -0,0 +1,1261 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <glib/gstdio.h>
+
+#include "pmu-manager.h"
+#include "crc16.h"
+
+/*
+ * Simulate the PMU side of the serial protocol on a pseudo terminal, so
+ * pcat-manager can be run against it by pointing [PowerManager]
+ * SerialDevice at the PTY (or at the --link path).
+ * pmu-simulator-test.sh does that and checks the handshake, status and
+ * shutdown flow.
+ *
+ * With --window the simulator keeps that many status reports outstanding
+ * and works as a throughput and latency benchmark of the manager's PMU
+ * path, timed from the first frame the host sends. --baud paces both
+ * directions like a real UART and --json prints the results in a
+ * machine-readable form. pmu-simulator-sweep.sh runs it over a grid of
+ * payload sizes and baud rates.
+ */
+
+#define PCAT_PMU_SIMULATOR_FRAME_MAX (65532 + 10)
+#define PCAT_PMU_SIMULATOR_READ_BUFFER_SIZE 4096
+#define PCAT_PMU_SIMULATOR_STATUS_DATA_SIZE 18
+#define PCAT_PMU_SIMULATOR_WINDOW_STALL_TIMEOUT 1000000L
+#define PCAT_PMU_SIMULATOR_MANAGER_SOCKET_FILE "/tmp/pcat-manager.sock"
+
+typedef struct _PCatPMUSimulatorData
+{
+    GMainLoop *main_loop;
+
+    int master_fd;
+    int slave_fd;
+    gchar *slave_path;
+    GIOChannel *channel;
+    guint read_source;
+    guint write_source;
+    GByteArray *read_buffer;
+    GByteArray *write_buffer;
+    gdouble read_budget;
+    gint64 read_budget_timestamp;
+    guint read_resume_timeout_id;
+    gdouble write_budget;
+    gint64 write_budget_timestamp;
+    guint write_resume_timeout_id;
+
+    guint16 frame_num;
+    gint64 request_timestamps[65536];
+    guint16 request_commands[65536];
+
+    guint status_report_timeout_id;
+    guint8 *status_data;
+    gsize status_data_size;
+    guint outstanding_reports;
+    gint64 last_report_ack_timestamp;
+    gint64 time_offset;
+    gint64 last_heartbeat_timestamp;
+    guint watchdog_timeout;
+
+    guint64 rx_frames;
+    guint64 rx_errors;
+    guint64 acks_sent;
+    guint64 acks_dropped;
+    guint64 acks_corrupted;
+    guint64 status_reports_sent;
+    guint64 requests_acked;
+    guint64 requests_lost;
+    guint64 rx_bytes;
+    guint64 tx_bytes;
+    GArray *rtt_samples;
+    gint64 request_rtt_sum;
+    gint64 request_rtt_max;
+    guint64 heartbeats;
+    guint64 fw_version_requests;
+    guint64 status_reports_acked;
+    guint64 shutdown_requests_acked;
+    guint64 host_shutdown_requests;
+    gint64 start_timestamp;
+}PCatPMUSimulatorData;
+
+typedef struct _PCatPMUSimulatorDelayedFrame
+{
+    PCatPMUSimulatorData *sim_data;
+    GByteArray *frame;
+}PCatPMUSimulatorDelayedFrame;
+
+static PCatPMUSimulatorData g_pcat_pmu_simulator_data = {0};
+
+static gchar *g_pcat_pmu_simulator_cmd_link = NULL;
+static gdouble g_pcat_pmu_simulator_cmd_status_rate = 1.0;
+static gdouble g_pcat_pmu_simulator_cmd_ack_loss = 0.0;
+static gdouble g_pcat_pmu_simulator_cmd_ack_corrupt = 0.0;
+static gint g_pcat_pmu_simulator_cmd_ack_delay = 0;
+static gint g_pcat_pmu_simulator_cmd_ack_jitter = 0;
+static gint g_pcat_pmu_simulator_cmd_battery_voltage = 4000;
+static gint g_pcat_pmu_simulator_cmd_charger_voltage = 5000;
+static gint g_pcat_pmu_simulator_cmd_board_temp = 40;
+static gint g_pcat_pmu_simulator_cmd_power_on_event = 0;
+static gint g_pcat_pmu_simulator_cmd_shutdown_after = 0;
+static gint g_pcat_pmu_simulator_cmd_factory_reset_after = 0;
+static gint g_pcat_pmu_simulator_cmd_duration = 0;
+static gchar *g_pcat_pmu_simulator_cmd_fw_version = NULL;
+static gint g_pcat_pmu_simulator_cmd_baud = 0;
+static gint g_pcat_pmu_simulator_cmd_baud_max = 0;
+static gint g_pcat_pmu_simulator_cmd_window = 0;
+static gint g_pcat_pmu_simulator_cmd_payload_size = 0;
+static gboolean g_pcat_pmu_simulator_cmd_json = FALSE;
+static gboolean g_pcat_pmu_simulator_cmd_manager_stats = FALSE;
+
+static GOptionEntry g_pcat_pmu_simulator_cmd_entries[] =
+{
+    { "link", 'l', 0, G_OPTION_ARG_FILENAME,
+        &g_pcat_pmu_simulator_cmd_link,
+        "Create a symlink to the PTY at this path", NULL },
+    { "status-rate", 'r', 0, G_OPTION_ARG_DOUBLE,
+        &g_pcat_pmu_simulator_cmd_status_rate,
+        "Status reports per second (0 to disable)", NULL },
+    { "ack-loss", 0, 0, G_OPTION_ARG_DOUBLE,
+        &g_pcat_pmu_simulator_cmd_ack_loss,
+        "Percentage of ACKs to drop", NULL },
+    { "ack-corrupt", 0, 0, G_OPTION_ARG_DOUBLE,
+        &g_pcat_pmu_simulator_cmd_ack_corrupt,
+        "Percentage of ACKs to corrupt", NULL },
+    { "ack-delay", 0, 0, G_OPTION_ARG_INT,
+        &g_pcat_pmu_simulator_cmd_ack_delay,
+        "Delay in ms before sending each ACK", NULL },
+    { "ack-jitter", 0, 0, G_OPTION_ARG_INT,
+        &g_pcat_pmu_simulator_cmd_ack_jitter,
+        "Random extra ACK delay in ms", NULL },
+    { "battery-voltage", 0, 0, G_OPTION_ARG_INT,
+        &g_pcat_pmu_simulator_cmd_battery_voltage,
+        "Reported battery voltage in mV", NULL },
+    { "charger-voltage", 0, 0, G_OPTION_ARG_INT,
+        &g_pcat_pmu_simulator_cmd_charger_voltage,
+        "Reported charger voltage in mV", NULL },
+    { "board-temp", 0, 0, G_OPTION_ARG_INT,
+        &g_pcat_pmu_simulator_cmd_board_temp,
+        "Reported board temperature", NULL },
+    { "power-on-event", 0, 0, G_OPTION_ARG_INT,
+        &g_pcat_pmu_simulator_cmd_power_on_event,
+        "Reported power on event", NULL },
+    { "shutdown-after", 0, 0, G_OPTION_ARG_INT,
+        &g_pcat_pmu_simulator_cmd_shutdown_after,
+        "Request host shutdown after N seconds", NULL },
+    { "factory-reset-after", 0, 0, G_OPTION_ARG_INT,
+        &g_pcat_pmu_simulator_cmd_factory_reset_after,
+        "Request factory reset after N seconds", NULL },
+    { "duration", 'd', 0, G_OPTION_ARG_INT,
+        &g_pcat_pmu_simulator_cmd_duration,
+        "Exit after N seconds", NULL },
+    { "fw-version", 0, 0, G_OPTION_ARG_STRING,
+        &g_pcat_pmu_simulator_cmd_fw_version,
+        "Reported PMU firmware version", NULL },
+    { "baud", 'b', 0, G_OPTION_ARG_INT,
+        &g_pcat_pmu_simulator_cmd_baud,
+        "Pace the PTY like a UART at this baud rate", NULL },
+    { "baud-max", 'B', 0, G_OPTION_ARG_INT,
+        &g_pcat_pmu_simulator_cmd_baud_max,
+        "Accept serial speed upgrades up to this baud rate", NULL },
+    { "window", 'w', 0, G_OPTION_ARG_INT,
+        &g_pcat_pmu_simulator_cmd_window,
+        "Keep N status reports outstanding instead of a fixed rate", NULL },
+    { "payload-size", 's', 0, G_OPTION_ARG_INT,
+        &g_pcat_pmu_simulator_cmd_payload_size,
+        "Status report payload size in bytes (18 to 65532)", NULL },
+    { "json", 'j', 0, G_OPTION_ARG_NONE,
+        &g_pcat_pmu_simulator_cmd_json,
+        "Print the results as JSON", NULL },
+    { "manager-stats", 'm', 0, G_OPTION_ARG_NONE,
+        &g_pcat_pmu_simulator_cmd_manager_stats,
+        "Include pcat-manager PMU link statistics in the results", NULL },
+    { NULL }
+};
+
+/*
+ * Token bucket which limits a direction of the PTY to baud / 10 bytes per
+ * second (8N1), bursts are limited to 10 ms worth of data.
+ */
+static gsize pcat_pmu_simulator_line_budget_get(gdouble *budget,
+    gint64 *timestamp)
+{
+    gint64 now;
+    gdouble rate, burst;
+
+    if(g_pcat_pmu_simulator_cmd_baud <= 0)
+    {
+        return G_MAXSIZE;
+    }
+
+    now = g_get_monotonic_time();
+    rate = g_pcat_pmu_simulator_cmd_baud / 10.0;
+    burst = MAX(rate / 100.0, 16.0);
+
+    if(*timestamp==0)
+    {
+        *budget = burst;
+    }
+    else
+    {
+        *budget += (now - *timestamp) * rate / 1000000.0;
+        if(*budget > burst)
+        {
+            *budget = burst;
+        }
+    }
+    *timestamp = now;
+
+    return *budget > 0.0 ? (gsize)*budget : 0;
+}
+
+static guint pcat_pmu_simulator_line_wait_get()
+{
+    return 10000 / g_pcat_pmu_simulator_cmd_baud + 1;
+}
+
+static gboolean pcat_pmu_simulator_write_watch_func(GIOChannel *source,
+    GIOCondition condition, gpointer user_data);
+
+static gboolean pcat_pmu_simulator_write_resume_func(gpointer user_data)
+{
+    PCatPMUSimulatorData *sim_data = (PCatPMUSimulatorData *)user_data;
+
+    sim_data->write_resume_timeout_id = 0;
+    sim_data->write_source = g_io_add_watch(sim_data->channel,
+        G_IO_OUT, pcat_pmu_simulator_write_watch_func, sim_data);
+
+    return FALSE;
+}
+
+static gboolean pcat_pmu_simulator_write_watch_func(GIOChannel *source,
+    GIOCondition condition, gpointer user_data)
+{
+    PCatPMUSimulatorData *sim_data = (PCatPMUSimulatorData *)user_data;
+    gssize wsize;
+    gsize budget;
+
+    budget = pcat_pmu_simulator_line_budget_get(&sim_data->write_budget,
+        &sim_data->write_budget_timestamp);
+
+    while(sim_data->write_buffer->len > 0)
+    {
+        if(budget==0)
+        {
+            sim_data->write_source = 0;
+            sim_data->write_resume_timeout_id = g_timeout_add(
+                pcat_pmu_simulator_line_wait_get(),
+                pcat_pmu_simulator_write_resume_func, sim_data);
+
+            return FALSE;
+        }
+
+        wsize = write(sim_data->master_fd, sim_data->write_buffer->data,
+            MIN(sim_data->write_buffer->len, budget));
+        if(wsize > 0)
+        {
+            g_byte_array_remove_range(sim_data->write_buffer, 0, wsize);
+            sim_data->tx_bytes += wsize;
+            sim_data->write_budget -= wsize;
+            budget -= wsize;
+        }
+        else if(wsize < 0 && errno==EAGAIN)
+        {
+            return TRUE;
+        }
+        else
+        {
+            g_warning("PTY write error: %s", strerror(errno));
+            g_byte_array_set_size(sim_data->write_buffer, 0);
+            break;
+        }
+    }
+
+    sim_data->write_source = 0;
+
+    return FALSE;
+}
+
+static void pcat_pmu_simulator_write_raw(PCatPMUSimulatorData *sim_data,
+    const guint8 *data, guint len)
+{
+    g_byte_array_append(sim_data->write_buffer, data, len);
+
+    if(sim_data->write_source==0 && sim_data->write_resume_timeout_id==0)
+    {
+        sim_data->write_source = g_io_add_watch(sim_data->channel,
+            G_IO_OUT, pcat_pmu_simulator_write_watch_func, sim_data);
+    }
+}
+
+static GByteArray *pcat_pmu_simulator_frame_build(guint16 command,
+    guint16 frame_num, const guint8 *extra_data, guint16 extra_data_len,
+    gboolean need_ack)
+{
+    GByteArray *frame;
+    guint8 *p;
+    guint16 dp_size;
+    guint16 crc;
+
+    dp_size = extra_data_len + 3;
+
+    frame = g_byte_array_sized_new(extra_data_len + 13);
+    g_byte_array_set_size(frame, extra_data_len + 13);
+    p = frame->data;
+
+    p[0] = 0xA5;
+    p[1] = 0x81;
+    p[2] = 0x01;
+    p[3] = frame_num & 0xFF;
+    p[4] = (frame_num >> 8) & 0xFF;
+    p[5] = dp_size & 0xFF;
+    p[6] = (dp_size >> 8) & 0xFF;
+    p[7] = command & 0xFF;
+    p[8] = (command >> 8) & 0xFF;
+    if(extra_data_len > 0)
+    {
+        memcpy(p + 9, extra_data, extra_data_len);
+    }
+    p[9 + extra_data_len] = need_ack ? 1 : 0;
+
+    crc = pcat_crc16_compute(p + 1, dp_size + 6);
+    p[10 + extra_data_len] = crc & 0xFF;
+    p[11 + extra_data_len] = (crc >> 8) & 0xFF;
+    p[12 + extra_data_len] = 0x5A;
+
+    return frame;
+}
+
+static void pcat_pmu_simulator_request_send(PCatPMUSimulatorData *sim_data,
+    guint16 command, const guint8 *extra_data, guint16 extra_data_len)
+{
+    GByteArray *frame;
+    guint16 frame_num;
+
+    frame_num = sim_data->frame_num;
+    sim_data->frame_num++;
+
+    sim_data->request_timestamps[frame_num] = g_get_monotonic_time();
+    sim_data->request_commands[frame_num] = command;
+
+    frame = pcat_pmu_simulator_frame_build(command, frame_num, extra_data,
+        extra_data_len, TRUE);
+    pcat_pmu_simulator_write_raw(sim_data, frame->data, frame->len);
+    g_byte_array_unref(frame);
+}
+
+static gboolean pcat_pmu_simulator_delayed_frame_func(gpointer user_data)
+{
+    PCatPMUSimulatorDelayedFrame *delayed =
+        (PCatPMUSimulatorDelayedFrame *)user_data;
+
+    pcat_pmu_simulator_write_raw(delayed->sim_data, delayed->frame->data,
+        delayed->frame->len);
+    g_byte_array_unref(delayed->frame);
+    g_free(delayed);
+
+    return FALSE;
+}
+
+static void pcat_pmu_simulator_ack_send(PCatPMUSimulatorData *sim_data,
+    guint16 command, guint16 frame_num, const guint8 *extra_data,
+    guint16 extra_data_len)
+{
+    GByteArray *frame;
+    PCatPMUSimulatorDelayedFrame *delayed;
+    guint delay;
+    guint pos;
+
+    if(g_random_double_range(0.0, 100.0) <
+        g_pcat_pmu_simulator_cmd_ack_loss)
+    {
+        sim_data->acks_dropped++;
+
+        return;
+    }
+
+    frame = pcat_pmu_simulator_frame_build(command + 1, frame_num,
+        extra_data, extra_data_len, FALSE);
+
+    if(g_random_double_range(0.0, 100.0) <
+        g_pcat_pmu_simulator_cmd_ack_corrupt)
+    {
+        pos = g_random_int_range(1, frame->len - 1);
+        frame->data[pos] ^= 1 << g_random_int_range(0, 8);
+        sim_data->acks_corrupted++;
+    }
+
+    sim_data->acks_sent++;
+
+    delay = g_pcat_pmu_simulator_cmd_ack_delay;
+    if(g_pcat_pmu_simulator_cmd_ack_jitter > 0)
+    {
+        delay += g_random_int_range(0,
+            g_pcat_pmu_simulator_cmd_ack_jitter + 1);
+    }
+
+    if(delay==0)
+    {
+        pcat_pmu_simulator_write_raw(sim_data, frame->data, frame->len);
+        g_byte_array_unref(frame);
+
+        return;
+    }
+
+    delayed = g_new0(PCatPMUSimulatorDelayedFrame, 1);
+    delayed->sim_data = sim_data;
+    delayed->frame = frame;
+    g_timeout_add(delay, pcat_pmu_simulator_delayed_frame_func, delayed);
+}
+
+static void pcat_pmu_simulator_window_fill(PCatPMUSimulatorData *sim_data);
+
+static void pcat_pmu_simulator_frame_process(PCatPMUSimulatorData *sim_data,
+    const guint8 *p, guint16 dp_size)
+{
+    guint16 frame_num;
+    guint16 command;
+    const guint8 *extra_data;
+    guint16 extra_data_len;
+    gboolean need_ack;
+    gint64 rtt;
+    guint8 v;
+    guint32 baud;
+    GDateTime *dt;
+
+    frame_num = p[3] + ((guint16)p[4] << 8);
+    command = p[7] + ((guint16)p[8] << 8);
+    extra_data = p + 9;
+    extra_data_len = dp_size - 3;
+    need_ack = (p[6 + dp_size]!=0);
+
+    sim_data->rx_frames++;
+
+    /*
+     * Reports sent before the host opened the PTY would only stall the
+     * window, so the benchmark and its clock start with the first frame.
+     */
+    if(g_pcat_pmu_simulator_cmd_window > 0 && sim_data->rx_frames==1)
+    {
+        sim_data->start_timestamp = g_get_monotonic_time();
+        sim_data->last_report_ack_timestamp = sim_data->start_timestamp;
+        pcat_pmu_simulator_window_fill(sim_data);
+    }
+
+    g_debug("Got command %X frame %u from host.", command, frame_num);
+
+    switch(command)
+    {
+        case PCAT_PMU_MANAGER_COMMAND_HEARTBEAT:
+        {
+            sim_data->heartbeats++;
+            sim_data->last_heartbeat_timestamp = g_get_monotonic_time();
+            break;
+        }
+        case PCAT_PMU_MANAGER_COMMAND_DATE_TIME_SYNC:
+        {
+            if(extra_data_len < 7)
+            {
+                break;
+            }
+
+            dt = g_date_time_new_utc(extra_data[0] +
+                ((guint16)extra_data[1] << 8), extra_data[2], extra_data[3],
+                extra_data[4], extra_data[5], extra_data[6]);
+            if(dt!=NULL)
+            {
+                sim_data->time_offset = g_date_time_to_unix(dt) -
+                    g_get_real_time() / 1000000;
+                g_date_time_unref(dt);
+            }
+            break;
+        }
+        case PCAT_PMU_MANAGER_COMMAND_WATCHDOG_TIMEOUT_SET:
+        {
+            if(extra_data_len >= 3)
+            {
+                sim_data->watchdog_timeout = extra_data[2];
+            }
+            break;
+        }
+        case PCAT_PMU_MANAGER_COMMAND_PMU_FW_VERSION_GET:
+        {
+            sim_data->fw_version_requests++;
+            break;
+        }
+        case PCAT_PMU_MANAGER_COMMAND_HOST_REQUEST_SHUTDOWN:
+        {
+            g_message("Host requested shutdown.");
+            sim_data->host_shutdown_requests++;
+            break;
+        }
+        case PCAT_PMU_MANAGER_COMMAND_STATUS_REPORT_ACK:
+        case PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_SHUTDOWN_ACK:
+        case PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_FACTORY_RESET_ACK:
+        {
+            if(sim_data->request_timestamps[frame_num]==0 ||
+               sim_data->request_commands[frame_num] + 1!=command)
+            {
+                break;
+            }
+
+            rtt = g_get_monotonic_time() -
+                sim_data->request_timestamps[frame_num];
+            sim_data->request_timestamps[frame_num] = 0;
+            sim_data->requests_acked++;
+            sim_data->request_rtt_sum += rtt;
+            if(rtt > sim_data->request_rtt_max)
+            {
+                sim_data->request_rtt_max = rtt;
+            }
+            g_array_append_val(sim_data->rtt_samples, rtt);
+
+            if(command==PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_SHUTDOWN_ACK)
+            {
+                sim_data->shutdown_requests_acked++;
+            }
+            else if(command==PCAT_PMU_MANAGER_COMMAND_STATUS_REPORT_ACK)
+            {
+                sim_data->status_reports_acked++;
+                if(sim_data->outstanding_reports > 0)
+                {
+                    sim_data->outstanding_reports--;
+                }
+                sim_data->last_report_ack_timestamp =
+                    g_get_monotonic_time();
+                pcat_pmu_simulator_window_fill(sim_data);
+            }
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+
+    if(!need_ack)
+    {
+        return;
+    }
+
+    switch(command)
+    {
+        case PCAT_PMU_MANAGER_COMMAND_PMU_HW_VERSION_GET:
+        case PCAT_PMU_MANAGER_COMMAND_PMU_FW_VERSION_GET:
+        {
+            pcat_pmu_simulator_ack_send(sim_data, command, frame_num,
+                (const guint8 *)g_pcat_pmu_simulator_cmd_fw_version,
+                strlen(g_pcat_pmu_simulator_cmd_fw_version));
+            break;
+        }
+        case PCAT_PMU_MANAGER_COMMAND_SERIAL_BAUD_SET:
+        {
+            /* Without --baud-max, behave like firmware which predates it. */
+            if(g_pcat_pmu_simulator_cmd_baud_max <= 0 || extra_data_len < 4)
+            {
+                pcat_pmu_simulator_ack_send(sim_data, command, frame_num,
+                    NULL, 0);
+                break;
+            }
+
+            baud = extra_data[0] + ((guint32)extra_data[1] << 8) +
+                ((guint32)extra_data[2] << 16) +
+                ((guint32)extra_data[3] << 24);
+            v = (baud <= (guint32)g_pcat_pmu_simulator_cmd_baud_max) ? 0 : 1;
+            pcat_pmu_simulator_ack_send(sim_data, command, frame_num,
+                &v, 1);
+
+            if(v==0)
+            {
+                g_message("Serial speed changed to %u.", baud);
+                if(g_pcat_pmu_simulator_cmd_baud > 0)
+                {
+                    g_pcat_pmu_simulator_cmd_baud = baud;
+                }
+            }
+            break;
+        }
+        case PCAT_PMU_MANAGER_COMMAND_POWER_ON_EVENT_GET:
+        {
+            v = g_pcat_pmu_simulator_cmd_power_on_event;
+            pcat_pmu_simulator_ack_send(sim_data, command, frame_num,
+                &v, 1);
+            break;
+        }
+        default:
+        {
+            pcat_pmu_simulator_ack_send(sim_data, command, frame_num,
+                NULL, 0);
+            break;
+        }
+    }
+}
+
+static void pcat_pmu_simulator_read_data_parse(
+    PCatPMUSimulatorData *sim_data)
+{
+    GByteArray *buffer = sim_data->read_buffer;
+    const guint8 *p;
+    guint16 dp_size;
+    guint16 crc;
+    gsize i;
+    gsize used_size = 0;
+
+    while(buffer->len - used_size >= 13)
+    {
+        p = buffer->data + used_size;
+
+        if(p[0]!=0xA5)
+        {
+            for(i=1;used_size + i < buffer->len && p[i]!=0xA5;i++);
+            used_size += i;
+            continue;
+        }
+
+        dp_size = p[5] + ((guint16)p[6] << 8);
+        if(dp_size < 3 || dp_size > 65535 - 10)
+        {
+            sim_data->rx_errors++;
+            used_size++;
+            continue;
+        }
+
+        if(buffer->len - used_size < (gsize)dp_size + 10)
+        {
+            break;
+        }
+
+        crc = p[7 + dp_size] + ((guint16)p[8 + dp_size] << 8);
+        if(p[9 + dp_size]!=0x5A ||
+           pcat_crc16_compute(p + 1, dp_size + 6)!=crc)
+        {
+            sim_data->rx_errors++;
+            used_size++;
+            continue;
+        }
+
+        pcat_pmu_simulator_frame_process(sim_data, p, dp_size);
+
+        used_size += dp_size + 10;
+    }
+
+    if(used_size > 0)
+    {
+        g_byte_array_remove_range(buffer, 0, used_size);
+    }
+
+    if(buffer->len > PCAT_PMU_SIMULATOR_FRAME_MAX)
+    {
+        g_byte_array_set_size(buffer, 0);
+    }
+}
+
+static gboolean pcat_pmu_simulator_read_watch_func(GIOChannel *source,
+    GIOCondition condition, gpointer user_data);
+
+static gboolean pcat_pmu_simulator_read_resume_func(gpointer user_data)
+{
+    PCatPMUSimulatorData *sim_data = (PCatPMUSimulatorData *)user_data;
+
+    sim_data->read_resume_timeout_id = 0;
+    sim_data->read_source = g_io_add_watch(sim_data->channel, G_IO_IN,
+        pcat_pmu_simulator_read_watch_func, sim_data);
+
+    return FALSE;
+}
+
+static gboolean pcat_pmu_simulator_read_watch_func(GIOChannel *source,
+    GIOCondition condition, gpointer user_data)
+{
+    PCatPMUSimulatorData *sim_data = (PCatPMUSimulatorData *)user_data;
+    guint8 buffer[PCAT_PMU_SIMULATOR_READ_BUFFER_SIZE];
+    gssize rsize;
+    gsize budget;
+
+    budget = pcat_pmu_simulator_line_budget_get(&sim_data->read_budget,
+        &sim_data->read_budget_timestamp);
+
+    while(budget > 0 && (rsize=read(sim_data->master_fd, buffer,
+        MIN(sizeof(buffer), budget))) > 0)
+    {
+        g_byte_array_append(sim_data->read_buffer, buffer, rsize);
+        sim_data->rx_bytes += rsize;
+        sim_data->read_budget -= rsize;
+        budget -= rsize;
+    }
+
+    pcat_pmu_simulator_read_data_parse(sim_data);
+
+    if(budget==0)
+    {
+        sim_data->read_source = 0;
+        sim_data->read_resume_timeout_id = g_timeout_add(
+            pcat_pmu_simulator_line_wait_get(),
+            pcat_pmu_simulator_read_resume_func, sim_data);
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void pcat_pmu_simulator_status_report_send(
+    PCatPMUSimulatorData *sim_data)
+{
+    guint8 *data = sim_data->status_data;
+    GDateTime *dt;
+    gint y, m, d;
+
+    data[0] = g_pcat_pmu_simulator_cmd_battery_voltage & 0xFF;
+    data[1] = (g_pcat_pmu_simulator_cmd_battery_voltage >> 8) & 0xFF;
+    data[2] = g_pcat_pmu_simulator_cmd_charger_voltage & 0xFF;
+    data[3] = (g_pcat_pmu_simulator_cmd_charger_voltage >> 8) & 0xFF;
+
+    dt = g_date_time_new_from_unix_utc(g_get_real_time() / 1000000 +
+        sim_data->time_offset);
+    if(dt!=NULL)
+    {
+        g_date_time_get_ymd(dt, &y, &m, &d);
+        data[8] = y & 0xFF;
+        data[9] = (y >> 8) & 0xFF;
+        data[10] = m;
+        data[11] = d;
+        data[12] = g_date_time_get_hour(dt);
+        data[13] = g_date_time_get_minute(dt);
+        data[14] = g_date_time_get_second(dt);
+        g_date_time_unref(dt);
+    }
+
+    data[17] = g_pcat_pmu_simulator_cmd_board_temp + 40;
+
+    pcat_pmu_simulator_request_send(sim_data,
+        PCAT_PMU_MANAGER_COMMAND_STATUS_REPORT, data,
+        sim_data->status_data_size);
+    sim_data->status_reports_sent++;
+    sim_data->outstanding_reports++;
+}
+
+static void pcat_pmu_simulator_window_fill(PCatPMUSimulatorData *sim_data)
+{
+    while(sim_data->outstanding_reports <
+        (guint)g_pcat_pmu_simulator_cmd_window)
+    {
+        pcat_pmu_simulator_status_report_send(sim_data);
+    }
+}
+
+static gboolean pcat_pmu_simulator_status_report_func(gpointer user_data)
+{
+    PCatPMUSimulatorData *sim_data = (PCatPMUSimulatorData *)user_data;
+
+    pcat_pmu_simulator_status_report_send(sim_data);
+
+    return TRUE;
+}
+
+/*
+ * Status reports which stay unacknowledged (for example sent before the
+ * manager opened and flushed the port) are counted as lost, so the window
+ * does not stall forever.
+ */
+static gboolean pcat_pmu_simulator_window_check_func(gpointer user_data)
+{
+    PCatPMUSimulatorData *sim_data = (PCatPMUSimulatorData *)user_data;
+    gint64 now;
+
+    now = g_get_monotonic_time();
+
+    if(sim_data->outstanding_reports > 0 &&
+       now > sim_data->last_report_ack_timestamp +
+       PCAT_PMU_SIMULATOR_WINDOW_STALL_TIMEOUT)
+    {
+        sim_data->requests_lost += sim_data->outstanding_reports;
+        sim_data->outstanding_reports = 0;
+        sim_data->last_report_ack_timestamp = now;
+        pcat_pmu_simulator_window_fill(sim_data);
+    }
+
+    return TRUE;
+}
+
+static gboolean pcat_pmu_simulator_shutdown_request_func(gpointer user_data)
+{
+    PCatPMUSimulatorData *sim_data = (PCatPMUSimulatorData *)user_data;
+
+    g_message("Requesting host shutdown.");
+
+    pcat_pmu_simulator_request_send(sim_data,
+        PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_SHUTDOWN, NULL, 0);
+
+    return FALSE;
+}
+
+static gboolean pcat_pmu_simulator_factory_reset_request_func(
+    gpointer user_data)
+{
+    PCatPMUSimulatorData *sim_data = (PCatPMUSimulatorData *)user_data;
+
+    g_message("Requesting factory reset.");
+
+    pcat_pmu_simulator_request_send(sim_data,
+        PCAT_PMU_MANAGER_COMMAND_PMU_REQUEST_FACTORY_RESET, NULL, 0);
+
+    return FALSE;
+}
+
+static gboolean pcat_pmu_simulator_watchdog_check_func(gpointer user_data)
+{
+    PCatPMUSimulatorData *sim_data = (PCatPMUSimulatorData *)user_data;
+    gint64 now;
+
+    if(sim_data->watchdog_timeout==0 ||
+       sim_data->last_heartbeat_timestamp==0)
+    {
+        return TRUE;
+    }
+
+    now = g_get_monotonic_time();
+    if(now > sim_data->last_heartbeat_timestamp +
+        (gint64)sim_data->watchdog_timeout * 1000000)
+    {
+        g_warning("No heartbeat for %u seconds, the PMU would reset the "
+            "host now!", sim_data->watchdog_timeout);
+        sim_data->last_heartbeat_timestamp = now;
+    }
+
+    return TRUE;
+}
+
+static gboolean pcat_pmu_simulator_quit_func(gpointer user_data)
+{
+    PCatPMUSimulatorData *sim_data = (PCatPMUSimulatorData *)user_data;
+
+    g_main_loop_quit(sim_data->main_loop);
+
+    return FALSE;
+}
+
+static gint pcat_pmu_simulator_rtt_compare_func(gconstpointer a,
+    gconstpointer b)
+{
+    gint64 va = *(const gint64 *)a;
+    gint64 vb = *(const gint64 *)b;
+
+    return (va > vb) - (va < vb);
+}
+
+static gdouble pcat_pmu_simulator_rtt_percentile_get(
+    PCatPMUSimulatorData *sim_data, guint percentile)
+{
+    guint index;
+
+    if(sim_data->rtt_samples->len==0)
+    {
+        return 0.0;
+    }
+
+    index = (sim_data->rtt_samples->len - 1) * percentile / 100;
+
+    return g_array_index(sim_data->rtt_samples, gint64, index) / 1000.0;
+}
+
+/*
+ * Ask the running pcat-manager for its PMU link counters, the reply is
+ * returned as the raw JSON text.
+ */
+static gchar *pcat_pmu_simulator_manager_stats_get()
+{
+    struct sockaddr_un addr;
+    struct timeval tv = { 1, 0 };
+    static const gchar request[] = "{\"command\":\"pmu-link-stats-get\"}";
+    GString *reply;
+    gchar buffer[1024];
+    gssize rsize;
+    gchar *end;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    g_strlcpy(addr.sun_path, PCAT_PMU_SIMULATOR_MANAGER_SOCKET_FILE,
+        sizeof(addr.sun_path));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr))!=0 ||
+       write(fd, request, sizeof(request))!=sizeof(request))
+    {
+        close(fd);
+
+        return NULL;
+    }
+
+    reply = g_string_new(NULL);
+    while((rsize=read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        g_string_append_len(reply, buffer, rsize);
+
+        end = memchr(reply->str, '\0', reply->len);
+        if(end!=NULL)
+        {
+            g_string_truncate(reply, end - reply->str);
+            close(fd);
+
+            return g_string_free(reply, FALSE);
+        }
+    }
+
+    close(fd);
+    g_string_free(reply, TRUE);
+
+    return NULL;
+}
+
+static void pcat_pmu_simulator_stats_print(PCatPMUSimulatorData *sim_data)
+{
+    gdouble elapsed;
+    gdouble rtt_avg = 0.0;
+    gdouble frame_rate;
+    gchar *manager_stats = NULL;
+
+    elapsed = (g_get_monotonic_time() - sim_data->start_timestamp) /
+        1000000.0;
+
+    g_array_sort(sim_data->rtt_samples, pcat_pmu_simulator_rtt_compare_func);
+    if(sim_data->requests_acked > 0)
+    {
+        rtt_avg = sim_data->request_rtt_sum / 1000.0 /
+            sim_data->requests_acked;
+    }
+    frame_rate = elapsed > 0.0 ? sim_data->requests_acked / elapsed : 0.0;
+
+    if(g_pcat_pmu_simulator_cmd_manager_stats)
+    {
+        manager_stats = pcat_pmu_simulator_manager_stats_get();
+        if(manager_stats==NULL)
+        {
+            g_warning("Failed to get PMU link statistics from "
+                "pcat-manager!");
+        }
+    }
+
+    if(g_pcat_pmu_simulator_cmd_json)
+    {
+        printf("{\"elapsed\":%.3f,\"baud\":%d,\"payload-size\":%"
+            G_GSIZE_FORMAT ",\"window\":%d,", elapsed,
+            g_pcat_pmu_simulator_cmd_baud, sim_data->status_data_size,
+            g_pcat_pmu_simulator_cmd_window);
+        printf("\"rx-frames\":%" G_GUINT64_FORMAT ",\"rx-errors\":%"
+            G_GUINT64_FORMAT ",\"rx-bytes\":%" G_GUINT64_FORMAT
+            ",\"tx-bytes\":%" G_GUINT64_FORMAT ",", sim_data->rx_frames,
+            sim_data->rx_errors, sim_data->rx_bytes, sim_data->tx_bytes);
+        printf("\"heartbeats\":%" G_GUINT64_FORMAT ",\"acks-sent\":%"
+            G_GUINT64_FORMAT ",\"acks-dropped\":%" G_GUINT64_FORMAT
+            ",\"acks-corrupted\":%" G_GUINT64_FORMAT ",",
+            sim_data->heartbeats, sim_data->acks_sent,
+            sim_data->acks_dropped, sim_data->acks_corrupted);
+        printf("\"fw-version-requests\":%" G_GUINT64_FORMAT
+            ",\"status-reports-acked\":%" G_GUINT64_FORMAT
+            ",\"shutdown-requests-acked\":%" G_GUINT64_FORMAT
+            ",\"host-shutdown-requests\":%" G_GUINT64_FORMAT ",",
+            sim_data->fw_version_requests, sim_data->status_reports_acked,
+            sim_data->shutdown_requests_acked,
+            sim_data->host_shutdown_requests);
+        printf("\"status-reports-sent\":%" G_GUINT64_FORMAT
+            ",\"requests-acked\":%" G_GUINT64_FORMAT
+            ",\"requests-lost\":%" G_GUINT64_FORMAT
+            ",\"frames-per-second\":%.1f,",
+            sim_data->status_reports_sent, sim_data->requests_acked,
+            sim_data->requests_lost, frame_rate);
+        printf("\"ack-latency-avg\":%.3f,\"ack-latency-p50\":%.3f,"
+            "\"ack-latency-p99\":%.3f,\"ack-latency-max\":%.3f",
+            rtt_avg, pcat_pmu_simulator_rtt_percentile_get(sim_data, 50),
+            pcat_pmu_simulator_rtt_percentile_get(sim_data, 99),
+            sim_data->request_rtt_max / 1000.0);
+        if(manager_stats!=NULL)
+        {
+            printf(",\"manager\":%s", manager_stats);
+        }
+        printf("}\n");
+    }
+    else
+    {
+        printf("elapsed: %.3f s\n", elapsed);
+        printf("frames received: %" G_GUINT64_FORMAT "\n",
+            sim_data->rx_frames);
+        printf("receive errors: %" G_GUINT64_FORMAT "\n",
+            sim_data->rx_errors);
+        printf("bytes received: %" G_GUINT64_FORMAT ", sent: %"
+            G_GUINT64_FORMAT "\n", sim_data->rx_bytes, sim_data->tx_bytes);
+        printf("heartbeats: %" G_GUINT64_FORMAT "\n", sim_data->heartbeats);
+        printf("acks sent: %" G_GUINT64_FORMAT "\n", sim_data->acks_sent);
+        printf("acks dropped: %" G_GUINT64_FORMAT "\n",
+            sim_data->acks_dropped);
+        printf("acks corrupted: %" G_GUINT64_FORMAT "\n",
+            sim_data->acks_corrupted);
+        printf("firmware version requests: %" G_GUINT64_FORMAT "\n",
+            sim_data->fw_version_requests);
+        printf("status reports sent: %" G_GUINT64_FORMAT ", acked: %"
+            G_GUINT64_FORMAT "\n", sim_data->status_reports_sent,
+            sim_data->status_reports_acked);
+        printf("shutdown requests acked: %" G_GUINT64_FORMAT "\n",
+            sim_data->shutdown_requests_acked);
+        printf("host shutdown requests: %" G_GUINT64_FORMAT "\n",
+            sim_data->host_shutdown_requests);
+        printf("requests acked by host: %" G_GUINT64_FORMAT " (%.1f/s), "
+            "lost: %" G_GUINT64_FORMAT "\n", sim_data->requests_acked,
+            frame_rate, sim_data->requests_lost);
+        if(sim_data->requests_acked > 0)
+        {
+            printf("host ack latency: avg %.3f ms, p50 %.3f ms, "
+                "p99 %.3f ms, max %.3f ms\n", rtt_avg,
+                pcat_pmu_simulator_rtt_percentile_get(sim_data, 50),
+                pcat_pmu_simulator_rtt_percentile_get(sim_data, 99),
+                sim_data->request_rtt_max / 1000.0);
+        }
+        if(manager_stats!=NULL)
+        {
+            printf("manager: %s\n", manager_stats);
+        }
+    }
+
+    g_free(manager_stats);
+}
+
+static gboolean pcat_pmu_simulator_pty_open(PCatPMUSimulatorData *sim_data)
+{
+    struct termios options;
+    const gchar *path;
+
+    sim_data->master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if(sim_data->master_fd < 0)
+    {
+        g_warning("Failed to open PTY master: %s", strerror(errno));
+
+        return FALSE;
+    }
+
+    if(grantpt(sim_data->master_fd)!=0 || unlockpt(sim_data->master_fd)!=0)
+    {
+        g_warning("Failed to unlock PTY: %s", strerror(errno));
+        close(sim_data->master_fd);
+
+        return FALSE;
+    }
+
+    path = ptsname(sim_data->master_fd);
+    if(path==NULL)
+    {
+        g_warning("Failed to get PTY slave name: %s", strerror(errno));
+        close(sim_data->master_fd);
+
+        return FALSE;
+    }
+    sim_data->slave_path = g_strdup(path);
+
+    /*
+     * Keep the slave side open in raw mode, so nothing is echoed back
+     * before the manager opens the port and the PTY survives the manager
+     * closing and reopening it.
+     */
+    sim_data->slave_fd = open(sim_data->slave_path, O_RDWR | O_NOCTTY);
+    if(sim_data->slave_fd < 0)
+    {
+        g_warning("Failed to open PTY slave %s: %s", sim_data->slave_path,
+            strerror(errno));
+        close(sim_data->master_fd);
+
+        return FALSE;
+    }
+    tcgetattr(sim_data->slave_fd, &options);
+    cfmakeraw(&options);
+    tcsetattr(sim_data->slave_fd, TCSANOW, &options);
+
+    fcntl(sim_data->master_fd, F_SETFL,
+        fcntl(sim_data->master_fd, F_GETFL) | O_NONBLOCK);
+
+    if(g_pcat_pmu_simulator_cmd_link!=NULL)
+    {
+        g_remove(g_pcat_pmu_simulator_cmd_link);
+        if(symlink(sim_data->slave_path, g_pcat_pmu_simulator_cmd_link)!=0)
+        {
+            g_warning("Failed to create symlink %s: %s",
+                g_pcat_pmu_simulator_cmd_link, strerror(errno));
+        }
+    }
+
+    sim_data->channel = g_io_channel_unix_new(sim_data->master_fd);
+
+    sim_data->read_source = g_io_add_watch(sim_data->channel, G_IO_IN,
+        pcat_pmu_simulator_read_watch_func, sim_data);
+
+    return TRUE;
+}
+
+static void pcat_pmu_simulator_pty_close(PCatPMUSimulatorData *sim_data)
+{
+    if(sim_data->read_source > 0)
+    {
+        g_source_remove(sim_data->read_source);
+        sim_data->read_source = 0;
+    }
+    if(sim_data->write_source > 0)
+    {
+        g_source_remove(sim_data->write_source);
+        sim_data->write_source = 0;
+    }
+    if(sim_data->read_resume_timeout_id > 0)
+    {
+        g_source_remove(sim_data->read_resume_timeout_id);
+        sim_data->read_resume_timeout_id = 0;
+    }
+    if(sim_data->write_resume_timeout_id > 0)
+    {
+        g_source_remove(sim_data->write_resume_timeout_id);
+        sim_data->write_resume_timeout_id = 0;
+    }
+    if(sim_data->channel!=NULL)
+    {
+        g_io_channel_unref(sim_data->channel);
+        sim_data->channel = NULL;
+    }
+    if(sim_data->slave_fd >= 0)
+    {
+        close(sim_data->slave_fd);
+        sim_data->slave_fd = -1;
+    }
+    if(sim_data->master_fd >= 0)
+    {
+        close(sim_data->master_fd);
+        sim_data->master_fd = -1;
+    }
+    if(g_pcat_pmu_simulator_cmd_link!=NULL)
+    {
+        g_remove(g_pcat_pmu_simulator_cmd_link);
+    }
+
+    g_free(sim_data->slave_path);
+    sim_data->slave_path = NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    PCatPMUSimulatorData *sim_data = &g_pcat_pmu_simulator_data;
+    GOptionContext *context;
+    GError *error = NULL;
+    guint interval;
+
+    context = g_option_context_new("- PCat PMU Simulator");
+    g_option_context_add_main_entries(context,
+        g_pcat_pmu_simulator_cmd_entries, NULL);
+    if(!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_warning("Option parsing failed: %s", error->message);
+        g_clear_error(&error);
+        g_option_context_free(context);
+
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if(g_pcat_pmu_simulator_cmd_fw_version==NULL ||
+       strlen(g_pcat_pmu_simulator_cmd_fw_version) < 14)
+    {
+        g_free(g_pcat_pmu_simulator_cmd_fw_version);
+        g_pcat_pmu_simulator_cmd_fw_version = g_strdup(
+            "PCAT-PMU-SIMULATOR");
+    }
+
+    sim_data->master_fd = -1;
+    sim_data->slave_fd = -1;
+    sim_data->read_buffer = g_byte_array_new();
+    sim_data->write_buffer = g_byte_array_new();
+    sim_data->rtt_samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+    sim_data->status_data_size = CLAMP(g_pcat_pmu_simulator_cmd_payload_size,
+        PCAT_PMU_SIMULATOR_STATUS_DATA_SIZE, 65532);
+    sim_data->status_data = g_malloc0(sim_data->status_data_size);
+
+    if(!pcat_pmu_simulator_pty_open(sim_data))
+    {
+        return 1;
+    }
+
+    printf("%s\n", sim_data->slave_path);
+    fflush(stdout);
+
+    sim_data->main_loop = g_main_loop_new(NULL, FALSE);
+    sim_data->start_timestamp = g_get_monotonic_time();
+
+    if(g_pcat_pmu_simulator_cmd_window > 0)
+    {
+        g_timeout_add(100, pcat_pmu_simulator_window_check_func, sim_data);
+    }
+    else if(g_pcat_pmu_simulator_cmd_status_rate > 0.0)
+    {
+        interval = 1000.0 / g_pcat_pmu_simulator_cmd_status_rate;
+        if(interval==0)
+        {
+            interval = 1;
+        }
+        sim_data->status_report_timeout_id = g_timeout_add(interval,
+            pcat_pmu_simulator_status_report_func, sim_data);
+    }
+    if(g_pcat_pmu_simulator_cmd_shutdown_after > 0)
+    {
+        g_timeout_add_seconds(g_pcat_pmu_simulator_cmd_shutdown_after,
+            pcat_pmu_simulator_shutdown_request_func, sim_data);
+    }
+    if(g_pcat_pmu_simulator_cmd_factory_reset_after > 0)
+    {
+        g_timeout_add_seconds(g_pcat_pmu_simulator_cmd_factory_reset_after,
+            pcat_pmu_simulator_factory_reset_request_func, sim_data);
+    }
+    if(g_pcat_pmu_simulator_cmd_duration > 0)
+    {
+        g_timeout_add_seconds(g_pcat_pmu_simulator_cmd_duration,
+            pcat_pmu_simulator_quit_func, sim_data);
+    }
+    g_timeout_add_seconds(1, pcat_pmu_simulator_watchdog_check_func,
+        sim_data);
+
+    g_unix_signal_add(SIGINT, pcat_pmu_simulator_quit_func, sim_data);
+    g_unix_signal_add(SIGTERM, pcat_pmu_simulator_quit_func, sim_data);
+
+    g_main_loop_run(sim_data->main_loop);
+
+    pcat_pmu_simulator_stats_print(sim_data);
+
+    if(sim_data->status_report_timeout_id > 0)
+    {
+        g_source_remove(sim_data->status_report_timeout_id);
+        sim_data->status_report_timeout_id = 0;
+    }
+    pcat_pmu_simulator_pty_close(sim_data);
+
+    g_byte_array_unref(sim_data->read_buffer);
+    g_byte_array_unref(sim_data->write_buffer);
+    g_array_unref(sim_data->rtt_samples);
+    g_free(sim_data->status_data);
+    g_main_loop_unref(sim_data->main_loop);
+    g_free(g_pcat_pmu_simulator_cmd_fw_version);
+    g_free(g_pcat_pmu_simulator_cmd_link);
+
+    return 0;
+}
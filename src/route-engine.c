@@ -0,0 +1,864 @@
+#include <sys/socket.h>
+#include <glib-unix.h>
+#include <json.h>
+#include "route-engine.h"
+#include "ubus-client.h"
+#include "netlink-monitor.h"
+#include "icmp-prober.h"
+#include "mwan-status.h"
+#include "iface-registry.h"
+
+/*
+ * Route mode state machine. Netlink link/address/route changes, netifd
+ * interface events and ICMP probe results all land on one private main
+ * context, and the resulting mode is handed to the default main context
+ * only when it changes. Every timer here is one-shot and only re-armed
+ * while something is wrong:
+ *
+ * - mwan3 consistent with a balanced route: nothing wakes up until the
+ *   next rtnetlink or ubus event.
+ * - mwan3 missing or inconsistent: its status is only re-read on events,
+ *   one timer fires when it stayed inconsistent for
+ *   PCAT_ROUTE_ENGINE_MWAN_RESTART_TIMEOUT seconds to restart it. The
+ *   restart runs asynchronously, and the timeout doubles up to
+ *   PCAT_ROUTE_ENGINE_MWAN_RESTART_TIMEOUT_MAX while restarts do not help.
+ * - no mwan3 route: the connectivity probe backs off from
+ *   PCAT_ROUTE_ENGINE_PROBE_INTERVAL_MIN to
+ *   PCAT_ROUTE_ENGINE_PROBE_INTERVAL_MAX seconds while it gets replies,
+ *   and to PCAT_ROUTE_ENGINE_PROBE_INTERVAL_OFFLINE_MAX while it fails,
+ *   an uplink coming back is normally noticed by its events first.
+ *   Every network event starts the interval over.
+ *
+ * So on a device without a usable mwan3 setup the engine settles at one
+ * probe every 30 seconds while online and every 2 minutes while offline.
+ */
+
+#define PCAT_ROUTE_ENGINE_MWAN_RESTART_TIMEOUT 30
+#define PCAT_ROUTE_ENGINE_MWAN_RESTART_TIMEOUT_MAX 600
+#define PCAT_ROUTE_ENGINE_MWAN_BOOT_WAIT 120
+#define PCAT_ROUTE_ENGINE_MWAN_UBUS_CALL_TIMEOUT 15000
+#define PCAT_ROUTE_ENGINE_EVENT_SETTLE_TIME 500
+
+#define PCAT_ROUTE_ENGINE_PROBE_ROUNDS_DEFAULT 2
+#define PCAT_ROUTE_ENGINE_PROBE_INTERVAL_MIN 5
+
+/* The first round waits this long (ms), the class timeout is for retries. */
+#define PCAT_ROUTE_ENGINE_PROBE_TIMEOUT_FIRST 450
+
+/* A silently lost upstream (carrier still up) is noticed this late. */
+#define PCAT_ROUTE_ENGINE_PROBE_INTERVAL_MAX 30
+
+/* Same for a silently recovered upstream. */
+#define PCAT_ROUTE_ENGINE_PROBE_INTERVAL_OFFLINE_MAX 120
+
+typedef struct _PCatRouteEngineData
+{
+    gboolean initialized;
+    GThread *thread;
+    GMainContext *context;
+    GMainLoop *loop;
+
+    PCatUbusClient *ubus_client;
+    PCatNetlinkMonitor *netlink_monitor;
+    GSource *ubus_source;
+    gint ubus_source_fd;
+    GSource *netlink_source;
+
+    PCatIcmpProber *prober;
+    guint probe_timeout;
+    guint probe_rounds;
+    guint probe_interval;
+
+    guint boot_wait_timeout_id;
+    guint settle_timeout_id;
+    guint mwan_restart_timeout_id;
+    guint probe_timeout_id;
+
+    GPid mwan_restart_pid;
+    guint mwan_restart_watch_id;
+    guint mwan_restart_timeout;
+
+    PCatIfaceRegistry *iface_registry;
+    gboolean *iface_status;
+    PCatMwanStatus mwan_status;
+    gint64 mwan_consistent_timestamp;
+
+    gint mode;
+    PCatRouteEngineModeChangedFunc mode_changed_func;
+    gpointer mode_changed_data;
+}PCatRouteEngineData;
+
+static PCatRouteEngineData g_pcat_route_engine_data = {0};
+
+static guint pcat_route_engine_source_attach(PCatRouteEngineData *engine_data,
+    GSource *source, GSourceFunc func)
+{
+    guint id;
+
+    g_source_set_callback(source, func, engine_data, NULL);
+    id = g_source_attach(source, engine_data->context);
+    g_source_unref(source);
+
+    return id;
+}
+
+static guint pcat_route_engine_timeout_add(PCatRouteEngineData *engine_data,
+    guint interval, GSourceFunc func)
+{
+    return pcat_route_engine_source_attach(engine_data,
+        g_timeout_source_new(interval), func);
+}
+
+static guint pcat_route_engine_timeout_add_seconds(
+    PCatRouteEngineData *engine_data, guint interval, GSourceFunc func)
+{
+    return pcat_route_engine_source_attach(engine_data,
+        g_timeout_source_new_seconds(interval), func);
+}
+
+static void pcat_route_engine_source_remove(PCatRouteEngineData *engine_data,
+    guint *id)
+{
+    GSource *source;
+
+    if(*id==0)
+    {
+        return;
+    }
+
+    source = g_main_context_find_source_by_id(engine_data->context, *id);
+    if(source!=NULL)
+    {
+        g_source_destroy(source);
+    }
+    *id = 0;
+}
+
+static gboolean pcat_route_engine_mode_notify_func(gpointer user_data)
+{
+    PCatRouteEngineData *engine_data = &g_pcat_route_engine_data;
+
+    if(engine_data->mode_changed_func!=NULL)
+    {
+        engine_data->mode_changed_func(
+            (PCatManagerRouteMode)GPOINTER_TO_INT(user_data),
+            engine_data->mode_changed_data);
+    }
+
+    return FALSE;
+}
+
+static void pcat_route_engine_mode_set(PCatRouteEngineData *engine_data,
+    PCatManagerRouteMode mode)
+{
+    if(g_atomic_int_get(&engine_data->mode)==(gint)mode)
+    {
+        return;
+    }
+
+    g_atomic_int_set(&engine_data->mode, mode);
+
+    g_main_context_invoke(NULL, pcat_route_engine_mode_notify_func,
+        GINT_TO_POINTER(mode));
+}
+
+/*
+ * An interface counts as up when netifd reports it up with an address,
+ * and (if the rtnetlink view is available) the kernel really has an
+ * address of that family on its layer 3 device. netifd may keep listing
+ * addresses for a while after e.g. a modem lost its bearer.
+ */
+static void pcat_route_engine_interface_status_update(
+    PCatRouteEngineData *engine_data)
+{
+    guint i;
+    guint interfaces_len;
+    struct json_object *root, *interfaces, *interface, *child;
+    const gchar *name, *device;
+    gboolean has_ipv4, has_ipv6;
+    gint index;
+    gboolean *iface_status = engine_data->iface_status;
+
+    for(i=0;i<pcat_iface_registry_count_get(engine_data->iface_registry);
+        i++)
+    {
+        iface_status[i] = FALSE;
+    }
+
+    root = pcat_ubus_client_call(engine_data->ubus_client,
+        "network.interface", "dump",
+        PCAT_ROUTE_ENGINE_MWAN_UBUS_CALL_TIMEOUT);
+    if(root==NULL)
+    {
+        return;
+    }
+
+    if(!json_object_object_get_ex(root, "interface", &interfaces) ||
+       json_object_get_type(interfaces)!=json_type_array)
+    {
+        json_object_put(root);
+
+        return;
+    }
+
+    interfaces_len = json_object_array_length(interfaces);
+    for(i=0;i<interfaces_len;i++)
+    {
+        interface = json_object_array_get_idx(interfaces, i);
+
+        if(!json_object_object_get_ex(interface, "interface", &child))
+        {
+            continue;
+        }
+        name = json_object_get_string(child);
+
+        index = pcat_iface_registry_lookup(engine_data->iface_registry, name);
+        if(index < 0)
+        {
+            continue;
+        }
+
+        if(!json_object_object_get_ex(interface, "up", &child) ||
+           !json_object_get_boolean(child))
+        {
+            continue;
+        }
+
+        has_ipv4 = FALSE;
+        has_ipv6 = FALSE;
+        if(json_object_object_get_ex(interface, "ipv4-address", &child) &&
+           json_object_get_type(child)==json_type_array &&
+           json_object_array_length(child) > 0)
+        {
+            has_ipv4 = TRUE;
+        }
+        if(json_object_object_get_ex(interface, "ipv6-address", &child) &&
+           json_object_get_type(child)==json_type_array &&
+           json_object_array_length(child) > 0)
+        {
+            has_ipv6 = TRUE;
+        }
+
+        if(engine_data->netlink_monitor!=NULL &&
+           json_object_object_get_ex(interface, "l3_device", &child))
+        {
+            device = json_object_get_string(child);
+
+            has_ipv4 = has_ipv4 && pcat_netlink_monitor_address_check(
+                engine_data->netlink_monitor, device, AF_INET);
+            has_ipv6 = has_ipv6 && pcat_netlink_monitor_address_check(
+                engine_data->netlink_monitor, device, AF_INET6);
+        }
+
+        iface_status[index] = (has_ipv4 || has_ipv6);
+    }
+
+    json_object_put(root);
+}
+
+static gint pcat_route_engine_iface_lookup_func(const gchar *name,
+    gpointer user_data)
+{
+    return pcat_iface_registry_lookup((PCatIfaceRegistry *)user_data, name);
+}
+
+static void pcat_route_engine_mwan_status_func(const guint8 *data,
+    gsize len, gpointer user_data)
+{
+    PCatRouteEngineData *engine_data = (PCatRouteEngineData *)user_data;
+
+    pcat_mwan_status_parse(data, len, pcat_route_engine_iface_lookup_func,
+        engine_data->iface_registry, &engine_data->mwan_status);
+}
+
+/*
+ * Query mwan3 for the route in use. Returns TRUE if mwan3 answered and
+ * reports every interface which is up as online, the route mode is only
+ * touched when a balanced policy names one of our interfaces.
+ */
+static gboolean pcat_route_engine_mwan_status_check(
+    PCatRouteEngineData *engine_data, PCatManagerRouteMode *mode)
+{
+    PCatMwanStatus *status = &engine_data->mwan_status;
+    gboolean consistent;
+    guint i;
+
+    pcat_route_engine_interface_status_update(engine_data);
+
+    status->has_interfaces = FALSE;
+    status->route_iface = -1;
+
+    if(!pcat_ubus_client_call_full(engine_data->ubus_client, "mwan3",
+        "status", PCAT_ROUTE_ENGINE_MWAN_UBUS_CALL_TIMEOUT,
+        pcat_route_engine_mwan_status_func, engine_data))
+    {
+        status->has_interfaces = FALSE;
+        status->route_iface = -1;
+    }
+
+    consistent = status->has_interfaces;
+    for(i=0;i<status->iface_count && consistent;i++)
+    {
+        if(engine_data->iface_status[i] &&
+           (status->iface_states[i]==PCAT_MWAN_STATUS_IFACE_NO_STATUS ||
+           status->iface_states[i]==PCAT_MWAN_STATUS_IFACE_OFFLINE))
+        {
+            consistent = FALSE;
+        }
+    }
+
+    if(status->route_iface >= 0)
+    {
+        *mode = pcat_iface_registry_get(engine_data->iface_registry,
+            status->route_iface)->route_mode;
+    }
+    else if(*mode > PCAT_MANAGER_ROUTE_MODE_UNKNOWN)
+    {
+        *mode = PCAT_MANAGER_ROUTE_MODE_NONE;
+    }
+
+    return consistent;
+}
+
+/*
+ * Unless configured, retry as long as the slowest class of uplink which is
+ * up needs. Without a known uplink wait for the slowest one there is.
+ */
+static guint pcat_route_engine_probe_timeout_get(
+    PCatRouteEngineData *engine_data)
+{
+    guint i, value;
+    guint timeout = 0, any_timeout = 0;
+
+    if(engine_data->probe_timeout > 0)
+    {
+        return engine_data->probe_timeout;
+    }
+
+    for(i=0;i<pcat_iface_registry_count_get(engine_data->iface_registry);
+        i++)
+    {
+        value = pcat_iface_registry_probe_timeout_get(
+            engine_data->iface_registry, i);
+        any_timeout = MAX(any_timeout, value);
+        if(engine_data->iface_status[i])
+        {
+            timeout = MAX(timeout, value);
+        }
+    }
+
+    return timeout > 0 ? timeout : any_timeout;
+}
+
+/*
+ * A run stops at the first reply, so a working uplink is confirmed within
+ * a round trip. The first round is kept short, only the retries after it
+ * wait for the class timeout, which a negative verdict has to sit out.
+ */
+static gboolean pcat_route_engine_probe_run(PCatRouteEngineData *engine_data)
+{
+    guint i, round, timeout;
+    const PCatIcmpProberTargetStats *stats;
+    guint stats_count;
+    gboolean connection_status = FALSE;
+
+    timeout = pcat_route_engine_probe_timeout_get(engine_data);
+    for(round=0;round<engine_data->probe_rounds && !connection_status;
+        round++)
+    {
+        connection_status = (pcat_icmp_prober_run(engine_data->prober,
+            (round==0 && engine_data->probe_timeout==0) ?
+            MIN(timeout, PCAT_ROUTE_ENGINE_PROBE_TIMEOUT_FIRST) :
+            timeout) > 0);
+    }
+
+    stats = pcat_icmp_prober_stats_get(engine_data->prober, &stats_count);
+    for(i=0;i<stats_count;i++)
+    {
+        g_debug("Ping check on %s: %s, rtt %.1f/%.1f/%.1f ms, "
+            "loss %u/%u", stats[i].address,
+            stats[i].last_reply ? "reply" : "no reply",
+            stats[i].rtt_min, stats[i].rtt_avg, stats[i].rtt_max,
+            stats[i].sent - stats[i].received, stats[i].sent);
+    }
+
+    return connection_status;
+}
+
+static gboolean pcat_route_engine_probe_timeout_func(gpointer user_data);
+
+/*
+ * Without a mwan3 route the mode comes from the probe. It is repeated
+ * with an exponential backoff, capped lower while it gets replies than
+ * while it fails, after any network event the interval starts over.
+ */
+static void pcat_route_engine_probe_update(PCatRouteEngineData *engine_data,
+    PCatManagerRouteMode *mode, gboolean force)
+{
+    if(*mode > PCAT_MANAGER_ROUTE_MODE_UNKNOWN)
+    {
+        pcat_route_engine_source_remove(engine_data,
+            &engine_data->probe_timeout_id);
+        engine_data->probe_interval = PCAT_ROUTE_ENGINE_PROBE_INTERVAL_MIN;
+
+        return;
+    }
+
+    if(!force && engine_data->probe_timeout_id > 0)
+    {
+        return;
+    }
+
+    *mode = pcat_route_engine_probe_run(engine_data) ?
+        PCAT_MANAGER_ROUTE_MODE_UNKNOWN : PCAT_MANAGER_ROUTE_MODE_NONE;
+
+    pcat_route_engine_source_remove(engine_data,
+        &engine_data->probe_timeout_id);
+    engine_data->probe_timeout_id = pcat_route_engine_timeout_add_seconds(
+        engine_data, engine_data->probe_interval,
+        pcat_route_engine_probe_timeout_func);
+
+    if(*mode==PCAT_MANAGER_ROUTE_MODE_NONE)
+    {
+        engine_data->probe_interval = MIN(engine_data->probe_interval * 2,
+            PCAT_ROUTE_ENGINE_PROBE_INTERVAL_OFFLINE_MAX);
+    }
+    else
+    {
+        engine_data->probe_interval = MIN(engine_data->probe_interval * 2,
+            PCAT_ROUTE_ENGINE_PROBE_INTERVAL_MAX);
+    }
+}
+
+static gboolean pcat_route_engine_probe_timeout_func(gpointer user_data)
+{
+    PCatRouteEngineData *engine_data = (PCatRouteEngineData *)user_data;
+    PCatManagerRouteMode mode;
+
+    engine_data->probe_timeout_id = 0;
+
+    mode = g_atomic_int_get(&engine_data->mode);
+    pcat_route_engine_probe_update(engine_data, &mode, TRUE);
+    pcat_route_engine_mode_set(engine_data, mode);
+
+    return FALSE;
+}
+
+static gboolean pcat_route_engine_mwan_restart_timeout_func(
+    gpointer user_data);
+
+static void pcat_route_engine_ubus_watch_update(
+    PCatRouteEngineData *engine_data);
+
+static void pcat_route_engine_settle_schedule(
+    PCatRouteEngineData *engine_data);
+
+/*
+ * mwan3 brings its interfaces up again before it exits, give it the whole
+ * timeout from then on and re-read its status.
+ */
+static void pcat_route_engine_mwan_restart_watch_func(GPid pid,
+    gint wait_status, gpointer user_data)
+{
+    PCatRouteEngineData *engine_data = (PCatRouteEngineData *)user_data;
+
+    engine_data->mwan_restart_watch_id = 0;
+    engine_data->mwan_restart_pid = 0;
+    g_spawn_close_pid(pid);
+
+    engine_data->mwan_consistent_timestamp = g_get_monotonic_time();
+
+    pcat_route_engine_settle_schedule(engine_data);
+}
+
+static void pcat_route_engine_mwan_restart(PCatRouteEngineData *engine_data)
+{
+    gchar *command[] = {"mwan3", "restart", NULL};
+    GError *error = NULL;
+    GPid pid;
+
+    if(!g_spawn_async(NULL, command, NULL, G_SPAWN_SEARCH_PATH |
+        G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &pid, &error))
+    {
+        g_warning("Failed to restart MWAN3: %s", error->message);
+        g_clear_error(&error);
+
+        return;
+    }
+
+    engine_data->mwan_restart_pid = pid;
+    engine_data->mwan_restart_watch_id = pcat_route_engine_source_attach(
+        engine_data, g_child_watch_source_new(pid),
+        (GSourceFunc)pcat_route_engine_mwan_restart_watch_func);
+}
+
+/*
+ * Run the whole state machine once. The mwan3 part is skipped during
+ * the boot wait, mwan3 is restarted if its status stays inconsistent.
+ */
+static void pcat_route_engine_evaluate(PCatRouteEngineData *engine_data,
+    gboolean event)
+{
+    PCatManagerRouteMode mode;
+    gboolean consistent;
+    gint64 now, deadline;
+
+    mode = g_atomic_int_get(&engine_data->mode);
+
+    if(engine_data->boot_wait_timeout_id==0)
+    {
+        consistent = pcat_route_engine_mwan_status_check(engine_data, &mode);
+
+        pcat_route_engine_source_remove(engine_data,
+            &engine_data->mwan_restart_timeout_id);
+
+        now = g_get_monotonic_time();
+        deadline = engine_data->mwan_consistent_timestamp +
+            engine_data->mwan_restart_timeout * 1000000L;
+
+        if(consistent)
+        {
+            engine_data->mwan_consistent_timestamp = now;
+            engine_data->mwan_restart_timeout =
+                PCAT_ROUTE_ENGINE_MWAN_RESTART_TIMEOUT;
+
+            g_debug("MWAN3 status check OK!");
+        }
+        else if(engine_data->mwan_restart_pid!=0)
+        {
+            g_debug("MWAN3 status ERROR, restart still running!");
+        }
+        else if(now >= deadline)
+        {
+            g_warning("MWAN3 status is not correct, try to restart!");
+
+            pcat_route_engine_mwan_restart(engine_data);
+
+            engine_data->mwan_consistent_timestamp = now;
+            engine_data->mwan_restart_timeout = MIN(
+                engine_data->mwan_restart_timeout * 2,
+                PCAT_ROUTE_ENGINE_MWAN_RESTART_TIMEOUT_MAX);
+            deadline = now + engine_data->mwan_restart_timeout * 1000000L;
+        }
+        else
+        {
+            g_debug("MWAN3 status ERROR!");
+        }
+
+        /*
+         * Events re-read the status as mwan3 settles, only the restart
+         * deadline needs a timer. A running restart re-reads it on exit.
+         */
+        if(!consistent && engine_data->mwan_restart_pid==0)
+        {
+            engine_data->mwan_restart_timeout_id =
+                pcat_route_engine_timeout_add_seconds(engine_data,
+                MAX((deadline - now + 999999) / 1000000, 1),
+                pcat_route_engine_mwan_restart_timeout_func);
+        }
+
+        pcat_route_engine_ubus_watch_update(engine_data);
+    }
+
+    if(event)
+    {
+        engine_data->probe_interval = PCAT_ROUTE_ENGINE_PROBE_INTERVAL_MIN;
+    }
+    pcat_route_engine_probe_update(engine_data, &mode, event);
+
+    pcat_route_engine_mode_set(engine_data, mode);
+}
+
+static gboolean pcat_route_engine_mwan_restart_timeout_func(
+    gpointer user_data)
+{
+    PCatRouteEngineData *engine_data = (PCatRouteEngineData *)user_data;
+
+    engine_data->mwan_restart_timeout_id = 0;
+
+    pcat_route_engine_evaluate(engine_data, FALSE);
+
+    return FALSE;
+}
+
+static gboolean pcat_route_engine_settle_timeout_func(gpointer user_data)
+{
+    PCatRouteEngineData *engine_data = (PCatRouteEngineData *)user_data;
+
+    engine_data->settle_timeout_id = 0;
+
+    /* Drop whatever else the burst left behind, we re-read it all now. */
+    if(engine_data->netlink_monitor!=NULL)
+    {
+        pcat_netlink_monitor_dispatch(engine_data->netlink_monitor);
+    }
+    pcat_ubus_client_dispatch(engine_data->ubus_client);
+
+    pcat_route_engine_evaluate(engine_data, TRUE);
+
+    return FALSE;
+}
+
+/* Let the burst of events of an interface coming up settle first. */
+static void pcat_route_engine_settle_schedule(
+    PCatRouteEngineData *engine_data)
+{
+    if(engine_data->settle_timeout_id > 0)
+    {
+        return;
+    }
+
+    engine_data->settle_timeout_id = pcat_route_engine_timeout_add(
+        engine_data, PCAT_ROUTE_ENGINE_EVENT_SETTLE_TIME,
+        pcat_route_engine_settle_timeout_func);
+}
+
+static gboolean pcat_route_engine_netlink_watch_func(gint fd,
+    GIOCondition condition, gpointer user_data)
+{
+    PCatRouteEngineData *engine_data = (PCatRouteEngineData *)user_data;
+
+    if(pcat_netlink_monitor_dispatch(engine_data->netlink_monitor))
+    {
+        pcat_route_engine_settle_schedule(engine_data);
+    }
+
+    return TRUE;
+}
+
+static gboolean pcat_route_engine_ubus_watch_func(gint fd,
+    GIOCondition condition, gpointer user_data)
+{
+    PCatRouteEngineData *engine_data = (PCatRouteEngineData *)user_data;
+
+    /* A dropped connection is handled by the evaluation reconnecting. */
+    if(pcat_ubus_client_dispatch(engine_data->ubus_client) ||
+       pcat_ubus_client_fd_get(engine_data->ubus_client)!=fd)
+    {
+        pcat_route_engine_settle_schedule(engine_data);
+    }
+
+    pcat_route_engine_ubus_watch_update(engine_data);
+
+    return TRUE;
+}
+
+/* The ubus client reconnects lazily, so follow its socket around. */
+static void pcat_route_engine_ubus_watch_update(
+    PCatRouteEngineData *engine_data)
+{
+    gint fd;
+
+    fd = pcat_ubus_client_fd_get(engine_data->ubus_client);
+    if(fd==engine_data->ubus_source_fd && engine_data->ubus_source!=NULL)
+    {
+        return;
+    }
+
+    if(engine_data->ubus_source!=NULL)
+    {
+        g_source_destroy(engine_data->ubus_source);
+        g_source_unref(engine_data->ubus_source);
+        engine_data->ubus_source = NULL;
+    }
+
+    engine_data->ubus_source_fd = fd;
+    if(fd < 0)
+    {
+        return;
+    }
+
+    engine_data->ubus_source = g_unix_fd_source_new(fd,
+        G_IO_IN | G_IO_HUP | G_IO_ERR);
+    g_source_set_callback(engine_data->ubus_source,
+        (GSourceFunc)pcat_route_engine_ubus_watch_func, engine_data, NULL);
+    g_source_attach(engine_data->ubus_source, engine_data->context);
+}
+
+static gboolean pcat_route_engine_boot_wait_timeout_func(gpointer user_data)
+{
+    PCatRouteEngineData *engine_data = (PCatRouteEngineData *)user_data;
+
+    engine_data->boot_wait_timeout_id = 0;
+
+    if(!pcat_ubus_client_event_register(engine_data->ubus_client,
+        "network.interface"))
+    {
+        g_warning("Failed to listen to netifd interface events!");
+    }
+    engine_data->mwan_consistent_timestamp = g_get_monotonic_time();
+    engine_data->mwan_restart_timeout = PCAT_ROUTE_ENGINE_MWAN_RESTART_TIMEOUT;
+
+    pcat_route_engine_evaluate(engine_data, TRUE);
+
+    return FALSE;
+}
+
+static gpointer pcat_route_engine_thread_func(gpointer user_data)
+{
+    PCatRouteEngineData *engine_data = (PCatRouteEngineData *)user_data;
+
+    g_main_context_push_thread_default(engine_data->context);
+    g_main_loop_run(engine_data->loop);
+    g_main_context_pop_thread_default(engine_data->context);
+
+    return NULL;
+}
+
+gboolean pcat_route_engine_init(PCatRouteEngineModeChangedFunc func,
+    gpointer user_data)
+{
+    static const gchar * const default_check_address_list[] = {"1.1.1.1",
+        "8.8.8.8", "114.114.114.114", "223.6.6.6", NULL};
+    const gchar * const *check_address_list = default_check_address_list;
+    const PCatManagerMainConfigData *config_data;
+    PCatRouteEngineData *engine_data = &g_pcat_route_engine_data;
+    guint iface_count;
+
+    if(engine_data->initialized)
+    {
+        return TRUE;
+    }
+
+    config_data = pcat_main_config_data_get();
+
+    engine_data->mode_changed_func = func;
+    engine_data->mode_changed_data = user_data;
+    g_atomic_int_set(&engine_data->mode, PCAT_MANAGER_ROUTE_MODE_NONE);
+
+    engine_data->probe_timeout = config_data->net_check_timeout;
+    engine_data->probe_rounds = config_data->net_check_rounds > 0 ?
+        config_data->net_check_rounds :
+        PCAT_ROUTE_ENGINE_PROBE_ROUNDS_DEFAULT;
+    engine_data->probe_interval = PCAT_ROUTE_ENGINE_PROBE_INTERVAL_MIN;
+    if(config_data->net_check_targets!=NULL &&
+       config_data->net_check_targets[0]!=NULL)
+    {
+        check_address_list = (const gchar * const *)
+            config_data->net_check_targets;
+    }
+    engine_data->prober = pcat_icmp_prober_new(check_address_list);
+
+    engine_data->iface_registry = pcat_iface_registry_new(
+        config_data->net_interfaces);
+    iface_count = pcat_iface_registry_count_get(engine_data->iface_registry);
+    engine_data->iface_status = g_new0(gboolean, iface_count);
+    engine_data->mwan_status.iface_states = g_new0(
+        PCatMwanStatusIfaceState, iface_count);
+    engine_data->mwan_status.iface_weights =
+        pcat_iface_registry_weights_get(engine_data->iface_registry);
+    engine_data->mwan_status.iface_count = iface_count;
+
+    engine_data->context = g_main_context_new();
+    engine_data->loop = g_main_loop_new(engine_data->context, FALSE);
+
+    engine_data->ubus_client = pcat_ubus_client_new(NULL);
+    engine_data->ubus_source_fd = -1;
+
+    engine_data->netlink_monitor = pcat_netlink_monitor_new();
+    if(engine_data->netlink_monitor!=NULL)
+    {
+        engine_data->netlink_source = g_unix_fd_source_new(
+            pcat_netlink_monitor_fd_get(engine_data->netlink_monitor),
+            G_IO_IN | G_IO_ERR);
+        g_source_set_callback(engine_data->netlink_source,
+            (GSourceFunc)pcat_route_engine_netlink_watch_func, engine_data,
+            NULL);
+        g_source_attach(engine_data->netlink_source, engine_data->context);
+    }
+    else
+    {
+        g_warning("Failed to monitor rtnetlink, route changes will only "
+            "be noticed through netifd!");
+    }
+
+    engine_data->boot_wait_timeout_id = pcat_route_engine_timeout_add_seconds(
+        engine_data, PCAT_ROUTE_ENGINE_MWAN_BOOT_WAIT,
+        pcat_route_engine_boot_wait_timeout_func);
+
+    /* First probe right away, the mwan3 part waits for the boot. */
+    engine_data->settle_timeout_id = pcat_route_engine_timeout_add(
+        engine_data, 0, pcat_route_engine_settle_timeout_func);
+
+    engine_data->thread = g_thread_new("pcat-route-engine-thread",
+        pcat_route_engine_thread_func, engine_data);
+
+    engine_data->initialized = TRUE;
+
+    return TRUE;
+}
+
+void pcat_route_engine_uninit()
+{
+    PCatRouteEngineData *engine_data = &g_pcat_route_engine_data;
+
+    if(!engine_data->initialized)
+    {
+        return;
+    }
+
+    if(engine_data->thread!=NULL)
+    {
+        g_main_loop_quit(engine_data->loop);
+        g_thread_join(engine_data->thread);
+        engine_data->thread = NULL;
+    }
+
+    pcat_route_engine_source_remove(engine_data,
+        &engine_data->boot_wait_timeout_id);
+    pcat_route_engine_source_remove(engine_data,
+        &engine_data->settle_timeout_id);
+    pcat_route_engine_source_remove(engine_data,
+        &engine_data->mwan_restart_timeout_id);
+    pcat_route_engine_source_remove(engine_data,
+        &engine_data->probe_timeout_id);
+    pcat_route_engine_source_remove(engine_data,
+        &engine_data->mwan_restart_watch_id);
+    if(engine_data->mwan_restart_pid!=0)
+    {
+        g_spawn_close_pid(engine_data->mwan_restart_pid);
+        engine_data->mwan_restart_pid = 0;
+    }
+
+    if(engine_data->ubus_source!=NULL)
+    {
+        g_source_destroy(engine_data->ubus_source);
+        g_source_unref(engine_data->ubus_source);
+        engine_data->ubus_source = NULL;
+    }
+    if(engine_data->netlink_source!=NULL)
+    {
+        g_source_destroy(engine_data->netlink_source);
+        g_source_unref(engine_data->netlink_source);
+        engine_data->netlink_source = NULL;
+    }
+
+    pcat_netlink_monitor_free(engine_data->netlink_monitor);
+    engine_data->netlink_monitor = NULL;
+    pcat_ubus_client_free(engine_data->ubus_client);
+    engine_data->ubus_client = NULL;
+    pcat_icmp_prober_free(engine_data->prober);
+    engine_data->prober = NULL;
+
+    g_free(engine_data->iface_status);
+    engine_data->iface_status = NULL;
+    g_free(engine_data->mwan_status.iface_states);
+    engine_data->mwan_status.iface_states = NULL;
+    engine_data->mwan_status.iface_weights = NULL;
+    engine_data->mwan_status.iface_count = 0;
+    pcat_iface_registry_free(engine_data->iface_registry);
+    engine_data->iface_registry = NULL;
+
+    g_main_loop_unref(engine_data->loop);
+    engine_data->loop = NULL;
+    g_main_context_unref(engine_data->context);
+    engine_data->context = NULL;
+
+    engine_data->mode_changed_func = NULL;
+    engine_data->initialized = FALSE;
+}
+
+PCatManagerRouteMode pcat_route_engine_mode_get()
+{
+    return g_atomic_int_get(&g_pcat_route_engine_data.mode);
+}
@@ -0,0 +1,20 @@
+#ifndef HAVE_PCAT_ROUTE_ENGINE_H
+#define HAVE_PCAT_ROUTE_ENGINE_H
+
+#include <glib.h>
+#include "common.h"
+
+G_BEGIN_DECLS
+
+/* Called on the default main context whenever the route mode changes. */
+typedef void (*PCatRouteEngineModeChangedFunc)(PCatManagerRouteMode mode,
+    gpointer user_data);
+
+gboolean pcat_route_engine_init(PCatRouteEngineModeChangedFunc func,
+    gpointer user_data);
+void pcat_route_engine_uninit();
+PCatManagerRouteMode pcat_route_engine_mode_get();
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef HAVE_PCAT_SEQLOCK_H
+#define HAVE_PCAT_SEQLOCK_H
+
+#include <glib.h>
+#include <string.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Sequence counter protected data for a single writer and any number of
+ * lock-free readers. The counter is odd while an update is in progress,
+ * readers retry until they copied the data between two equal even values.
+ * Writers on more than one thread must serialize themselves.
+ */
+
+static inline void pcat_seqlock_write(guint *sequence, gpointer dst,
+    gconstpointer src, gsize size)
+{
+    guint seq;
+
+    seq = __atomic_load_n(sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(sequence, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(dst, src, size);
+
+    __atomic_store_n(sequence, seq + 2, __ATOMIC_RELEASE);
+}
+
+static inline guint pcat_seqlock_read(const guint *sequence, gpointer dst,
+    gconstpointer src, gsize size)
+{
+    guint seq1, seq2;
+
+    while(TRUE)
+    {
+        seq1 = __atomic_load_n(sequence, __ATOMIC_ACQUIRE);
+        if(seq1 & 1)
+        {
+            g_thread_yield();
+            continue;
+        }
+
+        memcpy(dst, src, size);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq2 = __atomic_load_n(sequence, __ATOMIC_RELAXED);
+        if(seq1==seq2)
+        {
+            break;
+        }
+    }
+
+    return seq1;
+}
+
+static inline guint pcat_seqlock_sequence_get(const guint *sequence)
+{
+    return __atomic_load_n(sequence, __ATOMIC_ACQUIRE) & ~1U;
+}
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,204 @@
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#include "serial.h"
+
+/*
+ * Map a baud rate to its termios speed constant, B0 means the rate is not
+ * supported by the C library.
+ */
+speed_t pcat_serial_speed_get(unsigned int baud)
+{
+    switch(baud)
+    {
+        case 4800:
+        {
+            return B4800;
+        }
+        case 9600:
+        {
+            return B9600;
+        }
+        case 19200:
+        {
+            return B19200;
+        }
+        case 38400:
+        {
+            return B38400;
+        }
+        case 57600:
+        {
+            return B57600;
+        }
+        case 115200:
+        {
+            return B115200;
+        }
+#ifdef B230400
+        case 230400:
+        {
+            return B230400;
+        }
+#endif
+#ifdef B460800
+        case 460800:
+        {
+            return B460800;
+        }
+#endif
+#ifdef B500000
+        case 500000:
+        {
+            return B500000;
+        }
+#endif
+#ifdef B576000
+        case 576000:
+        {
+            return B576000;
+        }
+#endif
+#ifdef B921600
+        case 921600:
+        {
+            return B921600;
+        }
+#endif
+#ifdef B1000000
+        case 1000000:
+        {
+            return B1000000;
+        }
+#endif
+#ifdef B1152000
+        case 1152000:
+        {
+            return B1152000;
+        }
+#endif
+#ifdef B1500000
+        case 1500000:
+        {
+            return B1500000;
+        }
+#endif
+#ifdef B2000000
+        case 2000000:
+        {
+            return B2000000;
+        }
+#endif
+#ifdef B2500000
+        case 2500000:
+        {
+            return B2500000;
+        }
+#endif
+#ifdef B3000000
+        case 3000000:
+        {
+            return B3000000;
+        }
+#endif
+        default:
+        {
+            break;
+        }
+    }
+
+    return B0;
+}
+
+/*
+ * Put the port into raw 8N1 mode without flow control. VMIN and VTIME are
+ * passed through, with VTIME at 0 a poll() on the port only wakes up once
+ * VMIN bytes are available, so VMIN must not exceed the smallest frame.
+ */
+int pcat_serial_setup(int fd, unsigned int baud, unsigned int vmin,
+    unsigned int vtime)
+{
+    struct termios options;
+    speed_t rspeed;
+
+    rspeed = pcat_serial_speed_get(baud);
+    if(rspeed==B0)
+    {
+        return -1;
+    }
+
+    if(tcgetattr(fd, &options)!=0)
+    {
+        return -1;
+    }
+
+    cfmakeraw(&options);
+    cfsetispeed(&options, rspeed);
+    cfsetospeed(&options, rspeed);
+    options.c_cflag &= ~CSIZE;
+    options.c_cflag &= ~PARENB;
+    options.c_cflag &= ~PARODD;
+    options.c_cflag &= ~CSTOPB;
+    options.c_cflag &= ~CRTSCTS;
+    options.c_cflag |= CS8;
+    options.c_cflag |= (CLOCAL | CREAD);
+    options.c_iflag &= ~(IGNBRK | BRKINT | ICRNL |
+        INLCR | PARMRK | INPCK | ISTRIP | IXON | IXOFF | IXANY);
+    options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG | IEXTEN);
+    options.c_oflag &= ~OPOST;
+    options.c_cc[VMIN] = vmin;
+    options.c_cc[VTIME] = vtime;
+    tcflush(fd, TCIOFLUSH);
+
+    return tcsetattr(fd, TCSANOW, &options);
+}
+
+/*
+ * Change the line speed of an already configured port, pending output is
+ * sent at the old speed first.
+ */
+int pcat_serial_speed_set(int fd, unsigned int baud)
+{
+    struct termios options;
+    speed_t rspeed;
+
+    rspeed = pcat_serial_speed_get(baud);
+    if(rspeed==B0)
+    {
+        return -1;
+    }
+
+    if(tcgetattr(fd, &options)!=0)
+    {
+        return -1;
+    }
+
+    cfsetispeed(&options, rspeed);
+    cfsetospeed(&options, rspeed);
+
+    return tcsetattr(fd, TCSADRAIN, &options);
+}
+
+/*
+ * ASYNC_LOW_LATENCY makes the UART driver push received bytes to the line
+ * discipline immediately instead of from a deferred work item.
+ */
+int pcat_serial_low_latency_set(int fd, int enabled)
+{
+    struct serial_struct serial;
+
+    if(ioctl(fd, TIOCGSERIAL, &serial)!=0)
+    {
+        return -1;
+    }
+
+    if(enabled)
+    {
+        serial.flags |= ASYNC_LOW_LATENCY;
+    }
+    else
+    {
+        serial.flags &= ~ASYNC_LOW_LATENCY;
+    }
+
+    return ioctl(fd, TIOCSSERIAL, &serial);
+}
@@ -0,0 +1,14 @@
+#ifndef HAVE_PCAT_SERIAL_H
+#define HAVE_PCAT_SERIAL_H
+
+#include <termios.h>
+
+#define PCAT_SERIAL_BAUD_DEFAULT 115200
+
+speed_t pcat_serial_speed_get(unsigned int baud);
+int pcat_serial_setup(int fd, unsigned int baud, unsigned int vmin,
+    unsigned int vtime);
+int pcat_serial_speed_set(int fd, unsigned int baud);
+int pcat_serial_low_latency_set(int fd, int enabled);
+
+#endif
@@ -0,0 +1,355 @@
+#include <string.h>
+#include "telemetry.h"
+
+/*
+ * Fixed size, columnar ring buffers of PMU telemetry. Every sample goes
+ * into the 1 second tier, a completed bucket of one tier is averaged into
+ * the next one, so the minute and hour tiers cost nothing extra at
+ * append time. Samples are only stored once their bucket is complete.
+ */
+
+typedef enum
+{
+    PCAT_TELEMETRY_AGGREGATE_MEAN = 0,
+    PCAT_TELEMETRY_AGGREGATE_LAST
+}PCatTelemetryAggregate;
+
+typedef struct _PCatTelemetryTierData
+{
+    guint interval;
+    guint capacity;
+    guint head;
+    guint count;
+    gint64 *timestamps;
+    gint32 *columns[PCAT_TELEMETRY_COLUMN_LAST];
+
+    gint64 bucket;
+    guint bucket_samples;
+    gint64 bucket_sum[PCAT_TELEMETRY_COLUMN_LAST];
+    gint32 bucket_last[PCAT_TELEMETRY_COLUMN_LAST];
+}PCatTelemetryTierData;
+
+struct _PCatTelemetry
+{
+    GMutex mutex;
+    gint64 last_timestamp;
+    PCatTelemetryTierData tiers[PCAT_TELEMETRY_TIER_LAST];
+};
+
+static const guint g_pcat_telemetry_tier_intervals[
+    PCAT_TELEMETRY_TIER_LAST] =
+{
+    1, 60, 3600
+};
+
+/* 1 hour of seconds, 1 day of minutes and 30 days of hours. */
+static const guint g_pcat_telemetry_tier_capacities[
+    PCAT_TELEMETRY_TIER_LAST] =
+{
+    3600, 1440, 720
+};
+
+static const PCatTelemetryAggregate g_pcat_telemetry_column_aggregates[
+    PCAT_TELEMETRY_COLUMN_LAST] =
+{
+    [PCAT_TELEMETRY_COLUMN_BATTERY_VOLTAGE] = PCAT_TELEMETRY_AGGREGATE_MEAN,
+    [PCAT_TELEMETRY_COLUMN_CHARGER_VOLTAGE] = PCAT_TELEMETRY_AGGREGATE_MEAN,
+    [PCAT_TELEMETRY_COLUMN_GPIO_INPUT] = PCAT_TELEMETRY_AGGREGATE_LAST,
+    [PCAT_TELEMETRY_COLUMN_GPIO_OUTPUT] = PCAT_TELEMETRY_AGGREGATE_LAST,
+    [PCAT_TELEMETRY_COLUMN_BOARD_TEMP] = PCAT_TELEMETRY_AGGREGATE_MEAN,
+    [PCAT_TELEMETRY_COLUMN_BATTERY_PERCENTAGE] =
+        PCAT_TELEMETRY_AGGREGATE_MEAN
+};
+
+static const gchar * const g_pcat_telemetry_column_names[
+    PCAT_TELEMETRY_COLUMN_LAST] =
+{
+    [PCAT_TELEMETRY_COLUMN_BATTERY_VOLTAGE] = "battery-voltage",
+    [PCAT_TELEMETRY_COLUMN_CHARGER_VOLTAGE] = "charger-voltage",
+    [PCAT_TELEMETRY_COLUMN_GPIO_INPUT] = "gpio-input",
+    [PCAT_TELEMETRY_COLUMN_GPIO_OUTPUT] = "gpio-output",
+    [PCAT_TELEMETRY_COLUMN_BOARD_TEMP] = "board-temperature",
+    [PCAT_TELEMETRY_COLUMN_BATTERY_PERCENTAGE] = "charge-percentage"
+};
+
+PCatTelemetry *pcat_telemetry_new()
+{
+    PCatTelemetry *telemetry;
+    PCatTelemetryTierData *tier_data;
+    guint i, j;
+
+    telemetry = g_new0(PCatTelemetry, 1);
+    g_mutex_init(&telemetry->mutex);
+    telemetry->last_timestamp = G_MININT64;
+
+    for(i=0;i<PCAT_TELEMETRY_TIER_LAST;i++)
+    {
+        tier_data = &telemetry->tiers[i];
+        tier_data->interval = g_pcat_telemetry_tier_intervals[i];
+        tier_data->capacity = g_pcat_telemetry_tier_capacities[i];
+        tier_data->timestamps = g_new0(gint64, tier_data->capacity);
+        for(j=0;j<PCAT_TELEMETRY_COLUMN_LAST;j++)
+        {
+            tier_data->columns[j] = g_new0(gint32, tier_data->capacity);
+        }
+    }
+
+    return telemetry;
+}
+
+void pcat_telemetry_free(PCatTelemetry *telemetry)
+{
+    PCatTelemetryTierData *tier_data;
+    guint i, j;
+
+    if(telemetry==NULL)
+    {
+        return;
+    }
+
+    for(i=0;i<PCAT_TELEMETRY_TIER_LAST;i++)
+    {
+        tier_data = &telemetry->tiers[i];
+        g_free(tier_data->timestamps);
+        for(j=0;j<PCAT_TELEMETRY_COLUMN_LAST;j++)
+        {
+            g_free(tier_data->columns[j]);
+        }
+    }
+
+    g_mutex_clear(&telemetry->mutex);
+    g_free(telemetry);
+}
+
+static void pcat_telemetry_tier_append(PCatTelemetry *telemetry,
+    PCatTelemetryTier tier, gint64 timestamp, const gint32 *values);
+
+static void pcat_telemetry_tier_bucket_flush(PCatTelemetry *telemetry,
+    PCatTelemetryTier tier)
+{
+    PCatTelemetryTierData *tier_data = &telemetry->tiers[tier];
+    gint32 values[PCAT_TELEMETRY_COLUMN_LAST];
+    guint i;
+
+    if(tier_data->bucket_samples==0)
+    {
+        return;
+    }
+
+    for(i=0;i<PCAT_TELEMETRY_COLUMN_LAST;i++)
+    {
+        if(g_pcat_telemetry_column_aggregates[i]==
+            PCAT_TELEMETRY_AGGREGATE_LAST)
+        {
+            values[i] = tier_data->bucket_last[i];
+        }
+        else
+        {
+            values[i] = tier_data->bucket_sum[i] /
+                (gint64)tier_data->bucket_samples;
+        }
+    }
+
+    tier_data->timestamps[tier_data->head] = tier_data->bucket;
+    for(i=0;i<PCAT_TELEMETRY_COLUMN_LAST;i++)
+    {
+        tier_data->columns[i][tier_data->head] = values[i];
+    }
+    tier_data->head = (tier_data->head + 1) % tier_data->capacity;
+    if(tier_data->count < tier_data->capacity)
+    {
+        tier_data->count++;
+    }
+
+    tier_data->bucket_samples = 0;
+    memset(tier_data->bucket_sum, 0, sizeof(tier_data->bucket_sum));
+
+    if(tier + 1 < PCAT_TELEMETRY_TIER_LAST)
+    {
+        pcat_telemetry_tier_append(telemetry, tier + 1, tier_data->bucket,
+            values);
+    }
+}
+
+static void pcat_telemetry_tier_append(PCatTelemetry *telemetry,
+    PCatTelemetryTier tier, gint64 timestamp, const gint32 *values)
+{
+    PCatTelemetryTierData *tier_data = &telemetry->tiers[tier];
+    gint64 bucket;
+    guint i;
+
+    bucket = timestamp - timestamp % tier_data->interval;
+
+    if(tier_data->bucket_samples > 0 && bucket!=tier_data->bucket)
+    {
+        pcat_telemetry_tier_bucket_flush(telemetry, tier);
+    }
+
+    tier_data->bucket = bucket;
+    tier_data->bucket_samples++;
+    for(i=0;i<PCAT_TELEMETRY_COLUMN_LAST;i++)
+    {
+        tier_data->bucket_sum[i] += values[i];
+        tier_data->bucket_last[i] = values[i];
+    }
+}
+
+static void pcat_telemetry_clear(PCatTelemetry *telemetry)
+{
+    PCatTelemetryTierData *tier_data;
+    guint i;
+
+    for(i=0;i<PCAT_TELEMETRY_TIER_LAST;i++)
+    {
+        tier_data = &telemetry->tiers[i];
+        tier_data->head = 0;
+        tier_data->count = 0;
+        tier_data->bucket_samples = 0;
+        memset(tier_data->bucket_sum, 0, sizeof(tier_data->bucket_sum));
+    }
+}
+
+/*
+ * Append a sample, the timestamp is in unix seconds. The ring buffers
+ * need monotonic timestamps for the range lookup, so a clock stepping
+ * backwards (e.g. the system time being set from the PMU) restarts them.
+ */
+void pcat_telemetry_append(PCatTelemetry *telemetry, gint64 timestamp,
+    const gint32 *values)
+{
+    if(timestamp < 0)
+    {
+        return;
+    }
+
+    g_mutex_lock(&telemetry->mutex);
+
+    if(timestamp < telemetry->last_timestamp)
+    {
+        g_message("System time moved backwards, telemetry cleared.");
+        pcat_telemetry_clear(telemetry);
+    }
+    telemetry->last_timestamp = timestamp;
+
+    pcat_telemetry_tier_append(telemetry, PCAT_TELEMETRY_TIER_SECOND,
+        timestamp, values);
+
+    g_mutex_unlock(&telemetry->mutex);
+}
+
+static inline guint pcat_telemetry_tier_index(
+    const PCatTelemetryTierData *tier_data, guint n)
+{
+    return (tier_data->head + tier_data->capacity - tier_data->count + n) %
+        tier_data->capacity;
+}
+
+/* Find the first stored sample with a timestamp not before the given one. */
+static guint pcat_telemetry_tier_lower_bound(
+    const PCatTelemetryTierData *tier_data, gint64 timestamp)
+{
+    guint low = 0, high = tier_data->count, mid;
+
+    while(low < high)
+    {
+        mid = low + (high - low) / 2;
+        if(tier_data->timestamps[pcat_telemetry_tier_index(tier_data, mid)] <
+            timestamp)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/*
+ * Copy the samples of a tier with timestamps in [start, end] out of the
+ * ring buffer, the copy is done with at most two memcpy() per column.
+ */
+PCatTelemetrySeries *pcat_telemetry_query(PCatTelemetry *telemetry,
+    PCatTelemetryTier tier, gint64 start, gint64 end)
+{
+    PCatTelemetrySeries *series;
+    const PCatTelemetryTierData *tier_data;
+    guint first, last, count, index, part;
+    guint i;
+
+    if(tier >= PCAT_TELEMETRY_TIER_LAST)
+    {
+        return NULL;
+    }
+
+    series = g_new0(PCatTelemetrySeries, 1);
+
+    g_mutex_lock(&telemetry->mutex);
+
+    tier_data = &telemetry->tiers[tier];
+    series->interval = tier_data->interval;
+
+    first = pcat_telemetry_tier_lower_bound(tier_data, start);
+    last = (end < G_MAXINT64) ?
+        pcat_telemetry_tier_lower_bound(tier_data, end + 1) :
+        tier_data->count;
+    count = (last > first) ? (last - first) : 0;
+
+    series->count = count;
+    series->timestamps = g_new(gint64, count > 0 ? count : 1);
+    for(i=0;i<PCAT_TELEMETRY_COLUMN_LAST;i++)
+    {
+        series->columns[i] = g_new(gint32, count > 0 ? count : 1);
+    }
+
+    if(count > 0)
+    {
+        index = pcat_telemetry_tier_index(tier_data, first);
+        part = MIN(count, tier_data->capacity - index);
+
+        memcpy(series->timestamps, tier_data->timestamps + index,
+            part * sizeof(gint64));
+        memcpy(series->timestamps + part, tier_data->timestamps,
+            (count - part) * sizeof(gint64));
+        for(i=0;i<PCAT_TELEMETRY_COLUMN_LAST;i++)
+        {
+            memcpy(series->columns[i], tier_data->columns[i] + index,
+                part * sizeof(gint32));
+            memcpy(series->columns[i] + part, tier_data->columns[i],
+                (count - part) * sizeof(gint32));
+        }
+    }
+
+    g_mutex_unlock(&telemetry->mutex);
+
+    return series;
+}
+
+void pcat_telemetry_series_free(PCatTelemetrySeries *series)
+{
+    guint i;
+
+    if(series==NULL)
+    {
+        return;
+    }
+
+    g_free(series->timestamps);
+    for(i=0;i<PCAT_TELEMETRY_COLUMN_LAST;i++)
+    {
+        g_free(series->columns[i]);
+    }
+    g_free(series);
+}
+
+const gchar *pcat_telemetry_column_name_get(PCatTelemetryColumn column)
+{
+    if(column >= PCAT_TELEMETRY_COLUMN_LAST)
+    {
+        return NULL;
+    }
+
+    return g_pcat_telemetry_column_names[column];
+}
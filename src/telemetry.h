@@ -0,0 +1,48 @@
+#ifndef HAVE_PCAT_TELEMETRY_H
+#define HAVE_PCAT_TELEMETRY_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+    PCAT_TELEMETRY_COLUMN_BATTERY_VOLTAGE = 0,
+    PCAT_TELEMETRY_COLUMN_CHARGER_VOLTAGE,
+    PCAT_TELEMETRY_COLUMN_GPIO_INPUT,
+    PCAT_TELEMETRY_COLUMN_GPIO_OUTPUT,
+    PCAT_TELEMETRY_COLUMN_BOARD_TEMP,
+    PCAT_TELEMETRY_COLUMN_BATTERY_PERCENTAGE,
+    PCAT_TELEMETRY_COLUMN_LAST
+}PCatTelemetryColumn;
+
+typedef enum
+{
+    PCAT_TELEMETRY_TIER_SECOND = 0,
+    PCAT_TELEMETRY_TIER_MINUTE,
+    PCAT_TELEMETRY_TIER_HOUR,
+    PCAT_TELEMETRY_TIER_LAST
+}PCatTelemetryTier;
+
+typedef struct _PCatTelemetrySeries
+{
+    guint interval;
+    guint count;
+    gint64 *timestamps;
+    gint32 *columns[PCAT_TELEMETRY_COLUMN_LAST];
+}PCatTelemetrySeries;
+
+typedef struct _PCatTelemetry PCatTelemetry;
+
+PCatTelemetry *pcat_telemetry_new();
+void pcat_telemetry_free(PCatTelemetry *telemetry);
+void pcat_telemetry_append(PCatTelemetry *telemetry, gint64 timestamp,
+    const gint32 *values);
+PCatTelemetrySeries *pcat_telemetry_query(PCatTelemetry *telemetry,
+    PCatTelemetryTier tier, gint64 start, gint64 end);
+void pcat_telemetry_series_free(PCatTelemetrySeries *series);
+const gchar *pcat_telemetry_column_name_get(PCatTelemetryColumn column);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,1155 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ubus-client.h"
+
+/*
+ * Minimal client for the ubusd wire protocol, enough to look up objects,
+ * invoke methods and listen to events without spawning the ubus command.
+ * Every message is an 8 byte header followed by a blob attribute list,
+ * method arguments and replies are blobmsg tables which are converted to
+ * json-c objects here, or walked in place by pcat_ubus_client_call_full()
+ * callers. All calls are blocking, the client is meant to be owned by a
+ * single worker thread.
+ */
+
+#define PCAT_UBUS_CLIENT_SOCKET_PATH "/var/run/ubus/ubus.sock"
+#define PCAT_UBUS_CLIENT_SOCKET_PATH_LEGACY "/var/run/ubus.sock"
+#define PCAT_UBUS_CLIENT_MESSAGE_SIZE_MAX (1024 * 1024)
+#define PCAT_UBUS_CLIENT_CONTROL_TIMEOUT 1000
+#define PCAT_UBUS_CLIENT_BLOBMSG_DEPTH_MAX 32
+
+#define PCAT_UBUS_BLOB_ATTR_EXTENDED 0x80000000U
+#define PCAT_UBUS_BLOB_ATTR_ID_MASK 0x7f000000U
+#define PCAT_UBUS_BLOB_ATTR_ID_SHIFT 24
+#define PCAT_UBUS_BLOB_ATTR_LEN_MASK 0x00ffffffU
+
+#define PCAT_UBUS_SYSTEM_OBJECT_EVENT 1
+#define PCAT_UBUS_STATUS_NOT_FOUND 4
+
+typedef enum
+{
+    PCAT_UBUS_MSG_HELLO,
+    PCAT_UBUS_MSG_STATUS,
+    PCAT_UBUS_MSG_DATA,
+    PCAT_UBUS_MSG_PING,
+    PCAT_UBUS_MSG_LOOKUP,
+    PCAT_UBUS_MSG_INVOKE,
+    PCAT_UBUS_MSG_ADD_OBJECT
+}PCatUbusMsgType;
+
+typedef enum
+{
+    PCAT_UBUS_ATTR_UNSPEC,
+    PCAT_UBUS_ATTR_STATUS,
+    PCAT_UBUS_ATTR_OBJPATH,
+    PCAT_UBUS_ATTR_OBJID,
+    PCAT_UBUS_ATTR_METHOD,
+    PCAT_UBUS_ATTR_OBJTYPE,
+    PCAT_UBUS_ATTR_SIGNATURE,
+    PCAT_UBUS_ATTR_DATA
+}PCatUbusAttrType;
+
+typedef void (*PCatUbusClientDataFunc)(const guint8 *attrs, gsize len,
+    gpointer user_data);
+
+typedef struct _PCatUbusClientReplyData
+{
+    PCatUbusClientReplyFunc func;
+    gpointer user_data;
+}PCatUbusClientReplyData;
+
+struct _PCatUbusClient
+{
+    gchar *socket_path;
+    gint fd;
+    guint16 seq;
+    guint32 event_object_id;
+    GPtrArray *event_patterns;
+    gboolean event_pending;
+    GHashTable *object_id_table;
+    GByteArray *message;
+};
+
+static inline gsize pcat_ubus_blob_pad(gsize len)
+{
+    return (len + 3) & ~((gsize)3);
+}
+
+static void pcat_ubus_blob_put(GByteArray *buf, guint32 id_flags,
+    const void *data, gsize len)
+{
+    static const guint8 padding[4] = {0};
+    guint32 id_len;
+
+    id_len = GUINT32_TO_BE(id_flags | ((len + 4) &
+        PCAT_UBUS_BLOB_ATTR_LEN_MASK));
+    g_byte_array_append(buf, (const guint8 *)&id_len, 4);
+    if(len > 0)
+    {
+        g_byte_array_append(buf, data, len);
+    }
+    g_byte_array_append(buf, padding, pcat_ubus_blob_pad(len + 4) -
+        (len + 4));
+}
+
+static void pcat_ubus_blob_put_u32(GByteArray *buf, guint id, guint32 value)
+{
+    value = GUINT32_TO_BE(value);
+    pcat_ubus_blob_put(buf, id << PCAT_UBUS_BLOB_ATTR_ID_SHIFT, &value, 4);
+}
+
+static void pcat_ubus_blob_put_string(GByteArray *buf, guint id,
+    const gchar *str)
+{
+    pcat_ubus_blob_put(buf, id << PCAT_UBUS_BLOB_ATTR_ID_SHIFT, str,
+        strlen(str) + 1);
+}
+
+static void pcat_ubus_blobmsg_put(GByteArray *buf, guint type,
+    const gchar *name, const void *data, gsize len)
+{
+    static const guint8 padding[4] = {0};
+    GByteArray *payload;
+    guint16 name_len;
+    gsize hdr_len;
+
+    name_len = strlen(name);
+    hdr_len = pcat_ubus_blob_pad(2 + name_len + 1);
+
+    payload = g_byte_array_sized_new(hdr_len + len);
+    name_len = GUINT16_TO_BE(name_len);
+    g_byte_array_append(payload, (const guint8 *)&name_len, 2);
+    g_byte_array_append(payload, (const guint8 *)name, strlen(name));
+    g_byte_array_append(payload, padding, hdr_len - 2 - strlen(name));
+    if(len > 0)
+    {
+        g_byte_array_append(payload, data, len);
+    }
+
+    pcat_ubus_blob_put(buf, PCAT_UBUS_BLOB_ATTR_EXTENDED |
+        (type << PCAT_UBUS_BLOB_ATTR_ID_SHIFT), payload->data, payload->len);
+
+    g_byte_array_unref(payload);
+}
+
+static gboolean pcat_ubus_blob_next(const guint8 **data, gsize *len,
+    guint32 *id_flags, const guint8 **payload, gsize *payload_len)
+{
+    guint32 id_len;
+    gsize attr_len;
+
+    if(*len < 4)
+    {
+        return FALSE;
+    }
+
+    memcpy(&id_len, *data, 4);
+    id_len = GUINT32_FROM_BE(id_len);
+    attr_len = id_len & PCAT_UBUS_BLOB_ATTR_LEN_MASK;
+    if(attr_len < 4 || attr_len > *len)
+    {
+        return FALSE;
+    }
+
+    *id_flags = id_len & ~PCAT_UBUS_BLOB_ATTR_LEN_MASK;
+    *payload = *data + 4;
+    *payload_len = attr_len - 4;
+
+    attr_len = MIN(pcat_ubus_blob_pad(attr_len), *len);
+    *data += attr_len;
+    *len -= attr_len;
+
+    return TRUE;
+}
+
+static gboolean pcat_ubus_blob_find(const guint8 *attrs, gsize len,
+    guint id, const guint8 **payload, gsize *payload_len)
+{
+    guint32 id_flags;
+
+    while(pcat_ubus_blob_next(&attrs, &len, &id_flags, payload,
+        payload_len))
+    {
+        if((id_flags & PCAT_UBUS_BLOB_ATTR_ID_MASK)==
+            (id << PCAT_UBUS_BLOB_ATTR_ID_SHIFT))
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static struct json_object *pcat_ubus_blobmsg_list_to_json(
+    const guint8 *attrs, gsize len, gboolean array, guint depth);
+
+static struct json_object *pcat_ubus_blobmsg_value_to_json(guint type,
+    const guint8 *data, gsize len, guint depth)
+{
+    guint64 v64;
+    guint32 v32;
+    guint16 v16;
+    gdouble dvalue;
+
+    switch(type)
+    {
+        case PCAT_UBUS_BLOBMSG_TYPE_ARRAY:
+        {
+            return pcat_ubus_blobmsg_list_to_json(data, len, TRUE,
+                depth + 1);
+        }
+        case PCAT_UBUS_BLOBMSG_TYPE_TABLE:
+        {
+            return pcat_ubus_blobmsg_list_to_json(data, len, FALSE,
+                depth + 1);
+        }
+        case PCAT_UBUS_BLOBMSG_TYPE_STRING:
+        {
+            return json_object_new_string_len((const gchar *)data,
+                strnlen((const gchar *)data, len));
+        }
+        case PCAT_UBUS_BLOBMSG_TYPE_INT64:
+        {
+            if(len < 8)
+            {
+                break;
+            }
+            memcpy(&v64, data, 8);
+
+            return json_object_new_int64((gint64)GUINT64_FROM_BE(v64));
+        }
+        case PCAT_UBUS_BLOBMSG_TYPE_INT32:
+        {
+            if(len < 4)
+            {
+                break;
+            }
+            memcpy(&v32, data, 4);
+
+            return json_object_new_int((gint32)GUINT32_FROM_BE(v32));
+        }
+        case PCAT_UBUS_BLOBMSG_TYPE_INT16:
+        {
+            if(len < 2)
+            {
+                break;
+            }
+            memcpy(&v16, data, 2);
+
+            return json_object_new_int((gint16)GUINT16_FROM_BE(v16));
+        }
+        case PCAT_UBUS_BLOBMSG_TYPE_INT8:
+        {
+            if(len < 1)
+            {
+                break;
+            }
+
+            return json_object_new_boolean(data[0]!=0);
+        }
+        case PCAT_UBUS_BLOBMSG_TYPE_DOUBLE:
+        {
+            if(len < 8)
+            {
+                break;
+            }
+            memcpy(&v64, data, 8);
+            v64 = GUINT64_FROM_BE(v64);
+            memcpy(&dvalue, &v64, 8);
+
+            return json_object_new_double(dvalue);
+        }
+        default:
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static struct json_object *pcat_ubus_blobmsg_list_to_json(
+    const guint8 *attrs, gsize len, gboolean array, guint depth)
+{
+    struct json_object *root, *value;
+    PCatUbusBlobmsgIter iter;
+    PCatUbusBlobmsgField field;
+
+    root = array ? json_object_new_array() : json_object_new_object();
+    if(depth > PCAT_UBUS_CLIENT_BLOBMSG_DEPTH_MAX)
+    {
+        return root;
+    }
+
+    pcat_ubus_blobmsg_iter_init(&iter, attrs, len);
+    while(pcat_ubus_blobmsg_iter_next(&iter, &field))
+    {
+        value = pcat_ubus_blobmsg_value_to_json(field.type, field.data,
+            field.len, depth);
+
+        if(array)
+        {
+            json_object_array_add(root, value);
+        }
+        else
+        {
+            json_object_object_add(root, field.name, value);
+        }
+    }
+
+    return root;
+}
+
+static void pcat_ubus_blobmsg_value_from_json(GByteArray *buf,
+    const gchar *name, struct json_object *value)
+{
+    GByteArray *list;
+    guint8 bvalue;
+    guint32 v32;
+    guint64 v64;
+    gint64 ivalue;
+    gdouble dvalue;
+    gsize i, len;
+    const gchar *str;
+
+    switch(json_object_get_type(value))
+    {
+        case json_type_object:
+        case json_type_array:
+        {
+            list = g_byte_array_new();
+            if(json_object_get_type(value)==json_type_object)
+            {
+                pcat_ubus_blobmsg_from_json(list, value);
+            }
+            else
+            {
+                len = json_object_array_length(value);
+                for(i=0;i<len;i++)
+                {
+                    pcat_ubus_blobmsg_value_from_json(list, "",
+                        json_object_array_get_idx(value, i));
+                }
+            }
+            pcat_ubus_blobmsg_put(buf, json_object_get_type(value)==
+                json_type_object ? PCAT_UBUS_BLOBMSG_TYPE_TABLE :
+                PCAT_UBUS_BLOBMSG_TYPE_ARRAY, name, list->data, list->len);
+            g_byte_array_unref(list);
+
+            break;
+        }
+        case json_type_string:
+        {
+            str = json_object_get_string(value);
+            pcat_ubus_blobmsg_put(buf, PCAT_UBUS_BLOBMSG_TYPE_STRING, name,
+                str, strlen(str) + 1);
+
+            break;
+        }
+        case json_type_int:
+        {
+            ivalue = json_object_get_int64(value);
+            if(ivalue >= G_MININT32 && ivalue <= G_MAXINT32)
+            {
+                v32 = GUINT32_TO_BE((guint32)ivalue);
+                pcat_ubus_blobmsg_put(buf, PCAT_UBUS_BLOBMSG_TYPE_INT32,
+                    name, &v32, 4);
+            }
+            else
+            {
+                v64 = GUINT64_TO_BE((guint64)ivalue);
+                pcat_ubus_blobmsg_put(buf, PCAT_UBUS_BLOBMSG_TYPE_INT64,
+                    name, &v64, 8);
+            }
+
+            break;
+        }
+        case json_type_boolean:
+        {
+            bvalue = json_object_get_boolean(value) ? 1 : 0;
+            pcat_ubus_blobmsg_put(buf, PCAT_UBUS_BLOBMSG_TYPE_INT8, name,
+                &bvalue, 1);
+
+            break;
+        }
+        case json_type_double:
+        {
+            dvalue = json_object_get_double(value);
+            memcpy(&v64, &dvalue, 8);
+            v64 = GUINT64_TO_BE(v64);
+            pcat_ubus_blobmsg_put(buf, PCAT_UBUS_BLOBMSG_TYPE_DOUBLE, name,
+                &v64, 8);
+
+            break;
+        }
+        default:
+        {
+            pcat_ubus_blobmsg_put(buf, PCAT_UBUS_BLOBMSG_TYPE_UNSPEC, name,
+                NULL, 0);
+
+            break;
+        }
+    }
+}
+
+static gboolean pcat_ubus_client_io_wait(gint fd, gshort events,
+    gint64 deadline)
+{
+    struct pollfd pfd;
+    gint64 timeout;
+    gint ret;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    do
+    {
+        timeout = (deadline - g_get_monotonic_time()) / 1000;
+        ret = poll(&pfd, 1, timeout > 0 ? (gint)timeout : 0);
+    }
+    while(ret < 0 && errno==EINTR);
+
+    return (ret > 0);
+}
+
+static gboolean pcat_ubus_client_read_full(PCatUbusClient *client,
+    guint8 *buf, gsize len, gint64 deadline)
+{
+    gsize offset = 0;
+    gssize rsize;
+
+    while(offset < len)
+    {
+        if(!pcat_ubus_client_io_wait(client->fd, POLLIN, deadline))
+        {
+            return FALSE;
+        }
+
+        rsize = read(client->fd, buf + offset, len - offset);
+        if(rsize < 0)
+        {
+            if(errno==EINTR || errno==EAGAIN)
+            {
+                continue;
+            }
+
+            return FALSE;
+        }
+        else if(rsize==0)
+        {
+            return FALSE;
+        }
+
+        offset += rsize;
+    }
+
+    return TRUE;
+}
+
+static gboolean pcat_ubus_client_write_full(PCatUbusClient *client,
+    const guint8 *buf, gsize len, gint64 deadline)
+{
+    gsize offset = 0;
+    gssize wsize;
+
+    while(offset < len)
+    {
+        if(!pcat_ubus_client_io_wait(client->fd, POLLOUT, deadline))
+        {
+            return FALSE;
+        }
+
+        wsize = send(client->fd, buf + offset, len - offset, MSG_NOSIGNAL);
+        if(wsize < 0)
+        {
+            if(errno==EINTR || errno==EAGAIN)
+            {
+                continue;
+            }
+
+            return FALSE;
+        }
+
+        offset += wsize;
+    }
+
+    return TRUE;
+}
+
+static void pcat_ubus_client_disconnect(PCatUbusClient *client)
+{
+    if(client->fd >= 0)
+    {
+        close(client->fd);
+        client->fd = -1;
+    }
+
+    client->event_object_id = 0;
+    g_hash_table_remove_all(client->object_id_table);
+}
+
+/*
+ * Read one message, the attributes of its root blob are left in
+ * client->message.
+ */
+static gboolean pcat_ubus_client_message_read(PCatUbusClient *client,
+    gint64 deadline, guint8 *type, guint16 *seq)
+{
+    guint8 header[12];
+    guint32 id_len;
+    guint16 vseq;
+    gsize len;
+
+    if(!pcat_ubus_client_read_full(client, header, sizeof(header),
+        deadline))
+    {
+        return FALSE;
+    }
+
+    *type = header[1];
+    memcpy(&vseq, header + 2, 2);
+    *seq = GUINT16_FROM_BE(vseq);
+    memcpy(&id_len, header + 8, 4);
+    len = GUINT32_FROM_BE(id_len) & PCAT_UBUS_BLOB_ATTR_LEN_MASK;
+    if(len < 4 || len > PCAT_UBUS_CLIENT_MESSAGE_SIZE_MAX)
+    {
+        return FALSE;
+    }
+
+    g_byte_array_set_size(client->message, len - 4);
+    if(len > 4 && !pcat_ubus_client_read_full(client, client->message->data,
+        len - 4, deadline))
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean pcat_ubus_client_message_send(PCatUbusClient *client,
+    guint8 type, guint32 peer, const GByteArray *attrs, gint64 deadline)
+{
+    guint8 header[12];
+    guint32 v32;
+    guint16 v16;
+
+    client->seq++;
+
+    header[0] = 0;
+    header[1] = type;
+    v16 = GUINT16_TO_BE(client->seq);
+    memcpy(header + 2, &v16, 2);
+    v32 = GUINT32_TO_BE(peer);
+    memcpy(header + 4, &v32, 4);
+    v32 = GUINT32_TO_BE(attrs->len + 4);
+    memcpy(header + 8, &v32, 4);
+
+    if(!pcat_ubus_client_write_full(client, header, sizeof(header),
+        deadline))
+    {
+        return FALSE;
+    }
+
+    return pcat_ubus_client_write_full(client, attrs->data, attrs->len,
+        deadline);
+}
+
+static gboolean pcat_ubus_client_connect(PCatUbusClient *client);
+
+/*
+ * Send a request and wait for its status reply, returns the ubus status
+ * code or -1 on connection errors. Events which arrive in the meantime
+ * are only remembered for the next pcat_ubus_client_dispatch().
+ */
+static gint pcat_ubus_client_request(PCatUbusClient *client, guint8 type,
+    guint32 peer, const GByteArray *attrs, guint timeout,
+    PCatUbusClientDataFunc func, gpointer user_data)
+{
+    gint64 deadline;
+    guint16 seq, msg_seq;
+    guint8 msg_type;
+    const guint8 *payload;
+    gsize payload_len;
+    guint32 status;
+
+    if(!pcat_ubus_client_connect(client))
+    {
+        return -1;
+    }
+
+    deadline = g_get_monotonic_time() + (gint64)timeout * 1000;
+    if(!pcat_ubus_client_message_send(client, type, peer, attrs, deadline))
+    {
+        pcat_ubus_client_disconnect(client);
+
+        return -1;
+    }
+    seq = client->seq;
+
+    while(TRUE)
+    {
+        if(!pcat_ubus_client_message_read(client, deadline, &msg_type,
+            &msg_seq))
+        {
+            pcat_ubus_client_disconnect(client);
+
+            return -1;
+        }
+
+        if(msg_type==PCAT_UBUS_MSG_INVOKE)
+        {
+            client->event_pending = TRUE;
+
+            continue;
+        }
+        if(msg_seq!=seq)
+        {
+            continue;
+        }
+
+        if(msg_type==PCAT_UBUS_MSG_DATA && func!=NULL)
+        {
+            func(client->message->data, client->message->len, user_data);
+        }
+        else if(msg_type==PCAT_UBUS_MSG_STATUS)
+        {
+            if(!pcat_ubus_blob_find(client->message->data,
+                client->message->len, PCAT_UBUS_ATTR_STATUS, &payload,
+                &payload_len) || payload_len < 4)
+            {
+                return -1;
+            }
+            memcpy(&status, payload, 4);
+
+            return GUINT32_FROM_BE(status);
+        }
+    }
+
+    return -1;
+}
+
+static void pcat_ubus_client_object_id_func(const guint8 *attrs, gsize len,
+    gpointer user_data)
+{
+    guint32 *id = user_data;
+    const guint8 *payload;
+    gsize payload_len;
+    guint32 value;
+
+    if(pcat_ubus_blob_find(attrs, len, PCAT_UBUS_ATTR_OBJID, &payload,
+        &payload_len) && payload_len >= 4)
+    {
+        memcpy(&value, payload, 4);
+        *id = GUINT32_FROM_BE(value);
+    }
+}
+
+static void pcat_ubus_client_invoke_data_func(const guint8 *attrs,
+    gsize len, gpointer user_data)
+{
+    PCatUbusClientReplyData *reply_data = user_data;
+    const guint8 *payload;
+    gsize payload_len;
+
+    if(!pcat_ubus_blob_find(attrs, len, PCAT_UBUS_ATTR_DATA, &payload,
+        &payload_len))
+    {
+        return;
+    }
+
+    reply_data->func(payload, payload_len, reply_data->user_data);
+}
+
+static void pcat_ubus_client_call_json_func(const guint8 *data, gsize len,
+    gpointer user_data)
+{
+    struct json_object **result = user_data;
+
+    if(*result!=NULL)
+    {
+        json_object_put(*result);
+    }
+    *result = pcat_ubus_blobmsg_list_to_json(data, len, FALSE, 0);
+}
+
+static gboolean pcat_ubus_client_event_register_internal(
+    PCatUbusClient *client, const gchar *pattern)
+{
+    GByteArray *attrs, *data;
+    guint32 object_id = 0;
+    gint status;
+
+    if(client->event_object_id==0)
+    {
+        /* Events are delivered as invocations of an anonymous object. */
+        attrs = g_byte_array_new();
+        status = pcat_ubus_client_request(client, PCAT_UBUS_MSG_ADD_OBJECT,
+            0, attrs, PCAT_UBUS_CLIENT_CONTROL_TIMEOUT,
+            pcat_ubus_client_object_id_func, &object_id);
+        g_byte_array_unref(attrs);
+
+        if(status!=0 || object_id==0)
+        {
+            return FALSE;
+        }
+        client->event_object_id = object_id;
+    }
+
+    data = g_byte_array_new();
+    object_id = GUINT32_TO_BE(client->event_object_id);
+    pcat_ubus_blobmsg_put(data, PCAT_UBUS_BLOBMSG_TYPE_INT32, "object",
+        &object_id, 4);
+    pcat_ubus_blobmsg_put(data, PCAT_UBUS_BLOBMSG_TYPE_STRING, "pattern",
+        pattern, strlen(pattern) + 1);
+
+    attrs = g_byte_array_new();
+    pcat_ubus_blob_put_u32(attrs, PCAT_UBUS_ATTR_OBJID,
+        PCAT_UBUS_SYSTEM_OBJECT_EVENT);
+    pcat_ubus_blob_put_string(attrs, PCAT_UBUS_ATTR_METHOD, "register");
+    pcat_ubus_blob_put(attrs, PCAT_UBUS_ATTR_DATA <<
+        PCAT_UBUS_BLOB_ATTR_ID_SHIFT, data->data, data->len);
+
+    status = pcat_ubus_client_request(client, PCAT_UBUS_MSG_INVOKE,
+        PCAT_UBUS_SYSTEM_OBJECT_EVENT, attrs,
+        PCAT_UBUS_CLIENT_CONTROL_TIMEOUT, NULL, NULL);
+
+    g_byte_array_unref(attrs);
+    g_byte_array_unref(data);
+
+    return (status==0);
+}
+
+static gboolean pcat_ubus_client_connect(PCatUbusClient *client)
+{
+    static const gchar * const default_paths[] = {
+        PCAT_UBUS_CLIENT_SOCKET_PATH, PCAT_UBUS_CLIENT_SOCKET_PATH_LEGACY,
+        NULL };
+    const gchar * const *paths = default_paths;
+    const gchar *custom_paths[2] = { NULL, NULL };
+    struct sockaddr_un addr;
+    guint8 msg_type;
+    guint16 msg_seq;
+    guint i;
+    gint fd = -1;
+
+    if(client->fd >= 0)
+    {
+        return TRUE;
+    }
+
+    if(client->socket_path!=NULL)
+    {
+        custom_paths[0] = client->socket_path;
+        paths = custom_paths;
+    }
+
+    for(i=0;paths[i]!=NULL;i++)
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd < 0)
+        {
+            return FALSE;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        g_strlcpy(addr.sun_path, paths[i], sizeof(addr.sun_path));
+        if(connect(fd, (struct sockaddr *)&addr, sizeof(addr))==0)
+        {
+            break;
+        }
+
+        close(fd);
+        fd = -1;
+    }
+
+    if(fd < 0)
+    {
+        return FALSE;
+    }
+    client->fd = fd;
+
+    if(!pcat_ubus_client_message_read(client, g_get_monotonic_time() +
+        PCAT_UBUS_CLIENT_CONTROL_TIMEOUT * 1000, &msg_type, &msg_seq) ||
+        msg_type!=PCAT_UBUS_MSG_HELLO)
+    {
+        pcat_ubus_client_disconnect(client);
+
+        return FALSE;
+    }
+
+    for(i=0;i<client->event_patterns->len && client->fd >= 0;i++)
+    {
+        if(!pcat_ubus_client_event_register_internal(client,
+            g_ptr_array_index(client->event_patterns, i)))
+        {
+            g_warning("Failed to register ubus event handler for %s!",
+                (const gchar *)g_ptr_array_index(client->event_patterns, i));
+        }
+    }
+
+    /* Anything may have changed while we were not listening. */
+    client->event_pending = TRUE;
+
+    return (client->fd >= 0);
+}
+
+PCatUbusClient *pcat_ubus_client_new(const gchar *socket_path)
+{
+    PCatUbusClient *client;
+
+    client = g_new0(PCatUbusClient, 1);
+    client->socket_path = g_strdup(socket_path);
+    client->fd = -1;
+    client->event_patterns = g_ptr_array_new_with_free_func(g_free);
+    client->object_id_table = g_hash_table_new_full(g_str_hash,
+        g_str_equal, g_free, NULL);
+    client->message = g_byte_array_new();
+
+    return client;
+}
+
+void pcat_ubus_client_free(PCatUbusClient *client)
+{
+    if(client==NULL)
+    {
+        return;
+    }
+
+    pcat_ubus_client_disconnect(client);
+    g_byte_array_unref(client->message);
+    g_hash_table_unref(client->object_id_table);
+    g_ptr_array_unref(client->event_patterns);
+    g_free(client->socket_path);
+    g_free(client);
+}
+
+/*
+ * The socket to poll for events, -1 while not connected (the next call
+ * reconnects and registers the event handlers again).
+ */
+gint pcat_ubus_client_fd_get(PCatUbusClient *client)
+{
+    return client->fd;
+}
+
+gboolean pcat_ubus_client_event_register(PCatUbusClient *client,
+    const gchar *pattern)
+{
+    g_ptr_array_add(client->event_patterns, g_strdup(pattern));
+
+    if(client->fd < 0)
+    {
+        /* Connecting registers all the patterns. */
+        return pcat_ubus_client_connect(client);
+    }
+
+    return pcat_ubus_client_event_register_internal(client, pattern);
+}
+
+/*
+ * Consume pending messages without blocking, returns TRUE if an event was
+ * received since the last call.
+ */
+gboolean pcat_ubus_client_dispatch(PCatUbusClient *client)
+{
+    gboolean ret;
+    guint8 msg_type;
+    guint16 msg_seq;
+
+    while(client->fd >= 0 && pcat_ubus_client_io_wait(client->fd, POLLIN,
+        0))
+    {
+        if(!pcat_ubus_client_message_read(client, g_get_monotonic_time() +
+            PCAT_UBUS_CLIENT_CONTROL_TIMEOUT * 1000, &msg_type, &msg_seq))
+        {
+            pcat_ubus_client_disconnect(client);
+
+            break;
+        }
+
+        if(msg_type==PCAT_UBUS_MSG_INVOKE)
+        {
+            client->event_pending = TRUE;
+        }
+    }
+
+    ret = client->event_pending;
+    client->event_pending = FALSE;
+
+    return ret;
+}
+
+/*
+ * Same as "ubus call <object> <method>" without arguments, returns the
+ * reply as a new json object or NULL on errors. Timeout is in ms.
+ */
+struct json_object *pcat_ubus_client_call(PCatUbusClient *client,
+    const gchar *object, const gchar *method, guint timeout)
+{
+    struct json_object *result = NULL;
+
+    if(!pcat_ubus_client_call_full(client, object, method, timeout,
+        pcat_ubus_client_call_json_func, &result))
+    {
+        if(result!=NULL)
+        {
+            json_object_put(result);
+        }
+
+        return NULL;
+    }
+
+    if(result==NULL)
+    {
+        result = json_object_new_object();
+    }
+
+    return result;
+}
+
+/*
+ * Like pcat_ubus_client_call(), but hands the blobmsg reply to func in
+ * place instead of building a json object. func is not called if the
+ * method replied without data.
+ */
+gboolean pcat_ubus_client_call_full(PCatUbusClient *client,
+    const gchar *object, const gchar *method, guint timeout,
+    PCatUbusClientReplyFunc func, gpointer user_data)
+{
+    PCatUbusClientReplyData reply_data;
+    GByteArray *attrs;
+    guint32 object_id;
+    gint status = -1;
+    guint retry;
+
+    reply_data.func = func;
+    reply_data.user_data = user_data;
+
+    for(retry=0;retry<2;retry++)
+    {
+        object_id = GPOINTER_TO_UINT(g_hash_table_lookup(
+            client->object_id_table, object));
+        if(object_id==0)
+        {
+            attrs = g_byte_array_new();
+            pcat_ubus_blob_put_string(attrs, PCAT_UBUS_ATTR_OBJPATH,
+                object);
+            status = pcat_ubus_client_request(client, PCAT_UBUS_MSG_LOOKUP,
+                0, attrs, timeout, pcat_ubus_client_object_id_func,
+                &object_id);
+            g_byte_array_unref(attrs);
+
+            if(status!=0 || object_id==0)
+            {
+                return FALSE;
+            }
+
+            g_hash_table_insert(client->object_id_table, g_strdup(object),
+                GUINT_TO_POINTER(object_id));
+        }
+
+        attrs = g_byte_array_new();
+        pcat_ubus_blob_put_u32(attrs, PCAT_UBUS_ATTR_OBJID, object_id);
+        pcat_ubus_blob_put_string(attrs, PCAT_UBUS_ATTR_METHOD, method);
+        pcat_ubus_blob_put(attrs, PCAT_UBUS_ATTR_DATA <<
+            PCAT_UBUS_BLOB_ATTR_ID_SHIFT, NULL, 0);
+        status = pcat_ubus_client_request(client, PCAT_UBUS_MSG_INVOKE,
+            object_id, attrs, timeout, func!=NULL ?
+            pcat_ubus_client_invoke_data_func : NULL, &reply_data);
+        g_byte_array_unref(attrs);
+
+        if(status!=PCAT_UBUS_STATUS_NOT_FOUND)
+        {
+            break;
+        }
+
+        /* The object was registered again with a new ID. */
+        g_hash_table_remove(client->object_id_table, object);
+    }
+
+    return (status==0);
+}
+
+void pcat_ubus_blobmsg_iter_init(PCatUbusBlobmsgIter *iter,
+    const guint8 *data, gsize len)
+{
+    iter->data = data;
+    iter->len = len;
+}
+
+/* Skips attributes which are not well formed blobmsg fields. */
+gboolean pcat_ubus_blobmsg_iter_next(PCatUbusBlobmsgIter *iter,
+    PCatUbusBlobmsgField *field)
+{
+    const guint8 *payload;
+    gsize payload_len, hdr_len;
+    guint32 id_flags;
+    guint16 name_len;
+
+    while(pcat_ubus_blob_next(&iter->data, &iter->len, &id_flags, &payload,
+        &payload_len))
+    {
+        if(!(id_flags & PCAT_UBUS_BLOB_ATTR_EXTENDED) || payload_len < 2)
+        {
+            continue;
+        }
+
+        memcpy(&name_len, payload, 2);
+        name_len = GUINT16_FROM_BE(name_len);
+        hdr_len = pcat_ubus_blob_pad(2 + name_len + 1);
+        if(hdr_len > payload_len || payload[2 + name_len]!=0)
+        {
+            continue;
+        }
+
+        field->type = (id_flags & PCAT_UBUS_BLOB_ATTR_ID_MASK) >>
+            PCAT_UBUS_BLOB_ATTR_ID_SHIFT;
+        field->name = (const gchar *)payload + 2;
+        field->data = payload + hdr_len;
+        field->len = payload_len - hdr_len;
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+gboolean pcat_ubus_blobmsg_field_iter_init(
+    const PCatUbusBlobmsgField *field, PCatUbusBlobmsgIter *iter)
+{
+    if(field->type!=PCAT_UBUS_BLOBMSG_TYPE_TABLE &&
+       field->type!=PCAT_UBUS_BLOBMSG_TYPE_ARRAY)
+    {
+        return FALSE;
+    }
+
+    pcat_ubus_blobmsg_iter_init(iter, field->data, field->len);
+
+    return TRUE;
+}
+
+const gchar *pcat_ubus_blobmsg_field_string_get(
+    const PCatUbusBlobmsgField *field)
+{
+    if(field->type!=PCAT_UBUS_BLOBMSG_TYPE_STRING ||
+       memchr(field->data, 0, field->len)==NULL)
+    {
+        return NULL;
+    }
+
+    return (const gchar *)field->data;
+}
+
+/* Integer value of a number, boolean or numeric string field, else 0. */
+gint64 pcat_ubus_blobmsg_field_int_get(const PCatUbusBlobmsgField *field)
+{
+    guint64 v64;
+    guint32 v32;
+    guint16 v16;
+    gdouble dvalue;
+    const gchar *str;
+
+    switch(field->type)
+    {
+        case PCAT_UBUS_BLOBMSG_TYPE_STRING:
+        {
+            str = pcat_ubus_blobmsg_field_string_get(field);
+            if(str==NULL)
+            {
+                break;
+            }
+
+            return g_ascii_strtoll(str, NULL, 10);
+        }
+        case PCAT_UBUS_BLOBMSG_TYPE_INT64:
+        {
+            if(field->len < 8)
+            {
+                break;
+            }
+            memcpy(&v64, field->data, 8);
+
+            return (gint64)GUINT64_FROM_BE(v64);
+        }
+        case PCAT_UBUS_BLOBMSG_TYPE_INT32:
+        {
+            if(field->len < 4)
+            {
+                break;
+            }
+            memcpy(&v32, field->data, 4);
+
+            return (gint32)GUINT32_FROM_BE(v32);
+        }
+        case PCAT_UBUS_BLOBMSG_TYPE_INT16:
+        {
+            if(field->len < 2)
+            {
+                break;
+            }
+            memcpy(&v16, field->data, 2);
+
+            return (gint16)GUINT16_FROM_BE(v16);
+        }
+        case PCAT_UBUS_BLOBMSG_TYPE_INT8:
+        {
+            if(field->len < 1)
+            {
+                break;
+            }
+
+            return (field->data[0]!=0) ? 1 : 0;
+        }
+        case PCAT_UBUS_BLOBMSG_TYPE_DOUBLE:
+        {
+            if(field->len < 8)
+            {
+                break;
+            }
+            memcpy(&v64, field->data, 8);
+            v64 = GUINT64_FROM_BE(v64);
+            memcpy(&dvalue, &v64, 8);
+
+            return (gint64)dvalue;
+        }
+        default:
+        {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+struct json_object *pcat_ubus_blobmsg_to_json(const guint8 *data,
+    gsize len)
+{
+    return pcat_ubus_blobmsg_list_to_json(data, len, FALSE, 0);
+}
+
+/* Appends the members of a json object as blobmsg table fields. */
+void pcat_ubus_blobmsg_from_json(GByteArray *buf, struct json_object *root)
+{
+    struct json_object_iterator iter, iter_end;
+
+    if(json_object_get_type(root)!=json_type_object)
+    {
+        return;
+    }
+
+    iter = json_object_iter_begin(root);
+    iter_end = json_object_iter_end(root);
+    while(!json_object_iter_equal(&iter, &iter_end))
+    {
+        pcat_ubus_blobmsg_value_from_json(buf,
+            json_object_iter_peek_name(&iter),
+            json_object_iter_peek_value(&iter));
+        json_object_iter_next(&iter);
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef HAVE_PCAT_UBUS_CLIENT_H
+#define HAVE_PCAT_UBUS_CLIENT_H
+
+#include <glib.h>
+#include <json.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+    PCAT_UBUS_BLOBMSG_TYPE_UNSPEC,
+    PCAT_UBUS_BLOBMSG_TYPE_ARRAY,
+    PCAT_UBUS_BLOBMSG_TYPE_TABLE,
+    PCAT_UBUS_BLOBMSG_TYPE_STRING,
+    PCAT_UBUS_BLOBMSG_TYPE_INT64,
+    PCAT_UBUS_BLOBMSG_TYPE_INT32,
+    PCAT_UBUS_BLOBMSG_TYPE_INT16,
+    PCAT_UBUS_BLOBMSG_TYPE_INT8,
+    PCAT_UBUS_BLOBMSG_TYPE_DOUBLE
+}PCatUbusBlobmsgType;
+
+/*
+ * Walks the fields of a blobmsg table or array in place, name and data
+ * point into the walked buffer.
+ */
+typedef struct _PCatUbusBlobmsgIter
+{
+    const guint8 *data;
+    gsize len;
+}PCatUbusBlobmsgIter;
+
+typedef struct _PCatUbusBlobmsgField
+{
+    guint type;
+    const gchar *name;
+    const guint8 *data;
+    gsize len;
+}PCatUbusBlobmsgField;
+
+/* Gets the blobmsg table of a reply, only valid during the call. */
+typedef void (*PCatUbusClientReplyFunc)(const guint8 *data, gsize len,
+    gpointer user_data);
+
+typedef struct _PCatUbusClient PCatUbusClient;
+
+PCatUbusClient *pcat_ubus_client_new(const gchar *socket_path);
+void pcat_ubus_client_free(PCatUbusClient *client);
+gint pcat_ubus_client_fd_get(PCatUbusClient *client);
+gboolean pcat_ubus_client_event_register(PCatUbusClient *client,
+    const gchar *pattern);
+gboolean pcat_ubus_client_dispatch(PCatUbusClient *client);
+struct json_object *pcat_ubus_client_call(PCatUbusClient *client,
+    const gchar *object, const gchar *method, guint timeout);
+gboolean pcat_ubus_client_call_full(PCatUbusClient *client,
+    const gchar *object, const gchar *method, guint timeout,
+    PCatUbusClientReplyFunc func, gpointer user_data);
+
+void pcat_ubus_blobmsg_iter_init(PCatUbusBlobmsgIter *iter,
+    const guint8 *data, gsize len);
+gboolean pcat_ubus_blobmsg_iter_next(PCatUbusBlobmsgIter *iter,
+    PCatUbusBlobmsgField *field);
+gboolean pcat_ubus_blobmsg_field_iter_init(
+    const PCatUbusBlobmsgField *field, PCatUbusBlobmsgIter *iter);
+const gchar *pcat_ubus_blobmsg_field_string_get(
+    const PCatUbusBlobmsgField *field);
+gint64 pcat_ubus_blobmsg_field_int_get(const PCatUbusBlobmsgField *field);
+struct json_object *pcat_ubus_blobmsg_to_json(const guint8 *data,
+    gsize len);
+void pcat_ubus_blobmsg_from_json(GByteArray *buf, struct json_object *root);
+
+G_END_DECLS
+
+#endif